@@ -1,7 +1,15 @@
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <linux/limits.h>
+#include <linux/fs.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,16 +20,481 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
+/* At least a source and a destination, more destinations may follow */
 static const int INPUT_PARAMS = 2;
-static const int SRC_FILE_ARGV_POSITION = 1, DEST_FILE_ARGV_POSITION = 2;
+static const int SRC_FILE_ARGV_POSITION = 0, DEST_FILE_ARGV_POSITION = 1;
 
 static const int GENERIC_ERROR_CODE = -1;
-static const int FAILED = -1, SUCCESS = 0;
+static const int FAILED = -1, SUCCESS = 0, NOT_SUPPORTED = 1;
 
 static const int FILE_EXISTS = 0, FILE_DOES_NOT_EXIST = -1;
-static const bool EXIT_ON_FAILURE = true, DONT_EXIT_ON_FAILURE = false;
-static const int ZERO_OFFSET = 0;
+static const bool DONT_EXIT_ON_FAILURE = false;
+
+/*
+ * Granularity used to look for all-zero blocks with `--sparse=always`, unless
+ * O_DIRECT needs a larger one, and size of the buffer the data extents are
+ * read into to look for them.
+ */
+static const long SPARSE_BLOCK_SIZE = 4096;
+static const size_t SPARSE_SCAN_BUFFER_SIZE = 1024 * 1024;
+
+/* Most worker threads copying a tree */
+static const int MAX_JOBS = 1024;
+static const size_t JOB_DEQUE_INITIAL_CAPACITY = 64;
+/* Slots of the table of hard-linked inodes, a power of two */
+static const size_t INODE_TABLE_INITIAL_CAPACITY = 256;
+
+/* Requests kept in flight by the io_uring engine and size of their buffers */
+static const int DEFAULT_QUEUE_DEPTH = 16, MAX_QUEUE_DEPTH = 4096;
+static const size_t URING_BUFFER_SIZE = 1024 * 1024;
+
+/*
+ * Size of the aligned buffer used with O_DIRECT, alignment assumed when the
+ * kernel does not report one and largest alignment supported.
+ */
+static const size_t DIRECT_IO_BUFFER_SIZE = 1024 * 1024;
+
+/*
+ * A striped copy splits the file into ranges of `STRIPE_SIZE` bytes that the
+ * threads take in turn, copying them through buffers of `STRIPE_BUFFER_SIZE`
+ * bytes when copy_file_range is not usable. At most `MAX_STRIPE_THREADS`
+ * threads copy a file.
+ */
+static const long STRIPE_SIZE = 8 * 1024 * 1024;
+static const size_t STRIPE_BUFFER_SIZE = 1024 * 1024;
+static const int MAX_STRIPE_THREADS = 1024;
+
+/*
+ * A delta copy compares the source and the destination `DELTA_BLOCK_SIZE`
+ * bytes at a time, reading `DELTA_BUFFER_SIZE` bytes of each at once.
+ */
+static const long DELTA_BLOCK_SIZE = 4096;
+static const size_t DELTA_BUFFER_SIZE = 1024 * 1024;
+static const long DIRECT_IO_DEFAULT_ALIGNMENT = 4096;
+#define DIRECT_IO_MAX_UNALIGNED 65536
+
+/* CRC32C (Castagnoli) polynomial, bit-reversed */
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+/*
+ * Bytes of each of the three interleaved streams of the SSE4.2 CRC32C, and
+ * size of the buffer the destination is read into to verify it.
+ */
+#define CRC32C_LANE_SIZE 4096
+static const size_t VERIFY_BUFFER_SIZE = 1024 * 1024;
+
+/*
+ * A resumable copy checkpoints every `RESUME_CHECKPOINT_SIZE` bytes into a
+ * journal named after the destination plus `RESUME_JOURNAL_SUFFIX`, recording
+ * the CRC32C of the last `RESUME_TAIL_SIZE` bytes it made durable.
+ */
+static const long RESUME_CHECKPOINT_SIZE = 256 * 1024 * 1024;
+static const long RESUME_TAIL_SIZE = 1024 * 1024;
+static const char RESUME_JOURNAL_SUFFIX[] = ".cpjournal";
+static const char RESUME_JOURNAL_TMP_SUFFIX[] = ".cpjournal.tmp";
+static const char RESUME_JOURNAL_FMT[] =
+        "cpjournal 1 %lu %lu %ld %ld %ld %ld %08x\n";
+static const int RESUME_JOURNAL_FIELDS = 7;
+
+/* Path that stands for the standard input as source or output as destination */
+static const char STDIO_PATH_ALIAS[] = "-";
+/*
+ * Bytes moved by each splice(2) call, which is also the size requested for the
+ * intermediate pipe, and size of the buffer used when splice is not supported.
+ */
+static const size_t SPLICE_CHUNK_SIZE = 1024 * 1024;
+static const size_t STREAM_BUFFER_SIZE = 128 * 1024;
+
+/* Largest single transfer accepted by sendfile(2) and copy_file_range(2) */
+static const size_t MAX_KERNEL_TRANSFER = 0x7ffff000;
+
+/* Default size of the source window mapped at a time by the stream engine */
+static const long DEFAULT_WINDOW_SIZE = 64L * 1024 * 1024;
+
+static const char USAGE_FMT[] =
+        "Expected %s [OPTION]... <source file> <destination file>...\n"
+        "  several destinations are written reading the source once\n"
+        "  '-' as source or destination stands for stdin or stdout\n"
+        "  -v, --verbose      report the strategy that completed the copy\n"
+        "  --engine=ENGINE    auto (default), stream or uring\n"
+        "  --queue-depth=N    requests in flight with --engine=uring "
+        "(default 16)\n"
+        "  --direct           bypass the page cache with O_DIRECT\n"
+        "  --verify           checksum (CRC32C) the source while copying "
+        "and check the destination against it\n"
+        "  --resume           continue an interrupted copy from its last "
+        "checkpoint\n"
+        "  --update-delta     update an existing destination writing only "
+        "the blocks that differ\n"
+        "  --window=SIZE      stream window size, accepts K, M and G "
+        "suffixes (default 64M)\n"
+        "  --sparse=WHEN      auto (default), always or never\n"
+        "  -r, --recursive    copy directories recursively\n"
+        "  -a, --archive      like -r, also keeping hard links, owners, "
+        "permissions and timestamps\n"
+        "  -j, --jobs=N       files copied in parallel with -r (default: "
+        "online CPUs)\n"
+        "  --threads=N        threads copying stripes of each large file "
+        "(default 1)\n";
+
+/*
+ * Strategies used to copy the file content, in the order they are tried.
+ * Every strategy but reflink resumes from the offset where the previous one
+ * gave up.
+ */
+enum copy_strategy {
+	STRATEGY_REFLINK,
+	STRATEGY_COPY_FILE_RANGE,
+	STRATEGY_SENDFILE,
+	STRATEGY_MMAP,
+	STRATEGY_STREAM,
+	STRATEGY_ZERO_SCAN,
+	STRATEGY_URING,
+	STRATEGY_DIRECT,
+	STRATEGY_SPLICE,
+	STRATEGY_READ_WRITE,
+	STRATEGY_STRIPED,
+	STRATEGY_DELTA,
+	STRATEGY_FANOUT,
+};
+
+static const char *COPY_STRATEGY_NAMES[] = {
+	[STRATEGY_REFLINK] = "reflink",
+	[STRATEGY_COPY_FILE_RANGE] = "copy_file_range",
+	[STRATEGY_SENDFILE] = "sendfile",
+	[STRATEGY_MMAP] = "mmap",
+	[STRATEGY_STREAM] = "stream",
+	[STRATEGY_ZERO_SCAN] = "zero-scan",
+	[STRATEGY_URING] = "io_uring",
+	[STRATEGY_DIRECT] = "direct",
+	[STRATEGY_SPLICE] = "splice",
+	[STRATEGY_READ_WRITE] = "read/write",
+	[STRATEGY_STRIPED] = "striped",
+	[STRATEGY_DELTA] = "delta",
+	[STRATEGY_FANOUT] = "fan-out",
+};
+
+/*
+ * Engines selectable with `--engine`. `ENGINE_AUTO` runs the strategies chain
+ * while `ENGINE_STREAM` always copies through a bounded sliding window.
+ * `ENGINE_URING` keeps several reads and writes in flight through io_uring and
+ * falls back to `ENGINE_AUTO` when io_uring is not available.
+ */
+enum copy_engine {
+	ENGINE_AUTO,
+	ENGINE_STREAM,
+	ENGINE_URING,
+};
+
+static const char *COPY_ENGINE_NAMES[] = {
+	[ENGINE_AUTO] = "auto",
+	[ENGINE_STREAM] = "stream",
+	[ENGINE_URING] = "uring",
+};
+static const int COPY_ENGINES_COUNT =
+        sizeof(COPY_ENGINE_NAMES) / sizeof(COPY_ENGINE_NAMES[0]);
+
+/*
+ * Handling of holes selectable with `--sparse`. `SPARSE_AUTO` keeps the holes
+ * of the source, `SPARSE_ALWAYS` also turns all-zero blocks into holes and
+ * `SPARSE_NEVER` writes every byte.
+ */
+enum sparse_mode {
+	SPARSE_AUTO,
+	SPARSE_ALWAYS,
+	SPARSE_NEVER,
+};
+
+static const char *SPARSE_MODE_NAMES[] = {
+	[SPARSE_AUTO] = "auto",
+	[SPARSE_ALWAYS] = "always",
+	[SPARSE_NEVER] = "never",
+};
+static const int SPARSE_MODES_COUNT =
+        sizeof(SPARSE_MODE_NAMES) / sizeof(SPARSE_MODE_NAMES[0]);
+
+struct copy_options {
+	bool verbose;
+	enum copy_engine engine;
+	long window_size;
+	enum sparse_mode sparse;
+	bool recursive;
+	int jobs;
+	int queue_depth;
+	bool direct;
+	bool verify;
+	bool resume;
+	int threads;
+	bool update_delta;
+	bool archive;
+};
+
+/*
+ * CRC32C of a file computed from chunks copied in any order. Each chunk adds
+ * its CRC, shifted as if it was followed by the rest of the file, to `raw`;
+ * the CRC of holes is zero so they can be skipped.
+ */
+struct checksum {
+	long total_len;
+	atomic_uint raw;
+};
+
+/*
+ * Checkpoint of a resumable copy: everything before `offset` is durable in the
+ * destination and `tail_crc` is the CRC32C of the bytes right before it. The
+ * source is identified by its device, inode, size and modification time, so
+ * a journal is not applied to a source that changed in between.
+ */
+struct resume_journal {
+	unsigned long src_dev;
+	unsigned long src_ino;
+	long src_size;
+	long src_mtime_sec;
+	long src_mtime_nsec;
+	long offset;
+	uint32_t tail_crc;
+};
+
+/*
+ * Copy of a single file, shared by the functions that copy its ranges.
+ * `direct_alignment` is the alignment required by O_DIRECT, or zero when the
+ * files go through the page cache.
+ */
+struct file_copy {
+	int src_fd;
+	int dest_fd;
+	long src_filesize;
+	long direct_alignment;
+	struct checksum *checksum;
+	const struct copy_options *options;
+};
+
+/*
+ * Regular file copy submitted by the tree walk to the worker pool. Both paths
+ * are owned by the job.
+ */
+struct copy_job {
+	char *src_path;
+	char *dest_path;
+};
+
+/*
+ * Jobs of a single worker. The owner pushes and pops at `tail` while the other
+ * workers steal from `head`.
+ */
+struct job_deque {
+	pthread_mutex_t lock;
+	struct copy_job *jobs;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct worker_pool;
+
+struct worker {
+	int id;
+	pthread_t thread;
+	struct worker_pool *pool;
+};
+
+/*
+ * Work-stealing pool: every worker has its own deque and, once it runs dry,
+ * steals the oldest jobs of the others. `queued_jobs` lets idle workers sleep
+ * on `idle_cond` until a job is submitted or the walk finishes.
+ */
+struct worker_pool {
+	const struct copy_options *options;
+	struct worker *workers;
+	struct job_deque *deques;
+	int workers_count;
+	int next_deque;
+	atomic_int queued_jobs;
+	atomic_int failures;
+	bool walk_finished;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+};
+
+/*
+ * Striped copy of a single file: the threads take the next `STRIPE_SIZE`
+ * bytes of [0, `end`) from `next_offset` until none is left or one of them
+ * sets `failed`.
+ */
+struct stripe_pool {
+	struct file_copy *copy;
+	long end;
+	atomic_long next_offset;
+	atomic_bool failed;
+};
+
+struct fanout;
+
+/*
+ * Writer of one destination of a fan-out copy. A writer whose destination
+ * fails keeps taking part in every window, but stops writing.
+ */
+struct fanout_writer {
+	struct fanout *fanout;
+	struct file_copy copy;
+	char *dest_filepath;
+	pthread_t thread;
+	bool is_started;
+	int res;
+};
+
+/*
+ * Copy of one source into several destinations reading it once. The calling
+ * thread publishes each chunk of the source in `window` and bumps
+ * `generation`, then waits on `window_done` until the `pending` writers have
+ * written it. `is_finished` tells the writers that no more chunks follow.
+ */
+struct fanout {
+	struct fanout_writer *writers;
+	int writers_count;
+	pthread_mutex_t lock;
+	pthread_cond_t window_ready;
+	pthread_cond_t window_done;
+	long generation;
+	int pending;
+	bool is_finished;
+	const char *window;
+	long window_offset;
+	long window_len;
+};
+
+/*
+ * Chunk of the file handled by one io_uring buffer. It is first read from the
+ * source and then written to the destination, `done` being the bytes of the
+ * current operation already completed.
+ */
+struct uring_slot {
+	long offset;
+	long len;
+	long done;
+	bool is_writing;
+	bool in_flight;
+};
+
+/*
+ * io_uring instance set up through the raw syscalls: the mapped submission and
+ * completion rings, and one registered buffer per slot.
+ */
+struct uring {
+	int fd;
+	int depth;
+	unsigned to_submit;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	char *buffers;
+	struct uring_slot *slots;
+	struct checksum *checksum;
+};
+
+/*
+ * Metadata of the source directory to apply to a destination directory once
+ * it is filled: only its permissions, or also its owner and timestamps in
+ * archive mode.
+ */
+struct directory_mode {
+	char *dest_path;
+	struct stat info;
+};
+
+struct directory_modes {
+	struct directory_mode *entries;
+	size_t count;
+	size_t capacity;
+	bool archive;
+};
+
+/* Destination of the first copy of a source inode with several hard links */
+struct inode_entry {
+	dev_t dev;
+	ino_t ino;
+	char *dest_path;
+};
+
+/*
+ * Open addressing hash table of the inodes with several hard links copied so
+ * far, keyed by (st_dev, st_ino). `capacity` is a power of two.
+ */
+struct inode_table {
+	struct inode_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+/* Hard link to `target_path`, created once the target has been copied */
+struct hard_link {
+	const char *target_path;
+	char *link_path;
+};
+
+struct hard_links {
+	struct hard_link *entries;
+	size_t count;
+	size_t capacity;
+};
+
+/*
+ * State of the walk of a recursive copy: the pool that copies the regular
+ * files, the directories whose metadata is applied at the end and, in archive
+ * mode, the inodes already copied and the hard links left to create.
+ */
+struct tree_copy {
+	struct worker_pool *pool;
+	struct directory_modes modes;
+	struct inode_table inodes;
+	struct hard_links links;
+};
+
+enum long_option_code {
+	OPTION_ENGINE = 256,
+	OPTION_WINDOW,
+	OPTION_SPARSE,
+	OPTION_QUEUE_DEPTH,
+	OPTION_DIRECT,
+	OPTION_VERIFY,
+	OPTION_RESUME,
+	OPTION_THREADS,
+	OPTION_UPDATE_DELTA,
+};
+
+static const struct option LONG_OPTIONS[] = {
+	{ "verbose", no_argument, NULL, 'v' },
+	{ "engine", required_argument, NULL, OPTION_ENGINE },
+	{ "window", required_argument, NULL, OPTION_WINDOW },
+	{ "sparse", required_argument, NULL, OPTION_SPARSE },
+	{ "queue-depth", required_argument, NULL, OPTION_QUEUE_DEPTH },
+	{ "direct", no_argument, NULL, OPTION_DIRECT },
+	{ "verify", no_argument, NULL, OPTION_VERIFY },
+	{ "resume", no_argument, NULL, OPTION_RESUME },
+	{ "threads", required_argument, NULL, OPTION_THREADS },
+	{ "update-delta", no_argument, NULL, OPTION_UPDATE_DELTA },
+	{ "recursive", no_argument, NULL, 'r' },
+	{ "archive", no_argument, NULL, 'a' },
+	{ "jobs", required_argument, NULL, 'j' },
+	{ NULL, 0, NULL, 0 },
+};
 
 /*
  * Check if the file at `filepath` exists.
@@ -39,34 +512,322 @@ does_file_exist(char *filepath)
 }
 
 /*
- * Parse command-line arguments to get source and destination file paths.
- * If the source file does not exist or the destination file already exists, the process exits.
+ * Check if `path` is `-`, which stands for the standard input or output.
+ */
+bool
+is_stdio_path(const char *path)
+{
+	return strcmp(path, STDIO_PATH_ALIAS) == 0;
+}
+
+/*
+ * Check if the entity at `path` is a directory, following symbolic links.
+ */
+bool
+is_directory(const char *path)
+{
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+/*
+ * Parse a size such as `4096`, `512K`, `64M` or `2G` from `str` into `size`.
+ * Returns `SUCCESS` if `str` is a positive size, otherwise returns `FAILED`.
+ */
+int
+parse_size(const char *str, long *size)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (errno != 0 || end == str || value <= 0) {
+		return FAILED;
+	}
+
+	long multiplier = 1;
+	switch (toupper((unsigned char) *end)) {
+	case 'G':
+		multiplier *= 1024;
+		/* fall through */
+	case 'M':
+		multiplier *= 1024;
+		/* fall through */
+	case 'K':
+		multiplier *= 1024;
+		end++;
+		break;
+	default:
+		break;
+	}
+
+	if (*end != '\0' || value > LONG_MAX / multiplier) {
+		return FAILED;
+	}
+
+	*size = value * multiplier;
+	return SUCCESS;
+}
+
+/*
+ * Parse a count such as a number of threads from `str` into `count`.
+ * Returns `SUCCESS` if `str` is a whole number from 1 to `max`, otherwise
+ * returns `FAILED`.
+ */
+int
+parse_count(const char *str, int max, int *count)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || value <= 0 ||
+	    value > max) {
+		return FAILED;
+	}
+
+	*count = (int) value;
+	return SUCCESS;
+}
+
+/*
+ * Find the engine named `name`.
+ * Returns `SUCCESS` and stores it in `engine` if it exists, otherwise returns
+ * `FAILED`.
+ */
+int
+parse_engine(const char *name, enum copy_engine *engine)
+{
+	for (int i = 0; i < COPY_ENGINES_COUNT; i++) {
+		if (strcmp(name, COPY_ENGINE_NAMES[i]) == 0) {
+			*engine = (enum copy_engine) i;
+			return SUCCESS;
+		}
+	}
+	return FAILED;
+}
+
+/*
+ * Find the sparse mode named `name`.
+ * Returns `SUCCESS` and stores it in `sparse` if it exists, otherwise returns
+ * `FAILED`.
+ */
+int
+parse_sparse_mode(const char *name, enum sparse_mode *sparse)
+{
+	for (int i = 0; i < SPARSE_MODES_COUNT; i++) {
+		if (strcmp(name, SPARSE_MODE_NAMES[i]) == 0) {
+			*sparse = (enum sparse_mode) i;
+			return SUCCESS;
+		}
+	}
+	return FAILED;
+}
+
+/*
+ * Check that the options in `options` can be used when copying into several
+ * destinations at once, printing the first one that cannot.
+ * Returns `SUCCESS` if they can, otherwise returns `FAILED`.
+ */
+int
+check_fanout_options(const struct copy_options *options)
+{
+	const char *option = NULL;
+	if (options->archive) {
+		option = "-a";
+	} else if (options->recursive) {
+		option = "-r";
+	} else if (options->resume) {
+		option = "--resume";
+	} else if (options->update_delta) {
+		option = "--update-delta";
+	} else if (options->direct) {
+		option = "--direct";
+	} else if (options->threads > 1) {
+		option = "--threads";
+	} else if (options->engine == ENGINE_URING) {
+		option = "--engine=uring";
+	}
+	if (option != NULL) {
+		fprintf(stderr,
+		        "Error: %s cannot be used with several destinations\n",
+		        option);
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Parse command-line arguments to get the options, the source file path and
+ * the `dests_count` destination file paths. If the arguments are invalid, the
+ * source file does not exist or a destination file already exists without
+ * `--resume` or `--update-delta`, the process exits.
  */
 void
-parse_arguments(char *argv[], char **src_filepath, char **dest_filepath)
+parse_arguments(int argc,
+                char *argv[],
+                struct copy_options *options,
+                char **src_filepath,
+                char ***dest_filepaths,
+                int *dests_count)
 {
-	*src_filepath = argv[SRC_FILE_ARGV_POSITION];
-	if (does_file_exist(*src_filepath) == FILE_DOES_NOT_EXIST) {
+	int opt = 0, res = SUCCESS;
+	while ((opt = getopt_long(argc, argv, "varj:", LONG_OPTIONS, NULL)) !=
+	       -1) {
+		switch (opt) {
+		case 'v':
+			options->verbose = true;
+			break;
+		case OPTION_ENGINE:
+			res = parse_engine(optarg, &options->engine);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: unknown engine '%s'\n",
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPTION_WINDOW:
+			res = parse_size(optarg, &options->window_size);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: invalid window size '%s'\n",
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			options->recursive = true;
+			break;
+		case 'a':
+			options->recursive = true;
+			options->archive = true;
+			break;
+		case 'j':
+			res = parse_count(optarg, MAX_JOBS, &options->jobs);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: invalid number of jobs '%s'\n",
+				        optarg);
+				fprintf(stderr, USAGE_FMT, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPTION_QUEUE_DEPTH:
+			res = parse_count(
+			        optarg, MAX_QUEUE_DEPTH, &options->queue_depth);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: invalid queue depth '%s'\n",
+				        optarg);
+				fprintf(stderr, USAGE_FMT, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPTION_DIRECT:
+			options->direct = true;
+			break;
+		case OPTION_VERIFY:
+			options->verify = true;
+			break;
+		case OPTION_RESUME:
+			options->resume = true;
+			break;
+		case OPTION_UPDATE_DELTA:
+			options->update_delta = true;
+			break;
+		case OPTION_THREADS:
+			res = parse_count(
+			        optarg, MAX_STRIPE_THREADS, &options->threads);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: invalid number of threads "
+				        "'%s'\n",
+				        optarg);
+				fprintf(stderr, USAGE_FMT, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPTION_SPARSE:
+			res = parse_sparse_mode(optarg, &options->sparse);
+			if (res == FAILED) {
+				fprintf(stderr,
+				        "Error: unknown sparse mode '%s'\n",
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			fprintf(stderr, USAGE_FMT, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind < INPUT_PARAMS) {
+		fprintf(stderr, "Error while calling program. ");
+		fprintf(stderr, USAGE_FMT, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	*src_filepath = argv[optind + SRC_FILE_ARGV_POSITION];
+	if (!is_stdio_path(*src_filepath) &&
+	    does_file_exist(*src_filepath) == FILE_DOES_NOT_EXIST) {
 		fprintf(stderr,
 		        "Error: source file '%s' does not exist",
 		        *src_filepath);
 		exit(EXIT_FAILURE);
 	}
 
-	*dest_filepath = argv[DEST_FILE_ARGV_POSITION];
-	if (does_file_exist(*dest_filepath) == FILE_EXISTS) {
-		fprintf(stderr, "Error: destination file '%s' already exists. Copy aborted\n", *dest_filepath);
+	if (!options->recursive && is_directory(*src_filepath)) {
+		fprintf(stderr,
+		        "Error: source '%s' is a directory, use -r to copy "
+		        "it\n",
+		        *src_filepath);
+		exit(EXIT_FAILURE);
+	}
+
+	if (options->jobs == 0) {
+		options->jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		if (options->jobs <= 0) {
+			options->jobs = 1;
+		}
+	}
+
+	*dest_filepaths = &argv[optind + DEST_FILE_ARGV_POSITION];
+	*dests_count = argc - optind - DEST_FILE_ARGV_POSITION;
+	if (*dests_count > 1 && check_fanout_options(options) == FAILED) {
 		exit(EXIT_FAILURE);
 	}
+	for (int i = 0; i < *dests_count; i++) {
+		char *dest_filepath = (*dest_filepaths)[i];
+		if (*dests_count > 1 && is_stdio_path(dest_filepath)) {
+			fprintf(stderr,
+			        "Error: '-' cannot be one of several "
+			        "destinations\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!options->resume && !options->update_delta &&
+		    !is_stdio_path(dest_filepath) &&
+		    does_file_exist(dest_filepath) == FILE_EXISTS) {
+			fprintf(stderr,
+			        "Error: destination file '%s' already exists. "
+			        "Copy aborted\n",
+			        dest_filepath);
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
 /*
- * Delete the file at `filepath`.
+ * Delete the file at `filepath`. The standard output, given as `-`, is left
+ * alone.
  * Returns `SUCCESS` if the file is successfully deleted, otherwise returns `FAILED`.
  */
 int
 unlink_file(char *filepath)
 {
+	if (is_stdio_path(filepath)) {
+		return SUCCESS;
+	}
+
 	int res = unlink(filepath);
 	if (res == GENERIC_ERROR_CODE) {
 		perror("Error: could not remove the file from the filesystem");
@@ -96,46 +857,73 @@ close_fd(int fd, bool exit_on_failure)
 
 /*
  * Close `src_fd` and `dest_fd` FDs.
- * If closing any file descriptor fails, the process exits.
+ * Returns `SUCCESS` if both FDs are successfully closed, otherwise returns
+ * `FAILED`.
  */
-void
+int
 close_all_fds(int src_fd, int dest_fd)
 {
 	int res_src = close_fd(src_fd, DONT_EXIT_ON_FAILURE);
 	int res_dest = close_fd(dest_fd, DONT_EXIT_ON_FAILURE);
 
 	if (res_src == FAILED || res_dest == FAILED) {
-		exit(EXIT_FAILURE);
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Open the destination file at `dest_filepath`, creating it if needed, and save
+ * the FD in `dest_fd`. A `-` path stands for a duplicate of the standard
+ * output.
+ * Returns `SUCCESS` if the file is opened, otherwise returns `FAILED`.
+ */
+int
+open_destination(char *dest_filepath, int *dest_fd)
+{
+	if (is_stdio_path(dest_filepath)) {
+		*dest_fd = dup(STDOUT_FILENO);
+	} else {
+		*dest_fd = open(dest_filepath,
+		                O_CREAT | O_RDWR,
+		                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	}
+	if (*dest_fd == GENERIC_ERROR_CODE) {
+		perror("Error: failed to create regular file from the "
+		       "destination path");
+		return FAILED;
 	}
+	return SUCCESS;
 }
 
 /*
  * Open the source and destination files via the src_filepath and dest_filepath
- * paths and save the FDs. If opening any file or getting the source file
- * metadata fails, the process exits. The size in bytes of the source files is
- * saved in `src_filesize`
+ * paths and save the FDs. A `-` path stands for a duplicate of the standard
+ * input or output. The size in bytes of the source files is saved in
+ * `src_filesize`.
+ * Returns `SUCCESS` if both files are opened and the source file metadata is
+ * read, otherwise the opened FDs are closed and returns `FAILED`.
  */
-void
+int
 open_files(int *src_fd,
            int *dest_fd,
            char *src_filepath,
            char *dest_filepath,
            long *src_filesize)
 {
-	*src_fd = open(src_filepath, O_RDONLY);
+	if (is_stdio_path(src_filepath)) {
+		*src_fd = dup(STDIN_FILENO);
+	} else {
+		*src_fd = open(src_filepath, O_RDONLY);
+	}
 	if (*src_fd == GENERIC_ERROR_CODE) {
 		perror("Error: failed to open source file from path");
-		exit(EXIT_FAILURE);
+		return FAILED;
 	}
 
-	*dest_fd = open(dest_filepath,
-	                O_CREAT | O_RDWR,
-	                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (*dest_fd == GENERIC_ERROR_CODE) {
-		perror("Error: failed to create regular file from the "
-		       "destination path");
-		close_fd(*src_fd, EXIT_ON_FAILURE);
-		exit(EXIT_FAILURE);
+	if (open_destination(dest_filepath, dest_fd) == FAILED) {
+		close_fd(*src_fd, DONT_EXIT_ON_FAILURE);
+		return FAILED;
 	}
 
 	struct stat file_info;
@@ -144,10 +932,11 @@ open_files(int *src_fd,
 		perror("Error: failed to accesing source file metadata");
 		unlink_file(dest_filepath);
 		close_all_fds(*src_fd, *dest_fd);
-		exit(EXIT_FAILURE);
+		return FAILED;
 	}
 
 	*src_filesize = file_info.st_size;
+	return SUCCESS;
 }
 
 /*
@@ -173,82 +962,4028 @@ release_resources(void *src_bytemap, void *dest_bytemap, long src_filesize)
 	return SUCCESS;
 }
 
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_x2n_table[32];
+static uint32_t crc32c_lane_shift, crc32c_two_lanes_shift;
+
 /*
- * Copy the content from the source file pointed by the FD `src_fd` to the
- * destination file pointed by the FD `dest_fd` using memory mapping and
- * expanding the size of `dest_fd`. If the mapping operations, the size
- * expansion or the memory unmapping fails, the process exits.
+ * Update the CRC32C register `crc` with the `len` bytes of `buf` one byte at a
+ * time. No conditioning (initial or final inversion) is applied.
  */
-void
-copy_content(int src_fd, int dest_fd, long src_filesize, char *dest_filepath)
+uint32_t
+crc32c_update_table(uint32_t crc, const char *buf, size_t len)
 {
-	void *src_map = mmap(
-	        NULL, src_filesize, PROT_READ, MAP_PRIVATE, src_fd, ZERO_OFFSET);
-	if (src_map == MAP_FAILED) {
-		perror("Error: could not map memory for source file");
-		unlink_file(dest_filepath);
-		close_all_fds(src_fd, dest_fd);
-		exit(EXIT_FAILURE);
+	const unsigned char *bytes = (const unsigned char *) buf;
+	for (size_t i = 0; i < len; i++) {
+		crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
 	}
+	return crc;
+}
 
-	int res = ftruncate(dest_fd, (off_t) src_filesize);
-	if (res == GENERIC_ERROR_CODE) {
-		perror("Error: could not grow file size for destination file");
-		int res = munmap(src_map, src_filesize);
-		if (res == GENERIC_ERROR_CODE) {
-			perror("Failed to unmap memory from source");
+/*
+ * Multiply the polynomials `a` and `b` modulo the CRC32C polynomial, both in
+ * the bit-reversed representation used by the CRC register.
+ */
+uint32_t
+crc32c_multiply(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+	for (uint32_t bit = 1u << 31; bit != 0 && a != 0; bit >>= 1) {
+		if (a & bit) {
+			product ^= b;
+			a ^= bit;
 		}
-		unlink_file(dest_filepath);
-		close_all_fds(src_fd, dest_fd);
-		exit(EXIT_FAILURE);
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
 	}
+	return product;
+}
 
-	void *dest_map = mmap(
-	        NULL, src_filesize, PROT_WRITE, MAP_SHARED, dest_fd, ZERO_OFFSET);
-	if (dest_map == MAP_FAILED) {
-		perror("Error: could not map memory for destination file");
-		int res = munmap(src_map, src_filesize);
-		if (res == GENERIC_ERROR_CODE) {
-			perror("Failed to unmap memory from source");
+/*
+ * Advance the CRC32C register `crc` as if `len` zero bytes were processed, by
+ * multiplying it by x^(8 * `len`) in O(log(`len`)) steps.
+ */
+uint32_t
+crc32c_shift(uint32_t crc, long len)
+{
+	uint32_t power = 1u << 31; /* x^0 */
+	for (int k = 3; len > 0; len >>= 1, k++) {
+		if (len & 1) {
+			power = crc32c_multiply(crc32c_x2n_table[k & 31],
+			                        power);
 		}
-		unlink_file(dest_filepath);
-		close_all_fds(src_fd, dest_fd);
-		exit(EXIT_FAILURE);
 	}
+	return crc32c_multiply(power, crc);
+}
 
-	memcpy(dest_map, src_map, src_filesize);
+#if defined(__x86_64__)
+/*
+ * Update the CRC32C register `crc` with the `len` bytes of `buf` using the
+ * SSE4.2 crc32 instruction. Large buffers are processed as three interleaved
+ * streams to hide the latency of the instruction, which are then merged by
+ * shifting the first two over the bytes that follow them.
+ */
+__attribute__((target("sse4.2"))) uint32_t
+crc32c_update_sse42(uint32_t crc, const char *buf, size_t len)
+{
+	uint64_t crc0 = crc;
+	while (len >= 3 * CRC32C_LANE_SIZE) {
+		uint64_t crc1 = 0, crc2 = 0;
+		const char *lane1 = buf + CRC32C_LANE_SIZE;
+		const char *lane2 = buf + 2 * CRC32C_LANE_SIZE;
+		for (size_t i = 0; i < CRC32C_LANE_SIZE; i += 8) {
+			uint64_t word0, word1, word2;
+			memcpy(&word0, buf + i, sizeof(word0));
+			memcpy(&word1, lane1 + i, sizeof(word1));
+			memcpy(&word2, lane2 + i, sizeof(word2));
+			crc0 = _mm_crc32_u64(crc0, word0);
+			crc1 = _mm_crc32_u64(crc1, word1);
+			crc2 = _mm_crc32_u64(crc2, word2);
+		}
+		/* Each stream is followed by the ones after it */
+		crc0 = crc32c_multiply(crc32c_two_lanes_shift,
+		                       (uint32_t) crc0) ^
+		       crc32c_multiply(crc32c_lane_shift, (uint32_t) crc1) ^
+		       (uint32_t) crc2;
+		buf += 3 * CRC32C_LANE_SIZE;
+		len -= 3 * CRC32C_LANE_SIZE;
+	}
 
-	res = release_resources(src_map, dest_map, src_filesize);
-	if (res == FAILED) {
-		unlink_file(dest_filepath);
-		close_all_fds(src_fd, dest_fd);
-		exit(EXIT_FAILURE);
+	for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		crc0 = _mm_crc32_u64(crc0, word);
+		buf += sizeof(uint64_t);
+	}
+	for (; len > 0; len--) {
+		crc0 = _mm_crc32_u8((uint32_t) crc0, (unsigned char) *buf++);
 	}
+	return (uint32_t) crc0;
 }
+#endif
 
-int
-main(int argc, char *argv[])
+static uint32_t (*crc32c_update)(uint32_t, const char *, size_t) =
+        &crc32c_update_table;
+
+/*
+ * Build the CRC32C tables and select the fastest implementation supported by
+ * the CPU. Must be called before any checksum is computed.
+ */
+void
+crc32c_init(void)
 {
-	if (argc != INPUT_PARAMS + 1) {
-		fprintf(stderr,
-		        "Error while calling program. Expected %s <source "
-		        "file> <destination file>\n",
-		        argv[0]);
-		exit(EXIT_FAILURE);
+	for (uint32_t byte = 0; byte < 256; byte++) {
+		uint32_t crc = byte;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[byte] = crc;
 	}
 
-	char *src_filepath = NULL;
-	char *dest_filepath = NULL;
+	/* x^(2^k) for every k, used to shift by any number of bytes */
+	crc32c_x2n_table[0] = 1u << 30; /* x^1 */
+	for (int k = 1; k < 32; k++) {
+		crc32c_x2n_table[k] = crc32c_multiply(crc32c_x2n_table[k - 1],
+		                                      crc32c_x2n_table[k - 1]);
+	}
+	crc32c_lane_shift = crc32c_shift(1u << 31, CRC32C_LANE_SIZE);
+	crc32c_two_lanes_shift = crc32c_shift(1u << 31, 2 * CRC32C_LANE_SIZE);
 
-	parse_arguments(argv, &src_filepath, &dest_filepath);
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_update = &crc32c_update_sse42;
+	}
+#endif
+}
 
-	int src_fd = 0;
+/*
+ * Add the `len` bytes of `buf`, found at `offset` of the file, to `checksum`.
+ * Chunks can be added in any order and from several threads. Does nothing if
+ * `checksum` is `NULL`.
+ */
+void
+checksum_update(struct checksum *checksum,
+                long offset,
+                const char *buf,
+                size_t len)
+{
+	if (checksum == NULL || len == 0) {
+		return;
+	}
+	uint32_t crc = crc32c_update(0, buf, len);
+	crc = crc32c_shift(crc, checksum->total_len - offset - (long) len);
+	atomic_fetch_xor(&checksum->raw, crc);
+}
+
+/*
+ * Get the CRC32C of the whole file from the chunks added to `checksum`.
+ */
+uint32_t
+checksum_digest(struct checksum *checksum)
+{
+	uint32_t initial = crc32c_shift(0xffffffff, checksum->total_len);
+	return ~(initial ^ atomic_load(&checksum->raw));
+}
+
+/*
+ * Check if `err` means that a copy strategy is not available for the pair of
+ * files (unsupported syscall, filesystem or file type), in which case the next
+ * strategy can be tried instead of failing the copy.
+ */
+bool
+is_strategy_unsupported_error(int err)
+{
+	return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP ||
+	       err == EXDEV || err == EINVAL || err == ENOTTY || err == EBADF;
+}
+
+/*
+ * Share the extents of the source file with the destination file through the
+ * FICLONE ioctl, so that no data is copied at all. Only filesystems with
+ * reflink support (e.g. btrfs, XFS) accept it.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` or `FAILED`.
+ */
+int
+copy_with_reflink(int src_fd, int dest_fd)
+{
+	int res = ioctl(dest_fd, FICLONE, src_fd);
+	if (res == GENERIC_ERROR_CODE) {
+		if (is_strategy_unsupported_error(errno)) {
+			return NOT_SUPPORTED;
+		}
+		perror("Error: reflink of source file failed");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the bytes from `*copied` up to `src_filesize` with copy_file_range(2),
+ * letting the kernel (or the filesystem) move the data without going through
+ * user space. `*copied` is advanced with the bytes transferred. Some
+ * filesystems, such as procfs and sysfs, make it copy nothing at all, which is
+ * taken as lack of support when it happens on the first call.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` or `FAILED`.
+ */
+int
+copy_with_copy_file_range(int src_fd,
+                          int dest_fd,
+                          long src_filesize,
+                          long *copied)
+{
+	long start = *copied;
+	while (*copied < src_filesize) {
+		off_t src_offset = *copied, dest_offset = *copied;
+		size_t remaining = src_filesize - *copied;
+		if (remaining > MAX_KERNEL_TRANSFER) {
+			remaining = MAX_KERNEL_TRANSFER;
+		}
+
+		ssize_t res = copy_file_range(src_fd,
+		                              &src_offset,
+		                              dest_fd,
+		                              &dest_offset,
+		                              remaining,
+		                              0);
+		if (res == GENERIC_ERROR_CODE) {
+			if (is_strategy_unsupported_error(errno)) {
+				return NOT_SUPPORTED;
+			}
+			perror("Error: copy_file_range of source file failed");
+			return FAILED;
+		}
+		if (res == 0 && *copied == start) {
+			return NOT_SUPPORTED;
+		}
+		if (res == 0) {
+			/* The source file was truncated while being copied */
+			break;
+		}
+		*copied += res;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the bytes from `*copied` up to `src_filesize` with sendfile(2), which
+ * moves the data through the page cache without a user space buffer.
+ * `*copied` is advanced with the bytes transferred.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` or `FAILED`.
+ */
+int
+copy_with_sendfile(int src_fd, int dest_fd, long src_filesize, long *copied)
+{
+	off_t res_seek = lseek(dest_fd, (off_t) *copied, SEEK_SET);
+	if (res_seek == GENERIC_ERROR_CODE) {
+		perror("Error: could not seek destination file");
+		return FAILED;
+	}
+
+	while (*copied < src_filesize) {
+		off_t src_offset = *copied;
+		size_t remaining = src_filesize - *copied;
+		if (remaining > MAX_KERNEL_TRANSFER) {
+			remaining = MAX_KERNEL_TRANSFER;
+		}
+
+		ssize_t res = sendfile(dest_fd, src_fd, &src_offset, remaining);
+		if (res == GENERIC_ERROR_CODE) {
+			if (is_strategy_unsupported_error(errno)) {
+				return NOT_SUPPORTED;
+			}
+			perror("Error: sendfile of source file failed");
+			return FAILED;
+		}
+		if (res == 0) {
+			break;
+		}
+		*copied += res;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Hint the kernel that the mapping at `map` of `len` bytes is accessed
+ * sequentially and may be backed by transparent huge pages. The hints are
+ * best effort: filesystems without huge page support reject them.
+ */
+void
+advise_mapping(void *map, size_t len)
+{
+	madvise(map, len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(map, len, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * Copy the bytes from `copied` up to `src_filesize` using memory mapping and
+ * expanding the size of `dest_fd`. Only the pages from `copied` onwards are
+ * mapped.
+ * Returns `SUCCESS` if the mapping operations, the size expansion and the
+ * memory unmapping succeed, otherwise returns `FAILED`.
+ */
+int
+copy_with_mmap(int src_fd,
+               int dest_fd,
+               long src_filesize,
+               long copied,
+               struct checksum *checksum)
+{
+	if (copied >= src_filesize) {
+		return SUCCESS;
+	}
+
+	/* mmap offsets must be page aligned */
+	long page_size = sysconf(_SC_PAGESIZE);
+	long map_offset = copied / page_size * page_size;
+	long map_len = src_filesize - map_offset;
+	long delta = copied - map_offset;
+
+	/*
+	 * The source is populated up front, so reading it does not take one
+	 * page fault per page. The destination is not: populating it for
+	 * writing zero-fills every page right before memcpy overwrites it.
+	 * Both mappings are hinted for sequential access and huge pages.
+	 */
+	void *src_map = mmap(NULL,
+	                     map_len,
+	                     PROT_READ,
+	                     MAP_PRIVATE | MAP_POPULATE,
+	                     src_fd,
+	                     (off_t) map_offset);
+	if (src_map == MAP_FAILED) {
+		perror("Error: could not map memory for source file");
+		return FAILED;
+	}
+	advise_mapping(src_map, map_len);
+
+	/* No-op when the destination was already preallocated */
+	int res = ftruncate(dest_fd, (off_t) src_filesize);
+	if (res == GENERIC_ERROR_CODE) {
+		perror("Error: could not grow file size for destination file");
+		int res = munmap(src_map, map_len);
+		if (res == GENERIC_ERROR_CODE) {
+			perror("Failed to unmap memory from source");
+		}
+		return FAILED;
+	}
+
+	void *dest_map = mmap(NULL,
+	                      map_len,
+	                      PROT_WRITE,
+	                      MAP_SHARED,
+	                      dest_fd,
+	                      (off_t) map_offset);
+	if (dest_map == MAP_FAILED) {
+		perror("Error: could not map memory for destination file");
+		int res = munmap(src_map, map_len);
+		if (res == GENERIC_ERROR_CODE) {
+			perror("Failed to unmap memory from source");
+		}
+		return FAILED;
+	}
+	advise_mapping(dest_map, map_len);
+
+	memcpy((char *) dest_map + delta,
+	       (char *) src_map + delta,
+	       map_len - delta);
+	checksum_update(checksum,
+	                copied,
+	                (char *) src_map + delta,
+	                map_len - delta);
+
+	return release_resources(src_map, dest_map, map_len);
+}
+
+/*
+ * Write the `len` bytes of `buf` at the current position of `fd`, which may be
+ * a pipe or a socket, retrying short writes.
+ * Returns `SUCCESS` if everything was written, otherwise returns `FAILED`.
+ */
+int
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t res = write(fd, buf, len);
+		if (res == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error: could not write to destination file");
+			return FAILED;
+		}
+		buf += res;
+		len -= res;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Write `len` bytes from `buf` into `fd` at `offset`, retrying short writes.
+ * Returns `SUCCESS` if everything was written, otherwise returns `FAILED`.
+ */
+int
+write_all_at(int fd, const char *buf, size_t len, off_t offset)
+{
+	while (len > 0) {
+		ssize_t res = pwrite(fd, buf, len, offset);
+		if (res == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error: could not write to destination file");
+			return FAILED;
+		}
+		buf += res;
+		len -= res;
+		offset += res;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Wait for the writeback of the destination range [`offset`, `offset` + `len`)
+ * started by `SYNC_FILE_RANGE_WRITE` and drop those pages from the page cache,
+ * as dirty pages cannot be dropped.
+ */
+void
+drop_written_pages(int dest_fd, off_t offset, off_t len)
+{
+	sync_file_range(dest_fd,
+	                offset,
+	                len,
+	                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+	                        SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(dest_fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Copy the bytes from `copied` up to `src_filesize` mapping at most
+ * `window_size` bytes of the source at a time and writing them into the
+ * destination. Finished windows are unmapped and dropped from the page cache,
+ * so the memory used stays flat regardless of the file size.
+ * Returns `SUCCESS` if the whole range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_with_window(int src_fd,
+                 int dest_fd,
+                 long src_filesize,
+                 long copied,
+                 long window_size,
+                 struct checksum *checksum)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	window_size = (window_size + page_size - 1) / page_size * page_size;
+	off_t prev_offset = 0, prev_len = 0;
+
+	for (long offset = copied; offset < src_filesize;) {
+		/* mmap offsets must be page aligned */
+		long map_offset = offset / window_size * window_size;
+		long map_len = src_filesize - map_offset;
+		if (map_len > window_size) {
+			map_len = window_size;
+		}
+		long delta = offset - map_offset;
+
+		char *src_map = mmap(NULL,
+		                     map_len,
+		                     PROT_READ,
+		                     MAP_SHARED | MAP_POPULATE,
+		                     src_fd,
+		                     (off_t) map_offset);
+		if (src_map == MAP_FAILED) {
+			perror("Error: could not map memory for source file");
+			return FAILED;
+		}
+		advise_mapping(src_map, map_len);
+
+		checksum_update(
+		        checksum, offset, src_map + delta, map_len - delta);
+		int res = write_all_at(dest_fd,
+		                       src_map + delta,
+		                       map_len - delta,
+		                       (off_t) offset);
+
+		madvise(src_map, map_len, MADV_DONTNEED);
+		if (munmap(src_map, map_len) == GENERIC_ERROR_CODE) {
+			perror("Failed to unmap memory from source");
+			res = FAILED;
+		}
+		if (res == FAILED) {
+			return FAILED;
+		}
+
+		/*
+		 * Start the writeback of this window now and wait for the
+		 * previous one, which keeps the disk busy while the next window
+		 * is being copied.
+		 */
+		posix_fadvise(src_fd, map_offset, map_len, POSIX_FADV_DONTNEED);
+		sync_file_range(dest_fd,
+		                (off_t) offset,
+		                map_len - delta,
+		                SYNC_FILE_RANGE_WRITE);
+		if (prev_len > 0) {
+			drop_written_pages(dest_fd, prev_offset, prev_len);
+		}
+		prev_offset = offset;
+		prev_len = map_len - delta;
+		offset = map_offset + map_len;
+	}
+
+	if (prev_len > 0) {
+		drop_written_pages(dest_fd, prev_offset, prev_len);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Release the rings, the registered buffers and the FD of `ring`.
+ */
+void
+uring_close(struct uring *ring)
+{
+	if (ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->fd != GENERIC_ERROR_CODE) {
+		close(ring->fd);
+	}
+	free(ring->buffers);
+	free(ring->slots);
+}
+
+/*
+ * Set up an io_uring instance in `ring` with `depth` entries, mapping its
+ * submission and completion rings, and register `depth` fixed buffers of
+ * `URING_BUFFER_SIZE` bytes so the kernel does not map them on every request.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if the kernel does not provide io_uring or
+ * does not allow to use it, or `FAILED`.
+ */
+int
+uring_open(struct uring *ring, int depth)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = GENERIC_ERROR_CODE;
+	ring->sq_ring = MAP_FAILED;
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->depth = depth;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int) syscall(__NR_io_uring_setup, depth, &params);
+	if (ring->fd == GENERIC_ERROR_CODE) {
+		return NOT_SUPPORTED;
+	}
+
+	ring->sq_ring_size =
+	        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes +
+	                     params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP &&
+	    ring->cq_ring_size > ring->sq_ring_size) {
+		ring->sq_ring_size = ring->cq_ring_size;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL,
+	                     ring->sq_ring_size,
+	                     PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE,
+	                     ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("Error: could not map io_uring submission ring");
+		return FAILED;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL,
+		                     ring->cq_ring_size,
+		                     PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE,
+		                     ring->fd,
+		                     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			perror("Error: could not map io_uring completion ring");
+			return FAILED;
+		}
+	}
+
+	ring->sqes = mmap(NULL,
+	                  ring->sqes_size,
+	                  PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE,
+	                  ring->fd,
+	                  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("Error: could not map io_uring submission entries");
+		return FAILED;
+	}
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	ring->slots = calloc(depth, sizeof(struct uring_slot));
+	struct iovec *iovecs = calloc(depth, sizeof(struct iovec));
+	int res = posix_memalign((void **) &ring->buffers,
+	                         sysconf(_SC_PAGESIZE),
+	                         depth * URING_BUFFER_SIZE);
+	if (ring->slots == NULL || iovecs == NULL || res != 0) {
+		fprintf(stderr, "Error: could not allocate io_uring buffers\n");
+		free(iovecs);
+		return FAILED;
+	}
+
+	for (int i = 0; i < depth; i++) {
+		iovecs[i].iov_base = ring->buffers + i * URING_BUFFER_SIZE;
+		iovecs[i].iov_len = URING_BUFFER_SIZE;
+	}
+	res = (int) syscall(__NR_io_uring_register,
+	                    ring->fd,
+	                    IORING_REGISTER_BUFFERS,
+	                    iovecs,
+	                    depth);
+	free(iovecs);
+	if (res == GENERIC_ERROR_CODE) {
+		/* e.g. the buffers exceed RLIMIT_MEMLOCK */
+		return NOT_SUPPORTED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Queue a fixed buffer read or write (`opcode`) of the pending part of the
+ * slot `slot_index`. It is sent to the kernel on the next `uring_enter`.
+ */
+void
+uring_queue(struct uring *ring, int opcode, int fd, int slot_index)
+{
+	struct uring_slot *slot = &ring->slots[slot_index];
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = slot->offset + slot->done;
+	char *buffer = ring->buffers + slot_index * URING_BUFFER_SIZE;
+	sqe->addr = (unsigned long) (buffer + slot->done);
+	sqe->len = slot->len - slot->done;
+	sqe->buf_index = slot_index;
+	sqe->user_data = slot_index;
+
+	ring->sq_array[index] = index;
+	/* The entry must be visible to the kernel before the new tail */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+/*
+ * Submit the queued requests and wait for at least one of them to complete.
+ * Returns `SUCCESS` or `FAILED`.
+ */
+int
+uring_enter(struct uring *ring)
+{
+	while (true) {
+		int res = (int) syscall(__NR_io_uring_enter,
+		                        ring->fd,
+		                        ring->to_submit,
+		                        1,
+		                        IORING_ENTER_GETEVENTS,
+		                        NULL,
+		                        0);
+		if (res == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error: io_uring submission failed");
+			return FAILED;
+		}
+		ring->to_submit -= res;
+		return SUCCESS;
+	}
+}
+
+/*
+ * Advance the slot `slot_index` with the result `res` of its completed
+ * request, queueing what is left of it: the rest of a short read or write, the
+ * write of a buffer that was filled, or the read of the next chunk of the
+ * range [`*next_offset`, `end`) once the buffer was written. A failed request
+ * leaves its slot idle, so it is no longer counted as in flight.
+ * Returns `SUCCESS` or `FAILED`.
+ */
+int
+uring_complete(struct uring *ring,
+               int slot_index,
+               int res,
+               int src_fd,
+               int dest_fd,
+               long *next_offset,
+               long end)
+{
+	struct uring_slot *slot = &ring->slots[slot_index];
+	if (slot->is_writing && slot->in_flight && res == 0) {
+		/* A write that makes no progress would be queued forever */
+		res = -EIO;
+	}
+	if (res < 0) {
+		fprintf(stderr,
+		        "Error: io_uring %s failed: %s\n",
+		        slot->is_writing ? "write" : "read",
+		        strerror(-res));
+		slot->in_flight = false;
+		return FAILED;
+	}
+
+	slot->done += res;
+	if (!slot->is_writing && res == 0) {
+		/* The source file was truncated while being copied */
+		slot->len = slot->done;
+	}
+
+	if (slot->done < slot->len) {
+		uring_queue(ring,
+		            slot->is_writing ? IORING_OP_WRITE_FIXED
+		                             : IORING_OP_READ_FIXED,
+		            slot->is_writing ? dest_fd : src_fd,
+		            slot_index);
+		return SUCCESS;
+	}
+
+	if (!slot->is_writing && slot->len > 0) {
+		checksum_update(ring->checksum,
+		                slot->offset,
+		                ring->buffers + slot_index * URING_BUFFER_SIZE,
+		                slot->len);
+		slot->is_writing = true;
+		slot->done = 0;
+		uring_queue(ring, IORING_OP_WRITE_FIXED, dest_fd, slot_index);
+		return SUCCESS;
+	}
+
+	slot->in_flight = false;
+	if (*next_offset < end) {
+		slot->offset = *next_offset;
+		slot->len = end - *next_offset;
+		if (slot->len > (long) URING_BUFFER_SIZE) {
+			slot->len = URING_BUFFER_SIZE;
+		}
+		slot->done = 0;
+		slot->is_writing = false;
+		slot->in_flight = true;
+		*next_offset += slot->len;
+		uring_queue(ring, IORING_OP_READ_FIXED, src_fd, slot_index);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the bytes from `copied` up to `src_filesize` through io_uring, keeping
+ * up to `queue_depth` chunks in flight: every chunk is read into its own
+ * registered buffer and written as soon as the read completes, while the other
+ * chunks are still being read or written.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if io_uring cannot be used, or `FAILED`.
+ */
+int
+copy_with_uring(int src_fd,
+                int dest_fd,
+                long src_filesize,
+                long copied,
+                int queue_depth,
+                struct checksum *checksum)
+{
+	if (copied >= src_filesize) {
+		return SUCCESS;
+	}
+
+	long chunks = (src_filesize - copied + URING_BUFFER_SIZE - 1) /
+	              URING_BUFFER_SIZE;
+	int depth = chunks < queue_depth ? (int) chunks : queue_depth;
+
+	struct uring ring;
+	int res = uring_open(&ring, depth);
+	if (res != SUCCESS) {
+		uring_close(&ring);
+		return res;
+	}
+	ring.checksum = checksum;
+
+	/* Start every slot with a read, as if its previous write completed */
+	long next_offset = copied;
+	for (int i = 0; i < depth && res == SUCCESS; i++) {
+		ring.slots[i].is_writing = true;
+		res = uring_complete(&ring,
+		                     i,
+		                     0,
+		                     src_fd,
+		                     dest_fd,
+		                     &next_offset,
+		                     src_filesize);
+	}
+
+	int in_flight = depth;
+	while (in_flight > 0) {
+		if (uring_enter(&ring) == FAILED) {
+			/* Nothing can be reaped, the buffers must be leaked */
+			ring.buffers = NULL;
+			res = FAILED;
+			break;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe =
+			        &ring.cqes[head & *ring.cq_mask];
+			int slot_index = (int) cqe->user_data;
+			if (res == SUCCESS) {
+				res = uring_complete(&ring,
+				                     slot_index,
+				                     cqe->res,
+				                     src_fd,
+				                     dest_fd,
+				                     &next_offset,
+				                     src_filesize);
+			} else {
+				/*
+				 * After a failure the requests still in flight
+				 * are only drained, as the kernel may be using
+				 * their buffers.
+				 */
+				ring.slots[slot_index].in_flight = false;
+			}
+			if (!ring.slots[slot_index].in_flight) {
+				in_flight--;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_close(&ring);
+	return res;
+}
+
+/*
+ * Enable or disable O_DIRECT on `fd`.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if the filesystem rejects O_DIRECT, or
+ * `FAILED`.
+ */
+int
+set_direct_io(int fd, bool enabled)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == GENERIC_ERROR_CODE) {
+		perror("Error: could not get FD flags");
+		return FAILED;
+	}
+
+	flags = enabled ? flags | O_DIRECT : flags & ~O_DIRECT;
+	if (fcntl(fd, F_SETFL, flags) == GENERIC_ERROR_CODE) {
+		if (is_strategy_unsupported_error(errno)) {
+			return NOT_SUPPORTED;
+		}
+		perror("Error: could not set FD flags");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Get the offset, length and memory alignment that O_DIRECT requires for
+ * `fd`, as reported by statx(STATX_DIOALIGN) or, on kernels that do not
+ * report it, the preferred I/O block size of the file.
+ */
+long
+direct_io_alignment(int fd)
+{
+	long alignment = 0;
+#ifdef STATX_DIOALIGN
+	struct statx dio_info;
+	int res = statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &dio_info);
+	if (res == 0 && dio_info.stx_mask & STATX_DIOALIGN) {
+		alignment = dio_info.stx_dio_offset_align;
+		if (dio_info.stx_dio_mem_align > alignment) {
+			alignment = dio_info.stx_dio_mem_align;
+		}
+	}
+#endif
+	if (alignment == 0) {
+		struct stat info;
+		alignment = fstat(fd, &info) == 0 ? info.st_blksize
+		                                  : DIRECT_IO_DEFAULT_ALIGNMENT;
+	}
+	return alignment;
+}
+
+/*
+ * Open both files of `copy` with O_DIRECT so that the copy bypasses the page
+ * cache, storing in `copy->direct_alignment` the alignment it requires. If
+ * either filesystem rejects O_DIRECT both files are left as they were and the
+ * copy goes through the page cache.
+ * Returns `SUCCESS` or `FAILED`.
+ */
+int
+enable_direct_io(struct file_copy *copy)
+{
+	int res = set_direct_io(copy->src_fd, true);
+	if (res == SUCCESS) {
+		res = set_direct_io(copy->dest_fd, true);
+		if (res != SUCCESS) {
+			set_direct_io(copy->src_fd, false);
+		}
+	}
+	if (res == FAILED) {
+		return FAILED;
+	}
+	if (res == NOT_SUPPORTED) {
+		if (copy->options->verbose) {
+			printf("O_DIRECT not supported, using page cache\n");
+		}
+		return SUCCESS;
+	}
+
+	long src_alignment = direct_io_alignment(copy->src_fd);
+	long dest_alignment = direct_io_alignment(copy->dest_fd);
+	copy->direct_alignment = src_alignment > dest_alignment
+	                                 ? src_alignment
+	                                 : dest_alignment;
+	return SUCCESS;
+}
+
+/*
+ * Turn O_DIRECT off on both files of `copy` for the rest of the copy.
+ */
+void
+disable_direct_io(struct file_copy *copy)
+{
+	set_direct_io(copy->src_fd, false);
+	set_direct_io(copy->dest_fd, false);
+	copy->direct_alignment = 0;
+}
+
+/*
+ * Copy the range [`offset`, `end`) through the page cache even if the files of
+ * `copy` use O_DIRECT, which is needed for the pieces that are not aligned,
+ * such as the tail of the file.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_unaligned_range(struct file_copy *copy, long offset, long end)
+{
+	if (offset >= end) {
+		return SUCCESS;
+	}
+
+	bool is_direct = copy->direct_alignment > 0;
+	if (is_direct && (set_direct_io(copy->src_fd, false) != SUCCESS ||
+	                  set_direct_io(copy->dest_fd, false) != SUCCESS)) {
+		return FAILED;
+	}
+
+	int res = SUCCESS;
+	char buffer[DIRECT_IO_MAX_UNALIGNED];
+	while (offset < end && res == SUCCESS) {
+		size_t to_read = end - offset;
+		if (to_read > sizeof(buffer)) {
+			to_read = sizeof(buffer);
+		}
+		ssize_t read_bytes =
+		        pread(copy->src_fd, buffer, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			perror("Error: could not read from source file");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes == 0) {
+			break;
+		}
+		res = write_all_at(copy->dest_fd, buffer, read_bytes, offset);
+		if (res == SUCCESS) {
+			checksum_update(
+			        copy->checksum, offset, buffer, read_bytes);
+		}
+		offset += read_bytes;
+	}
+
+	if (is_direct && (set_direct_io(copy->src_fd, true) != SUCCESS ||
+	                  set_direct_io(copy->dest_fd, true) != SUCCESS)) {
+		res = FAILED;
+	}
+	return res;
+}
+
+/*
+ * Copy the aligned range [`offset`, `end`) of the files of `copy`, opened with
+ * O_DIRECT, through an aligned buffer with pread and pwrite.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if the filesystem rejects the direct I/O
+ * before anything was copied, or `FAILED`.
+ */
+int
+copy_with_direct_io(struct file_copy *copy, long offset, long end)
+{
+	char *buffer = NULL;
+	int res = posix_memalign((void **) &buffer,
+	                         copy->direct_alignment,
+	                         DIRECT_IO_BUFFER_SIZE);
+	if (res != 0) {
+		fprintf(stderr, "Error: could not allocate aligned buffer\n");
+		return FAILED;
+	}
+
+	long start = offset;
+	res = SUCCESS;
+	while (offset < end && res == SUCCESS) {
+		size_t to_read = end - offset;
+		if (to_read > DIRECT_IO_BUFFER_SIZE) {
+			to_read = DIRECT_IO_BUFFER_SIZE;
+		}
+
+		ssize_t read_bytes =
+		        pread(copy->src_fd, buffer, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EINVAL && offset == start) {
+				res = NOT_SUPPORTED;
+				break;
+			}
+			perror("Error: could not read from source file");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes == 0) {
+			/* The source file was truncated while being copied */
+			break;
+		}
+
+		/* A short read may leave an unaligned piece */
+		long aligned_len = read_bytes / copy->direct_alignment *
+		                   copy->direct_alignment;
+		res = write_all_at(copy->dest_fd, buffer, aligned_len, offset);
+		if (res == FAILED && errno == EINVAL && offset == start) {
+			res = NOT_SUPPORTED;
+			break;
+		}
+		/* Only what was written counts, the fallback copies the rest */
+		if (res == SUCCESS) {
+			checksum_update(
+			        copy->checksum, offset, buffer, aligned_len);
+		}
+		if (res == SUCCESS && aligned_len < read_bytes) {
+			res = copy_unaligned_range(copy,
+			                           offset + aligned_len,
+			                           offset + read_bytes);
+		}
+		offset += read_bytes;
+	}
+
+	free(buffer);
+	return res;
+}
+
+/*
+ * Copy the range [`offset`, `end`) of the files of `copy`, opened with
+ * O_DIRECT. The aligned body of the range is copied by the io_uring engine when
+ * it was requested and otherwise through an aligned buffer, while the
+ * unaligned head and tail, if any, go through the page cache. If the
+ * filesystem rejects direct I/O, O_DIRECT is turned off before anything was
+ * copied or checksummed, so the caller can copy the whole range again.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if O_DIRECT had to be turned off, or
+ * `FAILED`.
+ */
+int
+copy_direct_range(struct file_copy *copy,
+                  long offset,
+                  long end,
+                  enum copy_strategy *strategy)
+{
+	long alignment = copy->direct_alignment;
+	long body_start = (offset + alignment - 1) / alignment * alignment;
+	if (body_start > end) {
+		body_start = end;
+	}
+	long body_end = body_start + (end - body_start) / alignment * alignment;
+
+	int res = NOT_SUPPORTED;
+	if (copy->options->engine == ENGINE_URING) {
+		*strategy = STRATEGY_URING;
+		res = copy_with_uring(copy->src_fd,
+		                      copy->dest_fd,
+		                      body_end,
+		                      body_start,
+		                      copy->options->queue_depth,
+		                      copy->checksum);
+	}
+	if (res == NOT_SUPPORTED) {
+		*strategy = STRATEGY_DIRECT;
+		res = copy_with_direct_io(copy, body_start, body_end);
+	}
+	if (res == NOT_SUPPORTED) {
+		disable_direct_io(copy);
+		return NOT_SUPPORTED;
+	}
+	if (res == FAILED ||
+	    copy_unaligned_range(copy, offset, body_start) == FAILED) {
+		return FAILED;
+	}
+
+	return copy_unaligned_range(copy, body_end, end);
+}
+
+/*
+ * Copy the range [`offset`, `end`) of the source file into the same range of
+ * the destination file. If the files use O_DIRECT, the range is copied with
+ * direct I/O. Otherwise, with `ENGINE_AUTO` the strategies are tried from the
+ * cheapest to the most expensive one: copy_file_range, sendfile and finally
+ * memory mapping, each one resuming where the previous one stopped. Ranges
+ * larger than the window are mapped through the stream engine instead of at
+ * once. With `ENGINE_STREAM` the stream engine is used straight away, and with
+ * `ENGINE_URING` the io_uring engine is tried before the strategies chain.
+ * When verifying, copy_file_range and sendfile are skipped so that every byte
+ * is checksummed while it is copied.
+ * The strategy that completed the range is stored in `strategy`.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_range(struct file_copy *copy,
+           long offset,
+           long end,
+           enum copy_strategy *strategy)
+{
+	const struct copy_options *options = copy->options;
+	int src_fd = copy->src_fd, dest_fd = copy->dest_fd;
+	long copied = offset;
+	int res = NOT_SUPPORTED;
+
+	if (copy->direct_alignment > 0) {
+		res = copy_direct_range(copy, offset, end, strategy);
+		if (res != NOT_SUPPORTED) {
+			return res;
+		}
+	}
+
+	if (options->engine == ENGINE_STREAM) {
+		*strategy = STRATEGY_STREAM;
+		return copy_with_window(src_fd,
+		                        dest_fd,
+		                        end,
+		                        copied,
+		                        options->window_size,
+		                        copy->checksum);
+	}
+
+	if (options->engine == ENGINE_URING) {
+		*strategy = STRATEGY_URING;
+		res = copy_with_uring(src_fd,
+		                      dest_fd,
+		                      end,
+		                      copied,
+		                      options->queue_depth,
+		                      copy->checksum);
+		if (res != NOT_SUPPORTED) {
+			return res;
+		}
+	}
+
+	/* The kernel strategies never expose the bytes to be checksummed */
+	if (copy->checksum == NULL) {
+		*strategy = STRATEGY_COPY_FILE_RANGE;
+		res = copy_with_copy_file_range(src_fd, dest_fd, end, &copied);
+	}
+
+	if (res == NOT_SUPPORTED && copy->checksum == NULL) {
+		*strategy = STRATEGY_SENDFILE;
+		res = copy_with_sendfile(src_fd, dest_fd, end, &copied);
+	}
+
+	if (res == NOT_SUPPORTED && end - copied > options->window_size) {
+		*strategy = STRATEGY_STREAM;
+		res = copy_with_window(src_fd,
+		                       dest_fd,
+		                       end,
+		                       copied,
+		                       options->window_size,
+		                       copy->checksum);
+	}
+
+	if (res == NOT_SUPPORTED) {
+		*strategy = STRATEGY_MMAP;
+		res = copy_with_mmap(
+		        src_fd, dest_fd, end, copied, copy->checksum);
+	}
+
+	return res;
+}
+
+/*
+ * Check if the `len` bytes of `block` are all zero.
+ */
+bool
+is_zero_block(const char *block, size_t len)
+{
+	return len == 0 ||
+	       (block[0] == 0 && memcmp(block, block + 1, len - 1) == 0);
+}
+
+/*
+ * Deallocate the range [`offset`, `offset` + `len`) of `dest_fd` so that it
+ * reads back as zeros without using disk blocks. Filesystems that cannot punch
+ * holes are left untouched, since the range is then written with zeros by the
+ * caller.
+ * Returns `SUCCESS` if the hole was punched, `NOT_SUPPORTED` or `FAILED`.
+ */
+int
+punch_hole(int dest_fd, off_t offset, off_t len)
+{
+	int res = fallocate(dest_fd,
+	                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	                    offset,
+	                    len);
+	if (res == GENERIC_ERROR_CODE) {
+		if (is_strategy_unsupported_error(errno)) {
+			return NOT_SUPPORTED;
+		}
+		perror("Error: could not punch hole in destination file");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Write `len` bytes from `buf` at `offset` of the destination file of `copy`.
+ * With O_DIRECT, an unaligned tail is written through the page cache.
+ * Returns `SUCCESS` if everything was written, otherwise returns `FAILED`.
+ */
+int
+write_copy_range(struct file_copy *copy,
+                 const char *buf,
+                 size_t len,
+                 off_t offset)
+{
+	size_t aligned_len = len;
+	if (copy->direct_alignment > 0) {
+		aligned_len = len / copy->direct_alignment *
+		              copy->direct_alignment;
+	}
+
+	int res = write_all_at(copy->dest_fd, buf, aligned_len, offset);
+	if (res == SUCCESS && aligned_len < len) {
+		set_direct_io(copy->dest_fd, false);
+		res = write_all_at(copy->dest_fd,
+		                   buf + aligned_len,
+		                   len - aligned_len,
+		                   offset + aligned_len);
+		set_direct_io(copy->dest_fd, true);
+	}
+	return res;
+}
+
+/*
+ * Copy the range [`offset`, `end`) of the source file reading it into a buffer
+ * and writing only the blocks that are not all zeros. Zero blocks are left as
+ * holes, punching them if the destination already holds data there. The blocks
+ * are `SPARSE_BLOCK_SIZE` bytes, or the O_DIRECT alignment if it is larger, so
+ * that every run written stays aligned.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_with_zero_scan(struct file_copy *copy, long offset, long end)
+{
+	struct stat dest_info;
+	if (fstat(copy->dest_fd, &dest_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access destination file metadata");
+		return FAILED;
+	}
+
+	/* Aligned, so that it can also be used with O_DIRECT */
+	char *buffer = NULL;
+	if (posix_memalign((void **) &buffer,
+	                   sysconf(_SC_PAGESIZE),
+	                   SPARSE_SCAN_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: could not allocate copy buffer\n");
+		return FAILED;
+	}
+	long block_size = SPARSE_BLOCK_SIZE;
+	if (copy->direct_alignment > block_size) {
+		block_size = copy->direct_alignment;
+	}
+
+	int res = SUCCESS;
+	while (offset < end && res == SUCCESS) {
+		size_t to_read = end - offset;
+		if (to_read > SPARSE_SCAN_BUFFER_SIZE) {
+			to_read = SPARSE_SCAN_BUFFER_SIZE;
+		}
+		if (copy->direct_alignment > 0) {
+			/* Reading past the end of the file returns less */
+			to_read = (to_read + copy->direct_alignment - 1) /
+			          copy->direct_alignment *
+			          copy->direct_alignment;
+		}
+
+		ssize_t read_bytes =
+		        pread(copy->src_fd, buffer, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error: could not read from source file");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes > end - offset) {
+			read_bytes = end - offset;
+		}
+		if (read_bytes == 0) {
+			break;
+		}
+
+		/* Group consecutive blocks of the same kind in a run */
+		for (long pos = 0; pos < read_bytes && res == SUCCESS;) {
+			long run_start = pos;
+			bool is_zero_run = false;
+			while (pos < read_bytes) {
+				long block_len = read_bytes - pos;
+				if (block_len > block_size) {
+					block_len = block_size;
+				}
+				bool is_zero =
+				        is_zero_block(buffer + pos, block_len);
+				if (pos == run_start) {
+					is_zero_run = is_zero;
+				} else if (is_zero != is_zero_run) {
+					break;
+				}
+				pos += block_len;
+			}
+
+			off_t run_offset = offset + run_start;
+			off_t run_len = pos - run_start;
+			if (is_zero_run && run_offset >= dest_info.st_size) {
+				/* Past the destination end it is a hole */
+				continue;
+			}
+			if (is_zero_run) {
+				res = punch_hole(
+				        copy->dest_fd, run_offset, run_len);
+				if (res != NOT_SUPPORTED) {
+					continue;
+				}
+			}
+			/* Zero runs do not change the checksum */
+			checksum_update(copy->checksum,
+			                run_offset,
+			                buffer + run_start,
+			                run_len);
+			res = write_copy_range(
+			        copy, buffer + run_start, run_len, run_offset);
+		}
+		offset += read_bytes;
+	}
+
+	free(buffer);
+	return res;
+}
+
+/*
+ * Reserve the blocks of the destination range [`offset`, `end`) with
+ * fallocate(2) before copying into it, so that the filesystem allocates the
+ * range in one go instead of block by block as it is written, which keeps the
+ * file contiguous and reports a full disk before anything is copied. Where
+ * fallocate is not supported the destination is only grown with ftruncate.
+ * Returns `SUCCESS` if the range was reserved, otherwise returns `FAILED`.
+ */
+int
+preallocate_range(int dest_fd, long offset, long end)
+{
+	if (end <= offset) {
+		return SUCCESS;
+	}
+
+	int res = fallocate(dest_fd, 0, (off_t) offset, (off_t) (end - offset));
+	if (res == SUCCESS) {
+		return SUCCESS;
+	}
+	if (errno != EOPNOTSUPP && errno != ENOSYS) {
+		perror("Error: could not preallocate destination file");
+		return FAILED;
+	}
+
+	struct stat dest_info;
+	if (fstat(dest_fd, &dest_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access destination file metadata");
+		return FAILED;
+	}
+	if (dest_info.st_size < end &&
+	    ftruncate(dest_fd, (off_t) end) == GENERIC_ERROR_CODE) {
+		perror("Error: could not grow file size for destination file");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the range [`offset`, `end`) of the source file according to the sparse
+ * mode: with `SPARSE_ALWAYS` all-zero blocks are turned into holes, otherwise
+ * the range is preallocated in the destination and copied whole.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_data_range(struct file_copy *copy,
+                long offset,
+                long end,
+                enum copy_strategy *strategy)
+{
+	if (copy->options->sparse == SPARSE_ALWAYS) {
+		*strategy = STRATEGY_ZERO_SCAN;
+		return copy_with_zero_scan(copy, offset, end);
+	}
+	if (preallocate_range(copy->dest_fd, offset, end) == FAILED) {
+		return FAILED;
+	}
+	return copy_range(copy, offset, end, strategy);
+}
+
+/*
+ * Copy only the data extents of the range [`start`, `end`) of the source file,
+ * found with lseek(SEEK_DATA/SEEK_HOLE), so that its holes stay as holes in
+ * the destination instead of being read and written as zeros. Filesystems
+ * that do not report holes are copied as a single data extent. The
+ * destination ends up `end` bytes long.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_sparse(struct file_copy *copy,
+            long start,
+            long end,
+            enum copy_strategy *strategy)
+{
+	off_t first_hole = lseek(copy->src_fd, start, SEEK_HOLE);
+	/* Without holes the range is one extent, and its zeros may become one */
+	off_t offset = first_hole == GENERIC_ERROR_CODE || first_hole >= end
+	                       ? end
+	                       : start;
+	if (offset == end &&
+	    copy_data_range(copy, start, end, strategy) != SUCCESS) {
+		return FAILED;
+	}
+
+	while (offset < end) {
+		off_t data_start = lseek(copy->src_fd, offset, SEEK_DATA);
+		if (data_start == GENERIC_ERROR_CODE) {
+			if (errno == ENXIO) {
+				/* Only a hole is left up to the end */
+				break;
+			}
+			perror("Error: could not find data in source file");
+			return FAILED;
+		}
+
+		off_t data_end = lseek(copy->src_fd, data_start, SEEK_HOLE);
+		if (data_end == GENERIC_ERROR_CODE) {
+			perror("Error: could not find hole in source file");
+			return FAILED;
+		}
+		if (data_end > end) {
+			data_end = end;
+		}
+
+		int res = copy_data_range(copy, data_start, data_end, strategy);
+		if (res != SUCCESS) {
+			return FAILED;
+		}
+		offset = data_end;
+	}
+
+	/* Keep the trailing hole, if any, as part of the destination */
+	int res = ftruncate(copy->dest_fd, (off_t) end);
+	if (res == GENERIC_ERROR_CODE) {
+		perror("Error: could not set file size for destination file");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the range [`start`, `end`) of the source file, keeping its holes unless
+ * the sparse mode is `SPARSE_NEVER`.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_extents(struct file_copy *copy,
+             long start,
+             long end,
+             enum copy_strategy *strategy)
+{
+	if (copy->options->sparse == SPARSE_NEVER) {
+		return copy_data_range(copy, start, end, strategy);
+	}
+	return copy_sparse(copy, start, end, strategy);
+}
+
+/*
+ * Copy the range [`offset`, `end`) of the source file through `buffer` with
+ * pread(2) and pwrite(2), which take explicit offsets and so, unlike
+ * sendfile(2) or the file positions, are safe to share between threads.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_with_pread(struct file_copy *copy, long offset, long end, char *buffer)
+{
+	while (offset < end) {
+		size_t to_read = end - offset;
+		if (to_read > STRIPE_BUFFER_SIZE) {
+			to_read = STRIPE_BUFFER_SIZE;
+		}
+		ssize_t read_bytes =
+		        pread(copy->src_fd, buffer, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			perror("Error: could not read from source file");
+			return FAILED;
+		}
+		if (read_bytes == 0) {
+			/* The source file was truncated while being copied */
+			break;
+		}
+		checksum_update(copy->checksum, offset, buffer, read_bytes);
+		if (write_all_at(copy->dest_fd, buffer, read_bytes, offset) ==
+		    FAILED) {
+			return FAILED;
+		}
+		offset += read_bytes;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the data range [`offset`, `end`) of a striped copy into the already
+ * sized destination: with `SPARSE_ALWAYS` through the zero scan, otherwise
+ * preallocated and copied with copy_file_range or, where it is not supported
+ * or the data must be checksummed, through `buffer`.
+ * Returns `SUCCESS` if the range was copied, otherwise returns `FAILED`.
+ */
+int
+copy_stripe_data(struct file_copy *copy, long offset, long end, char *buffer)
+{
+	if (copy->options->sparse == SPARSE_ALWAYS) {
+		return copy_with_zero_scan(copy, offset, end);
+	}
+	if (preallocate_range(copy->dest_fd, offset, end) == FAILED) {
+		return FAILED;
+	}
+
+	long copied = offset;
+	int res = NOT_SUPPORTED;
+	if (copy->checksum == NULL) {
+		res = copy_with_copy_file_range(
+		        copy->src_fd, copy->dest_fd, end, &copied);
+	}
+	if (res == NOT_SUPPORTED) {
+		res = copy_with_pread(copy, copied, end, buffer);
+	}
+	return res;
+}
+
+/*
+ * Copy the stripe [`offset`, `end`), walking its data extents with
+ * lseek(SEEK_DATA/SEEK_HOLE) unless the sparse mode is `SPARSE_NEVER`. The
+ * file positions these move are not used by any other stripe.
+ * Returns `SUCCESS` if the stripe was copied, otherwise returns `FAILED`.
+ */
+int
+copy_stripe(struct file_copy *copy, long offset, long end, char *buffer)
+{
+	if (copy->options->sparse == SPARSE_NEVER) {
+		return copy_stripe_data(copy, offset, end, buffer);
+	}
+
+	while (offset < end) {
+		off_t data_start = lseek(copy->src_fd, offset, SEEK_DATA);
+		if (data_start == GENERIC_ERROR_CODE && errno == ENXIO) {
+			/* Only a hole is left up to the end */
+			break;
+		}
+		if (data_start == GENERIC_ERROR_CODE) {
+			/* Holes are not reported, so it is all data */
+			return copy_stripe_data(copy, offset, end, buffer);
+		}
+		if (data_start >= end) {
+			break;
+		}
+		off_t data_end = lseek(copy->src_fd, data_start, SEEK_HOLE);
+		if (data_end == GENERIC_ERROR_CODE || data_end > end) {
+			data_end = end;
+		}
+
+		if (copy_stripe_data(copy, data_start, data_end, buffer) ==
+		    FAILED) {
+			return FAILED;
+		}
+		offset = data_end;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy stripes of the file of the striped copy `arg` until there are no more
+ * or a stripe fails.
+ */
+void *
+run_stripe_worker(void *arg)
+{
+	struct stripe_pool *stripes = arg;
+	struct file_copy *copy = stripes->copy;
+
+	/* Aligned, so that it can also be used with O_DIRECT */
+	char *buffer = NULL;
+	if (posix_memalign((void **) &buffer,
+	                   sysconf(_SC_PAGESIZE),
+	                   STRIPE_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: could not allocate copy buffer\n");
+		atomic_store(&stripes->failed, true);
+		return NULL;
+	}
+
+	while (!atomic_load(&stripes->failed)) {
+		long offset =
+		        atomic_fetch_add(&stripes->next_offset, STRIPE_SIZE);
+		if (offset >= stripes->end) {
+			break;
+		}
+		long end = offset + STRIPE_SIZE;
+		if (end > stripes->end) {
+			end = stripes->end;
+		}
+		if (copy_stripe(copy, offset, end, buffer) == FAILED) {
+			atomic_store(&stripes->failed, true);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Copy the source file of `copy` with `options->threads` threads, each one
+ * taking the next `STRIPE_SIZE` bytes in turn so that the copy is not bound to
+ * the memory bandwidth of a single core and keeps several devices of a striped
+ * array busy. The destination is sized up front, so that the stripes can be
+ * written in any order. With O_DIRECT the unaligned tail of the file is left
+ * out of the stripes and copied afterwards.
+ * Returns `SUCCESS` if the file was copied, otherwise returns `FAILED`.
+ */
+int
+copy_striped(struct file_copy *copy, enum copy_strategy *strategy)
+{
+	long src_filesize = copy->src_filesize;
+	long stripes_end = src_filesize;
+	if (copy->direct_alignment > 0) {
+		stripes_end = src_filesize / copy->direct_alignment *
+		              copy->direct_alignment;
+	}
+	if (ftruncate(copy->dest_fd, (off_t) src_filesize) ==
+	    GENERIC_ERROR_CODE) {
+		perror("Error: could not set file size for destination file");
+		return FAILED;
+	}
+
+	struct stripe_pool stripes = { .copy = copy, .end = stripes_end };
+	atomic_init(&stripes.next_offset, 0);
+	atomic_init(&stripes.failed, false);
+
+	long stripes_count = (stripes_end + STRIPE_SIZE - 1) / STRIPE_SIZE;
+	int threads_count = copy->options->threads;
+	if (threads_count > stripes_count) {
+		threads_count = (int) stripes_count;
+	}
+	pthread_t *threads = calloc(threads_count, sizeof(pthread_t));
+	if (threads == NULL) {
+		perror("Error: could not allocate copy threads");
+		return FAILED;
+	}
+
+	int started = 0;
+	for (; started < threads_count; started++) {
+		int res = pthread_create(
+		        &threads[started], NULL, run_stripe_worker, &stripes);
+		if (res != 0) {
+			fprintf(stderr,
+			        "Error: could not start copy thread: %s\n",
+			        strerror(res));
+			atomic_store(&stripes.failed, true);
+			break;
+		}
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	*strategy = STRATEGY_STRIPED;
+	if (atomic_load(&stripes.failed)) {
+		return FAILED;
+	}
+	if (stripes_end < src_filesize) {
+		enum copy_strategy tail_strategy;
+		return copy_extents(
+		        copy, stripes_end, src_filesize, &tail_strategy);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Read up to `len` bytes of `fd` at `offset` into `buf`, rounding the request
+ * up to `alignment` for O_DIRECT, which `buf` must have room for.
+ * Returns the bytes read, fewer than `len` only at the end of the file, or
+ * `FAILED`.
+ */
+ssize_t
+read_block_at(int fd, char *buf, size_t len, off_t offset, long alignment)
+{
+	size_t to_read = len;
+	if (alignment > 0) {
+		to_read = (len + alignment - 1) / alignment * alignment;
+	}
+	while (true) {
+		ssize_t read_bytes = pread(fd, buf, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes > (ssize_t) len) {
+			read_bytes = len;
+		}
+		return read_bytes;
+	}
+}
+
+/*
+ * Check if the `len` bytes of the source block `src` are already in the
+ * destination block `dest`, of which only `dest_len` bytes exist. Past the end
+ * of the destination only zeros match, as the destination is extended with a
+ * hole.
+ */
+bool
+is_same_block(const char *src, const char *dest, long len, long dest_len)
+{
+	if (dest_len >= len) {
+		return memcmp(src, dest, len) == 0;
+	}
+	return dest_len <= 0 && is_zero_block(src, len);
+}
+
+/*
+ * Update the existing destination of `copy` to match the source, comparing
+ * them `DELTA_BLOCK_SIZE` bytes at a time and only writing the runs of blocks
+ * that differ, which spares the writes (and the SSD wear) of refreshing a
+ * mostly unchanged file. The destination reads as zeros past its end, so
+ * all-zero source blocks there are left as holes. The destination is finally
+ * truncated or extended to the size of the source. The bytes written are
+ * stored in `written`.
+ * Returns `SUCCESS` if the destination was updated, otherwise returns `FAILED`.
+ */
+int
+copy_delta(struct file_copy *copy, long *written)
+{
+	struct stat dest_info;
+	if (fstat(copy->dest_fd, &dest_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access destination file metadata");
+		return FAILED;
+	}
+
+	/* Aligned, so that they can also be used with O_DIRECT */
+	char *src_buffer = NULL, *dest_buffer = NULL;
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (posix_memalign((void **) &src_buffer,
+	                   page_size,
+	                   DELTA_BUFFER_SIZE) != 0 ||
+	    posix_memalign((void **) &dest_buffer,
+	                   page_size,
+	                   DELTA_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: could not allocate compare buffers\n");
+		free(src_buffer);
+		return FAILED;
+	}
+	long block_size = DELTA_BLOCK_SIZE;
+	if (copy->direct_alignment > block_size) {
+		block_size = copy->direct_alignment;
+	}
+
+	*written = 0;
+	long offset = 0;
+	int res = SUCCESS;
+	while (offset < copy->src_filesize && res == SUCCESS) {
+		size_t len = copy->src_filesize - offset;
+		if (len > DELTA_BUFFER_SIZE) {
+			len = DELTA_BUFFER_SIZE;
+		}
+		ssize_t src_len = read_block_at(copy->src_fd,
+		                                src_buffer,
+		                                len,
+		                                offset,
+		                                copy->direct_alignment);
+		if (src_len == GENERIC_ERROR_CODE) {
+			perror("Error: could not read from source file");
+			res = FAILED;
+			break;
+		}
+		if (src_len == 0) {
+			/* The source file was truncated while being copied */
+			break;
+		}
+		checksum_update(copy->checksum, offset, src_buffer, src_len);
+
+		ssize_t dest_len = 0;
+		if (offset < dest_info.st_size) {
+			dest_len = read_block_at(copy->dest_fd,
+			                         dest_buffer,
+			                         src_len,
+			                         offset,
+			                         copy->direct_alignment);
+		}
+		if (dest_len == GENERIC_ERROR_CODE) {
+			perror("Error: could not read from destination file");
+			res = FAILED;
+			break;
+		}
+
+		/* Group consecutive blocks that differ in a single write */
+		for (long pos = 0; pos < src_len && res == SUCCESS;) {
+			long run_start = pos;
+			bool is_changed_run = false;
+			while (pos < src_len) {
+				long block_len = src_len - pos;
+				if (block_len > block_size) {
+					block_len = block_size;
+				}
+				bool is_same = is_same_block(src_buffer + pos,
+				                             dest_buffer + pos,
+				                             block_len,
+				                             dest_len - pos);
+				if (pos == run_start) {
+					is_changed_run = !is_same;
+				} else if (is_same == is_changed_run) {
+					break;
+				}
+				pos += block_len;
+			}
+
+			if (is_changed_run) {
+				res = write_copy_range(copy,
+				                       src_buffer + run_start,
+				                       pos - run_start,
+				                       offset + run_start);
+				*written += pos - run_start;
+			}
+		}
+		offset += src_len;
+	}
+
+	if (res == SUCCESS && offset != dest_info.st_size &&
+	    ftruncate(copy->dest_fd, (off_t) offset) == GENERIC_ERROR_CODE) {
+		perror("Error: could not set file size for destination file");
+		res = FAILED;
+	}
+	free(src_buffer);
+	free(dest_buffer);
+	return res;
+}
+
+/*
+ * Compute into `crc` the CRC32C of the last `RESUME_TAIL_SIZE` bytes before
+ * `end` in `fd`, starting at a multiple of `alignment` so that it can be read
+ * with O_DIRECT.
+ * Returns `SUCCESS` if the bytes could be read, otherwise returns `FAILED`.
+ */
+int
+checksum_tail(int fd, long end, long alignment, uint32_t *crc)
+{
+	if (alignment == 0) {
+		alignment = 1;
+	}
+	long start = end > RESUME_TAIL_SIZE ? end - RESUME_TAIL_SIZE : 0;
+	start = start / alignment * alignment;
+	size_t to_read =
+	        (end - start + alignment - 1) / alignment * alignment;
+
+	char *buffer = NULL;
+	if (posix_memalign((void **) &buffer, sysconf(_SC_PAGESIZE), to_read) !=
+	    0) {
+		fprintf(stderr,
+		        "Error: could not allocate checkpoint buffer\n");
+		return FAILED;
+	}
+
+	uint32_t reg = 0xffffffff;
+	for (long offset = start; offset < end;) {
+		ssize_t read_bytes = pread(fd, buffer, to_read, offset);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes == GENERIC_ERROR_CODE || read_bytes == 0) {
+			free(buffer);
+			return FAILED;
+		}
+		if (read_bytes > end - offset) {
+			read_bytes = end - offset;
+		}
+		reg = crc32c_update(reg, buffer, read_bytes);
+		offset += read_bytes;
+		to_read -= read_bytes;
+	}
+
+	free(buffer);
+	*crc = ~reg;
+	return SUCCESS;
+}
+
+/*
+ * Build into `path` the path of the journal of the copy into `dest_filepath`,
+ * appending `suffix` to it.
+ * Returns `SUCCESS` if the path fits in `PATH_MAX`, otherwise returns `FAILED`.
+ */
+int
+build_journal_path(const char *dest_filepath, const char *suffix, char *path)
+{
+	int len = snprintf(path, PATH_MAX, "%s%s", dest_filepath, suffix);
+	if (len < 0 || len >= PATH_MAX) {
+		fprintf(stderr,
+		        "Error: journal path for '%s' is too long\n",
+		        dest_filepath);
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Read the journal at `path` into `journal`.
+ * Returns `SUCCESS` if a well-formed journal was read, otherwise returns
+ * `FAILED`.
+ */
+int
+read_journal(const char *path, struct resume_journal *journal)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return FAILED;
+	}
+	int fields = fscanf(file,
+	                    RESUME_JOURNAL_FMT,
+	                    &journal->src_dev,
+	                    &journal->src_ino,
+	                    &journal->src_size,
+	                    &journal->src_mtime_sec,
+	                    &journal->src_mtime_nsec,
+	                    &journal->offset,
+	                    &journal->tail_crc);
+	fclose(file);
+	return fields == RESUME_JOURNAL_FIELDS ? SUCCESS : FAILED;
+}
+
+/*
+ * Durably replace the journal of the copy into `dest_filepath` with
+ * `journal`. It is written to a temporary file that is then renamed over the
+ * journal, so a crash leaves either the previous checkpoint or this one.
+ * Returns `SUCCESS` if the journal was written, otherwise returns `FAILED`.
+ */
+int
+write_journal(const char *dest_filepath, const struct resume_journal *journal)
+{
+	char tmp_path[PATH_MAX], path[PATH_MAX];
+	if (build_journal_path(
+	            dest_filepath, RESUME_JOURNAL_TMP_SUFFIX, tmp_path) ==
+	            FAILED ||
+	    build_journal_path(dest_filepath, RESUME_JOURNAL_SUFFIX, path) ==
+	            FAILED) {
+		return FAILED;
+	}
+
+	int fd = open(tmp_path,
+	              O_CREAT | O_WRONLY | O_TRUNC,
+	              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd == GENERIC_ERROR_CODE) {
+		perror("Error: could not create journal file");
+		return FAILED;
+	}
+	char line[128];
+	int len = snprintf(line,
+	                   sizeof(line),
+	                   RESUME_JOURNAL_FMT,
+	                   journal->src_dev,
+	                   journal->src_ino,
+	                   journal->src_size,
+	                   journal->src_mtime_sec,
+	                   journal->src_mtime_nsec,
+	                   journal->offset,
+	                   journal->tail_crc);
+	int res = write_all(fd, line, len);
+	if (res == SUCCESS && fsync(fd) == GENERIC_ERROR_CODE) {
+		perror("Error: could not flush journal file");
+		res = FAILED;
+	}
+	if (close(fd) == GENERIC_ERROR_CODE) {
+		perror("Error: could not close journal file");
+		res = FAILED;
+	}
+	if (res == SUCCESS && rename(tmp_path, path) == GENERIC_ERROR_CODE) {
+		perror("Error: could not replace journal file");
+		res = FAILED;
+	}
+	return res;
+}
+
+/*
+ * Delete the journal of the copy into `dest_filepath`, if there is one.
+ */
+void
+remove_journal(const char *dest_filepath)
+{
+	char path[PATH_MAX];
+	if (build_journal_path(dest_filepath, RESUME_JOURNAL_SUFFIX, path) ==
+	            SUCCESS &&
+	    unlink(path) == GENERIC_ERROR_CODE && errno != ENOENT) {
+		perror("Error: could not delete journal file");
+	}
+}
+
+/*
+ * Tell whether the destination of `copy`, which has no journal, was finished
+ * by an earlier run: the journal is written before its first byte and removed
+ * after its last one, so it is taken as finished if it has the size of the
+ * source described by `src_info` and was not modified before it.
+ * Returns `true` if the destination is taken as finished, otherwise `false`.
+ */
+bool
+is_copy_finished(const struct file_copy *copy, const struct stat *src_info)
+{
+	struct stat dest_info;
+	if (fstat(copy->dest_fd, &dest_info) == GENERIC_ERROR_CODE ||
+	    dest_info.st_size != src_info->st_size) {
+		return false;
+	}
+	return dest_info.st_mtim.tv_sec > src_info->st_mtim.tv_sec ||
+	       (dest_info.st_mtim.tv_sec == src_info->st_mtim.tv_sec &&
+	        dest_info.st_mtim.tv_nsec >= src_info->st_mtim.tv_nsec);
+}
+
+/*
+ * Find where the copy of `copy` into `dest_filepath` can resume from: the
+ * offset of its journal, if the journal is for this same source and the CRC32C
+ * of the destination bytes right before that offset matches the recorded one.
+ * Without a journal the destination is either finished, as told by
+ * `is_copy_finished`, and resumes at its end, or copied from the start.
+ * `journal` gets the identity of the source and that offset, which is zero
+ * when there is nothing to resume.
+ * Returns `SUCCESS`, or `FAILED` if the source cannot be inspected.
+ */
+int
+find_resume_offset(struct file_copy *copy,
+                   const char *dest_filepath,
+                   struct resume_journal *journal)
+{
+	struct stat src_info;
+	if (fstat(copy->src_fd, &src_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access source file metadata");
+		return FAILED;
+	}
+	*journal = (struct resume_journal){
+		.src_dev = src_info.st_dev,
+		.src_ino = src_info.st_ino,
+		.src_size = src_info.st_size,
+		.src_mtime_sec = src_info.st_mtim.tv_sec,
+		.src_mtime_nsec = src_info.st_mtim.tv_nsec,
+		.offset = 0,
+		.tail_crc = 0,
+	};
+
+	char path[PATH_MAX];
+	struct resume_journal saved;
+	if (build_journal_path(dest_filepath, RESUME_JOURNAL_SUFFIX, path) ==
+	    FAILED) {
+		return SUCCESS;
+	}
+	errno = 0;
+	if (read_journal(path, &saved) == FAILED) {
+		if (errno == ENOENT && is_copy_finished(copy, &src_info)) {
+			journal->offset = journal->src_size;
+		}
+		return SUCCESS;
+	}
+
+	bool is_same_source = saved.src_dev == journal->src_dev &&
+	                      saved.src_ino == journal->src_ino &&
+	                      saved.src_size == journal->src_size &&
+	                      saved.src_mtime_sec == journal->src_mtime_sec &&
+	                      saved.src_mtime_nsec == journal->src_mtime_nsec;
+	if (is_same_source && saved.offset == 0) {
+		/* Interrupted before its first checkpoint */
+		return SUCCESS;
+	}
+
+	struct stat dest_info;
+	uint32_t dest_crc = 0;
+	bool is_valid =
+	        is_same_source && saved.offset > 0 &&
+	        saved.offset <= saved.src_size &&
+	        fstat(copy->dest_fd, &dest_info) != GENERIC_ERROR_CODE &&
+	        dest_info.st_size >= saved.offset &&
+	        checksum_tail(copy->dest_fd,
+	                      saved.offset,
+	                      copy->direct_alignment,
+	                      &dest_crc) == SUCCESS &&
+	        dest_crc == saved.tail_crc;
+	if (!is_valid) {
+		fprintf(stderr,
+		        "Warning: journal of '%s' does not match, copying it "
+		        "from the start\n",
+		        dest_filepath);
+		return SUCCESS;
+	}
+	journal->offset = saved.offset;
+	return SUCCESS;
+}
+
+/*
+ * Add the range [0, `end`) of the source file, copied by an earlier run, to
+ * the checksum of `copy` so that the whole file can still be verified.
+ * Returns `SUCCESS` if the range was read, otherwise returns `FAILED`.
+ */
+int
+checksum_copied_prefix(struct file_copy *copy, long end)
+{
+	char *buffer = NULL;
+	if (posix_memalign((void **) &buffer,
+	                   sysconf(_SC_PAGESIZE),
+	                   VERIFY_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: could not allocate verify buffer\n");
+		return FAILED;
+	}
+
+	/* The prefix ends at a checkpoint, so whole buffers stay aligned */
+	int res = SUCCESS;
+	for (long offset = 0; offset < end;) {
+		ssize_t read_bytes =
+		        pread(copy->src_fd, buffer, VERIFY_BUFFER_SIZE, offset);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes == GENERIC_ERROR_CODE || read_bytes == 0) {
+			perror("Error: could not read from source file");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes > end - offset) {
+			read_bytes = end - offset;
+		}
+		checksum_update(copy->checksum, offset, buffer, read_bytes);
+		offset += read_bytes;
+	}
+
+	free(buffer);
+	return res;
+}
+
+/*
+ * Copy the source file of `copy` into `dest_filepath` so that an interrupted
+ * copy can be resumed. Every `RESUME_CHECKPOINT_SIZE` bytes the destination is
+ * flushed and the offset reached is recorded in the journal along with the
+ * CRC32C of the bytes before it, and a first journal at offset zero is
+ * written before anything else. A later run with a valid journal drops
+ * whatever the destination has past that offset and continues from there.
+ * Returns `SUCCESS` if the file was copied, otherwise returns `FAILED` and the
+ * destination and journal are left in place to be resumed.
+ */
+int
+copy_resumable(struct file_copy *copy,
+               const char *dest_filepath,
+               enum copy_strategy *strategy)
+{
+	struct resume_journal journal;
+	if (find_resume_offset(copy, dest_filepath, &journal) == FAILED) {
+		return FAILED;
+	}
+	if (ftruncate(copy->dest_fd, (off_t) journal.offset) ==
+	    GENERIC_ERROR_CODE) {
+		perror("Error: could not set file size for destination file");
+		return FAILED;
+	}
+
+	if (journal.offset == 0 &&
+	    write_journal(dest_filepath, &journal) == FAILED) {
+		return FAILED;
+	}
+	if (journal.offset > 0) {
+		if (copy->options->verbose &&
+		    journal.offset == copy->src_filesize) {
+			printf("'%s': already copied\n", dest_filepath);
+		} else if (copy->options->verbose) {
+			printf("'%s': resuming at byte %ld\n",
+			       dest_filepath,
+			       journal.offset);
+		}
+		if (copy->checksum != NULL &&
+		    checksum_copied_prefix(copy, journal.offset) == FAILED) {
+			return FAILED;
+		}
+	}
+
+	long src_filesize = copy->src_filesize;
+	for (long start = journal.offset; start < src_filesize;) {
+		long end = start + RESUME_CHECKPOINT_SIZE;
+		if (end > src_filesize) {
+			end = src_filesize;
+		}
+		if (copy_extents(copy, start, end, strategy) == FAILED) {
+			return FAILED;
+		}
+
+		if (fdatasync(copy->dest_fd) == GENERIC_ERROR_CODE) {
+			perror("Error: could not flush destination file");
+			return FAILED;
+		}
+		journal.offset = end;
+		if (checksum_tail(copy->src_fd,
+		                  end,
+		                  copy->direct_alignment,
+		                  &journal.tail_crc) == FAILED) {
+			perror("Error: could not read from source file");
+			return FAILED;
+		}
+		if (write_journal(dest_filepath, &journal) == FAILED) {
+			return FAILED;
+		}
+		start = end;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy the content from the source file to the destination file of `copy`.
+ * Unless the stream engine was requested, the copy is verified or resumable,
+ * the source extents are shared first through reflink. Otherwise the data is
+ * copied keeping the holes of the source according to the sparse mode, with
+ * checkpoints if `options->resume` is set, or in stripes by several threads
+ * if `options->threads` is greater than one. The strategy that completed the
+ * copy is stored in `strategy`.
+ * Returns `SUCCESS` if the content was copied, otherwise returns `FAILED`.
+ */
+int
+copy_content(struct file_copy *copy,
+             char *dest_filepath,
+             enum copy_strategy *strategy)
+{
+	const struct copy_options *options = copy->options;
+	*strategy = STRATEGY_REFLINK;
+	int res = NOT_SUPPORTED;
+
+	if (options->engine != ENGINE_STREAM && copy->checksum == NULL &&
+	    !options->resume) {
+		res = copy_with_reflink(copy->src_fd, copy->dest_fd);
+	}
+
+	bool is_striped = options->threads > 1 &&
+	                  options->engine == ENGINE_AUTO &&
+	                  copy->src_filesize > STRIPE_SIZE;
+	if (res == NOT_SUPPORTED && options->resume) {
+		res = copy_resumable(copy, dest_filepath, strategy);
+	} else if (res == NOT_SUPPORTED && is_striped) {
+		res = copy_striped(copy, strategy);
+	} else if (res == NOT_SUPPORTED) {
+		res = copy_extents(copy, 0, copy->src_filesize, strategy);
+	}
+	return res == SUCCESS ? SUCCESS : FAILED;
+}
+
+/*
+ * Move up to `len` bytes from `in_fd` to `out_fd` with splice(2), at least one
+ * of them being a pipe, retrying on interruptions. The bytes moved, zero at the
+ * end of the input, are stored in `moved`. `is_first` tells if nothing was
+ * moved yet, in which case an unsupported pair of files is not an error.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` or `FAILED`.
+ */
+int
+splice_chunk(int in_fd, int out_fd, size_t len, bool is_first, size_t *moved)
+{
+	while (true) {
+		ssize_t res = splice(in_fd,
+		                     NULL,
+		                     out_fd,
+		                     NULL,
+		                     len,
+		                     SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (res != GENERIC_ERROR_CODE) {
+			*moved = res;
+			return SUCCESS;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (is_first && is_strategy_unsupported_error(errno)) {
+			return NOT_SUPPORTED;
+		}
+		perror("Error: splice between source and destination failed");
+		return FAILED;
+	}
+}
+
+/*
+ * Move the `len` bytes waiting in the pipe `pipe_fd` into `dest_fd` with
+ * read(2) and write(2), for a destination found not to support splice after
+ * the first chunk was already spliced into the pipe.
+ * Returns `SUCCESS` or `FAILED`.
+ */
+int
+flush_pipe(int pipe_fd, int dest_fd, size_t len)
+{
+	char buffer[4096];
+	while (len > 0) {
+		size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+		ssize_t read_bytes = read(pipe_fd, buffer, chunk);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes <= 0) {
+			perror("Error: could not read from pipe");
+			return FAILED;
+		}
+		if (write_all(dest_fd, buffer, read_bytes) == FAILED) {
+			return FAILED;
+		}
+		len -= read_bytes;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Copy everything left in the source of `copy` into its destination with
+ * splice(2), so that the data never goes through a user space buffer. When
+ * neither side is a pipe, the data is spliced through an intermediate pipe.
+ * The bytes copied are added to `*copied`.
+ * Returns `SUCCESS`, `NOT_SUPPORTED` if the kernel cannot splice these files,
+ * or `FAILED`.
+ */
+int
+copy_with_splice(struct file_copy *copy, bool is_pipe_involved, long *copied)
+{
+	int pipe_fds[2] = { GENERIC_ERROR_CODE, GENERIC_ERROR_CODE };
+	if (!is_pipe_involved) {
+		if (pipe(pipe_fds) == GENERIC_ERROR_CODE) {
+			perror("Error: could not create pipe");
+			return FAILED;
+		}
+		/* A larger pipe means fewer splice calls, if it is allowed */
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, (int) SPLICE_CHUNK_SIZE);
+	}
+	int in_fd = copy->src_fd;
+	int out_fd = is_pipe_involved ? copy->dest_fd : pipe_fds[1];
+
+	int res = SUCCESS;
+	size_t moved = 0;
+	while (true) {
+		res = splice_chunk(
+		        in_fd, out_fd, SPLICE_CHUNK_SIZE, *copied == 0, &moved);
+		if (res != SUCCESS || moved == 0) {
+			break;
+		}
+
+		/* Drain the intermediate pipe into the destination */
+		size_t pending = is_pipe_involved ? 0 : moved;
+		while (pending > 0 && res == SUCCESS) {
+			size_t drained = 0;
+			res = splice_chunk(pipe_fds[0],
+			                   copy->dest_fd,
+			                   pending,
+			                   *copied == 0,
+			                   &drained);
+			pending -= drained;
+		}
+		if (res == NOT_SUPPORTED) {
+			/* Hand the data already in the pipe to the fallback */
+			res = flush_pipe(pipe_fds[0], copy->dest_fd, pending);
+			if (res == SUCCESS) {
+				res = NOT_SUPPORTED;
+			}
+		}
+		if (res != FAILED) {
+			*copied += moved;
+		}
+		if (res != SUCCESS) {
+			break;
+		}
+	}
+
+	if (!is_pipe_involved) {
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+	}
+	return res;
+}
+
+/*
+ * Copy everything left in the source of `copy` into its destination through a
+ * buffer with read(2) and write(2), checksumming the bytes in order if the copy
+ * is verified. The bytes copied are added to `*copied`.
+ * Returns `SUCCESS` or `FAILED`.
+ */
+int
+copy_with_read_write(struct file_copy *copy, long *copied)
+{
+	char *buffer = malloc(STREAM_BUFFER_SIZE);
+	if (buffer == NULL) {
+		perror("Error: could not allocate copy buffer");
+		return FAILED;
+	}
+
+	/*
+	 * The CRC of the data read so far is the checksum contribution of a
+	 * file that ends there, so it can be kept without knowing the size.
+	 */
+	uint32_t crc = 0;
+	int res = SUCCESS;
+	while (res == SUCCESS) {
+		ssize_t read_bytes =
+		        read(copy->src_fd, buffer, STREAM_BUFFER_SIZE);
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error: could not read from source");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes == 0) {
+			break;
+		}
+		if (copy->checksum != NULL) {
+			crc = crc32c_update(crc, buffer, read_bytes);
+		}
+		res = write_all(copy->dest_fd, buffer, read_bytes);
+		*copied += read_bytes;
+	}
+
+	if (copy->checksum != NULL) {
+		copy->checksum->total_len = *copied;
+		atomic_store(&copy->checksum->raw, crc);
+	}
+	free(buffer);
+	return res;
+}
+
+/*
+ * Copy a source that cannot be mapped or whose size is not known in advance
+ * (a pipe, a socket, a terminal or the standard input) or a copy into the
+ * standard output, from the current position of the source up to its end.
+ * splice(2) is used when possible and a read/write loop otherwise, which is
+ * also used when verifying, since the data must then be seen. The total size
+ * is stored in `copy->src_filesize` and the strategy used in `strategy`.
+ * Returns `SUCCESS` if the source was copied, otherwise returns `FAILED`.
+ */
+int
+copy_stream(struct file_copy *copy, enum copy_strategy *strategy)
+{
+	struct stat src_info, dest_info;
+	if (fstat(copy->src_fd, &src_info) == GENERIC_ERROR_CODE ||
+	    fstat(copy->dest_fd, &dest_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access file metadata");
+		return FAILED;
+	}
+	bool is_pipe_involved =
+	        S_ISFIFO(src_info.st_mode) || S_ISFIFO(dest_info.st_mode);
+
+	long copied = 0;
+	int res = NOT_SUPPORTED;
+	if (copy->checksum == NULL) {
+		*strategy = STRATEGY_SPLICE;
+		res = copy_with_splice(copy, is_pipe_involved, &copied);
+	}
+	if (res == NOT_SUPPORTED) {
+		*strategy = STRATEGY_READ_WRITE;
+		res = copy_with_read_write(copy, &copied);
+	}
+
+	copy->src_filesize = copied;
+	return res;
+}
+
+/*
+ * Compute the CRC32C of the destination file of `copy` into `crc`, reading
+ * only its data extents since holes just shift the CRC.
+ * Returns `SUCCESS` if the file could be read, otherwise returns `FAILED`.
+ */
+int
+checksum_destination(struct file_copy *copy, uint32_t *crc)
+{
+	char *buffer = NULL;
+	if (posix_memalign((void **) &buffer,
+	                   sysconf(_SC_PAGESIZE),
+	                   VERIFY_BUFFER_SIZE) != 0) {
+		fprintf(stderr, "Error: could not allocate verify buffer\n");
+		return FAILED;
+	}
+
+	/* O_DIRECT reads must be aligned, even past the end of the file */
+	long alignment = copy->direct_alignment;
+	if (alignment == 0) {
+		alignment = 1;
+	}
+	long size = copy->src_filesize;
+	uint32_t reg = 0xffffffff;
+	int res = SUCCESS;
+
+	for (long offset = 0; offset < size && res == SUCCESS;) {
+		off_t data_start = lseek(copy->dest_fd, offset, SEEK_DATA);
+		if (data_start == GENERIC_ERROR_CODE) {
+			data_start = errno == ENXIO ? size : offset;
+		}
+		off_t data_end = lseek(copy->dest_fd, data_start, SEEK_HOLE);
+		if (data_end == GENERIC_ERROR_CODE || data_end > size) {
+			data_end = size;
+		}
+		reg = crc32c_shift(reg, data_start - offset);
+
+		for (offset = data_start; offset < data_end;) {
+			size_t to_read = data_end - offset;
+			if (to_read > VERIFY_BUFFER_SIZE) {
+				to_read = VERIFY_BUFFER_SIZE;
+			}
+			to_read = (to_read + alignment - 1) / alignment *
+			          alignment;
+
+			ssize_t read_bytes =
+			        pread(copy->dest_fd, buffer, to_read, offset);
+			if (read_bytes == GENERIC_ERROR_CODE &&
+			    errno == EINTR) {
+				continue;
+			}
+			if (read_bytes == GENERIC_ERROR_CODE ||
+			    read_bytes == 0) {
+				perror("Error: could not read back "
+				       "destination file");
+				res = FAILED;
+				break;
+			}
+			if (read_bytes > data_end - offset) {
+				read_bytes = data_end - offset;
+			}
+			reg = crc32c_update(reg, buffer, read_bytes);
+			offset += read_bytes;
+		}
+	}
+
+	free(buffer);
+	*crc = ~reg;
+	return res;
+}
+
+/*
+ * Read the destination file of `copy` back, from the disk rather than from the
+ * page cache, and check that its CRC32C matches the one computed from the
+ * source while copying. The digest is printed next to `dest_filepath`. The
+ * standard output cannot be read back, so only the digest is reported.
+ * Returns `SUCCESS` if both checksums match, otherwise returns `FAILED`.
+ */
+int
+verify_copy(struct file_copy *copy, char *dest_filepath)
+{
+	if (is_stdio_path(dest_filepath)) {
+		/* The output cannot be read back, and carries the data */
+		fprintf(stderr,
+		        "%08x  %s\n",
+		        checksum_digest(copy->checksum),
+		        dest_filepath);
+		return SUCCESS;
+	}
+
+	if (copy->direct_alignment == 0) {
+		if (fdatasync(copy->dest_fd) == GENERIC_ERROR_CODE) {
+			perror("Error: could not flush destination file");
+			return FAILED;
+		}
+		posix_fadvise(copy->dest_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	struct stat dest_info;
+	if (fstat(copy->dest_fd, &dest_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access destination file metadata");
+		return FAILED;
+	}
+
+	uint32_t src_crc = checksum_digest(copy->checksum);
+	uint32_t dest_crc = 0;
+	if (dest_info.st_size != copy->src_filesize) {
+		fprintf(stderr,
+		        "Error: verification of '%s' failed: %ld bytes "
+		        "expected, %ld found\n",
+		        dest_filepath,
+		        copy->src_filesize,
+		        (long) dest_info.st_size);
+		return FAILED;
+	}
+	if (checksum_destination(copy, &dest_crc) == FAILED) {
+		return FAILED;
+	}
+	if (src_crc != dest_crc) {
+		fprintf(stderr,
+		        "Error: verification of '%s' failed: source crc32c "
+		        "%08x, destination crc32c %08x\n",
+		        dest_filepath,
+		        src_crc,
+		        dest_crc);
+		return FAILED;
+	}
+
+	printf("%08x  %s\n", src_crc, dest_filepath);
+	return SUCCESS;
+}
+
+/*
+ * Give the destination `dest_fd` the owner, permissions and timestamps in
+ * `info`, taken from the source before copying it, since reading it updates
+ * its access time. The owner is only kept if the user is allowed to change it,
+ * as with a copy made by an unprivileged user. It is set first, since changing
+ * it clears the set-user-ID and set-group-ID bits, and the timestamps last,
+ * once nothing else is written.
+ * Returns `SUCCESS` if the metadata was set, otherwise returns `FAILED`.
+ */
+int
+preserve_metadata(int dest_fd, const struct stat *info)
+{
+	if (fchown(dest_fd, info->st_uid, info->st_gid) == GENERIC_ERROR_CODE &&
+	    errno != EPERM) {
+		perror("Error: could not set destination owner");
+		return FAILED;
+	}
+	if (fchmod(dest_fd, info->st_mode & ALLPERMS) == GENERIC_ERROR_CODE) {
+		perror("Error: could not set destination permissions");
+		return FAILED;
+	}
+	struct timespec times[2] = { info->st_atim, info->st_mtim };
+	if (futimens(dest_fd, times) == GENERIC_ERROR_CODE) {
+		perror("Error: could not set destination timestamps");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Give the directory or symbolic link at `dest_path` the owner, permissions
+ * and timestamps in `info`, as `preserve_metadata` does for open files.
+ * Symbolic links themselves are updated, not their targets, and have no
+ * permissions of their own.
+ * Returns `SUCCESS` if the metadata was set, otherwise returns `FAILED`.
+ */
+int
+preserve_path_metadata(const char *dest_path, const struct stat *info)
+{
+	if (lchown(dest_path, info->st_uid, info->st_gid) ==
+	            GENERIC_ERROR_CODE &&
+	    errno != EPERM) {
+		perror("Error: could not set destination owner");
+		return FAILED;
+	}
+	if (!S_ISLNK(info->st_mode) &&
+	    chmod(dest_path, info->st_mode & ALLPERMS) == GENERIC_ERROR_CODE) {
+		perror("Error: could not set destination permissions");
+		return FAILED;
+	}
+	struct timespec times[2] = { info->st_atim, info->st_mtim };
+	if (utimensat(AT_FDCWD, dest_path, times, AT_SYMLINK_NOFOLLOW) ==
+	    GENERIC_ERROR_CODE) {
+		perror("Error: could not set destination timestamps");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Empty `fd` if it is a regular file, leaving pipes and devices alone.
+ * Returns `SUCCESS` if `fd` is empty or not a regular file, otherwise returns
+ * `FAILED`.
+ */
+int
+truncate_regular_file(int fd)
+{
+	struct stat info;
+	if (fstat(fd, &info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access destination file metadata");
+		return FAILED;
+	}
+	if (S_ISREG(info.st_mode) && ftruncate(fd, 0) == GENERIC_ERROR_CODE) {
+		perror("Error: could not truncate destination file");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Count the minor and major page faults taken so far by the calling thread,
+ * which is the one copying the file.
+ * Returns the number of page faults, or 0 if it cannot be queried.
+ */
+long
+count_page_faults(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_THREAD, &usage) == GENERIC_ERROR_CODE) {
+		return 0;
+	}
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * Copy the file at `src_filepath` into a new file at `dest_filepath`, either of
+ * them being `-` for the standard input or output. Sources that are not
+ * regular files, and copies into the standard output, are streamed. Reports
+ * the strategy used and the page faults taken if `options->verbose` is set and
+ * verifies the copy if `options->verify` is set. With `options->resume` an
+ * existing destination is continued from its journal, and with
+ * `options->update_delta` only its blocks that differ are rewritten; either
+ * way it is kept on failure. With `options->archive` the owner, permissions
+ * and timestamps of the source are kept. It is safe to call from several
+ * threads at once.
+ * Returns `SUCCESS` if the file was copied, otherwise returns `FAILED`.
+ */
+int
+copy_file(char *src_filepath,
+          char *dest_filepath,
+          const struct copy_options *options)
+{
+	int src_fd = 0;
 	int dest_fd = 0;
 	long src_filesize = 0;
-	open_files(&src_fd, &dest_fd, src_filepath, dest_filepath, &src_filesize);
+	int res = open_files(
+	        &src_fd, &dest_fd, src_filepath, dest_filepath, &src_filesize);
+	if (res == FAILED) {
+		return FAILED;
+	}
+
+	struct checksum checksum = { .total_len = src_filesize };
+	atomic_init(&checksum.raw, 0);
+	struct file_copy copy = {
+		.src_fd = src_fd,
+		.dest_fd = dest_fd,
+		.src_filesize = src_filesize,
+		.direct_alignment = 0,
+		.checksum = options->verify ? &checksum : NULL,
+		.options = options,
+	};
+	enum copy_strategy strategy = STRATEGY_REFLINK;
+
+	long faults_before = count_page_faults();
+	/* Taken before the copy, which updates the source access time */
+	struct stat src_info;
+	bool has_src_info = fstat(src_fd, &src_info) != GENERIC_ERROR_CODE;
+	bool is_stream = is_stdio_path(dest_filepath) || !has_src_info ||
+	                 !S_ISREG(src_info.st_mode);
+
+	if (options->direct && !is_stream) {
+		res = enable_direct_io(&copy);
+	}
+	bool is_update = options->resume || options->update_delta;
+	if (res == SUCCESS && is_stream && is_update) {
+		/* A stream can be neither compared nor resumed, so rewrite */
+		res = truncate_regular_file(dest_fd);
+	}
+	long delta_written = 0;
+	if (res == SUCCESS && is_stream) {
+		res = copy_stream(&copy, &strategy);
+	} else if (res == SUCCESS && options->update_delta) {
+		strategy = STRATEGY_DELTA;
+		res = copy_delta(&copy, &delta_written);
+	} else if (res == SUCCESS) {
+		res = copy_content(&copy, dest_filepath, &strategy);
+	}
+	if (res == FAILED && !is_update) {
+		unlink_file(dest_filepath);
+	}
+
+	if (res == SUCCESS && options->verify) {
+		res = verify_copy(&copy, dest_filepath);
+		if (res == FAILED) {
+			/* The journal would resume into corrupted data */
+			remove_journal(dest_filepath);
+		}
+		if (res == FAILED && !is_update) {
+			unlink_file(dest_filepath);
+		} else if (res == FAILED && options->resume &&
+		           ftruncate(dest_fd, 0) == GENERIC_ERROR_CODE) {
+			/* Without a journal it would be taken as finished */
+			perror("Error: could not truncate destination file");
+		}
+	}
+	if (res == SUCCESS && options->resume && !is_stream) {
+		remove_journal(dest_filepath);
+	}
+	if (res == SUCCESS && options->archive &&
+	    !is_stdio_path(dest_filepath)) {
+		if (has_src_info) {
+			res = preserve_metadata(dest_fd, &src_info);
+		} else {
+			fprintf(stderr,
+			        "Error: failed to access source file "
+			        "metadata\n");
+			res = FAILED;
+		}
+	}
+
+	if (close_all_fds(src_fd, dest_fd) == FAILED) {
+		res = FAILED;
+	}
+
+	if (res == SUCCESS && options->verbose) {
+		/* Keep the report out of the data when copying to stdout */
+		FILE *report = is_stdio_path(dest_filepath) ? stderr : stdout;
+		fprintf(report,
+		        "'%s' -> '%s' (%s, %ld page faults)\n",
+		        src_filepath,
+		        dest_filepath,
+		        COPY_STRATEGY_NAMES[strategy],
+		        count_page_faults() - faults_before);
+		if (strategy == STRATEGY_DELTA) {
+			fprintf(report,
+			        "'%s': %ld of %ld bytes written\n",
+			        dest_filepath,
+			        delta_written,
+			        copy.src_filesize);
+		}
+	}
+	return res;
+}
+
+/*
+ * Write every chunk published in the fan-out copy of `arg`, a writer, into its
+ * destination until the source is exhausted.
+ */
+void *
+run_fanout_writer(void *arg)
+{
+	struct fanout_writer *writer = arg;
+	struct fanout *fanout = writer->fanout;
+	long seen_generation = 0;
+
+	pthread_mutex_lock(&fanout->lock);
+	while (true) {
+		while (fanout->generation == seen_generation &&
+		       !fanout->is_finished) {
+			pthread_cond_wait(&fanout->window_ready, &fanout->lock);
+		}
+		if (fanout->is_finished) {
+			break;
+		}
+		seen_generation = fanout->generation;
+		pthread_mutex_unlock(&fanout->lock);
+
+		if (writer->res == SUCCESS) {
+			int dest_fd = writer->copy.dest_fd;
+			writer->res = write_all_at(dest_fd,
+			                           fanout->window,
+			                           fanout->window_len,
+			                           fanout->window_offset);
+			/* Start the writeback while the next chunk is read */
+			sync_file_range(dest_fd,
+			                fanout->window_offset,
+			                fanout->window_len,
+			                SYNC_FILE_RANGE_WRITE);
+		}
+
+		pthread_mutex_lock(&fanout->lock);
+		fanout->pending--;
+		if (fanout->pending == 0) {
+			pthread_cond_signal(&fanout->window_done);
+		}
+	}
+	pthread_mutex_unlock(&fanout->lock);
+	return NULL;
+}
+
+/*
+ * Hand the `len` bytes at `window`, which are at `offset` in the source, to
+ * the started writers of `fanout` and wait until all of them wrote them. The
+ * chunk is added to `checksum`, if any, while the writers are busy.
+ */
+void
+fanout_window(struct fanout *fanout,
+              const char *window,
+              long offset,
+              long len,
+              struct checksum *checksum)
+{
+	pthread_mutex_lock(&fanout->lock);
+	fanout->window = window;
+	fanout->window_offset = offset;
+	fanout->window_len = len;
+	fanout->pending = 0;
+	for (int i = 0; i < fanout->writers_count; i++) {
+		fanout->pending += fanout->writers[i].is_started;
+	}
+	fanout->generation++;
+	pthread_cond_broadcast(&fanout->window_ready);
+	pthread_mutex_unlock(&fanout->lock);
+
+	checksum_update(checksum, offset, window, len);
+
+	pthread_mutex_lock(&fanout->lock);
+	while (fanout->pending > 0) {
+		pthread_cond_wait(&fanout->window_done, &fanout->lock);
+	}
+	pthread_mutex_unlock(&fanout->lock);
+}
+
+/*
+ * Fan out the range [`offset`, `end`) of the regular file `src_fd`, mapping at
+ * most `window_size` bytes of it at a time.
+ * Returns `SUCCESS` if the range was mapped, otherwise returns `FAILED`.
+ */
+int
+fanout_range(struct fanout *fanout,
+             int src_fd,
+             long offset,
+             long end,
+             long window_size,
+             struct checksum *checksum)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	window_size = (window_size + page_size - 1) / page_size * page_size;
+
+	while (offset < end) {
+		/* mmap offsets must be page aligned */
+		long map_offset = offset / page_size * page_size;
+		long map_len = end - map_offset;
+		if (map_len > window_size) {
+			map_len = window_size;
+		}
+		long delta = offset - map_offset;
+
+		char *src_map = mmap(NULL,
+		                     map_len,
+		                     PROT_READ,
+		                     MAP_SHARED | MAP_POPULATE,
+		                     src_fd,
+		                     (off_t) map_offset);
+		if (src_map == MAP_FAILED) {
+			perror("Error: could not map memory for source file");
+			return FAILED;
+		}
+		advise_mapping(src_map, map_len);
+
+		fanout_window(fanout,
+		              src_map + delta,
+		              offset,
+		              map_len - delta,
+		              checksum);
+
+		madvise(src_map, map_len, MADV_DONTNEED);
+		if (munmap(src_map, map_len) == GENERIC_ERROR_CODE) {
+			perror("Failed to unmap memory from source");
+			return FAILED;
+		}
+		posix_fadvise(src_fd, map_offset, map_len, POSIX_FADV_DONTNEED);
+		offset = map_offset + map_len;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Fan out the regular source file `src_fd` of `src_filesize` bytes, only its
+ * data extents unless the sparse mode is `SPARSE_NEVER`, so that holes stay
+ * holes in every destination.
+ * Returns `SUCCESS` if the source was read, otherwise returns `FAILED`.
+ */
+int
+fanout_file(struct fanout *fanout,
+            int src_fd,
+            long src_filesize,
+            const struct copy_options *options,
+            struct checksum *checksum)
+{
+	long window_size = options->window_size;
+	off_t first_hole = lseek(src_fd, 0, SEEK_HOLE);
+	if (options->sparse == SPARSE_NEVER ||
+	    first_hole == GENERIC_ERROR_CODE || first_hole >= src_filesize) {
+		return fanout_range(
+		        fanout, src_fd, 0, src_filesize, window_size, checksum);
+	}
+
+	for (off_t offset = 0; offset < src_filesize;) {
+		off_t data_start = lseek(src_fd, offset, SEEK_DATA);
+		if (data_start == GENERIC_ERROR_CODE && errno == ENXIO) {
+			/* Only a hole is left up to the end */
+			break;
+		}
+		if (data_start == GENERIC_ERROR_CODE) {
+			perror("Error: could not find data in source file");
+			return FAILED;
+		}
+		off_t data_end = lseek(src_fd, data_start, SEEK_HOLE);
+		if (data_end == GENERIC_ERROR_CODE) {
+			perror("Error: could not find hole in source file");
+			return FAILED;
+		}
+		if (data_end > src_filesize) {
+			data_end = src_filesize;
+		}
+
+		if (fanout_range(fanout,
+		                 src_fd,
+		                 data_start,
+		                 data_end,
+		                 window_size,
+		                 checksum) == FAILED) {
+			return FAILED;
+		}
+		offset = data_end;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Fan out everything left in `src_fd`, a pipe or another file that cannot be
+ * mapped, reading it into a buffer. Its size is stored in `src_filesize` and,
+ * since it is not known in advance, the checksum is computed in order.
+ * Returns `SUCCESS` if the source was read, otherwise returns `FAILED`.
+ */
+int
+fanout_stream(struct fanout *fanout,
+              int src_fd,
+              long *src_filesize,
+              struct checksum *checksum)
+{
+	char *buffer = malloc(STREAM_BUFFER_SIZE);
+	if (buffer == NULL) {
+		perror("Error: could not allocate copy buffer");
+		return FAILED;
+	}
+
+	uint32_t crc = 0;
+	long offset = 0;
+	int res = SUCCESS;
+	while (true) {
+		ssize_t read_bytes = read(src_fd, buffer, STREAM_BUFFER_SIZE);
+		if (read_bytes == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (read_bytes == GENERIC_ERROR_CODE) {
+			perror("Error: could not read from source");
+			res = FAILED;
+			break;
+		}
+		if (read_bytes == 0) {
+			break;
+		}
+		if (checksum != NULL) {
+			crc = crc32c_update(crc, buffer, read_bytes);
+		}
+		fanout_window(fanout, buffer, offset, read_bytes, NULL);
+		offset += read_bytes;
+	}
+
+	if (checksum != NULL) {
+		checksum->total_len = offset;
+		atomic_store(&checksum->raw, crc);
+	}
+	*src_filesize = offset;
+	free(buffer);
+	return res;
+}
+
+/*
+ * Finish the copy of `writer` into its destination once the source of
+ * `src_filesize` bytes was fanned out: size it, verify it if
+ * `options->verify` is set, close it and report it if `options->verbose` is
+ * set. A failed destination is removed.
+ * Returns `SUCCESS` if the destination was copied, otherwise returns `FAILED`.
+ */
+int
+finish_fanout_writer(struct fanout_writer *writer,
+                     long src_filesize,
+                     const struct copy_options *options,
+                     const char *src_filepath,
+                     long page_faults)
+{
+	struct file_copy *copy = &writer->copy;
+	if (copy->dest_fd == GENERIC_ERROR_CODE) {
+		return FAILED;
+	}
+
+	int res = writer->res;
+	copy->src_filesize = src_filesize;
+	if (res == SUCCESS &&
+	    ftruncate(copy->dest_fd, (off_t) src_filesize) ==
+	            GENERIC_ERROR_CODE) {
+		perror("Error: could not set file size for destination file");
+		res = FAILED;
+	}
+	if (res == SUCCESS && options->verify) {
+		res = verify_copy(copy, writer->dest_filepath);
+	}
+	if (close_fd(copy->dest_fd, DONT_EXIT_ON_FAILURE) == FAILED) {
+		res = FAILED;
+	}
+
+	if (res == FAILED) {
+		fprintf(stderr,
+		        "Error: could not copy '%s' into '%s'\n",
+		        src_filepath,
+		        writer->dest_filepath);
+		unlink_file(writer->dest_filepath);
+	} else if (options->verbose) {
+		printf("'%s' -> '%s' (%s, %ld page faults)\n",
+		       src_filepath,
+		       writer->dest_filepath,
+		       COPY_STRATEGY_NAMES[STRATEGY_FANOUT],
+		       page_faults);
+	}
+	return res;
+}
+
+/*
+ * Copy the file at `src_filepath` into the `dests_count` new files at
+ * `dest_filepaths` reading it only once: each window of the source is mapped
+ * (or, for a pipe, read into a buffer) once and written into every
+ * destination by its own writer thread in parallel. Errors are kept per
+ * destination, so a failed one is removed without stopping the others.
+ * Returns `SUCCESS` if every destination was copied, otherwise returns
+ * `FAILED`.
+ */
+int
+copy_fanout(char *src_filepath,
+            char **dest_filepaths,
+            int dests_count,
+            const struct copy_options *options)
+{
+	int src_fd = is_stdio_path(src_filepath) ? dup(STDIN_FILENO)
+	                                         : open(src_filepath, O_RDONLY);
+	if (src_fd == GENERIC_ERROR_CODE) {
+		perror("Error: failed to open source file from path");
+		return FAILED;
+	}
+	struct stat src_info;
+	if (fstat(src_fd, &src_info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to accesing source file metadata");
+		close_fd(src_fd, DONT_EXIT_ON_FAILURE);
+		return FAILED;
+	}
+	long src_filesize = src_info.st_size;
+
+	struct fanout fanout = {
+		.writers = calloc(dests_count, sizeof(struct fanout_writer)),
+		.writers_count = dests_count,
+		.generation = 0,
+		.pending = 0,
+		.is_finished = false,
+	};
+	if (fanout.writers == NULL) {
+		perror("Error: could not allocate destination writers");
+		close_fd(src_fd, DONT_EXIT_ON_FAILURE);
+		return FAILED;
+	}
+	pthread_mutex_init(&fanout.lock, NULL);
+	pthread_cond_init(&fanout.window_ready, NULL);
+	pthread_cond_init(&fanout.window_done, NULL);
 
-	copy_content(src_fd, dest_fd, src_filesize, dest_filepath);
+	struct checksum checksum = { .total_len = src_filesize };
+	atomic_init(&checksum.raw, 0);
+	for (int i = 0; i < dests_count; i++) {
+		struct fanout_writer *writer = &fanout.writers[i];
+		writer->fanout = &fanout;
+		writer->dest_filepath = dest_filepaths[i];
+		writer->copy = (struct file_copy){
+			.src_fd = src_fd,
+			.dest_fd = GENERIC_ERROR_CODE,
+			.src_filesize = src_filesize,
+			.direct_alignment = 0,
+			.checksum = options->verify ? &checksum : NULL,
+			.options = options,
+		};
+		writer->res = open_destination(writer->dest_filepath,
+		                               &writer->copy.dest_fd);
+		if (writer->res == FAILED) {
+			continue;
+		}
+		int res = pthread_create(
+		        &writer->thread, NULL, run_fanout_writer, writer);
+		if (res != 0) {
+			fprintf(stderr,
+			        "Error: could not start writer thread: %s\n",
+			        strerror(res));
+			writer->res = FAILED;
+			continue;
+		}
+		writer->is_started = true;
+	}
+
+	long faults_before = count_page_faults();
+	int res = SUCCESS;
+	if (S_ISREG(src_info.st_mode)) {
+		res = fanout_file(&fanout,
+		                  src_fd,
+		                  src_filesize,
+		                  options,
+		                  options->verify ? &checksum : NULL);
+	} else {
+		res = fanout_stream(&fanout,
+		                    src_fd,
+		                    &src_filesize,
+		                    options->verify ? &checksum : NULL);
+	}
+	long page_faults = count_page_faults() - faults_before;
+
+	pthread_mutex_lock(&fanout.lock);
+	fanout.is_finished = true;
+	pthread_cond_broadcast(&fanout.window_ready);
+	pthread_mutex_unlock(&fanout.lock);
+
+	int failures = 0;
+	for (int i = 0; i < dests_count; i++) {
+		struct fanout_writer *writer = &fanout.writers[i];
+		if (writer->is_started) {
+			pthread_join(writer->thread, NULL);
+		}
+		if (res == FAILED) {
+			/* The source could not be read, so no copy is whole */
+			writer->res = FAILED;
+		}
+		if (finish_fanout_writer(writer,
+		                         src_filesize,
+		                         options,
+		                         src_filepath,
+		                         page_faults) == FAILED) {
+			failures++;
+		}
+	}
+
+	pthread_cond_destroy(&fanout.window_done);
+	pthread_cond_destroy(&fanout.window_ready);
+	pthread_mutex_destroy(&fanout.lock);
+	free(fanout.writers);
+	if (close_fd(src_fd, DONT_EXIT_ON_FAILURE) == FAILED) {
+		failures++;
+	}
+	return failures == 0 ? SUCCESS : FAILED;
+}
+
+/*
+ * Append `job` at the owner end of `deque`, growing it when it is full.
+ * Returns `SUCCESS` if the job was queued, otherwise returns `FAILED`.
+ */
+int
+push_job(struct job_deque *deque, struct copy_job job)
+{
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->tail == deque->capacity && deque->head > 0) {
+		/* Reclaim the slots already stolen from the front */
+		memmove(deque->jobs,
+		        deque->jobs + deque->head,
+		        (deque->tail - deque->head) * sizeof(struct copy_job));
+		deque->tail -= deque->head;
+		deque->head = 0;
+	}
+
+	if (deque->tail == deque->capacity) {
+		size_t capacity = deque->capacity == 0
+		                          ? JOB_DEQUE_INITIAL_CAPACITY
+		                          : deque->capacity * 2;
+		struct copy_job *jobs = realloc(
+		        deque->jobs, capacity * sizeof(struct copy_job));
+		if (jobs == NULL) {
+			pthread_mutex_unlock(&deque->lock);
+			perror("Error: could not grow the jobs queue");
+			return FAILED;
+		}
+		deque->jobs = jobs;
+		deque->capacity = capacity;
+	}
+
+	deque->jobs[deque->tail++] = job;
+	pthread_mutex_unlock(&deque->lock);
+	return SUCCESS;
+}
+
+/*
+ * Take a job from `deque` into `job`, from the owner end (the most recently
+ * pushed, whose directory is likely still cached) when `is_owner` is set, or
+ * from the opposite end when stealing.
+ * Returns `true` if a job was taken, `false` if `deque` is empty.
+ */
+bool
+take_job(struct job_deque *deque, bool is_owner, struct copy_job *job)
+{
+	bool found = false;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->head < deque->tail) {
+		*job = is_owner ? deque->jobs[--deque->tail]
+		                : deque->jobs[deque->head++];
+		found = true;
+	}
+	if (deque->head == deque->tail) {
+		deque->head = 0;
+		deque->tail = 0;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+/*
+ * Queue `job` into the deque of the next worker in round-robin order and wake
+ * up an idle worker.
+ * Returns `SUCCESS` if the job was queued, otherwise returns `FAILED`.
+ */
+int
+submit_job(struct worker_pool *pool, struct copy_job job)
+{
+	struct job_deque *deque = &pool->deques[pool->next_deque];
+	pool->next_deque = (pool->next_deque + 1) % pool->workers_count;
+
+	if (push_job(deque, job) == FAILED) {
+		return FAILED;
+	}
+
+	pthread_mutex_lock(&pool->idle_lock);
+	atomic_fetch_add(&pool->queued_jobs, 1);
+	pthread_cond_signal(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+	return SUCCESS;
+}
+
+/*
+ * Get the next job for the worker `worker_id`, taking it from its own deque
+ * first and stealing from the other workers' deques otherwise. Sleeps while
+ * there is no job queued but the tree walk has not finished.
+ * Returns `true` if a job was stored in `job`, `false` when all the jobs are
+ * done.
+ */
+bool
+next_job(struct worker_pool *pool, int worker_id, struct copy_job *job)
+{
+	while (true) {
+		for (int i = 0; i < pool->workers_count; i++) {
+			int victim = (worker_id + i) % pool->workers_count;
+			if (take_job(&pool->deques[victim], i == 0, job)) {
+				atomic_fetch_sub(&pool->queued_jobs, 1);
+				return true;
+			}
+		}
+
+		pthread_mutex_lock(&pool->idle_lock);
+		while (atomic_load(&pool->queued_jobs) == 0 &&
+		       !pool->walk_finished) {
+			pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+		}
+		bool is_done = atomic_load(&pool->queued_jobs) == 0 &&
+		               pool->walk_finished;
+		pthread_mutex_unlock(&pool->idle_lock);
+
+		if (is_done) {
+			return false;
+		}
+	}
+}
+
+/*
+ * Worker thread: copy files until the pool runs out of jobs, counting the
+ * files that could not be copied.
+ */
+void *
+run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct worker_pool *pool = worker->pool;
+	struct copy_job job;
+
+	while (next_job(pool, worker->id, &job)) {
+		if (copy_file(job.src_path, job.dest_path, pool->options) ==
+		    FAILED) {
+			fprintf(stderr,
+			        "Error: could not copy '%s' to '%s'\n",
+			        job.src_path,
+			        job.dest_path);
+			atomic_fetch_add(&pool->failures, 1);
+		}
+		free(job.src_path);
+		free(job.dest_path);
+	}
+	return NULL;
+}
+
+/*
+ * Tell the first `started_count` workers of `pool` that no more jobs will be
+ * submitted, wait for them to finish the queued ones and release the pool.
+ */
+void
+stop_worker_pool(struct worker_pool *pool, int started_count)
+{
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->walk_finished = true;
+	pthread_cond_broadcast(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+
+	for (int i = 0; i < started_count; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < pool->workers_count; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].jobs);
+	}
+	free(pool->deques);
+	free(pool->workers);
+	pthread_cond_destroy(&pool->idle_cond);
+	pthread_mutex_destroy(&pool->idle_lock);
+}
+
+/*
+ * Initialize `pool` and start `options->jobs` worker threads. If any of them
+ * cannot be started, the ones that were are stopped and the pool is released.
+ * Returns `SUCCESS` if every worker was started, otherwise returns `FAILED`.
+ */
+int
+start_worker_pool(struct worker_pool *pool, const struct copy_options *options)
+{
+	pool->options = options;
+	pool->workers_count = options->jobs;
+	pool->next_deque = 0;
+	pool->walk_finished = false;
+	atomic_init(&pool->queued_jobs, 0);
+	atomic_init(&pool->failures, 0);
+	pthread_mutex_init(&pool->idle_lock, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+
+	pool->deques = calloc(pool->workers_count, sizeof(struct job_deque));
+	pool->workers = calloc(pool->workers_count, sizeof(struct worker));
+	if (pool->deques == NULL || pool->workers == NULL) {
+		perror("Error: could not allocate the worker pool");
+		pool->workers_count = 0;
+		stop_worker_pool(pool, 0);
+		return FAILED;
+	}
+
+	for (int i = 0; i < pool->workers_count; i++) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+
+	for (int i = 0; i < pool->workers_count; i++) {
+		pool->workers[i].id = i;
+		pool->workers[i].pool = pool;
+		int res = pthread_create(&pool->workers[i].thread,
+		                         NULL,
+		                         run_worker,
+		                         &pool->workers[i]);
+		if (res != 0) {
+			fprintf(stderr,
+			        "Error: could not start worker thread: %s\n",
+			        strerror(res));
+			stop_worker_pool(pool, i);
+			return FAILED;
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * Tell the workers of `pool` that no more jobs will be submitted, wait for
+ * them to finish the queued ones and release the pool.
+ * Returns the number of files that could not be copied.
+ */
+int
+finish_worker_pool(struct worker_pool *pool)
+{
+	stop_worker_pool(pool, pool->workers_count);
+	return atomic_load(&pool->failures);
+}
+
+/*
+ * Build the path `parent_path`/`entity_name` in newly allocated memory.
+ * Returns the path, or `NULL` if it could not be allocated.
+ */
+char *
+join_path(const char *parent_path, const char *entity_name)
+{
+	size_t len = strlen(parent_path) + strlen(entity_name) + 2;
+	char *path = malloc(len);
+	if (path == NULL) {
+		perror("Error: could not allocate path");
+		return NULL;
+	}
+	snprintf(path, len, "%s/%s", parent_path, entity_name);
+	return path;
+}
+
+/*
+ * Remember that the metadata of the directory at `dest_path` must be set from
+ * `info`, the metadata of its source, once every entity inside it has been
+ * copied.
+ * Returns `SUCCESS` if it was recorded, otherwise returns `FAILED`.
+ */
+int
+record_directory_mode(struct directory_modes *modes,
+                      const char *dest_path,
+                      const struct stat *info)
+{
+	if (modes->count == modes->capacity) {
+		size_t capacity = modes->capacity == 0
+		                          ? JOB_DEQUE_INITIAL_CAPACITY
+		                          : modes->capacity * 2;
+		struct directory_mode *entries =
+		        realloc(modes->entries,
+		                capacity * sizeof(struct directory_mode));
+		if (entries == NULL) {
+			perror("Error: could not record directory permissions");
+			return FAILED;
+		}
+		modes->entries = entries;
+		modes->capacity = capacity;
+	}
+
+	char *path = strdup(dest_path);
+	if (path == NULL) {
+		perror("Error: could not record directory permissions");
+		return FAILED;
+	}
+	modes->entries[modes->count].dest_path = path;
+	modes->entries[modes->count].info = *info;
+	modes->count++;
+	return SUCCESS;
+}
+
+/*
+ * Apply the recorded directory permissions, and in archive mode owners and
+ * timestamps, children before their parents so that a read-only parent does
+ * not prevent updating its children and the timestamps of a parent are not
+ * changed afterwards. The records are released.
+ * Returns the number of directories whose metadata could not be set.
+ */
+int
+restore_directory_modes(struct directory_modes *modes)
+{
+	int failures = 0;
+	for (size_t i = modes->count; i > 0; i--) {
+		struct directory_mode *entry = &modes->entries[i - 1];
+		int res = SUCCESS;
+		if (modes->archive) {
+			res = preserve_path_metadata(entry->dest_path,
+			                             &entry->info);
+		} else if (chmod(entry->dest_path,
+		                 entry->info.st_mode & ALLPERMS) ==
+		           GENERIC_ERROR_CODE) {
+			perror("Error: could not set directory permissions");
+			res = FAILED;
+		}
+		if (res == FAILED) {
+			failures++;
+		}
+		free(entry->dest_path);
+	}
+	free(modes->entries);
+	return failures;
+}
+
+/*
+ * Hash the inode `ino` of the device `dev`, mixing the bits so that the
+ * sequential inode numbers of a filesystem spread over the table.
+ */
+size_t
+hash_inode(dev_t dev, ino_t ino)
+{
+	uint64_t hash = ((uint64_t) ino ^ ((uint64_t) dev << 32)) *
+	                0x9e3779b97f4a7c15ULL;
+	return (size_t) (hash ^ (hash >> 32));
+}
+
+/*
+ * Find where the inode of `info` was copied in `inodes`.
+ * Returns the destination path of its first copy, or `NULL` if it was not
+ * copied yet.
+ */
+const char *
+find_inode(const struct inode_table *inodes, const struct stat *info)
+{
+	if (inodes->capacity == 0) {
+		return NULL;
+	}
+	size_t mask = inodes->capacity - 1;
+	for (size_t i = hash_inode(info->st_dev, info->st_ino) & mask;
+	     inodes->entries[i].dest_path != NULL;
+	     i = (i + 1) & mask) {
+		struct inode_entry *entry = &inodes->entries[i];
+		if (entry->dev == info->st_dev && entry->ino == info->st_ino) {
+			return entry->dest_path;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add the inode of `info`, copied into `dest_path`, to `inodes`, growing the
+ * table once it is 3/4 full.
+ * Returns `SUCCESS` if it was added, otherwise returns `FAILED`.
+ */
+int
+add_inode(struct inode_table *inodes,
+          const struct stat *info,
+          const char *dest_path)
+{
+	if ((inodes->count + 1) * 4 > inodes->capacity * 3) {
+		size_t capacity = inodes->capacity == 0
+		                          ? INODE_TABLE_INITIAL_CAPACITY
+		                          : inodes->capacity * 2;
+		struct inode_entry *entries =
+		        calloc(capacity, sizeof(struct inode_entry));
+		if (entries == NULL) {
+			perror("Error: could not grow the hard link table");
+			return FAILED;
+		}
+		for (size_t i = 0; i < inodes->capacity; i++) {
+			struct inode_entry *entry = &inodes->entries[i];
+			if (entry->dest_path == NULL) {
+				continue;
+			}
+			size_t j = hash_inode(entry->dev, entry->ino) &
+			           (capacity - 1);
+			while (entries[j].dest_path != NULL) {
+				j = (j + 1) & (capacity - 1);
+			}
+			entries[j] = *entry;
+		}
+		free(inodes->entries);
+		inodes->entries = entries;
+		inodes->capacity = capacity;
+	}
+
+	char *path = strdup(dest_path);
+	if (path == NULL) {
+		perror("Error: could not record hard link");
+		return FAILED;
+	}
+	size_t mask = inodes->capacity - 1;
+	size_t i = hash_inode(info->st_dev, info->st_ino) & mask;
+	while (inodes->entries[i].dest_path != NULL) {
+		i = (i + 1) & mask;
+	}
+	inodes->entries[i] = (struct inode_entry){ .dev = info->st_dev,
+		                                   .ino = info->st_ino,
+		                                   .dest_path = path };
+	inodes->count++;
+	return SUCCESS;
+}
+
+/*
+ * Remember that `link_path` must be created as a hard link to `target_path`.
+ * Returns `SUCCESS` if it was recorded, otherwise returns `FAILED`.
+ */
+int
+record_hard_link(struct hard_links *links,
+                 const char *target_path,
+                 const char *link_path)
+{
+	if (links->count == links->capacity) {
+		size_t capacity = links->capacity == 0
+		                          ? JOB_DEQUE_INITIAL_CAPACITY
+		                          : links->capacity * 2;
+		struct hard_link *entries = realloc(
+		        links->entries, capacity * sizeof(struct hard_link));
+		if (entries == NULL) {
+			perror("Error: could not record hard link");
+			return FAILED;
+		}
+		links->entries = entries;
+		links->capacity = capacity;
+	}
+
+	char *path = strdup(link_path);
+	if (path == NULL) {
+		perror("Error: could not record hard link");
+		return FAILED;
+	}
+	links->entries[links->count].target_path = target_path;
+	links->entries[links->count].link_path = path;
+	links->count++;
+	return SUCCESS;
+}
+
+/*
+ * Create the recorded hard links, once every file has been copied so that
+ * their targets are complete, and release the records and the inode table.
+ * A link whose target could not be copied is not created. When resuming or
+ * updating, an existing file at a link path is replaced. Each link is reported
+ * if `options->verbose` is set.
+ * Returns the number of hard links that could not be created.
+ */
+int
+create_hard_links(struct hard_links *links,
+                  struct inode_table *inodes,
+                  const struct copy_options *options)
+{
+	int failures = 0;
+	for (size_t i = 0; i < links->count; i++) {
+		struct hard_link *entry = &links->entries[i];
+		int res = link(entry->target_path, entry->link_path);
+		if (res == GENERIC_ERROR_CODE && errno == EEXIST &&
+		    (options->resume || options->update_delta) &&
+		    unlink(entry->link_path) == SUCCESS) {
+			res = link(entry->target_path, entry->link_path);
+		}
+		if (res == GENERIC_ERROR_CODE) {
+			fprintf(stderr,
+			        "Error: could not link '%s' to '%s': %s\n",
+			        entry->link_path,
+			        entry->target_path,
+			        strerror(errno));
+			failures++;
+		} else if (options->verbose) {
+			printf("'%s' => '%s' (hard link)\n",
+			       entry->link_path,
+			       entry->target_path);
+		}
+		free(entry->link_path);
+	}
+	free(links->entries);
+
+	for (size_t i = 0; i < inodes->capacity; i++) {
+		free(inodes->entries[i].dest_path);
+	}
+	free(inodes->entries);
+	return failures;
+}
+
+/*
+ * Recreate the symbolic link at `src_path` as `dest_path`, pointing to the
+ * same target. If `may_exist` is set, as when resuming, an existing link with
+ * that target is kept and any other file that is not a directory is replaced.
+ * Returns `SUCCESS` if the link was created, otherwise returns `FAILED`.
+ */
+int
+copy_symlink(const char *src_path, const char *dest_path, bool may_exist)
+{
+	char target[PATH_MAX] = { 0 };
+	ssize_t len = readlink(src_path, target, sizeof(target) - 1);
+	if (len == GENERIC_ERROR_CODE) {
+		perror("Error: could not read symbolic link");
+		return FAILED;
+	}
+	int res = symlink(target, dest_path);
+	if (res == GENERIC_ERROR_CODE && may_exist && errno == EEXIST) {
+		char existing[PATH_MAX] = { 0 };
+		ssize_t existing_len =
+		        readlink(dest_path, existing, sizeof(existing) - 1);
+		if (existing_len == len && memcmp(existing, target, len) == 0) {
+			return SUCCESS;
+		}
+		if (unlink(dest_path) == SUCCESS) {
+			res = symlink(target, dest_path);
+		}
+	}
+	if (res == GENERIC_ERROR_CODE) {
+		perror("Error: could not create symbolic link");
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Create the directory `dest_path` for the source directory whose metadata is
+ * `info`. It is created writable and searchable by its owner so that it can be
+ * filled; its metadata is recorded to be applied once that is done. If
+ * `may_exist` is set, as when resuming, an existing directory is reused.
+ * Returns `SUCCESS` if the directory was created, otherwise returns `FAILED`.
+ */
+int
+create_directory(const char *dest_path,
+                 const struct stat *info,
+                 bool may_exist,
+                 struct directory_modes *modes)
+{
+	mode_t mode = (info->st_mode & ALLPERMS) | S_IRWXU;
+	int res = mkdir(dest_path, mode);
+	if (res == GENERIC_ERROR_CODE && may_exist && errno == EEXIST &&
+	    is_directory(dest_path)) {
+		res = chmod(dest_path, mode);
+	}
+	if (res == GENERIC_ERROR_CODE) {
+		perror("Error: could not create destination directory");
+		return FAILED;
+	}
+	return record_directory_mode(modes, dest_path, info);
+}
+
+/*
+ * Submit the copy of the regular file `src_path`, whose metadata is `info`,
+ * into `dest_path` to the pool of `tree`. In archive mode, a file with several
+ * hard links whose inode was already submitted is instead recorded as a hard
+ * link to its first copy. Ownership of the paths passes to this function.
+ * Returns `SUCCESS` if the file was submitted or recorded, otherwise returns
+ * `FAILED`.
+ */
+int
+submit_file(struct tree_copy *tree,
+            char *src_path,
+            char *dest_path,
+            const struct stat *info)
+{
+	if (tree->modes.archive && info->st_nlink > 1) {
+		const char *target_path = find_inode(&tree->inodes, info);
+		if (target_path != NULL) {
+			int res = record_hard_link(
+			        &tree->links, target_path, dest_path);
+			free(src_path);
+			free(dest_path);
+			return res;
+		}
+		if (add_inode(&tree->inodes, info, dest_path) == FAILED) {
+			free(src_path);
+			free(dest_path);
+			return FAILED;
+		}
+	}
+
+	struct copy_job job = { .src_path = src_path, .dest_path = dest_path };
+	if (submit_job(tree->pool, job) == FAILED) {
+		free(src_path);
+		free(dest_path);
+		return FAILED;
+	}
+	/* The worker that copies it frees the paths */
+	return SUCCESS;
+}
+
+/*
+ * Walk the directory `src_path` depth-first, creating each directory in
+ * `dest_path` before anything inside it and submitting a copy job to the pool
+ * of `tree` for every regular file. Symbolic links are recreated right away
+ * and other file types are skipped.
+ * Returns the number of entities that could not be copied.
+ */
+int
+copy_directory(const char *src_path,
+               const char *dest_path,
+               struct tree_copy *tree)
+{
+	const struct copy_options *options = tree->pool->options;
+	bool is_update = options->resume || options->update_delta;
+	DIR *directory = opendir(src_path);
+	if (directory == NULL) {
+		perror("Error: could not open source directory");
+		return 1;
+	}
+
+	int failures = 0;
+	struct dirent *entity = NULL;
+	while (true) {
+		errno = 0;
+		entity = readdir(directory);
+		if (entity == NULL) {
+			if (errno != 0) {
+				perror("Error while reading from directory");
+				failures++;
+			}
+			break;
+		}
+		if (strcmp(entity->d_name, ".") == 0 ||
+		    strcmp(entity->d_name, "..") == 0) {
+			continue;
+		}
+
+		char *src_child = join_path(src_path, entity->d_name);
+		char *dest_child = join_path(dest_path, entity->d_name);
+		if (src_child == NULL || dest_child == NULL) {
+			free(src_child);
+			free(dest_child);
+			failures++;
+			break;
+		}
+
+		struct stat info;
+		if (lstat(src_child, &info) == GENERIC_ERROR_CODE) {
+			perror("Error: failed to access source metadata");
+			failures++;
+		} else if (S_ISDIR(info.st_mode)) {
+			if (create_directory(dest_child,
+			                     &info,
+			                     is_update,
+			                     &tree->modes) == SUCCESS) {
+				failures += copy_directory(
+				        src_child, dest_child, tree);
+			} else {
+				failures++;
+			}
+		} else if (S_ISREG(info.st_mode)) {
+			if (submit_file(tree, src_child, dest_child, &info) ==
+			    FAILED) {
+				failures++;
+			}
+			continue;
+		} else if (S_ISLNK(info.st_mode)) {
+			if (copy_symlink(src_child, dest_child, is_update) ==
+			            FAILED ||
+			    (options->archive &&
+			     preserve_path_metadata(dest_child, &info) ==
+			             FAILED)) {
+				failures++;
+			}
+		} else {
+			fprintf(stderr,
+			        "Warning: skipping special file '%s'\n",
+			        src_child);
+		}
+
+		free(src_child);
+		free(dest_child);
+	}
+
+	closedir(directory);
+	return failures;
+}
+
+/*
+ * Copy the directory tree at `src_path` into the new directory `dest_path`.
+ * The calling thread walks the tree while a pool of `options->jobs` workers
+ * copies the regular files through `copy_file`. In archive mode hard links are
+ * created once the pool is drained, and directory metadata is applied last.
+ * Returns `SUCCESS` if every entity was copied, otherwise returns `FAILED`.
+ */
+int
+copy_tree(const char *src_path,
+          const char *dest_path,
+          const struct copy_options *options)
+{
+	struct stat info;
+	if (stat(src_path, &info) == GENERIC_ERROR_CODE) {
+		perror("Error: failed to access source directory metadata");
+		return FAILED;
+	}
+
+	struct worker_pool pool;
+	struct tree_copy tree;
+	memset(&tree, 0, sizeof(tree));
+	tree.pool = &pool;
+	tree.modes.archive = options->archive;
+	bool is_update = options->resume || options->update_delta;
+	if (create_directory(dest_path, &info, is_update, &tree.modes) ==
+	    FAILED) {
+		return FAILED;
+	}
+
+	if (start_worker_pool(&pool, options) == FAILED) {
+		restore_directory_modes(&tree.modes);
+		return FAILED;
+	}
+
+	int failures = copy_directory(src_path, dest_path, &tree);
+	failures += finish_worker_pool(&pool);
+	failures += create_hard_links(&tree.links, &tree.inodes, options);
+	failures += restore_directory_modes(&tree.modes);
+
+	return failures == 0 ? SUCCESS : FAILED;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct copy_options options = {
+		.verbose = false,
+		.engine = ENGINE_AUTO,
+		.window_size = DEFAULT_WINDOW_SIZE,
+		.sparse = SPARSE_AUTO,
+		.recursive = false,
+		.jobs = 0,
+		.queue_depth = DEFAULT_QUEUE_DEPTH,
+		.direct = false,
+		.verify = false,
+		.resume = false,
+		.threads = 1,
+		.update_delta = false,
+		.archive = false,
+	};
+	char *src_filepath = NULL;
+	char **dest_filepaths = NULL;
+	int dests_count = 0;
+
+	parse_arguments(argc,
+	                argv,
+	                &options,
+	                &src_filepath,
+	                &dest_filepaths,
+	                &dests_count);
+
+	if (options.verify || options.resume) {
+		crc32c_init();
+	}
+
+	int res = FAILED;
+	if (dests_count > 1) {
+		res = copy_fanout(
+		        src_filepath, dest_filepaths, dests_count, &options);
+	} else if (options.recursive && is_directory(src_filepath)) {
+		res = copy_tree(src_filepath, dest_filepaths[0], &options);
+	} else {
+		res = copy_file(src_filepath, dest_filepaths[0], &options);
+	}
 
-	close_all_fds(src_fd, dest_fd);
-	exit(EXIT_SUCCESS);
+	exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -1,9 +1,19 @@
 #define _GNU_SOURCE
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
 #include <linux/limits.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -12,280 +22,7466 @@
 #include <errno.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define DIR_NAMES_BLACKLIST_SIZE 2
 
-static const int MAX_INPUT_PARAMS = 2, MIN_INPUT_PARAMS = 1;
-static const char CASE_SENSITIVITY_NONE_FLAG[] = "-i";
-static const int NO_FLAG_FOUND = -1;
+static const int MIN_INPUT_PARAMS = 1;
+static const char NAME_PREDICATE[] = "-name", REGEX_PREDICATE[] = "-regex";
+static const char TYPE_PREDICATE[] = "-type", SIZE_PREDICATE[] = "-size",
+                  MTIME_PREDICATE[] = "-mtime", NEWER_PREDICATE[] = "-newer";
+static const char END_OF_OPTIONS[] = "--";
 static const int CASE_SENSITIVITY_FULL_CODE = 1, CASE_SENSITIVITY_NONE_CODE = 0;
 
+static const char USAGE_FMT[] =
+        "Expected %s [-i] [-j N] [--sorted] [-f FILE] [-name GLOB] "
+        "[-regex RE]\n"
+        "         [-type C] [-size [+-]N[cwbkMG]] [-mtime [+-]N] "
+        "[-newer FILE] [--index DB]\n"
+        "         [--exclude PATTERN] [--ignore]\n"
+        "         <phrase>...\n"
+        "      or %s [-i] [-j N] [-name GLOB] [-regex RE] --contains TEXT "
+        "[phrase]...\n"
+        "      or %s --build-index DB | --watch\n"
+        "  -i               match ignoring the letter case\n"
+        "  -f FILE          also search the phrases in FILE, one per line\n"
+        "  -name GLOB       only entities whose name matches GLOB\n"
+        "  -regex RE        only entities whose whole path matches RE\n"
+        "  -type C          only entities of type C (f, d, l, b, c, p or s)\n"
+        "  -size [+-]N      only entities of more, less or exactly N units "
+        "of 512\n"
+        "                   bytes, or of bytes (c), words (w), KiB (k), "
+        "MiB (M) or GiB (G)\n"
+        "  -mtime [+-]N     only entities modified more, less or exactly N "
+        "days ago\n"
+        "  -newer FILE      only entities modified after FILE\n"
+        "  -j, --jobs=N     directories read in parallel by N threads\n"
+        "  --sorted         print the entities of each directory sorted by "
+        "name\n"
+        "  --build-index DB write an index of the directory to DB, reading "
+        "again\n"
+        "                   only the directories modified since the last "
+        "one\n"
+        "  --index DB       search the entities in the index DB instead of "
+        "walking\n"
+        "  --watch          keep an index of the directory up to date and "
+        "answer\n"
+        "                   the queries made in it while running\n"
+        "  --exclude PATTERN skip the entities matching the .gitignore-style "
+        "PATTERN,\n"
+        "                   and everything inside them\n"
+        "  --ignore         also skip the ones matching the .gitignore and "
+        ".ignore\n"
+        "                   files found, and the .git directories\n"
+        "  --contains TEXT  print the lines of the regular files found that "
+        "contain\n"
+        "                   TEXT, searched by N threads (all the CPUs by "
+        "default)\n";
+
+enum long_option_code {
+	OPTION_SORTED = 256,
+	OPTION_BUILD_INDEX,
+	OPTION_INDEX,
+	OPTION_WATCH,
+	OPTION_CONTAINS,
+	OPTION_EXCLUDE,
+	OPTION_IGNORE,
+};
+
+static const struct option LONG_OPTIONS[] = {
+	{ "jobs", required_argument, NULL, 'j' },
+	{ "sorted", no_argument, NULL, OPTION_SORTED },
+	{ "build-index", required_argument, NULL, OPTION_BUILD_INDEX },
+	{ "index", required_argument, NULL, OPTION_INDEX },
+	{ "watch", no_argument, NULL, OPTION_WATCH },
+	{ "contains", required_argument, NULL, OPTION_CONTAINS },
+	{ "exclude", required_argument, NULL, OPTION_EXCLUDE },
+	{ "ignore", no_argument, NULL, OPTION_IGNORE },
+	{ NULL, 0, NULL, 0 },
+};
+
+static const int SUCCESS = 0, FAILED = -1;
+
 static const char STRING_NULL_TERMINATOR = '\0';
 
-static const int GENERIC_ERROR_CODE = -1;
+static const int GENERIC_ERROR_CODE = -1;
+
+static const char WD_PATH_ALIAS[] = ".";
+
+static const char *DIR_NAMES_BLACKLIST[DIR_NAMES_BLACKLIST_SIZE] = { ".", ".." };
+static const int DIR_NAMES_BLACKLIST_MAX_LEN = 3;
+
+static const size_t JOB_DEQUE_INITIAL_CAPACITY = 64;
+static const size_t DIR_BUFFERS_INITIAL_CAPACITY = 16;
+/* Bytes of directory records fetched by every getdents64 call */
+#define DIR_BUFFER_SIZE (1024 * 1024)
+static const size_t RESULT_DIR_INITIAL_CAPACITY = 8;
+static const size_t PATTERNS_INITIAL_CAPACITY = 8;
+static const size_t METADATA_INITIAL_CAPACITY = 4;
+static const int METADATA_STATX_FLAGS =
+        AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+static const int64_t SECONDS_PER_DAY = 24 * 60 * 60;
+static const size_t IGNORE_NODES_INITIAL_CAPACITY = 8;
+static const size_t IGNORE_CURSORS_INITIAL_CAPACITY = 4;
+static const uint32_t IGNORE_NO_NODE = UINT32_MAX;
+static const char IGNORE_ANY_DEPTH[] = "**";
+static const char IGNORE_GIT_DIR_RULE[] = ".git/";
+/* Read in this order, so the rules of .ignore win over those of .gitignore */
+#define IGNORE_FILES_COUNT 2
+static const char *IGNORE_FILES[IGNORE_FILES_COUNT] = { ".gitignore",
+	                                                ".ignore" };
+static const size_t NFA_INITIAL_CAPACITY = 64;
+static const size_t DFA_INITIAL_CAPACITY = 16;
+/* Bound of the DFA states of a -name or -regex, as they can grow exponentially
+ * with the pattern */
+#define DFA_MAX_STATES 8192
+/* Slots of the table finding the DFA state of a set of NFA states */
+#define DFA_TABLE_SIZE (4 * DFA_MAX_STATES)
+static const uint32_t DFA_DEAD_STATE = 0;
+static const char TAG_SEPARATOR = '\t';
+/* Loads past the end of a string are only done within its last page */
+static const uintptr_t PAGE_SIZE_MIN = 4096;
+static const size_t WALK_STACK_INITIAL_CAPACITY = 64;
+/* Directories kept open by the walk, at most, and at least */
+static const size_t WALK_MAX_OPEN_DIRS = 64, WALK_MIN_OPEN_DIRS = 2;
+/* Part of the file descriptors of the process the walk may keep open */
+static const rlim_t WALK_FD_BUDGET_SHARE = 4;
+/* Bytes of output a worker gathers before writing them at once */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+/* Files larger than this are mapped instead of read */
+static const size_t CONTENT_READ_MAX = 256 * 1024;
+static const size_t CONTENT_BINARY_PROBE = 8 * 1024;
+#define CONTENT_QUEUE_CAPACITY 256
+static const char CONTENT_SEPARATOR = ':';
+static const char INDEX_MAGIC[8] = "FINDIDX";
+static const uint32_t INDEX_VERSION = 1;
+/* Entities per front coding block; decoding can only start at a block */
+static const uint32_t INDEX_BLOCK_SIZE = 64;
+/* Sections read in place from the mapped index start at multiples of it */
+#define INDEX_ALIGNMENT 8
+static const size_t INDEX_TRIGRAM_LEN = 3;
+static const size_t INDEX_TRIGRAMS_SPACE = (size_t) 1 << 24;
+static const uint8_t INDEX_ENTRY_IS_DIR = 1;
+static const size_t INDEX_ENTRIES_INITIAL_CAPACITY = 1024;
+static const char INDEX_TMP_SUFFIX[] = ".tmp";
+static const char WATCH_SOCKET_PREFIX[] = "find-watch-";
+static const uint64_t WATCH_HASH_BASIS = 0xcbf29ce484222325;
+static const uint64_t WATCH_HASH_PRIME = 0x100000001b3;
+static const uint32_t WATCH_TRIGRAM_MULTIPLIER = 0x9e3779b1;
+static const uint32_t WATCH_ROOT_NODE = 0;
+/* Free slot of the watch tables, also returned when a node is not found */
+static const uint32_t WATCH_EMPTY_SLOT = UINT32_MAX;
+static const size_t WATCH_NODES_INITIAL_CAPACITY = 1024;
+static const size_t WATCH_TABLE_INITIAL_SIZE = 1024;
+static const size_t WATCH_POSTING_INITIAL_CAPACITY = 4;
+/* Removed nodes kept before compacting, at least */
+static const size_t WATCH_COMPACTION_MIN = 4096;
+#define WATCH_EVENTS_SIZE (64 * 1024)
+#define WATCH_HANDLE_KEY_MAX (sizeof(uint64_t) + sizeof(int) + MAX_HANDLE_SZ)
+static const uint64_t WATCH_FANOTIFY_MASK =
+        FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ATTRIB |
+        FAN_ONDIR;
+static const uint32_t WATCH_INOTIFY_MASK = IN_CREATE | IN_DELETE |
+                                           IN_MOVED_FROM | IN_MOVED_TO |
+                                           IN_ATTRIB | IN_ONLYDIR;
+static const size_t WATCH_REQUEST_MAX = 1024 * 1024;
+static const int WATCH_CLIENT_TIMEOUT_SEC = 1;
+/* How long the find command waits for the daemon between two reads */
+static const int WATCH_REPLY_TIMEOUT_SEC = 10;
+static const char WATCH_FIELD_IGNORE_CASE = 'i', WATCH_FIELD_PHRASE = 'p',
+                  WATCH_FIELD_NAME = 'n', WATCH_FIELD_REGEX = 'r';
+static const char WATCH_REPLY_END = '\0';
+
+/* Directory record returned by getdents64, as laid out by the kernel */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Directory being read with getdents64: `buffer` holds the records of the last
+ * call, `len` bytes of them, and `pos` is the offset of the next one.
+ */
+struct dir_reader {
+	int fd;
+	char *buffer;
+	long len;
+	long pos;
+};
+
+/*
+ * Buffers for the directory records of the recursive walk, one per depth, as
+ * every directory in the current path is read at the same time. They are
+ * allocated when a depth is first reached and reused by every directory at
+ * that depth.
+ */
+struct dir_buffers {
+	char **buffers;
+	size_t count;
+};
+
+struct matcher;
+
+/*
+ * Find the first occurrence of the phrase of a matcher in the `len` bytes of
+ * `string`. Returns a pointer to it, or `NULL` if the phrase is not found.
+ */
+typedef const char *(*find_fn)(const struct matcher *,
+                               const char *string,
+                               size_t len);
+
+/*
+ * Phrase prepared once to be searched in every entity name: `needle` is the
+ * phrase, lowercased when ignoring the letter case, and `find` the fastest
+ * search the CPU supports, picked at startup.
+ */
+struct matcher {
+	char needle[PATH_MAX];
+	size_t len;
+	bool ignore_case;
+	find_fn find;
+};
+
+/*
+ * Aho-Corasick automaton finding every phrase in a single pass over a name.
+ * Bytes are first mapped to classes: the bytes found in no phrase share class
+ * 0 and, when ignoring the letter case, both cases of a letter share one. This
+ * way the transitions of all the states fit in a small flat table of
+ * `states_count * classes_count` entries, with the failure links already
+ * resolved into them, so matching takes a single lookup per byte.
+ */
+struct automaton {
+	uint8_t byte_classes[256];
+	size_t classes_count;
+	size_t states_count;
+	size_t patterns_count;
+	uint32_t *transitions;
+	/* First phrase ending at each state, or -1 */
+	int32_t *state_patterns;
+	/* Nearest state that is a proper suffix of each one and ends phrases */
+	uint32_t *output_links;
+	/* Next phrase ending at the same state as each phrase, or -1 */
+	int32_t *next_patterns;
+};
+
+enum nfa_state_type {
+	NFA_BYTES,
+	NFA_SPLIT,
+	NFA_EMPTY,
+	NFA_MATCH,
+};
+
+/*
+ * State of the NFA of a -name or -regex: `NFA_BYTES` consumes one of `bytes`
+ * (a 256 bit set) moving to `out`; `NFA_SPLIT` moves to `out` and `out_alt`
+ * and `NFA_EMPTY` to `out` without consuming; `NFA_MATCH` accepts.
+ */
+struct nfa_state {
+	enum nfa_state_type type;
+	int32_t out;
+	int32_t out_alt;
+	uint64_t bytes[4];
+};
+
+/* NFA built by Thompson's construction while parsing a -name or -regex */
+struct nfa {
+	struct nfa_state *states;
+	size_t count;
+	size_t capacity;
+	bool ignore_case;
+};
+
+/* Piece of an NFA, from its `start` state to its `end` state */
+struct nfa_fragment {
+	int32_t start;
+	int32_t end;
+};
+
+/* Parsing of a -name or -regex: `error` is set once it fails */
+struct pattern_parser {
+	const char *pattern;
+	size_t pos;
+	struct nfa *nfa;
+	const char *error;
+};
+
+/*
+ * DFA matching a whole string against a -name or -regex, built ahead of time
+ * from its NFA by subset construction: there is no backtracking, so matching
+ * takes a single lookup per byte. Bytes are mapped to classes, the bytes no
+ * set of the pattern tells apart sharing one, so the transitions fit in a
+ * flat table of `states_count * classes_count` entries. State 0 is dead: no
+ * match is possible once it is reached.
+ */
+struct dfa {
+	uint8_t byte_classes[256];
+	size_t classes_count;
+	size_t states_count;
+	uint32_t *transitions;
+	bool *accepting;
+	uint32_t start;
+};
+
+/*
+ * -name GLOB (matched against the entity name) or -regex RE (matched against
+ * its full path). When every match has to contain some literal text, it is
+ * searched first with the SIMD `literal` matcher, which rejects most names
+ * faster than the DFA.
+ */
+struct pattern_predicate {
+	const char *source;
+	bool is_glob;
+	struct dfa dfa;
+	bool has_literal;
+	struct matcher literal;
+};
+
+/* Last rule of an ignore trie ending at a node, by its line */
+struct ignore_verdict {
+	bool is_set;
+	bool is_negated;
+	uint32_t line;
+};
+
+/*
+ * Path component of the ignore rules: a literal name, a `glob` or `**`, which
+ * matches any number of components. The rules ending here are split into
+ * those matching any entity and those matching only directories (written with
+ * a trailing slash).
+ */
+struct ignore_node {
+	char *component;
+	bool is_any_depth;
+	struct pattern_predicate *glob;
+	uint32_t first_child;
+	uint32_t next_sibling;
+	struct ignore_verdict entities;
+	struct ignore_verdict dirs;
+};
+
+/*
+ * Rules of a source of ignore rules (the --exclude patterns or an ignore file)
+ * compiled into a trie of path components, rooted at the directory they apply
+ * to. When several rules match an entity the last one wins, and the rules of a
+ * trie win over those of any trie with a lower `level`: the tries of deeper
+ * directories have higher levels. Tries are shared by the walk states of the
+ * directories below them, counted in `refs`.
+ */
+struct ignore_trie {
+	struct ignore_node *nodes;
+	size_t count;
+	size_t capacity;
+	uint32_t level;
+	atomic_int refs;
+};
+
+/* Node reached in an ignore trie by the path of a directory */
+struct ignore_cursor {
+	struct ignore_trie *trie;
+	uint32_t node;
+};
+
+/*
+ * Ignore rules in effect in a directory at `depth`: the nodes reached by its
+ * path in every trie that applies to it, including the `**` below them.
+ */
+struct ignore_state {
+	struct ignore_cursor *cursors;
+	size_t count;
+	size_t capacity;
+	uint32_t depth;
+};
+
+enum metadata_kind {
+	METADATA_TYPE,
+	METADATA_SIZE,
+	METADATA_MTIME,
+	METADATA_NEWER,
+};
+
+/*
+ * -type, -size, -mtime or -newer, matched against the metadata of the entity.
+ * `mask` holds the statx fields it needs. The file type, the size in `unit`
+ * bytes or the age in days of the entity is compared with `value` by
+ * `comparison`: '+' for greater, '-' for less and '=' for equal; -newer
+ * compares the modification time with `reference`.
+ */
+struct metadata_predicate {
+	enum metadata_kind kind;
+	unsigned int mask;
+	char comparison;
+	int64_t value;
+	int64_t unit;
+	struct statx_timestamp reference;
+};
+
+/*
+ * Phrases searched in the entity names. A single phrase is searched with the
+ * SIMD `matcher`, several with the `automaton`. The `metadata` predicates are
+ * only checked for the entities whose name matches, with a single statx call
+ * for the fields in `metadata_mask`; ages are counted from `now`. The entities
+ * matching the `exclude_rules` (compiled into `excludes`) or, if
+ * `has_ignore_files` is set, the rules of the ignore files are skipped along
+ * with everything inside them.
+ */
+struct search {
+	char **patterns;
+	size_t patterns_count;
+	size_t patterns_capacity;
+	struct matcher matcher;
+	struct automaton automaton;
+	struct pattern_predicate name;
+	struct pattern_predicate path;
+	struct metadata_predicate *metadata;
+	size_t metadata_count;
+	size_t metadata_capacity;
+	unsigned int metadata_mask;
+	int64_t now;
+	const char **exclude_rules;
+	size_t exclude_rules_count;
+	size_t exclude_rules_capacity;
+	struct ignore_trie *excludes;
+	bool has_ignore_files;
+};
+
+/*
+ * Space used by a walker to collect the phrases found in a name: `stamps`
+ * marks the phrases already found in the current one, and `tags` lists them
+ * to print after its path when there are several phrases.
+ */
+struct match_scratch {
+	uint32_t *stamps;
+	uint32_t stamp;
+	int32_t *matched;
+	size_t matched_count;
+	char *tags;
+	char fullpath[PATH_MAX];
+};
+
+/* Path of the entity being visited, of any length */
+struct walk_path {
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+/*
+ * Directory on the stack of the walk, whose path is the first `path_len`
+ * bytes of the walk path. While open, its records are read with `reader`;
+ * once closed to stay within the budget of open directories, it is reopened
+ * and checked to be the same `dev` and `ino`, and read again from `offset`:
+ * the position after the last entity taken from it.
+ */
+struct walk_frame {
+	struct dir_reader reader;
+	struct ignore_state ignore;
+	size_t path_len;
+	off_t offset;
+	dev_t dev;
+	ino_t ino;
+	bool is_open;
+};
+
+/*
+ * Stack of the directories being walked, from the working directory to the
+ * current one. Only the deepest `open_count` of them are open, at most
+ * `budget`, each with the buffer of its depth modulo `budget` in `buffers`.
+ */
+struct walk_stack {
+	struct walk_frame *frames;
+	size_t count;
+	size_t capacity;
+	size_t open_count;
+	size_t budget;
+	struct walk_path path;
+	struct dir_buffers buffers;
+};
+
+struct find_options {
+	int case_sensitivity_code;
+	int jobs;
+	bool sorted;
+	const char *build_index_path;
+	const char *index_path;
+	bool watch;
+	const char *contains;
+};
+
+/*
+ * Header of an index written by --build-index, at the start of the file. It is
+ * followed by the absolute path of the indexed directory and then by these
+ * sections, all offsets counting from the start of the file:
+ * - entries: the path of every entity relative to the indexed directory,
+ *   sorted by directory and then by name and front coded in blocks of
+ *   `block_size`, followed by a flags byte and, for a directory, its
+ *   modification time.
+ * - blocks: the offset of every block from the start of the entries.
+ * - postings: the ids (positions) of the entities whose name contains each
+ *   trigram, letter case folded, delta encoded.
+ * - trigrams: the sorted table of trigrams, locating their postings.
+ * Varints are LEB128 and the rest is stored in the native byte order.
+ */
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t entries_count;
+	uint64_t blocks_count;
+	uint64_t root_offset;
+	uint64_t entries_offset;
+	uint64_t blocks_offset;
+	uint64_t postings_offset;
+	uint64_t trigrams_count;
+	uint64_t trigrams_offset;
+	int64_t root_mtime_sec;
+	int64_t root_mtime_nsec;
+	uint64_t size;
+};
+
+/* Trigram of the index: `count` postings at `offset` from the postings */
+struct index_trigram {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t offset;
+};
+
+/* Index mapped into memory, with its sections located */
+struct index {
+	const uint8_t *data;
+	size_t size;
+	const struct index_header *header;
+	const char *root;
+	const uint64_t *blocks;
+	const struct index_trigram *trigrams;
+};
+
+/*
+ * Position while decoding the entities of an index: `path` holds the last
+ * entity decoded, whose name starts at `name_offset`, and `id` is the id of
+ * the next one, found at `next`.
+ */
+struct index_cursor {
+	const struct index *index;
+	uint64_t id;
+	const uint8_t *next;
+	char path[PATH_MAX];
+	size_t path_len;
+	size_t dir_len;
+	size_t name_offset;
+	bool is_dir;
+	struct timespec mtime;
+	bool is_corrupt;
+};
+
+/*
+ * Entity found while building an index: its path relative to the indexed
+ * directory, with `dir_len` bytes of directory and its name at `name_offset`.
+ */
+struct index_entry {
+	char *path;
+	size_t dir_len;
+	size_t name_offset;
+	bool is_dir;
+	struct timespec mtime;
+};
+
+/* Entities gathered for a new index, and the previous index if reusable */
+struct index_builder {
+	struct index_entry *entries;
+	size_t count;
+	size_t capacity;
+	const struct index *old;
+	struct dir_buffers buffers;
+	size_t failures;
+};
+
+/* Index file being written, `offset` bytes so far */
+struct index_writer {
+	FILE *file;
+	uint64_t offset;
+	bool has_failed;
+};
+
+/*
+ * Entity of the tree kept by --watch. Its path is found following `parent` up
+ * to the root node. Nodes are only appended, so a parent always has a lower id
+ * than its children; a removed node stays, unreachable, until compaction.
+ */
+struct watch_node {
+	char *name;
+	uint32_t parent;
+	ino_t ino;
+	bool is_dir;
+	bool is_removed;
+	/* inotify watch descriptor of a directory, or -1 */
+	int wd;
+	/* fanotify key of a directory: its file system id and file handle */
+	unsigned char *handle;
+	size_t handle_len;
+};
+
+/* Open addressing table of node ids, with `used` of its `size` slots taken */
+struct watch_table {
+	uint32_t *slots;
+	size_t size;
+	size_t used;
+};
+
+/* Ids of the nodes whose name contains `trigram`, in ascending order */
+struct watch_posting {
+	uint32_t trigram;
+	uint32_t *ids;
+	size_t count;
+	size_t capacity;
+};
+
+/* Open addressing table of the posting lists, keyed by trigram */
+struct watch_postings {
+	struct watch_posting *slots;
+	size_t size;
+	size_t used;
+};
+
+/*
+ * In-memory index of the tree watched by --watch: the nodes, the `names`
+ * table finding a node by parent and name, the posting lists of the trigrams
+ * of the names and the `dirs` table finding a directory by the key its events
+ * come with.
+ */
+struct watch_index {
+	struct watch_node *nodes;
+	size_t count;
+	size_t capacity;
+	size_t removed_count;
+	struct watch_table names;
+	struct watch_table dirs;
+	struct watch_postings postings;
+	/* File systems marked for fanotify */
+	uint64_t *marked_fsids;
+	size_t marked_count;
+	struct file_handle *handle_buffer;
+	struct dir_buffers buffers;
+	int root_fd;
+	int events_fd;
+	bool use_fanotify;
+};
+
+/* Hash of the key of the node `id` in a watch table */
+typedef uint64_t (*watch_hash_fn)(const struct watch_index *index,
+                                  uint32_t id);
+
+/*
+ * Entity found in a directory, kept when printing sorted: its name, whether it
+ * matched and, for a directory, what was found inside it.
+ */
+struct result_entry {
+	char *name;
+	bool is_match;
+	char *tags;
+	struct result_dir *dir;
+};
+
+/* Entities of a directory to print sorted, filled by a single worker */
+struct result_dir {
+	struct result_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+/*
+ * Open directory shared by the jobs of its subdirectories, which are opened
+ * relative to it. It is closed when the last of them releases it.
+ */
+struct dir_ref {
+	int fd;
+	atomic_int refs;
+};
+
+/*
+ * Directory left to read: `name` inside `parent`, or the working directory
+ * when `parent` is `NULL`, found at `path`. In sorted mode `result` receives
+ * its entities.
+ */
+struct walk_job {
+	struct dir_ref *parent;
+	char *name;
+	char *path;
+	struct result_dir *result;
+	struct ignore_state ignore;
+};
+
+/* Double-ended queue of jobs, taken by its owner from the tail */
+struct job_deque {
+	pthread_mutex_t lock;
+	struct walk_job *jobs;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+/* Lines printed by a worker, written to stdout a whole buffer at a time */
+struct output_buffer {
+	char data[OUTPUT_BUFFER_SIZE];
+	size_t len;
+};
+
+struct walk_pool;
+
+struct walker {
+	int id;
+	pthread_t thread;
+	struct walk_pool *pool;
+	char *dir_buffer;
+	struct match_scratch scratch;
+	struct output_buffer output;
+};
+
+/*
+ * Work-stealing pool walking the tree: every walker has its own deque and,
+ * once it runs dry, steals the oldest jobs of the others. `pending_jobs` counts
+ * the directories queued or being read, so the walk is over when it drops to
+ * zero; idle walkers sleep on `idle_cond` meanwhile.
+ */
+struct walk_pool {
+	const struct find_options *options;
+	const struct search *search;
+	struct walker *walkers;
+	struct job_deque *deques;
+	int walkers_count;
+	atomic_int queued_jobs;
+	atomic_int pending_jobs;
+	atomic_int failures;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+};
+
+/* Regular file found by the walk, already open, waiting to be searched */
+struct content_job {
+	int fd;
+	char *path;
+};
+
+/*
+ * Threads searching `matcher` in the contents of the files found by the walk.
+ * The walk queues the files in the ring `jobs`, waiting on `not_full` while
+ * `open_files_max` files are open, either queued or being searched, and the
+ * threads take them waiting on `not_empty` until the walk closes the queue.
+ */
+struct content_pool {
+	struct matcher matcher;
+	struct content_job jobs[CONTENT_QUEUE_CAPACITY];
+	size_t head;
+	size_t count;
+	size_t open_files;
+	size_t open_files_max;
+	bool is_closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_mutex_t output_lock;
+	pthread_t *threads;
+	int threads_count;
+	atomic_int failures;
+};
+
+/*
+ * Add a copy of `pattern` to the phrases of `search`. If it cannot be added,
+ * the program exits.
+ */
+void
+add_pattern(struct search *search, const char *pattern)
+{
+	if (search->patterns_count == search->patterns_capacity) {
+		size_t capacity = search->patterns_capacity == 0
+		                          ? PATTERNS_INITIAL_CAPACITY
+		                          : search->patterns_capacity * 2;
+		char **patterns =
+		        realloc(search->patterns, capacity * sizeof(char *));
+		if (patterns == NULL) {
+			perror("Error: could not grow the phrases");
+			exit(EXIT_FAILURE);
+		}
+		search->patterns = patterns;
+		search->patterns_capacity = capacity;
+	}
+
+	char *copy = strndup(pattern, PATH_MAX - 1);
+	if (copy == NULL) {
+		perror("Error: could not allocate phrase");
+		exit(EXIT_FAILURE);
+	}
+	search->patterns[search->patterns_count++] = copy;
+}
+
+/*
+ * Add the .gitignore-style `rule` to the --exclude rules of `search`, to be
+ * compiled with the rest of it. If it cannot be added, the program exits.
+ */
+void
+add_exclude_rule(struct search *search, const char *rule)
+{
+	if (search->exclude_rules_count == search->exclude_rules_capacity) {
+		size_t capacity = search->exclude_rules_capacity == 0
+		                          ? PATTERNS_INITIAL_CAPACITY
+		                          : search->exclude_rules_capacity * 2;
+		const char **rules = realloc(search->exclude_rules,
+		                             capacity * sizeof(char *));
+		if (rules == NULL) {
+			perror("Error: could not grow the exclude rules");
+			exit(EXIT_FAILURE);
+		}
+		search->exclude_rules = rules;
+		search->exclude_rules_capacity = capacity;
+	}
+	search->exclude_rules[search->exclude_rules_count++] = rule;
+}
+
+/*
+ * Add to `search` the phrases of the file `filepath`, one per line, skipping
+ * the empty lines. If the file cannot be read, the program exits.
+ */
+void
+read_patterns_file(struct search *search, const char *filepath)
+{
+	FILE *file = fopen(filepath, "r");
+	if (file == NULL) {
+		fprintf(stderr,
+		        "Error: could not open phrases file '%s': %s\n",
+		        filepath,
+		        strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len = 0;
+	while ((len = getline(&line, &capacity, file)) != GENERIC_ERROR_CODE) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[--len] = STRING_NULL_TERMINATOR;
+		}
+		if (len > 0) {
+			add_pattern(search, line);
+		}
+	}
+
+	bool has_failed = ferror(file);
+	free(line);
+	fclose(file);
+	if (has_failed) {
+		fprintf(stderr,
+		        "Error: could not read phrases file '%s'\n",
+		        filepath);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Parse the `number` of the metadata predicate `flag`, optionally preceded by
+ * the '+' or '-' `comparison`, into `value`, leaving `end` after its digits.
+ * If it is not a valid number, the program exits.
+ */
+void
+parse_metadata_number(const char *flag,
+                      const char *number,
+                      char *comparison,
+                      int64_t *value,
+                      const char **end)
+{
+	*comparison = '=';
+	const char *digits = number;
+	if (*digits == '+' || *digits == '-') {
+		*comparison = *digits++;
+	}
+
+	char *digits_end = NULL;
+	errno = 0;
+	long long parsed = strtoll(digits, &digits_end, 10);
+	if (!isdigit((unsigned char) *digits) || errno == ERANGE) {
+		fprintf(stderr,
+		        "Error: invalid number '%s' for %s\n",
+		        number,
+		        flag);
+		exit(EXIT_FAILURE);
+	}
+	*value = parsed;
+	*end = digits_end;
+}
+
+/*
+ * Get the size in bytes of the -size unit `suffix`, 512 byte blocks when it
+ * is empty.
+ * Returns the size of the unit, or 0 if `suffix` is not a unit.
+ */
+int64_t
+get_size_unit(const char *suffix)
+{
+	if (*suffix == STRING_NULL_TERMINATOR) {
+		return 512;
+	}
+	if (suffix[1] != STRING_NULL_TERMINATOR) {
+		return 0;
+	}
+
+	switch (*suffix) {
+	case 'c':
+		return 1;
+	case 'w':
+		return 2;
+	case 'b':
+		return 512;
+	case 'k':
+		return 1024;
+	case 'M':
+		return 1024 * 1024;
+	case 'G':
+		return 1024 * 1024 * 1024;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Get the file type bits of the -type letter `type`.
+ * Returns the type bits, or 0 if `type` is not a type letter.
+ */
+int64_t
+get_type_bits(const char *type)
+{
+	if (type[0] == STRING_NULL_TERMINATOR ||
+	    type[1] != STRING_NULL_TERMINATOR) {
+		return 0;
+	}
+
+	switch (type[0]) {
+	case 'f':
+		return S_IFREG;
+	case 'd':
+		return S_IFDIR;
+	case 'l':
+		return S_IFLNK;
+	case 'b':
+		return S_IFBLK;
+	case 'c':
+		return S_IFCHR;
+	case 'p':
+		return S_IFIFO;
+	case 's':
+		return S_IFSOCK;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Add to `search` the metadata predicate `flag`, which is one of -type, -size,
+ * -mtime or -newer, with its `argument`, and the statx fields it needs to its
+ * mask. If the argument is invalid, the program exits.
+ */
+void
+add_metadata_predicate(struct search *search,
+                       const char *flag,
+                       const char *argument)
+{
+	if (search->metadata_count == search->metadata_capacity) {
+		size_t capacity = search->metadata_capacity == 0
+		                          ? METADATA_INITIAL_CAPACITY
+		                          : search->metadata_capacity * 2;
+		struct metadata_predicate *metadata =
+		        realloc(search->metadata,
+		                capacity * sizeof(struct metadata_predicate));
+		if (metadata == NULL) {
+			perror("Error: could not grow the metadata predicates");
+			exit(EXIT_FAILURE);
+		}
+		search->metadata = metadata;
+		search->metadata_capacity = capacity;
+	}
+
+	struct metadata_predicate predicate = { .comparison = '=' };
+	const char *end = argument;
+	if (strcmp(flag, TYPE_PREDICATE) == 0) {
+		predicate.kind = METADATA_TYPE;
+		predicate.mask = STATX_TYPE;
+		predicate.value = get_type_bits(argument);
+		if (predicate.value == 0) {
+			fprintf(stderr,
+			        "Error: invalid type '%s' for -type\n",
+			        argument);
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(flag, SIZE_PREDICATE) == 0) {
+		predicate.kind = METADATA_SIZE;
+		predicate.mask = STATX_SIZE;
+		parse_metadata_number(flag,
+		                      argument,
+		                      &predicate.comparison,
+		                      &predicate.value,
+		                      &end);
+		predicate.unit = get_size_unit(end);
+		if (predicate.unit == 0) {
+			fprintf(stderr,
+			        "Error: invalid unit '%s' for -size\n",
+			        end);
+			exit(EXIT_FAILURE);
+		}
+	} else if (strcmp(flag, MTIME_PREDICATE) == 0) {
+		predicate.kind = METADATA_MTIME;
+		predicate.mask = STATX_MTIME;
+		parse_metadata_number(flag,
+		                      argument,
+		                      &predicate.comparison,
+		                      &predicate.value,
+		                      &end);
+		if (*end != STRING_NULL_TERMINATOR) {
+			fprintf(stderr,
+			        "Error: invalid number '%s' for -mtime\n",
+			        argument);
+			exit(EXIT_FAILURE);
+		}
+		search->now = time(NULL);
+	} else {
+		predicate.kind = METADATA_NEWER;
+		predicate.mask = STATX_MTIME;
+		struct statx info;
+		if (statx(AT_FDCWD,
+		          argument,
+		          AT_SYMLINK_NOFOLLOW,
+		          STATX_MTIME,
+		          &info) == GENERIC_ERROR_CODE) {
+			fprintf(stderr,
+			        "Error: could not read the modification time "
+			        "of '%s': %s\n",
+			        argument,
+			        strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		predicate.reference = info.stx_mtime;
+	}
+
+	search->metadata[search->metadata_count++] = predicate;
+	search->metadata_mask |= predicate.mask;
+}
+
+/*
+ * Check if `flag` is one of the metadata predicates -type, -size, -mtime or
+ * -newer.
+ * Returns `true` if it is, `false` otherwise.
+ */
+bool
+is_metadata_predicate(const char *flag)
+{
+	return strcmp(flag, TYPE_PREDICATE) == 0 ||
+	       strcmp(flag, SIZE_PREDICATE) == 0 ||
+	       strcmp(flag, MTIME_PREDICATE) == 0 ||
+	       strcmp(flag, NEWER_PREDICATE) == 0;
+}
+
+/*
+ * Take the find-like predicates (`-name GLOB`, `-regex RE` and the metadata
+ * ones), which start with a single dash, out of argv into `search`, shifting
+ * the other arguments so `getopt` parses them. The metadata predicates may be
+ * repeated, all of them must match. If -name or -regex is repeated or a
+ * predicate has no value, the program exits.
+ */
+void
+extract_predicates(struct search *search, int *argc, char *argv[])
+{
+	int kept = 1;
+	bool is_end_of_options = false;
+
+	for (int i = 1; i < *argc; i++) {
+		struct pattern_predicate *predicate = NULL;
+		if (is_end_of_options) {
+			predicate = NULL;
+		} else if (strcmp(argv[i], NAME_PREDICATE) == 0) {
+			predicate = &search->name;
+			predicate->is_glob = true;
+		} else if (strcmp(argv[i], REGEX_PREDICATE) == 0) {
+			predicate = &search->path;
+			predicate->is_glob = false;
+		} else if (strcmp(argv[i], END_OF_OPTIONS) == 0) {
+			is_end_of_options = true;
+		} else if (is_metadata_predicate(argv[i])) {
+			if (i + 1 == *argc) {
+				fprintf(stderr,
+				        "Error: %s expects a value\n",
+				        argv[i]);
+				exit(EXIT_FAILURE);
+			}
+			add_metadata_predicate(search, argv[i], argv[i + 1]);
+			i++;
+			continue;
+		}
+
+		if (predicate == NULL) {
+			argv[kept++] = argv[i];
+			continue;
+		}
+		if (predicate->source != NULL || i + 1 == *argc) {
+			fprintf(stderr,
+			        "Error: %s expects a single value\n",
+			        argv[i]);
+			exit(EXIT_FAILURE);
+		}
+		predicate->source = argv[++i];
+	}
+
+	argv[kept] = NULL;
+	*argc = kept;
+}
+
+/*
+ * Parse the argv to extract the phrases to be used to find inside entity names
+ * into `search`, given as parameters or read from a file, along with its -name
+ * and -regex, and the `options`:
+ * the case sensitivity based on the presence of the case insensitivity flag,
+ * the number of jobs, the sorted output and the text searched in the contents
+ * of the files. The text and the ignore rules make the phrases optional. If
+ * the arguments are invalid (e.g. zero size string) the program exits.
+ */
+void
+parse_arguments(struct search *search,
+                struct find_options *options,
+                int argc,
+                char *argv[])
+{
+	const char *patterns_filepath = NULL;
+	extract_predicates(search, &argc, argv);
+
+	bool has_predicates = search->name.source != NULL ||
+	                      search->path.source != NULL ||
+	                      search->metadata_count > 0;
+	int opt = 0;
+	while ((opt = getopt_long(argc, argv, "ij:f:", LONG_OPTIONS, NULL)) !=
+	       -1) {
+		switch (opt) {
+		case 'i':
+			options->case_sensitivity_code =
+			        CASE_SENSITIVITY_NONE_CODE;
+			break;
+		case 'j':
+			options->jobs = atoi(optarg);
+			if (options->jobs <= 0) {
+				fprintf(stderr,
+				        "Error: invalid number of jobs '%s'\n",
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'f':
+			patterns_filepath = optarg;
+			break;
+		case OPTION_SORTED:
+			options->sorted = true;
+			break;
+		case OPTION_BUILD_INDEX:
+			options->build_index_path = optarg;
+			break;
+		case OPTION_INDEX:
+			options->index_path = optarg;
+			break;
+		case OPTION_WATCH:
+			options->watch = true;
+			break;
+		case OPTION_CONTAINS:
+			if (strlen(optarg) == 0 || strlen(optarg) >= PATH_MAX) {
+				fprintf(stderr,
+				        "Error: --contains expects a non-empty "
+				        "text shorter than %d bytes\n",
+				        PATH_MAX);
+				exit(EXIT_FAILURE);
+			}
+			options->contains = optarg;
+			has_predicates = true;
+			break;
+		case OPTION_EXCLUDE:
+			add_exclude_rule(search, optarg);
+			has_predicates = true;
+			break;
+		case OPTION_IGNORE:
+			search->has_ignore_files = true;
+			has_predicates = true;
+			break;
+		default:
+			fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (options->build_index_path != NULL || options->watch) {
+		if (optind < argc || patterns_filepath != NULL ||
+		    has_predicates || options->index_path != NULL ||
+		    options->jobs > 0 || options->sorted ||
+		    options->contains != NULL ||
+		    (options->build_index_path != NULL && options->watch)) {
+			fprintf(stderr,
+			        "Error: %s takes no other arguments\n",
+			        options->watch ? "--watch" : "--build-index");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+	if (options->index_path != NULL &&
+	    (options->jobs > 0 || options->sorted)) {
+		fprintf(stderr,
+		        "Error: --index cannot be used with -j or --sorted\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->index_path != NULL && search->metadata_count > 0) {
+		fprintf(stderr,
+		        "Error: --index cannot be used with -type, -size, "
+		        "-mtime or -newer\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->index_path != NULL &&
+	    (search->exclude_rules_count > 0 || search->has_ignore_files)) {
+		fprintf(stderr,
+		        "Error: --index cannot be used with --exclude or "
+		        "--ignore\n");
+		exit(EXIT_FAILURE);
+	}
+	if (options->contains != NULL &&
+	    (options->index_path != NULL || options->sorted)) {
+		fprintf(stderr,
+		        "Error: --contains cannot be used with --index or "
+		        "--sorted\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (patterns_filepath == NULL && !has_predicates &&
+	    argc - optind < MIN_INPUT_PARAMS) {
+		fprintf(stderr,
+		        "Error while calling program, non recognized parameter "
+		        "found. ");
+		fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (strlen(argv[i]) == 0) {
+			fprintf(stderr,
+			        "Error while calling program, no phrase "
+			        "found. ");
+			fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		add_pattern(search, argv[i]);
+	}
+
+	if (patterns_filepath != NULL) {
+		read_patterns_file(search, patterns_filepath);
+	}
+
+	if (search->patterns_count == 0 && !has_predicates) {
+		fprintf(stderr,
+		        "Error while calling program, no phrase found. ");
+		fprintf(stderr, USAGE_FMT, argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Close the directory `directory_fd`. If the closing fails, the current
+ * process exits.
+ */
+void
+close_directory(int directory_fd)
+{
+	int res = close(directory_fd);
+
+	if (res == GENERIC_ERROR_CODE) {
+		perror("Error while closing directory");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Get the next record of the directory of `reader` into `entity`, parsed in
+ * place from its buffer, which is refilled with a single getdents64 call once
+ * all its records were taken. `entity` is nulled at the end of the directory.
+ * Returns `SUCCESS` if the directory could be read, otherwise returns `FAILED`
+ * with `entity` nulled.
+ */
+int
+next_dir_entity(struct dir_reader *reader, struct linux_dirent64 **entity)
+{
+	*entity = NULL;
+	if (reader->pos >= reader->len) {
+		long res = syscall(SYS_getdents64,
+		                   reader->fd,
+		                   reader->buffer,
+		                   DIR_BUFFER_SIZE);
+		if (res == GENERIC_ERROR_CODE) {
+			return FAILED;
+		}
+		reader->len = res;
+		reader->pos = 0;
+		if (res == 0) {
+			return SUCCESS;
+		}
+	}
+
+	*entity = (struct linux_dirent64 *) (reader->buffer + reader->pos);
+	reader->pos += (*entity)->d_reclen;
+	return SUCCESS;
+}
+
+/*
+ * Read an entity from the directory of `reader` into the struct `entity`.
+ * If the read fails, `entity` is nulled and the current process exits.
+ */
+void
+read_entity_from_directory(struct dir_reader *reader,
+                           struct linux_dirent64 **entity)
+{
+	if (next_dir_entity(reader, entity) == FAILED) {
+		perror("Error while reading from directory");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Check if `entity`, found in the directory `directory_fd`, is a directory.
+ * Its type comes with the record except on file systems that do not fill it
+ * in, where it is looked up with fstatat.
+ * Returns `true` if `entity` is a directory, `false` otherwise.
+ */
+bool
+is_directory_entity(int directory_fd, struct linux_dirent64 *entity)
+{
+	if (entity->d_type != DT_UNKNOWN) {
+		return entity->d_type == DT_DIR;
+	}
+
+	struct stat info;
+	if (fstatat(directory_fd, entity->d_name, &info, AT_SYMLINK_NOFOLLOW) ==
+	    GENERIC_ERROR_CODE) {
+		return false;
+	}
+	return S_ISDIR(info.st_mode);
+}
+
+/*
+ * Check if `entity`, found in the directory `directory_fd`, is a regular file,
+ * looking it up with fstatat only when its record comes without a type.
+ * Returns `true` if `entity` is a regular file, `false` otherwise.
+ */
+bool
+is_regular_file_entity(int directory_fd, struct linux_dirent64 *entity)
+{
+	if (entity->d_type != DT_UNKNOWN) {
+		return entity->d_type == DT_REG;
+	}
+
+	struct stat info;
+	if (fstatat(directory_fd, entity->d_name, &info, AT_SYMLINK_NOFOLLOW) ==
+	    GENERIC_ERROR_CODE) {
+		return false;
+	}
+	return S_ISREG(info.st_mode);
+}
+
+/*
+ * Get the records buffer of the recursive walk for the directories at
+ * `depth`, allocating it the first time the depth is reached. If the buffer
+ * cannot be allocated, the current process exits.
+ */
+char *
+get_dir_buffer(struct dir_buffers *buffers, size_t depth)
+{
+	if (depth >= buffers->count) {
+		size_t count = buffers->count == 0
+		                       ? DIR_BUFFERS_INITIAL_CAPACITY
+		                       : buffers->count * 2;
+		char **grown =
+		        realloc(buffers->buffers, count * sizeof(char *));
+		if (grown == NULL) {
+			perror("Error: could not grow the directory buffers");
+			exit(EXIT_FAILURE);
+		}
+		memset(grown + buffers->count,
+		       0,
+		       (count - buffers->count) * sizeof(char *));
+		buffers->buffers = grown;
+		buffers->count = count;
+	}
+
+	if (buffers->buffers[depth] == NULL) {
+		buffers->buffers[depth] = malloc(DIR_BUFFER_SIZE);
+		if (buffers->buffers[depth] == NULL) {
+			perror("Error: could not allocate a directory buffer");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return buffers->buffers[depth];
+}
+
+/*
+ * Release every records buffer of the recursive walk.
+ */
+void
+free_dir_buffers(struct dir_buffers *buffers)
+{
+	for (size_t i = 0; i < buffers->count; i++) {
+		free(buffers->buffers[i]);
+	}
+	free(buffers->buffers);
+}
+
+/*
+ * Lowercase `c` if it is an ASCII uppercase letter, as the letter case is
+ * folded in the "C" locale.
+ */
+char
+fold_case(char c)
+{
+	return c >= 'A' && c <= 'Z' ? (char) (c | 0x20) : c;
+}
+
+/*
+ * Check if the `len` bytes of `string` are the same as the ones of `needle`,
+ * folding the letter case of `string` when `ignore_case` is set (`needle` is
+ * already folded).
+ * Returns `true` if they are the same, `false` otherwise.
+ */
+bool
+is_same_text(const char *string,
+             const char *needle,
+             size_t len,
+             bool ignore_case)
+{
+	if (!ignore_case) {
+		return memcmp(string, needle, len) == 0;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		if (fold_case(string[i]) != needle[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Check if the candidate occurrence of the phrase of `matcher` at `string`,
+ * whose first and last bytes are known to match, matches the bytes between
+ * them too.
+ * Returns `true` if it does, `false` otherwise.
+ */
+bool
+is_candidate_match(const struct matcher *matcher, const char *string)
+{
+	if (matcher->len <= 2) {
+		return true;
+	}
+	return is_same_text(string + 1,
+	                    matcher->needle + 1,
+	                    matcher->len - 2,
+	                    matcher->ignore_case);
+}
+
+/*
+ * Find the phrase of `matcher` in the `len` bytes of `string`, checking the
+ * candidate positions from `start` one by one.
+ * Returns a pointer to the occurrence, or `NULL` if it is not found.
+ */
+const char *
+find_scalar_from(const struct matcher *matcher,
+                 const char *string,
+                 size_t len,
+                 size_t start)
+{
+	size_t n = matcher->len;
+	char first = matcher->needle[0];
+	char last = matcher->needle[n - 1];
+
+	for (size_t i = start; i + n <= len; i++) {
+		char head = string[i];
+		char tail = string[i + n - 1];
+		if (matcher->ignore_case) {
+			head = fold_case(head);
+			tail = fold_case(tail);
+		}
+		if (head == first && tail == last &&
+		    is_candidate_match(matcher, string + i)) {
+			return string + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Portable search, used when no SIMD extension is available.
+ * Returns a pointer to the occurrence, or `NULL` if it is not found.
+ */
+const char *
+find_scalar(const struct matcher *matcher, const char *string, size_t len)
+{
+	return find_scalar_from(matcher, string, len, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Check if `width` bytes can be loaded from `address` without leaving its
+ * page, so reading past the end of a string never faults.
+ */
+bool
+is_load_in_page(const char *address, uintptr_t width)
+{
+	return ((uintptr_t) address & (PAGE_SIZE_MIN - 1)) <=
+	       PAGE_SIZE_MIN - width;
+}
+
+/*
+ * Lowercase the ASCII uppercase letters of `block`.
+ */
+__attribute__((target("sse2"))) __m128i
+fold_case_sse2(__m128i block)
+{
+	/* Move 'A'..'Z' to the lowest signed bytes to check the range once */
+	__m128i shifted =
+	        _mm_sub_epi8(block, _mm_set1_epi8((char) ('A' + 128)));
+	__m128i is_upper =
+	        _mm_cmplt_epi8(shifted, _mm_set1_epi8((char) (-128 + 26)));
+	return _mm_or_si128(block,
+	                    _mm_and_si128(is_upper, _mm_set1_epi8(0x20)));
+}
+
+/*
+ * Search with SSE2 (Muła's first-and-last-byte filter): for 16 candidate
+ * positions at once, compare the byte at each one with the first byte of the
+ * phrase and the byte `len - 1` after it with the last one. Only the
+ * positions where both match are compared in full. The last, partial block is
+ * loaded past the end of `string` when that stays in the same page, and its
+ * positions out of the string are masked off.
+ * Returns a pointer to the occurrence, or `NULL` if it is not found.
+ */
+__attribute__((target("sse2"))) const char *
+find_sse2(const struct matcher *matcher, const char *string, size_t len)
+{
+	const uintptr_t width = sizeof(__m128i);
+	size_t n = matcher->len;
+	if (n > len) {
+		return NULL;
+	}
+
+	__m128i first = _mm_set1_epi8(matcher->needle[0]);
+	__m128i last = _mm_set1_epi8(matcher->needle[n - 1]);
+	size_t candidates = len - n + 1;
+
+	for (size_t i = 0; i < candidates; i += width) {
+		uint32_t valid = 0xffff;
+		if (candidates - i < width) {
+			if (!is_load_in_page(string + i, width) ||
+			    !is_load_in_page(string + i + n - 1, width)) {
+				return find_scalar_from(
+				        matcher, string, len, i);
+			}
+			valid = (1u << (candidates - i)) - 1;
+		}
+
+		__m128i block_first =
+		        _mm_loadu_si128((const __m128i *) (string + i));
+		__m128i block_last =
+		        _mm_loadu_si128((const __m128i *) (string + i + n - 1));
+		if (matcher->ignore_case) {
+			block_first = fold_case_sse2(block_first);
+			block_last = fold_case_sse2(block_last);
+		}
+
+		uint32_t mask = _mm_movemask_epi8(
+		        _mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+		                      _mm_cmpeq_epi8(block_last, last)));
+		mask &= valid;
+		while (mask != 0) {
+			size_t pos = i + __builtin_ctz(mask);
+			if (is_candidate_match(matcher, string + pos)) {
+				return string + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Lowercase the ASCII uppercase letters of `block`.
+ */
+__attribute__((target("avx2"))) __m256i
+fold_case_avx2(__m256i block)
+{
+	__m256i shifted =
+	        _mm256_sub_epi8(block, _mm256_set1_epi8((char) ('A' + 128)));
+	__m256i is_upper = _mm256_cmpgt_epi8(
+	        _mm256_set1_epi8((char) (-128 + 26)), shifted);
+	return _mm256_or_si256(
+	        block, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20)));
+}
+
+/*
+ * Same search as `find_sse2`, with AVX2 checking 32 candidate positions at
+ * once.
+ * Returns a pointer to the occurrence, or `NULL` if it is not found.
+ */
+__attribute__((target("avx2"))) const char *
+find_avx2(const struct matcher *matcher, const char *string, size_t len)
+{
+	const uintptr_t width = sizeof(__m256i);
+	size_t n = matcher->len;
+	if (n > len) {
+		return NULL;
+	}
+
+	__m256i first = _mm256_set1_epi8(matcher->needle[0]);
+	__m256i last = _mm256_set1_epi8(matcher->needle[n - 1]);
+	size_t candidates = len - n + 1;
+
+	for (size_t i = 0; i < candidates; i += width) {
+		uint32_t valid = UINT32_MAX;
+		if (candidates - i < width) {
+			if (!is_load_in_page(string + i, width) ||
+			    !is_load_in_page(string + i + n - 1, width)) {
+				return find_scalar_from(
+				        matcher, string, len, i);
+			}
+			valid = (1u << (candidates - i)) - 1;
+		}
+
+		__m256i block_first =
+		        _mm256_loadu_si256((const __m256i *) (string + i));
+		__m256i block_last = _mm256_loadu_si256(
+		        (const __m256i *) (string + i + n - 1));
+		if (matcher->ignore_case) {
+			block_first = fold_case_avx2(block_first);
+			block_last = fold_case_avx2(block_last);
+		}
+
+		uint32_t mask = _mm256_movemask_epi8(
+		        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+		                         _mm256_cmpeq_epi8(block_last, last)));
+		mask &= valid;
+		while (mask != 0) {
+			size_t pos = i + __builtin_ctz(mask);
+			if (is_candidate_match(matcher, string + pos)) {
+				return string + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Prepare `matcher` to search `phrase`, folding its letter case when
+ * `ignore_case` is set, and pick the search for the CPU: AVX2, SSE2 or the
+ * portable one.
+ */
+void
+compile_matcher(struct matcher *matcher, const char *phrase, bool ignore_case)
+{
+	matcher->len = strnlen(phrase, PATH_MAX - 1);
+	matcher->ignore_case = ignore_case;
+	for (size_t i = 0; i < matcher->len; i++) {
+		matcher->needle[i] =
+		        ignore_case ? fold_case(phrase[i]) : phrase[i];
+	}
+	matcher->needle[matcher->len] = STRING_NULL_TERMINATOR;
+
+	matcher->find = find_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		matcher->find = find_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		matcher->find = find_sse2;
+	}
+#endif
+}
+
+/*
+ * Check if `string` contains the phrase of `matcher`.
+ * Returns `true` if the phrase is found in `string`, `false` otherwise.
+ */
+bool
+contains_phrase(const struct matcher *matcher, const char *string)
+{
+	return matcher->find(matcher, string, strlen(string)) != NULL;
+}
+
+/*
+ * Map the bytes of `patterns` to the byte classes of `automaton`, folding the
+ * letter case when `ignore_case` is set.
+ */
+void
+build_byte_classes(struct automaton *automaton,
+                   char **patterns,
+                   size_t patterns_count,
+                   bool ignore_case)
+{
+	memset(automaton->byte_classes, 0, sizeof(automaton->byte_classes));
+	automaton->classes_count = 1;
+
+	for (size_t i = 0; i < patterns_count; i++) {
+		for (const char *c = patterns[i]; *c != STRING_NULL_TERMINATOR;
+		     c++) {
+			uint8_t byte = ignore_case ? fold_case(*c) : *c;
+			if (automaton->byte_classes[byte] == 0) {
+				automaton->byte_classes[byte] =
+				        automaton->classes_count++;
+			}
+		}
+	}
+
+	if (ignore_case) {
+		for (int c = 'A'; c <= 'Z'; c++) {
+			automaton->byte_classes[c] =
+			        automaton->byte_classes[c | 0x20];
+		}
+	}
+}
+
+/*
+ * Resolve the failure links of `automaton`, whose trie is already built, in
+ * breadth first order: every missing transition of a state becomes the
+ * transition of its failure state, and every state is linked to the nearest
+ * failure state that ends phrases. `queue` and `failures` have room for every
+ * state.
+ */
+void
+resolve_failure_links(struct automaton *automaton,
+                      uint32_t *queue,
+                      uint32_t *failures)
+{
+	size_t classes_count = automaton->classes_count;
+	uint32_t *transitions = automaton->transitions;
+	size_t head = 0, tail = 0;
+
+	/* Missing transitions of the root already lead back to it (state 0) */
+	for (size_t c = 0; c < classes_count; c++) {
+		if (transitions[c] != 0) {
+			failures[transitions[c]] = 0;
+			queue[tail++] = transitions[c];
+		}
+	}
+
+	while (head < tail) {
+		uint32_t state = queue[head++];
+		uint32_t failure = failures[state];
+		automaton->output_links[state] =
+		        automaton->state_patterns[failure] != -1
+		                ? failure
+		                : automaton->output_links[failure];
+
+		uint32_t *state_row = &transitions[state * classes_count];
+		uint32_t *failure_row = &transitions[failure * classes_count];
+		for (size_t c = 0; c < classes_count; c++) {
+			uint32_t *next = &state_row[c];
+			uint32_t fallback = failure_row[c];
+			if (*next == 0) {
+				*next = fallback;
+			} else {
+				failures[*next] = fallback;
+				queue[tail++] = *next;
+			}
+		}
+	}
+}
+
+/*
+ * Compile `patterns` into `automaton`, folding their letter case when
+ * `ignore_case` is set.
+ * Returns `SUCCESS` if the automaton was built, otherwise returns `FAILED`.
+ */
+int
+compile_automaton(struct automaton *automaton,
+                  char **patterns,
+                  size_t patterns_count,
+                  bool ignore_case)
+{
+	build_byte_classes(automaton, patterns, patterns_count, ignore_case);
+	automaton->patterns_count = patterns_count;
+
+	size_t max_states = 1;
+	for (size_t i = 0; i < patterns_count; i++) {
+		max_states += strlen(patterns[i]);
+	}
+
+	size_t classes_count = automaton->classes_count;
+	automaton->transitions =
+	        calloc(max_states * classes_count, sizeof(uint32_t));
+	automaton->state_patterns = malloc(max_states * sizeof(int32_t));
+	automaton->output_links = calloc(max_states, sizeof(uint32_t));
+	automaton->next_patterns = malloc(patterns_count * sizeof(int32_t));
+	uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+	uint32_t *failures = calloc(max_states, sizeof(uint32_t));
+	if (automaton->transitions == NULL ||
+	    automaton->state_patterns == NULL ||
+	    automaton->output_links == NULL ||
+	    automaton->next_patterns == NULL || queue == NULL ||
+	    failures == NULL) {
+		perror("Error: could not allocate the phrases automaton");
+		free(queue);
+		free(failures);
+		return FAILED;
+	}
+	memset(automaton->state_patterns, -1, max_states * sizeof(int32_t));
+
+	/* Build the trie; a transition to 0 is missing, as no state leads back
+	 * to the root yet */
+	automaton->states_count = 1;
+	for (size_t i = 0; i < patterns_count; i++) {
+		uint32_t state = 0;
+		for (const char *c = patterns[i]; *c != STRING_NULL_TERMINATOR;
+		     c++) {
+			uint32_t *next = &automaton->transitions
+			                          [state * classes_count +
+			                           automaton->byte_classes
+			                                   [(uint8_t) *c]];
+			if (*next == 0) {
+				*next = automaton->states_count++;
+			}
+			state = *next;
+		}
+		automaton->next_patterns[i] = automaton->state_patterns[state];
+		automaton->state_patterns[state] = i;
+	}
+
+	resolve_failure_links(automaton, queue, failures);
+	free(queue);
+	free(failures);
+	return SUCCESS;
+}
+
+/*
+ * Release the tables of `automaton`.
+ */
+void
+free_automaton(struct automaton *automaton)
+{
+	free(automaton->transitions);
+	free(automaton->state_patterns);
+	free(automaton->output_links);
+	free(automaton->next_patterns);
+}
+
+/*
+ * Store in `scratch` the phrases ending at `state` of `automaton` or at any
+ * state that is a suffix of it, skipping the ones already found.
+ */
+void
+collect_patterns(const struct automaton *automaton,
+                 struct match_scratch *scratch,
+                 uint32_t state)
+{
+	uint32_t output = automaton->state_patterns[state] != -1
+	                          ? state
+	                          : automaton->output_links[state];
+
+	for (; output != 0; output = automaton->output_links[output]) {
+		int32_t pattern = automaton->state_patterns[output];
+		for (; pattern != -1;
+		     pattern = automaton->next_patterns[pattern]) {
+			if (scratch->stamps[pattern] == scratch->stamp) {
+				continue;
+			}
+			scratch->stamps[pattern] = scratch->stamp;
+			scratch->matched[scratch->matched_count++] = pattern;
+		}
+	}
+}
+
+/*
+ * Run `automaton` over `string`, storing in `scratch` the phrases found in it,
+ * each once, in the order they were found.
+ * Returns `true` if some phrase was found, `false` otherwise.
+ */
+bool
+run_automaton(const struct automaton *automaton,
+              struct match_scratch *scratch,
+              const char *string)
+{
+	scratch->matched_count = 0;
+	if (++scratch->stamp == 0) {
+		/* The stamps wrapped around, so forget the old ones */
+		memset(scratch->stamps,
+		       0,
+		       automaton->patterns_count * sizeof(uint32_t));
+		scratch->stamp = 1;
+	}
+
+	const uint32_t *transitions = automaton->transitions;
+	size_t classes_count = automaton->classes_count;
+	uint32_t state = 0;
+	for (const uint8_t *c = (const uint8_t *) string;
+	     *c != STRING_NULL_TERMINATOR;
+	     c++) {
+		state = transitions[state * classes_count +
+		                    automaton->byte_classes[*c]];
+		if (automaton->state_patterns[state] != -1 ||
+		    automaton->output_links[state] != 0) {
+			collect_patterns(automaton, scratch, state);
+		}
+	}
+	return scratch->matched_count > 0;
+}
+
+/*
+ * Add `byte` to the 256 bit set `bytes`.
+ */
+void
+add_byte(uint64_t bytes[4], uint8_t byte)
+{
+	bytes[byte / 64] |= (uint64_t) 1 << (byte % 64);
+}
+
+/*
+ * Check if `byte` is in the 256 bit set `bytes`.
+ * Returns `true` if it is, `false` otherwise.
+ */
+bool
+has_byte(const uint64_t bytes[4], uint8_t byte)
+{
+	return (bytes[byte / 64] >> (byte % 64)) & 1;
+}
+
+/*
+ * Add a state of `type` to the NFA of `parser`.
+ * Returns the index of the state, or -1 if it could not be allocated.
+ */
+int32_t
+add_nfa_state(struct pattern_parser *parser, enum nfa_state_type type)
+{
+	struct nfa *nfa = parser->nfa;
+	if (nfa->count == nfa->capacity) {
+		size_t capacity = nfa->capacity == 0 ? NFA_INITIAL_CAPACITY
+		                                     : nfa->capacity * 2;
+		struct nfa_state *states = realloc(
+		        nfa->states, capacity * sizeof(struct nfa_state));
+		if (states == NULL) {
+			parser->error = "out of memory";
+			return -1;
+		}
+		nfa->states = states;
+		nfa->capacity = capacity;
+	}
+
+	struct nfa_state *state = &nfa->states[nfa->count];
+	memset(state, 0, sizeof(struct nfa_state));
+	state->type = type;
+	state->out = -1;
+	state->out_alt = -1;
+	return nfa->count++;
+}
+
+/*
+ * Add to `bytes` the other case of its letters.
+ */
+void
+fold_bytes_case(uint64_t bytes[4])
+{
+	for (int c = 'a'; c <= 'z'; c++) {
+		int upper = c - 'a' + 'A';
+		if (has_byte(bytes, c) || has_byte(bytes, upper)) {
+			add_byte(bytes, c);
+			add_byte(bytes, upper);
+		}
+	}
+}
+
+/*
+ * Build the fragment consuming one byte of `bytes`, adding the other case of
+ * its letters when the letter case is ignored.
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+bytes_fragment(struct pattern_parser *parser, const uint64_t bytes[4])
+{
+	struct nfa_fragment fragment = { -1, -1 };
+	int32_t start = add_nfa_state(parser, NFA_BYTES);
+	int32_t end = add_nfa_state(parser, NFA_EMPTY);
+	if (start == -1 || end == -1) {
+		return fragment;
+	}
+
+	struct nfa_state *state = &parser->nfa->states[start];
+	memcpy(state->bytes, bytes, sizeof(state->bytes));
+	if (parser->nfa->ignore_case) {
+		fold_bytes_case(state->bytes);
+	}
+	state->out = end;
+
+	fragment.start = start;
+	fragment.end = end;
+	return fragment;
+}
+
+/*
+ * Build the fragment consuming the single byte `byte`.
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+byte_fragment(struct pattern_parser *parser, uint8_t byte)
+{
+	uint64_t bytes[4] = { 0, 0, 0, 0 };
+	add_byte(bytes, byte);
+	return bytes_fragment(parser, bytes);
+}
+
+/*
+ * Build the fragment consuming any byte.
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+any_byte_fragment(struct pattern_parser *parser)
+{
+	uint64_t bytes[4] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	return bytes_fragment(parser, bytes);
+}
+
+/*
+ * Build the fragment matching the empty string.
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+empty_fragment(struct pattern_parser *parser)
+{
+	int32_t state = add_nfa_state(parser, NFA_EMPTY);
+	struct nfa_fragment fragment = { state, state };
+	return fragment;
+}
+
+/*
+ * Build the fragment matching `first` followed by `second`.
+ */
+struct nfa_fragment
+concat_fragments(struct pattern_parser *parser,
+                 struct nfa_fragment first,
+                 struct nfa_fragment second)
+{
+	parser->nfa->states[first.end].out = second.start;
+	struct nfa_fragment fragment = { first.start, second.end };
+	return fragment;
+}
+
+/*
+ * Build the fragment matching either `first` or `second`.
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+alternate_fragments(struct pattern_parser *parser,
+                    struct nfa_fragment first,
+                    struct nfa_fragment second)
+{
+	struct nfa_fragment fragment = { -1, -1 };
+	int32_t start = add_nfa_state(parser, NFA_SPLIT);
+	int32_t end = add_nfa_state(parser, NFA_EMPTY);
+	if (start == -1 || end == -1) {
+		return fragment;
+	}
+
+	struct nfa_state *states = parser->nfa->states;
+	states[start].out = first.start;
+	states[start].out_alt = second.start;
+	states[first.end].out = end;
+	states[second.end].out = end;
+	fragment.start = start;
+	fragment.end = end;
+	return fragment;
+}
+
+/*
+ * Build the fragment matching `inner` repeated as told by `quantifier`: zero
+ * or more times ('*'), one or more ('+') or zero or one ('?').
+ * Returns the fragment, with a -1 start if it could not be built.
+ */
+struct nfa_fragment
+repeat_fragment(struct pattern_parser *parser,
+                struct nfa_fragment inner,
+                char quantifier)
+{
+	struct nfa_fragment fragment = { -1, -1 };
+	int32_t split = add_nfa_state(parser, NFA_SPLIT);
+	int32_t end = add_nfa_state(parser, NFA_EMPTY);
+	if (split == -1 || end == -1) {
+		return fragment;
+	}
+
+	struct nfa_state *states = parser->nfa->states;
+	states[split].out = inner.start;
+	states[split].out_alt = end;
+	states[inner.end].out = quantifier == '?' ? end : split;
+	fragment.start = quantifier == '+' ? inner.start : split;
+	fragment.end = end;
+	return fragment;
+}
+
+/*
+ * Parse a bracket expression (e.g. `[a-z_]`, `[^/]`) whose opening bracket was
+ * already consumed, into `bytes`. Besides '^', a glob negates it with '!'.
+ * Returns `true` if it was parsed, `false` if it is not closed.
+ */
+bool
+parse_bracket(struct pattern_parser *parser, uint64_t bytes[4], bool is_glob)
+{
+	const char *pattern = parser->pattern;
+	bool is_negated = false;
+	if (pattern[parser->pos] == '^' ||
+	    (is_glob && pattern[parser->pos] == '!')) {
+		is_negated = true;
+		parser->pos++;
+	}
+
+	memset(bytes, 0, 4 * sizeof(uint64_t));
+	bool is_first = true;
+	while (pattern[parser->pos] != ']' || is_first) {
+		if (pattern[parser->pos] == STRING_NULL_TERMINATOR) {
+			parser->error = "unmatched '['";
+			return false;
+		}
+
+		uint8_t low = pattern[parser->pos++];
+		uint8_t high = low;
+		if (pattern[parser->pos] == '-' &&
+		    pattern[parser->pos + 1] != ']' &&
+		    pattern[parser->pos + 1] != STRING_NULL_TERMINATOR) {
+			high = pattern[parser->pos + 1];
+			parser->pos += 2;
+		}
+		for (int byte = low; byte <= high; byte++) {
+			add_byte(bytes, byte);
+		}
+		is_first = false;
+	}
+	parser->pos++;
+
+	/* Fold before negating, so [^a-z] excludes 'A'..'Z' too */
+	if (parser->nfa->ignore_case) {
+		fold_bytes_case(bytes);
+	}
+	if (is_negated) {
+		for (int i = 0; i < 4; i++) {
+			bytes[i] = ~bytes[i];
+		}
+	}
+	return true;
+}
+
+struct nfa_fragment parse_regex_alternation(struct pattern_parser *parser);
+
+/*
+ * Parse a regex atom: a group, a bracket expression, '.', an escaped byte or
+ * a literal byte.
+ * Returns its fragment, with a -1 start if it could not be parsed.
+ */
+struct nfa_fragment
+parse_regex_atom(struct pattern_parser *parser)
+{
+	struct nfa_fragment failed = { -1, -1 };
+	char c = parser->pattern[parser->pos++];
+
+	switch (c) {
+	case '(': {
+		struct nfa_fragment group = parse_regex_alternation(parser);
+		if (group.start == -1) {
+			return failed;
+		}
+		if (parser->pattern[parser->pos] != ')') {
+			parser->error = "unmatched '('";
+			return failed;
+		}
+		parser->pos++;
+		return group;
+	}
+	case '[': {
+		uint64_t bytes[4];
+		if (!parse_bracket(parser, bytes, false)) {
+			return failed;
+		}
+		return bytes_fragment(parser, bytes);
+	}
+	case '.':
+		return any_byte_fragment(parser);
+	case '\\':
+		if (parser->pattern[parser->pos] == STRING_NULL_TERMINATOR) {
+			parser->error = "trailing '\\'";
+			return failed;
+		}
+		return byte_fragment(parser, parser->pattern[parser->pos++]);
+	case '*':
+	case '+':
+	case '?':
+		parser->error = "quantifier without operand";
+		return failed;
+	case '^':
+		if (parser->pos == 1) {
+			return empty_fragment(parser);
+		}
+		parser->error = "'^' is only accepted at the start";
+		return failed;
+	case '$':
+		if (parser->pattern[parser->pos] == STRING_NULL_TERMINATOR) {
+			return empty_fragment(parser);
+		}
+		parser->error = "'$' is only accepted at the end";
+		return failed;
+	case '{':
+		parser->error = "bounds are not supported";
+		return failed;
+	default:
+		return byte_fragment(parser, c);
+	}
+}
+
+/*
+ * Parse a sequence of regex atoms, each followed by any quantifiers, up to a
+ * '|', a ')' or the end of the pattern.
+ * Returns its fragment, with a -1 start if it could not be parsed.
+ */
+struct nfa_fragment
+parse_regex_sequence(struct pattern_parser *parser)
+{
+	struct nfa_fragment sequence = empty_fragment(parser);
+
+	while (sequence.start != -1) {
+		char c = parser->pattern[parser->pos];
+		if (c == STRING_NULL_TERMINATOR || c == '|' || c == ')') {
+			break;
+		}
+
+		struct nfa_fragment atom = parse_regex_atom(parser);
+		while (atom.start != -1 &&
+		       strchr("*+?", parser->pattern[parser->pos]) != NULL &&
+		       parser->pattern[parser->pos] != STRING_NULL_TERMINATOR) {
+			atom = repeat_fragment(
+			        parser, atom, parser->pattern[parser->pos++]);
+		}
+		if (atom.start == -1) {
+			sequence.start = -1;
+			break;
+		}
+		sequence = concat_fragments(parser, sequence, atom);
+	}
+	return sequence;
+}
+
+/*
+ * Parse regex sequences separated by '|'.
+ * Returns their fragment, with a -1 start if they could not be parsed.
+ */
+struct nfa_fragment
+parse_regex_alternation(struct pattern_parser *parser)
+{
+	struct nfa_fragment alternation = parse_regex_sequence(parser);
+
+	while (alternation.start != -1 && parser->pattern[parser->pos] == '|') {
+		parser->pos++;
+		struct nfa_fragment next = parse_regex_sequence(parser);
+		if (next.start == -1) {
+			alternation.start = -1;
+			break;
+		}
+		alternation = alternate_fragments(parser, alternation, next);
+	}
+	return alternation;
+}
+
+/*
+ * Parse a whole regex (a POSIX extended regex without back references nor
+ * bounds), which has to match the whole string: a leading '^' and a trailing
+ * '$' are accepted but change nothing.
+ * Returns its fragment, with a -1 start if it could not be parsed.
+ */
+struct nfa_fragment
+parse_regex(struct pattern_parser *parser)
+{
+	struct nfa_fragment regex = parse_regex_alternation(parser);
+	if (regex.start != -1 && parser->pattern[parser->pos] == ')') {
+		parser->error = "unmatched ')'";
+		regex.start = -1;
+	}
+	return regex;
+}
+
+/*
+ * Parse a whole glob: '*' matches any bytes, '?' any single byte, brackets a
+ * set of bytes and '\' escapes the next byte.
+ * Returns its fragment, with a -1 start if it could not be parsed.
+ */
+struct nfa_fragment
+parse_glob(struct pattern_parser *parser)
+{
+	struct nfa_fragment glob = empty_fragment(parser);
+
+	while (glob.start != -1 &&
+	       parser->pattern[parser->pos] != STRING_NULL_TERMINATOR) {
+		char c = parser->pattern[parser->pos++];
+		struct nfa_fragment next;
+		uint64_t bytes[4];
+
+		if (c == '*') {
+			next = any_byte_fragment(parser);
+			if (next.start != -1) {
+				next = repeat_fragment(parser, next, '*');
+			}
+		} else if (c == '?') {
+			next = any_byte_fragment(parser);
+		} else if (c == '[') {
+			next.start = -1;
+			if (parse_bracket(parser, bytes, true)) {
+				next = bytes_fragment(parser, bytes);
+			}
+		} else {
+			if (c == '\\' && parser->pattern[parser->pos] !=
+			                         STRING_NULL_TERMINATOR) {
+				c = parser->pattern[parser->pos++];
+			}
+			next = byte_fragment(parser, c);
+		}
+
+		if (next.start == -1) {
+			glob.start = -1;
+			break;
+		}
+		glob = concat_fragments(parser, glob, next);
+	}
+	return glob;
+}
+
+/*
+ * Skip the bracket expression of a glob or regex starting at `pattern[i]`.
+ * Returns the index of its closing bracket, or of the last byte of `pattern`
+ * if it is not closed.
+ */
+size_t
+skip_bracket(const char *pattern, size_t i, bool is_glob)
+{
+	i++;
+	if (pattern[i] == '^' || (is_glob && pattern[i] == '!')) {
+		i++;
+	}
+	if (pattern[i] == ']') {
+		i++;
+	}
+	while (pattern[i] != ']' && pattern[i] != STRING_NULL_TERMINATOR) {
+		i++;
+	}
+	return pattern[i] == STRING_NULL_TERMINATOR ? i - 1 : i;
+}
+
+/*
+ * Keep the `run_len` bytes of `run` in `literal` if they are longer than its
+ * `literal_len` bytes, and start a new run.
+ */
+void
+keep_longest_run(char literal[PATH_MAX],
+                 size_t *literal_len,
+                 const char *run,
+                 size_t *run_len)
+{
+	if (*run_len > *literal_len) {
+		memcpy(literal, run, *run_len);
+		*literal_len = *run_len;
+	}
+	*run_len = 0;
+}
+
+/*
+ * Find the longest run of literal bytes that every match of the glob or regex
+ * `pattern` has to contain, into `literal`. Only the top level of a regex is
+ * considered: nothing is required when it has a '|', and a byte followed by
+ * '*' or '?' may be skipped, so it is not required either.
+ * Returns the length of the literal, 0 if there is none.
+ */
+size_t
+find_required_literal(const char *pattern,
+                      bool is_glob,
+                      char literal[PATH_MAX])
+{
+	char run[PATH_MAX];
+	size_t run_len = 0, literal_len = 0;
+	int depth = 0;
+
+	for (size_t i = 0; pattern[i] != STRING_NULL_TERMINATOR; i++) {
+		char c = pattern[i];
+		bool is_literal = false;
+
+		if (c == '[') {
+			i = skip_bracket(pattern, i, is_glob);
+		} else if (c == '\\' &&
+		           pattern[i + 1] != STRING_NULL_TERMINATOR) {
+			c = pattern[++i];
+			is_literal = depth == 0;
+		} else if (is_glob) {
+			is_literal = c != '*' && c != '?';
+		} else if (c == '(') {
+			depth++;
+		} else if (c == ')') {
+			depth--;
+		} else if (c == '|' && depth == 0) {
+			literal[0] = STRING_NULL_TERMINATOR;
+			return 0;
+		} else {
+			is_literal = depth == 0 && strchr(".*+?^$", c) == NULL;
+		}
+
+		char next = pattern[i + 1];
+		bool is_optional = !is_glob && (next == '*' || next == '?');
+		if (is_literal && !is_optional) {
+			run[run_len++] = c;
+		}
+		if (!is_literal || is_optional || (!is_glob && next == '+')) {
+			keep_longest_run(literal, &literal_len, run, &run_len);
+		}
+	}
+
+	keep_longest_run(literal, &literal_len, run, &run_len);
+	literal[literal_len] = STRING_NULL_TERMINATOR;
+	return literal_len;
+}
+
+/*
+ * Split the bytes into the classes of `dfa`: two bytes share a class when
+ * every byte set of `nfa` has both or neither of them.
+ */
+void
+build_dfa_byte_classes(struct dfa *dfa, const struct nfa *nfa)
+{
+	memset(dfa->byte_classes, 0, sizeof(dfa->byte_classes));
+	dfa->classes_count = 1;
+
+	for (size_t i = 0; i < nfa->count; i++) {
+		if (nfa->states[i].type != NFA_BYTES) {
+			continue;
+		}
+
+		/* Split each class by the membership of its bytes in the set */
+		int16_t inside[256], outside[256];
+		memset(inside, -1, sizeof(inside));
+		memset(outside, -1, sizeof(outside));
+		size_t classes_count = 0;
+		for (int byte = 0; byte < 256; byte++) {
+			int16_t *refined = has_byte(nfa->states[i].bytes, byte)
+			                           ? inside
+			                           : outside;
+			uint8_t class = dfa->byte_classes[byte];
+			if (refined[class] == -1) {
+				refined[class] = classes_count++;
+			}
+			dfa->byte_classes[byte] = refined[class];
+		}
+		dfa->classes_count = classes_count;
+	}
+}
+
+/*
+ * Extend the set of NFA states `set` with every state reachable from them
+ * without consuming bytes. `stack` has room for every state of `nfa`.
+ */
+void
+close_nfa_set(const struct nfa *nfa, uint64_t *set, int32_t *stack)
+{
+	size_t stack_len = 0;
+	size_t words = (nfa->count + 63) / 64;
+	for (size_t word = 0; word < words; word++) {
+		for (uint64_t bits = set[word]; bits != 0; bits &= bits - 1) {
+			stack[stack_len++] = word * 64 + __builtin_ctzll(bits);
+		}
+	}
+
+	while (stack_len > 0) {
+		const struct nfa_state *state =
+		        &nfa->states[stack[--stack_len]];
+		if (state->type != NFA_SPLIT && state->type != NFA_EMPTY) {
+			continue;
+		}
+
+		int32_t outs[2] = { state->out, state->out_alt };
+		for (int i = 0; i < 2; i++) {
+			int32_t out = outs[i];
+			if (out == -1 || (set[out / 64] >> (out % 64)) & 1) {
+				continue;
+			}
+			set[out / 64] |= (uint64_t) 1 << (out % 64);
+			stack[stack_len++] = out;
+		}
+	}
+}
+
+/*
+ * Hash the set of NFA states `set`, of `words` words.
+ */
+uint64_t
+hash_nfa_set(const uint64_t *set, size_t words)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < words; i++) {
+		hash = (hash ^ set[i]) * 1099511628211ULL;
+	}
+	return hash ^ (hash >> 29);
+}
+
+/*
+ * Subset construction in progress: the set of NFA states of every DFA state
+ * (`words` words each) and a hash table from sets to DFA states.
+ */
+struct subset_construction {
+	const struct nfa *nfa;
+	struct dfa *dfa;
+	size_t words;
+	uint64_t *sets;
+	size_t capacity;
+	uint32_t *table;
+};
+
+/*
+ * Find the DFA state of the NFA states `set`, adding it if it is new.
+ * Returns the DFA state, or `DFA_MAX_STATES` if there are too many states or
+ * they could not be allocated.
+ */
+uint32_t
+find_dfa_state(struct subset_construction *subsets, const uint64_t *set)
+{
+	struct dfa *dfa = subsets->dfa;
+	size_t words = subsets->words;
+	size_t slot = hash_nfa_set(set, words) % DFA_TABLE_SIZE;
+
+	/* Slots hold state + 1, so 0 is free */
+	while (subsets->table[slot] != 0) {
+		uint32_t state = subsets->table[slot] - 1;
+		if (memcmp(&subsets->sets[state * words],
+		           set,
+		           words * sizeof(uint64_t)) == 0) {
+			return state;
+		}
+		slot = (slot + 1) % DFA_TABLE_SIZE;
+	}
+
+	if (dfa->states_count == DFA_MAX_STATES) {
+		return DFA_MAX_STATES;
+	}
+	if (dfa->states_count == subsets->capacity) {
+		size_t capacity = subsets->capacity * 2;
+		uint64_t *sets = realloc(subsets->sets,
+		                         capacity * words * sizeof(uint64_t));
+		size_t transitions_size =
+		        capacity * dfa->classes_count * sizeof(uint32_t);
+		uint32_t *transitions =
+		        realloc(dfa->transitions, transitions_size);
+		bool *accepting =
+		        realloc(dfa->accepting, capacity * sizeof(bool));
+		subsets->sets = sets != NULL ? sets : subsets->sets;
+		dfa->transitions = transitions != NULL ? transitions
+		                                       : dfa->transitions;
+		dfa->accepting = accepting != NULL ? accepting : dfa->accepting;
+		if (sets == NULL || transitions == NULL || accepting == NULL) {
+			return DFA_MAX_STATES;
+		}
+		subsets->capacity = capacity;
+	}
+
+	uint32_t state = dfa->states_count++;
+	memcpy(&subsets->sets[state * words], set, words * sizeof(uint64_t));
+	subsets->table[slot] = state + 1;
+
+	dfa->accepting[state] = false;
+	for (size_t i = 0; i < subsets->nfa->count; i++) {
+		if (subsets->nfa->states[i].type == NFA_MATCH &&
+		    (set[i / 64] >> (i % 64)) & 1) {
+			dfa->accepting[state] = true;
+		}
+	}
+	return state;
+}
+
+/*
+ * Store in `set` the NFA states reached from the states in `from` consuming
+ * `byte`.
+ */
+void
+step_nfa_set(const struct nfa *nfa,
+             const uint64_t *from,
+             uint8_t byte,
+             uint64_t *set)
+{
+	size_t words = (nfa->count + 63) / 64;
+	memset(set, 0, words * sizeof(uint64_t));
+
+	for (size_t word = 0; word < words; word++) {
+		for (uint64_t bits = from[word]; bits != 0; bits &= bits - 1) {
+			const struct nfa_state *state =
+			        &nfa->states[word * 64 + __builtin_ctzll(bits)];
+			if (state->type == NFA_BYTES &&
+			    has_byte(state->bytes, byte)) {
+				set[state->out / 64] |= (uint64_t) 1
+				                        << (state->out % 64);
+			}
+		}
+	}
+}
+
+/*
+ * Compute the transitions of every DFA state of `subsets`, adding the states
+ * they reach until no new one appears. `class_bytes` holds a byte of each
+ * class, and `set` and `stack` have room for the NFA states.
+ * Returns `SUCCESS` if every transition was computed, otherwise returns
+ * `FAILED`.
+ */
+int
+fill_dfa_transitions(struct subset_construction *subsets,
+                     const uint8_t class_bytes[256],
+                     uint64_t *set,
+                     int32_t *stack)
+{
+	const struct nfa *nfa = subsets->nfa;
+	struct dfa *dfa = subsets->dfa;
+	size_t words = subsets->words;
+
+	for (uint32_t state = 0; state < dfa->states_count; state++) {
+		for (size_t class = 0; class < dfa->classes_count; class++) {
+			step_nfa_set(nfa,
+			             &subsets->sets[state * words],
+			             class_bytes[class],
+			             set);
+			close_nfa_set(nfa, set, stack);
+
+			uint32_t next = find_dfa_state(subsets, set);
+			if (next == DFA_MAX_STATES) {
+				return FAILED;
+			}
+			dfa->transitions[state * dfa->classes_count + class] =
+			        next;
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * Build `dfa` from `nfa`, starting at its state `start`, by subset
+ * construction: every DFA state is a set of NFA states, and its transition on
+ * each byte class goes to the set reached from them on a byte of the class.
+ * Returns `SUCCESS` if the DFA was built, otherwise returns `FAILED`.
+ */
+int
+build_dfa(struct dfa *dfa, const struct nfa *nfa, int32_t start)
+{
+	build_dfa_byte_classes(dfa, nfa);
+
+	uint8_t class_bytes[256];
+	for (int byte = 255; byte >= 0; byte--) {
+		class_bytes[dfa->byte_classes[byte]] = byte;
+	}
+
+	struct subset_construction subsets = {
+		.nfa = nfa,
+		.dfa = dfa,
+		.words = (nfa->count + 63) / 64,
+		.capacity = DFA_INITIAL_CAPACITY,
+	};
+	size_t words = subsets.words;
+	dfa->states_count = 0;
+	dfa->transitions = malloc(subsets.capacity * dfa->classes_count *
+	                          sizeof(uint32_t));
+	dfa->accepting = malloc(subsets.capacity * sizeof(bool));
+	subsets.sets = malloc(subsets.capacity * words * sizeof(uint64_t));
+	subsets.table = calloc(DFA_TABLE_SIZE, sizeof(uint32_t));
+	uint64_t *set = calloc(words, sizeof(uint64_t));
+	int32_t *stack = malloc(nfa->count * sizeof(int32_t));
+
+	int res = FAILED;
+	if (dfa->transitions != NULL && dfa->accepting != NULL &&
+	    subsets.sets != NULL && subsets.table != NULL && set != NULL &&
+	    stack != NULL) {
+		/* The empty set is the dead state */
+		find_dfa_state(&subsets, set);
+		set[start / 64] |= (uint64_t) 1 << (start % 64);
+		close_nfa_set(nfa, set, stack);
+		dfa->start = find_dfa_state(&subsets, set);
+
+		res = fill_dfa_transitions(&subsets, class_bytes, set, stack);
+	}
+
+	free(subsets.sets);
+	free(subsets.table);
+	free(set);
+	free(stack);
+	if (res == FAILED) {
+		free(dfa->transitions);
+		free(dfa->accepting);
+		dfa->transitions = NULL;
+		dfa->accepting = NULL;
+	}
+	return res;
+}
+
+/*
+ * Check if the whole `string` is matched by `dfa`, leaving as soon as the
+ * dead state is reached.
+ * Returns `true` if it is matched, `false` otherwise.
+ */
+bool
+run_dfa(const struct dfa *dfa, const char *string)
+{
+	const uint32_t *transitions = dfa->transitions;
+	size_t classes_count = dfa->classes_count;
+	uint32_t state = dfa->start;
+
+	for (const uint8_t *c = (const uint8_t *) string;
+	     *c != STRING_NULL_TERMINATOR;
+	     c++) {
+		state = transitions[state * classes_count +
+		                    dfa->byte_classes[*c]];
+		if (state == DFA_DEAD_STATE) {
+			return false;
+		}
+	}
+	return dfa->accepting[state];
+}
+
+/*
+ * Compile the glob or regex of `predicate` into its DFA and find the literal
+ * to search first, folding the letter case when `ignore_case` is set. Errors
+ * are reported naming the pattern as an `option`.
+ * Returns `SUCCESS` if it was compiled, otherwise returns `FAILED`.
+ */
+int
+build_pattern_predicate(struct pattern_predicate *predicate,
+                        bool ignore_case,
+                        const char *option)
+{
+	struct nfa nfa = { NULL, 0, 0, ignore_case };
+	struct pattern_parser parser = { predicate->source, 0, &nfa, NULL };
+
+	struct nfa_fragment fragment = predicate->is_glob
+	                                       ? parse_glob(&parser)
+	                                       : parse_regex(&parser);
+	int32_t match = add_nfa_state(&parser, NFA_MATCH);
+	if (fragment.start == -1 || match == -1) {
+		fprintf(stderr,
+		        "Error: invalid %s '%s': %s\n",
+		        option,
+		        predicate->source,
+		        parser.error);
+		free(nfa.states);
+		return FAILED;
+	}
+	nfa.states[fragment.end].out = match;
+
+	if (build_dfa(&predicate->dfa, &nfa, fragment.start) == FAILED) {
+		fprintf(stderr,
+		        "Error: could not compile %s '%s' (it may need more "
+		        "than %d states)\n",
+		        option,
+		        predicate->source,
+		        DFA_MAX_STATES);
+		free(nfa.states);
+		return FAILED;
+	}
+	free(nfa.states);
+
+	char literal[PATH_MAX];
+	predicate->has_literal =
+	        find_required_literal(predicate->source,
+	                              predicate->is_glob,
+	                              literal) > 0;
+	if (predicate->has_literal) {
+		compile_matcher(&predicate->literal, literal, ignore_case);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Compile the glob or regex of `predicate`, the -name or -regex of the search,
+ * folding the letter case when `ignore_case` is set. If the pattern is invalid
+ * or too complex, the program exits.
+ */
+void
+compile_pattern_predicate(struct pattern_predicate *predicate,
+                          bool ignore_case)
+{
+	const char *option = predicate->is_glob ? "-name" : "-regex";
+	if (build_pattern_predicate(predicate, ignore_case, option) == FAILED) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Check if the whole `string` matches the glob or regex of `predicate`.
+ * Returns `true` if it does, `false` otherwise.
+ */
+bool
+match_pattern_predicate(const struct pattern_predicate *predicate,
+                        const char *string)
+{
+	if (predicate->has_literal &&
+	    !contains_phrase(&predicate->literal, string)) {
+		return false;
+	}
+	return run_dfa(&predicate->dfa, string);
+}
+
+/*
+ * Create an empty ignore trie of `level`, referenced once.
+ * Returns the trie, or `NULL` if it could not be allocated.
+ */
+struct ignore_trie *
+new_ignore_trie(uint32_t level)
+{
+	struct ignore_trie *trie = malloc(sizeof(struct ignore_trie));
+	struct ignore_node *nodes = malloc(IGNORE_NODES_INITIAL_CAPACITY *
+	                                   sizeof(struct ignore_node));
+	if (trie == NULL || nodes == NULL) {
+		perror("Error: could not allocate the ignore rules");
+		free(trie);
+		free(nodes);
+		return NULL;
+	}
+
+	nodes[0] = (struct ignore_node){
+		.component = NULL,
+		.first_child = IGNORE_NO_NODE,
+		.next_sibling = IGNORE_NO_NODE,
+	};
+	trie->nodes = nodes;
+	trie->count = 1;
+	trie->capacity = IGNORE_NODES_INITIAL_CAPACITY;
+	trie->level = level;
+	atomic_init(&trie->refs, 1);
+	return trie;
+}
+
+/*
+ * Release a reference to `trie`, freeing it when it was the last.
+ */
+void
+release_ignore_trie(struct ignore_trie *trie)
+{
+	if (trie == NULL || atomic_fetch_sub(&trie->refs, 1) > 1) {
+		return;
+	}
+
+	for (size_t i = 0; i < trie->count; i++) {
+		struct ignore_node *node = &trie->nodes[i];
+		if (node->glob != NULL) {
+			free(node->glob->dfa.transitions);
+			free(node->glob->dfa.accepting);
+			free(node->glob);
+		}
+		free(node->component);
+	}
+	free(trie->nodes);
+	free(trie);
+}
+
+/*
+ * Get the child of the node `parent` of `trie` for the path `component` of a
+ * rule, adding it if the trie has none: `**`, a glob when it has any of the
+ * glob special characters, or a literal name otherwise.
+ * Returns the index of the child, or `IGNORE_NO_NODE` if it could not be
+ * added.
+ */
+uint32_t
+add_ignore_node(struct ignore_trie *trie,
+                uint32_t parent,
+                const char *component)
+{
+	for (uint32_t child = trie->nodes[parent].first_child;
+	     child != IGNORE_NO_NODE;
+	     child = trie->nodes[child].next_sibling) {
+		if (strcmp(trie->nodes[child].component, component) == 0) {
+			return child;
+		}
+	}
+
+	if (trie->count == trie->capacity) {
+		size_t capacity = trie->capacity * 2;
+		struct ignore_node *nodes = realloc(
+		        trie->nodes, capacity * sizeof(struct ignore_node));
+		if (nodes == NULL) {
+			perror("Error: could not grow the ignore rules");
+			return IGNORE_NO_NODE;
+		}
+		trie->nodes = nodes;
+		trie->capacity = capacity;
+	}
+
+	struct ignore_node node = {
+		.component = strdup(component),
+		.is_any_depth = strcmp(component, IGNORE_ANY_DEPTH) == 0,
+		.glob = NULL,
+		.first_child = IGNORE_NO_NODE,
+		.next_sibling = trie->nodes[parent].first_child,
+	};
+	if (node.component == NULL) {
+		perror("Error: could not allocate an ignore rule");
+		return IGNORE_NO_NODE;
+	}
+	if (!node.is_any_depth && strpbrk(component, "*?[\\") != NULL) {
+		node.glob = calloc(1, sizeof(struct pattern_predicate));
+		if (node.glob == NULL) {
+			perror("Error: could not allocate an ignore rule");
+			free(node.component);
+			return IGNORE_NO_NODE;
+		}
+		node.glob->source = node.component;
+		node.glob->is_glob = true;
+		if (build_pattern_predicate(
+		            node.glob, false, "ignore rule") == FAILED) {
+			free(node.glob);
+			free(node.component);
+			return IGNORE_NO_NODE;
+		}
+	}
+
+	trie->nodes[parent].first_child = trie->count;
+	trie->nodes[trie->count] = node;
+	return trie->count++;
+}
+
+/*
+ * Add the .gitignore-style `rule`, found at `line` of its source, to `trie`.
+ * Blank rules and comments (starting with '#') are skipped; '!' negates a
+ * rule, a trailing slash limits it to directories and a rule with a slash
+ * anywhere else only matches paths from the root of the trie, while the rest
+ * match names at any depth. Its components are matched whole, so '*' does not
+ * cross slashes, and a `**` component matches any number of them.
+ * Returns `SUCCESS` if the rule was added or skipped, otherwise returns
+ * `FAILED`.
+ */
+int
+add_ignore_rule(struct ignore_trie *trie, const char *rule, uint32_t line)
+{
+	size_t len = strlen(rule);
+	while (len > 0 && (rule[len - 1] == '\n' || rule[len - 1] == '\r')) {
+		len--;
+	}
+	while (len > 0 && rule[len - 1] == ' ' &&
+	       (len == 1 || rule[len - 2] != '\\')) {
+		len--;
+	}
+	if (len == 0 || rule[0] == '#') {
+		return SUCCESS;
+	}
+
+	struct ignore_verdict verdict = { true, rule[0] == '!', line };
+	size_t start = verdict.is_negated ? 1 : 0;
+	bool is_dir_only = rule[len - 1] == '/';
+	while (len > start && rule[len - 1] == '/') {
+		len--;
+	}
+	if (len == start) {
+		return SUCCESS;
+	}
+
+	char *components = strndup(rule + start, len - start);
+	if (components == NULL) {
+		perror("Error: could not allocate an ignore rule");
+		return FAILED;
+	}
+
+	bool is_anchored = strchr(components, '/') != NULL;
+	uint32_t node = is_anchored
+	                        ? 0
+	                        : add_ignore_node(trie, 0, IGNORE_ANY_DEPTH);
+	char *saveptr = NULL;
+	for (char *component = strtok_r(components, "/", &saveptr);
+	     component != NULL && node != IGNORE_NO_NODE;
+	     component = strtok_r(NULL, "/", &saveptr)) {
+		/* Consecutive `**` match the same as a single one */
+		if (strcmp(component, IGNORE_ANY_DEPTH) != 0 ||
+		    !trie->nodes[node].is_any_depth) {
+			node = add_ignore_node(trie, node, component);
+		}
+	}
+	free(components);
+	if (node == IGNORE_NO_NODE) {
+		return FAILED;
+	}
+
+	if (is_dir_only) {
+		trie->nodes[node].dirs = verdict;
+	} else {
+		trie->nodes[node].entities = verdict;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Add the node `node` of `trie` to `state`, unless it is there already, along
+ * with the `**` below it, which may match no component at all. If it cannot
+ * be added, the program exits.
+ */
+void
+add_ignore_cursor(struct ignore_state *state,
+                  struct ignore_trie *trie,
+                  uint32_t node)
+{
+	for (size_t i = 0; i < state->count; i++) {
+		if (state->cursors[i].trie == trie &&
+		    state->cursors[i].node == node) {
+			return;
+		}
+	}
+
+	if (state->count == state->capacity) {
+		size_t capacity = state->capacity == 0
+		                          ? IGNORE_CURSORS_INITIAL_CAPACITY
+		                          : state->capacity * 2;
+		struct ignore_cursor *cursors =
+		        realloc(state->cursors,
+		                capacity * sizeof(struct ignore_cursor));
+		if (cursors == NULL) {
+			perror("Error: could not grow the ignore rules state");
+			exit(EXIT_FAILURE);
+		}
+		state->cursors = cursors;
+		state->capacity = capacity;
+	}
+	atomic_fetch_add(&trie->refs, 1);
+	state->cursors[state->count++] = (struct ignore_cursor){ trie, node };
+
+	for (uint32_t child = trie->nodes[node].first_child;
+	     child != IGNORE_NO_NODE;
+	     child = trie->nodes[child].next_sibling) {
+		if (trie->nodes[child].is_any_depth) {
+			add_ignore_cursor(state, trie, child);
+		}
+	}
+}
+
+/*
+ * Release the tries referenced by `state` and its cursors.
+ */
+void
+free_ignore_state(struct ignore_state *state)
+{
+	for (size_t i = 0; i < state->count; i++) {
+		release_ignore_trie(state->cursors[i].trie);
+	}
+	free(state->cursors);
+	state->cursors = NULL;
+	state->count = 0;
+	state->capacity = 0;
+}
+
+/*
+ * Start the ignore `state` of the working directory with the --exclude rules
+ * of `search`, if any.
+ */
+void
+init_ignore_state(const struct search *search, struct ignore_state *state)
+{
+	*state = (struct ignore_state){ NULL, 0, 0, 0 };
+	if (search->excludes != NULL) {
+		add_ignore_cursor(state, search->excludes, 0);
+	}
+}
+
+/*
+ * Add to `state` the rules of the ignore file `name` of the directory
+ * `directory_fd`, at `path`, as a trie of `level`. A missing file has no
+ * rules; the rules that cannot be compiled are reported and left out.
+ */
+void
+load_ignore_file(struct ignore_state *state,
+                 int directory_fd,
+                 const char *name,
+                 const char *path,
+                 uint32_t level)
+{
+	int fd = openat(directory_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	FILE *file = fd == GENERIC_ERROR_CODE ? NULL : fdopen(fd, "r");
+	if (file == NULL) {
+		if (errno != ENOENT && errno != ELOOP) {
+			fprintf(stderr,
+			        "Error: could not open ignore file '%s/%s': "
+			        "%s\n",
+			        path,
+			        name,
+			        strerror(errno));
+		}
+		if (fd != GENERIC_ERROR_CODE) {
+			close(fd);
+		}
+		return;
+	}
+
+	struct ignore_trie *trie = new_ignore_trie(level);
+	char *line = NULL;
+	size_t capacity = 0;
+	uint32_t line_number = 0;
+	while (trie != NULL &&
+	       getline(&line, &capacity, file) != GENERIC_ERROR_CODE) {
+		line_number++;
+		if (add_ignore_rule(trie, line, line_number) == FAILED) {
+			fprintf(stderr,
+			        "Error: skipping line %u of ignore file "
+			        "'%s/%s'\n",
+			        line_number,
+			        path,
+			        name);
+		}
+	}
+	free(line);
+	fclose(file);
+
+	if (trie != NULL && trie->nodes[0].first_child != IGNORE_NO_NODE) {
+		add_ignore_cursor(state, trie, 0);
+	}
+	release_ignore_trie(trie);
+}
+
+/*
+ * Add to `state` the rules of the ignore files of the directory `directory_fd`,
+ * at `path`, when `search` honors them. Their levels are above those of the
+ * ignore files of any parent directory.
+ */
+void
+load_ignore_files(const struct search *search,
+                  struct ignore_state *state,
+                  int directory_fd,
+                  const char *path)
+{
+	if (!search->has_ignore_files) {
+		return;
+	}
+	for (uint32_t i = 0; i < IGNORE_FILES_COUNT; i++) {
+		load_ignore_file(state,
+		                 directory_fd,
+		                 IGNORE_FILES[i],
+		                 path,
+		                 1 + state->depth * IGNORE_FILES_COUNT + i);
+	}
+}
+
+/*
+ * Check if the node `child` of `trie` matches the path component `name`.
+ * Returns `true` if it matches, `false` otherwise.
+ */
+bool
+match_ignore_node(const struct ignore_node *child, const char *name)
+{
+	if (child->glob != NULL) {
+		return match_pattern_predicate(child->glob, name);
+	}
+	return strcmp(child->component, name) == 0;
+}
+
+/*
+ * Keep in `best` whichever of itself and the rule of `trie` ending at `node`
+ * that applies to an entity that is a directory or not, as `is_dir` tells,
+ * wins: the one of the trie with the highest level, and then the last one.
+ */
+void
+pick_ignore_verdict(const struct ignore_trie *trie,
+                    uint32_t node,
+                    bool is_dir,
+                    struct ignore_verdict *best,
+                    uint32_t *best_level)
+{
+	const struct ignore_verdict *verdicts[2] = {
+		&trie->nodes[node].entities,
+		is_dir ? &trie->nodes[node].dirs : NULL,
+	};
+	for (size_t i = 0; i < 2; i++) {
+		const struct ignore_verdict *verdict = verdicts[i];
+		if (verdict == NULL || !verdict->is_set) {
+			continue;
+		}
+		if (!best->is_set || trie->level > *best_level ||
+		    (trie->level == *best_level &&
+		     verdict->line > best->line)) {
+			*best = *verdict;
+			*best_level = trie->level;
+		}
+	}
+}
+
+/*
+ * Step the ignore `state` of a directory into its entity `name`, which is a
+ * directory if `is_dir` is set, and check if the entity is ignored. For a
+ * directory the nodes reached are kept in `next`, to start its own state, and
+ * for anything else `next` may be `NULL`.
+ * Returns `true` if the entity is ignored, `false` otherwise.
+ */
+bool
+step_ignore_state(const struct ignore_state *state,
+                  const char *name,
+                  bool is_dir,
+                  struct ignore_state *next)
+{
+	struct ignore_verdict best = { false, false, 0 };
+	uint32_t best_level = 0;
+	if (next != NULL) {
+		*next = (struct ignore_state){ NULL, 0, 0, state->depth + 1 };
+	}
+
+	for (size_t i = 0; i < state->count; i++) {
+		struct ignore_trie *trie = state->cursors[i].trie;
+		uint32_t node = state->cursors[i].node;
+		/* `**` matches this component and stays for the next ones */
+		if (trie->nodes[node].is_any_depth) {
+			pick_ignore_verdict(
+			        trie, node, is_dir, &best, &best_level);
+			if (next != NULL) {
+				add_ignore_cursor(next, trie, node);
+			}
+		}
+
+		for (uint32_t child = trie->nodes[node].first_child;
+		     child != IGNORE_NO_NODE;
+		     child = trie->nodes[child].next_sibling) {
+			if (trie->nodes[child].is_any_depth ||
+			    !match_ignore_node(&trie->nodes[child], name)) {
+				continue;
+			}
+			pick_ignore_verdict(
+			        trie, child, is_dir, &best, &best_level);
+			if (next != NULL) {
+				add_ignore_cursor(next, trie, child);
+			}
+		}
+	}
+
+	bool is_ignored = best.is_set && !best.is_negated;
+	if (is_ignored && next != NULL) {
+		free_ignore_state(next);
+	}
+	return is_ignored;
+}
+
+/*
+ * Compile the --exclude rules of `search`, along with the implicit rule
+ * skipping the .git directories when it honors the ignore files, into its
+ * `excludes` trie. If a rule is invalid, the program exits.
+ */
+void
+compile_exclude_rules(struct search *search)
+{
+	if (search->exclude_rules_count == 0 && !search->has_ignore_files) {
+		return;
+	}
+
+	search->excludes = new_ignore_trie(0);
+	if (search->excludes == NULL ||
+	    (search->has_ignore_files &&
+	     add_ignore_rule(search->excludes, IGNORE_GIT_DIR_RULE, 0) ==
+	             FAILED)) {
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < search->exclude_rules_count; i++) {
+		if (add_ignore_rule(search->excludes,
+		                    search->exclude_rules[i],
+		                    i + 1) == FAILED) {
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Prepare `search` to find its phrases and match its -name and -regex,
+ * folding their letter case when `ignore_case` is set. Unlike
+ * `compile_search`, it never exits, so the --watch daemon can use it for the
+ * searches of its clients.
+ * Returns `SUCCESS` if it was prepared, otherwise returns `FAILED`.
+ */
+int
+build_search(struct search *search, bool ignore_case)
+{
+	if (search->name.source != NULL &&
+	    build_pattern_predicate(&search->name, ignore_case, "-name") ==
+	            FAILED) {
+		return FAILED;
+	}
+	if (search->path.source != NULL &&
+	    build_pattern_predicate(&search->path, ignore_case, "-regex") ==
+	            FAILED) {
+		return FAILED;
+	}
+
+	if (search->patterns_count == 1) {
+		compile_matcher(
+		        &search->matcher, search->patterns[0], ignore_case);
+		return SUCCESS;
+	}
+	if (search->patterns_count == 0) {
+		return SUCCESS;
+	}
+
+	return compile_automaton(&search->automaton,
+	                         search->patterns,
+	                         search->patterns_count,
+	                         ignore_case);
+}
+
+/*
+ * Prepare `search` to find its phrases and match its -name and -regex,
+ * folding their letter case when `ignore_case` is set, and its --exclude
+ * rules. If it cannot be prepared, the program exits.
+ */
+void
+compile_search(struct search *search, bool ignore_case)
+{
+	compile_exclude_rules(search);
+	if (build_search(search, ignore_case) == FAILED) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Release the phrases of `search` and what was compiled from them.
+ */
+void
+free_search(struct search *search)
+{
+	if (search->patterns_count > 1) {
+		free_automaton(&search->automaton);
+	}
+	if (search->name.source != NULL) {
+		free(search->name.dfa.transitions);
+		free(search->name.dfa.accepting);
+	}
+	if (search->path.source != NULL) {
+		free(search->path.dfa.transitions);
+		free(search->path.dfa.accepting);
+	}
+	for (size_t i = 0; i < search->patterns_count; i++) {
+		free(search->patterns[i]);
+	}
+	free(search->patterns);
+	free(search->metadata);
+	free(search->exclude_rules);
+	release_ignore_trie(search->excludes);
+}
+
+/*
+ * Allocate the `scratch` space to match names against `search`, with room
+ * for every phrase in its tags.
+ * Returns `SUCCESS` if it was allocated, otherwise returns `FAILED`.
+ */
+int
+init_match_scratch(struct match_scratch *scratch, const struct search *search)
+{
+	size_t tags_len = 1;
+	for (size_t i = 0; i < search->patterns_count; i++) {
+		tags_len += strlen(search->patterns[i]) + 1;
+	}
+
+	scratch->stamp = 0;
+	scratch->matched_count = 0;
+	/* Keep a slot when there is no phrase, so the allocations succeed */
+	size_t slots = search->patterns_count > 0 ? search->patterns_count : 1;
+	scratch->stamps = calloc(slots, sizeof(uint32_t));
+	scratch->matched = malloc(slots * sizeof(int32_t));
+	scratch->tags = malloc(tags_len);
+	if (scratch->stamps == NULL || scratch->matched == NULL ||
+	    scratch->tags == NULL) {
+		perror("Error: could not allocate the match scratch space");
+		return FAILED;
+	}
+	scratch->tags[0] = STRING_NULL_TERMINATOR;
+	return SUCCESS;
+}
+
+/*
+ * Release the `scratch` space.
+ */
+void
+free_match_scratch(struct match_scratch *scratch)
+{
+	free(scratch->stamps);
+	free(scratch->matched);
+	free(scratch->tags);
+}
+
+/*
+ * Compare two phrase indexes for `qsort`.
+ */
+int
+compare_pattern_indexes(const void *a, const void *b)
+{
+	int32_t index_a = *(const int32_t *) a;
+	int32_t index_b = *(const int32_t *) b;
+	return (index_a > index_b) - (index_a < index_b);
+}
+
+/*
+ * Check if the `entity_name` is in the directory names blacklist `DIR_NAMES_BLACKLIST`.
+ * Returns `true` if `entity_name` is blacklisted, `false` otherwise.
+ */
+bool
+is_directory_blacklisted(const char *entity_name)
+{
+	bool is_blacklisted = false;
+
+	for (int i = 0; i < DIR_NAMES_BLACKLIST_SIZE; i++) {
+		if (strncmp(entity_name,
+		            DIR_NAMES_BLACKLIST[i],
+		            DIR_NAMES_BLACKLIST_MAX_LEN * sizeof(char)) == 0) {
+			is_blacklisted = true;
+			break;
+		}
+	}
+
+	return is_blacklisted;
+}
+
+/*
+ * Build the full path of the entity given the `parent_path` and `entity_name`.
+ * The result is stored in `fullpath`.
+ */
+void
+build_fullpath(char fullpath[PATH_MAX],
+               const char *parent_path,
+               const char *entity_name)
+{
+	if (strcmp(parent_path, WD_PATH_ALIAS) == 0) {
+		snprintf(fullpath, (PATH_MAX - 1) * sizeof(char), "%s", entity_name);
+		return;
+	}
+
+	snprintf(fullpath,
+	         (PATH_MAX - 1) * sizeof(char),
+	         "%s/%s",
+	         parent_path,
+	         entity_name);
+}
+
+/*
+ * Check if `entity_name`, found in `parent_path`, contains any phrase of
+ * `search` and matches its -name and -regex, the cheapest checks first. With
+ * several phrases, the ones found are listed in the tags of `scratch`, in the
+ * order they were given and each preceded by `TAG_SEPARATOR`, to print them
+ * after the path; otherwise the tags are left empty.
+ * Returns `true` if the entity matches, `false` otherwise.
+ */
+bool
+match_entity(const struct search *search,
+             struct match_scratch *scratch,
+             const char *parent_path,
+             const char *entity_name)
+{
+	scratch->tags[0] = STRING_NULL_TERMINATOR;
+	if (search->patterns_count == 1 &&
+	    !contains_phrase(&search->matcher, entity_name)) {
+		return false;
+	}
+	if (search->name.source != NULL &&
+	    !match_pattern_predicate(&search->name, entity_name)) {
+		return false;
+	}
+	if (search->path.source != NULL) {
+		build_fullpath(scratch->fullpath, parent_path, entity_name);
+		if (!match_pattern_predicate(&search->path,
+		                             scratch->fullpath)) {
+			return false;
+		}
+	}
+	if (search->patterns_count <= 1) {
+		return true;
+	}
+
+	if (!run_automaton(&search->automaton, scratch, entity_name)) {
+		return false;
+	}
+
+	qsort(scratch->matched,
+	      scratch->matched_count,
+	      sizeof(int32_t),
+	      compare_pattern_indexes);
+	char *tag = scratch->tags;
+	for (size_t i = 0; i < scratch->matched_count; i++) {
+		const char *pattern = search->patterns[scratch->matched[i]];
+		size_t len = strlen(pattern);
+		*tag++ = TAG_SEPARATOR;
+		memcpy(tag, pattern, len);
+		tag += len;
+	}
+	*tag = STRING_NULL_TERMINATOR;
+	return true;
+}
+
+/*
+ * Compare the `actual` value of an entity with the `value` of a metadata
+ * predicate by its `comparison`.
+ * Returns `true` if the comparison holds, `false` otherwise.
+ */
+bool
+compare_metadata_value(char comparison, int64_t actual, int64_t value)
+{
+	if (comparison == '+') {
+		return actual > value;
+	}
+	if (comparison == '-') {
+		return actual < value;
+	}
+	return actual == value;
+}
+
+/*
+ * Check if the metadata `info` of an entity matches `predicate`, counting
+ * ages from `now` in whole days, rounded down like find does.
+ * Returns `true` if it matches, `false` otherwise.
+ */
+bool
+match_metadata_predicate(const struct metadata_predicate *predicate,
+                         const struct statx *info,
+                         int64_t now)
+{
+	switch (predicate->kind) {
+	case METADATA_TYPE:
+		return (info->stx_mode & S_IFMT) == predicate->value;
+	case METADATA_SIZE: {
+		int64_t unit = predicate->unit;
+		int64_t units = (info->stx_size + unit - 1) / unit;
+		return compare_metadata_value(
+		        predicate->comparison, units, predicate->value);
+	}
+	case METADATA_MTIME: {
+		int64_t age = now - info->stx_mtime.tv_sec;
+		int64_t days = age >= 0 ? age / SECONDS_PER_DAY
+		                        : -((SECONDS_PER_DAY - 1 - age) /
+		                            SECONDS_PER_DAY);
+		return compare_metadata_value(
+		        predicate->comparison, days, predicate->value);
+	}
+	case METADATA_NEWER:
+		return info->stx_mtime.tv_sec > predicate->reference.tv_sec ||
+		       (info->stx_mtime.tv_sec == predicate->reference.tv_sec &&
+		        info->stx_mtime.tv_nsec >
+		                predicate->reference.tv_nsec);
+	}
+	return false;
+}
+
+/*
+ * Check if `entity`, found in the directory `directory_fd` at `parent_path`,
+ * matches the metadata predicates of `search`. It is meant to be called once
+ * its name matched, and reads its metadata with a single statx call asking
+ * only for the fields the predicates need, without syncing them with remote
+ * file systems. The type comes with the record when the file system fills it
+ * in, so -type alone costs no call.
+ * Returns `true` if the entity matches, `false` otherwise.
+ */
+bool
+match_metadata(const struct search *search,
+               int directory_fd,
+               const struct linux_dirent64 *entity,
+               const char *parent_path)
+{
+	if (search->metadata_count == 0) {
+		return true;
+	}
+
+	unsigned int mask = search->metadata_mask;
+	if (entity->d_type != DT_UNKNOWN) {
+		mask &= ~STATX_TYPE;
+	}
+	struct statx info = { .stx_mask = 0 };
+	if (mask != 0 && statx(directory_fd,
+	                       entity->d_name,
+	                       METADATA_STATX_FLAGS,
+	                       mask,
+	                       &info) == GENERIC_ERROR_CODE) {
+		fprintf(stderr,
+		        "Error while reading the metadata of '%s/%s': %s\n",
+		        parent_path,
+		        entity->d_name,
+		        strerror(errno));
+		return false;
+	}
+	if ((info.stx_mask & mask) != mask) {
+		return false;
+	}
+	if (entity->d_type != DT_UNKNOWN) {
+		info.stx_mode = (info.stx_mode & ~S_IFMT) |
+		                DTTOIF(entity->d_type);
+	}
+
+	for (size_t i = 0; i < search->metadata_count; i++) {
+		if (!match_metadata_predicate(
+		            &search->metadata[i], &info, search->now)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Print the full path of the entity, found in `parent_path`, followed by the
+ * phrases found, if it matches `search`.
+ */
+void
+print_if_contains_substring(char *entity_name,
+                            char *fullpath,
+                            const char *parent_path,
+                            const struct search *search,
+                            struct match_scratch *scratch)
+{
+	bool _contains_substring =
+	        match_entity(search, scratch, parent_path, entity_name);
+
+	if (_contains_substring) {
+		printf("%s%s\n", fullpath, scratch->tags);
+	}
+}
+
+/*
+ * Write the lines gathered in `output` by a content worker of `pool` to the
+ * standard output, holding the output lock so the lines of different workers
+ * never mix.
+ */
+void
+flush_content_output(struct content_pool *pool, struct output_buffer *output)
+{
+	pthread_mutex_lock(&pool->output_lock);
+	fwrite(output->data, 1, output->len, stdout);
+	pthread_mutex_unlock(&pool->output_lock);
+	output->len = 0;
+}
+
+/*
+ * Gather in `output` the line `path:line` for the `len` bytes of `line`,
+ * writing the lines gathered so far first when it does not fit.
+ */
+void
+buffer_content_line(struct content_pool *pool,
+                    struct output_buffer *output,
+                    const char *path,
+                    const char *line,
+                    size_t len)
+{
+	size_t path_len = strlen(path);
+	size_t total_len = path_len + len + 2;
+	if (output->len + total_len > OUTPUT_BUFFER_SIZE) {
+		flush_content_output(pool, output);
+	}
+	if (total_len > OUTPUT_BUFFER_SIZE) {
+		pthread_mutex_lock(&pool->output_lock);
+		printf("%s%c%.*s\n", path, CONTENT_SEPARATOR, (int) len, line);
+		pthread_mutex_unlock(&pool->output_lock);
+		return;
+	}
+
+	char *end = output->data + output->len;
+	memcpy(end, path, path_len);
+	end[path_len] = CONTENT_SEPARATOR;
+	memcpy(end + path_len + 1, line, len);
+	end[total_len - 1] = '\n';
+	output->len += total_len;
+}
+
+/*
+ * Search the text of `pool` in the contents of the file of `job`, gathering
+ * each line containing it in `output`. Files of up to `CONTENT_READ_MAX`
+ * bytes are read with a single read into `buffer`, larger ones are mapped.
+ * Files with a null byte in their first `CONTENT_BINARY_PROBE` bytes are taken
+ * as binary and skipped.
+ * Returns `SUCCESS` if the file could be read, otherwise returns `FAILED`.
+ */
+int
+search_file_contents(struct content_pool *pool,
+                     const struct content_job *job,
+                     char *buffer,
+                     struct output_buffer *output)
+{
+	struct stat info;
+	if (fstat(job->fd, &info) == GENERIC_ERROR_CODE) {
+		return FAILED;
+	}
+
+	const char *data = buffer;
+	size_t len = 0;
+	bool is_mapped = (size_t) info.st_size > CONTENT_READ_MAX;
+	if (is_mapped) {
+		len = info.st_size;
+		data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, job->fd, 0);
+		if (data == MAP_FAILED) {
+			return FAILED;
+		}
+		madvise((void *) data, len, MADV_SEQUENTIAL);
+	} else {
+		/* The file may have changed since, take what is there now */
+		ssize_t res = 0;
+		while (len < CONTENT_READ_MAX &&
+		       (res = read(job->fd,
+		                   buffer + len,
+		                   CONTENT_READ_MAX - len)) > 0) {
+			len += res;
+		}
+		if (res == GENERIC_ERROR_CODE) {
+			return FAILED;
+		}
+	}
+
+	size_t probe_len =
+	        len < CONTENT_BINARY_PROBE ? len : CONTENT_BINARY_PROBE;
+	bool is_binary =
+	        memchr(data, STRING_NULL_TERMINATOR, probe_len) != NULL;
+	size_t pos = 0;
+	while (!is_binary && pos < len) {
+		const char *match = pool->matcher.find(
+		        &pool->matcher, data + pos, len - pos);
+		if (match == NULL) {
+			break;
+		}
+
+		const char *line_start =
+		        memrchr(data + pos, '\n', match - (data + pos));
+		line_start = line_start == NULL ? data + pos : line_start + 1;
+		const char *match_end = match + pool->matcher.len;
+		const char *line_end = memchr(
+		        match_end - 1, '\n', data + len - (match_end - 1));
+		line_end = line_end == NULL ? data + len : line_end;
+		buffer_content_line(pool,
+		                    output,
+		                    job->path,
+		                    line_start,
+		                    line_end - line_start);
+		pos = line_end - data + 1;
+	}
+
+	if (is_mapped) {
+		munmap((void *) data, len);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Take the next file queued in `pool` into `job`, waiting for the walk to
+ * queue one.
+ * Returns `true` if a file was taken, `false` once the walk is over and the
+ * queue is empty.
+ */
+bool
+take_content_job(struct content_pool *pool, struct content_job *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == 0 && !pool->is_closed) {
+		pthread_cond_wait(&pool->not_empty, &pool->lock);
+	}
+
+	bool has_job = pool->count > 0;
+	if (has_job) {
+		*job = pool->jobs[pool->head];
+		pool->head = (pool->head + 1) % CONTENT_QUEUE_CAPACITY;
+		pool->count--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return has_job;
+}
+
+/*
+ * Search the contents of the files queued in the `struct content_pool` given
+ * as `arg` until the walk is over.
+ * Returns `NULL`.
+ */
+void *
+run_content_worker(void *arg)
+{
+	struct content_pool *pool = arg;
+	char *buffer = malloc(CONTENT_READ_MAX);
+	struct output_buffer *output = malloc(sizeof(struct output_buffer));
+	if (buffer == NULL || output == NULL) {
+		perror("Error: could not allocate the contents buffers");
+		atomic_fetch_add(&pool->failures, 1);
+		free(buffer);
+		free(output);
+		return NULL;
+	}
+	output->len = 0;
+
+	struct content_job job;
+	while (take_content_job(pool, &job)) {
+		if (search_file_contents(pool, &job, buffer, output) ==
+		    FAILED) {
+			fprintf(stderr,
+			        "Error while reading file '%s': %s\n",
+			        job.path,
+			        strerror(errno));
+			atomic_fetch_add(&pool->failures, 1);
+		}
+		close(job.fd);
+		free(job.path);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->open_files--;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	flush_content_output(pool, output);
+	free(output);
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Work out how many directories the walk keeps open at most: up to
+ * `WALK_MAX_OPEN_DIRS`, but only a quarter of the file descriptors the process
+ * may open, and never fewer than a directory and its child.
+ * Returns the budget.
+ */
+size_t
+get_walk_fd_budget(void)
+{
+	struct rlimit limit;
+	size_t budget = WALK_MAX_OPEN_DIRS;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != GENERIC_ERROR_CODE &&
+	    limit.rlim_cur != RLIM_INFINITY &&
+	    limit.rlim_cur / WALK_FD_BUDGET_SHARE < budget) {
+		budget = limit.rlim_cur / WALK_FD_BUDGET_SHARE;
+	}
+	return budget < WALK_MIN_OPEN_DIRS ? WALK_MIN_OPEN_DIRS : budget;
+}
+
+/*
+ * Start `threads_count` threads in `pool` searching `text` in the contents of
+ * the files the walk queues, ignoring the letter case if `ignore_case` is set.
+ * The files open at once are as many as the walk may keep directories open,
+ * so both fit together in the file descriptors of the process.
+ * Returns `SUCCESS` if the threads were started, otherwise returns `FAILED`.
+ */
+int
+start_content_pool(struct content_pool *pool,
+                   const char *text,
+                   bool ignore_case,
+                   int threads_count)
+{
+	compile_matcher(&pool->matcher, text, ignore_case);
+	pool->head = 0;
+	pool->count = 0;
+	pool->open_files = 0;
+	pool->open_files_max = get_walk_fd_budget();
+	if (pool->open_files_max > CONTENT_QUEUE_CAPACITY) {
+		pool->open_files_max = CONTENT_QUEUE_CAPACITY;
+	}
+	pool->is_closed = false;
+	atomic_init(&pool->failures, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->output_lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+
+	pool->threads = calloc(threads_count, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		perror("Error: could not allocate the contents threads");
+		return FAILED;
+	}
+	for (pool->threads_count = 0; pool->threads_count < threads_count;
+	     pool->threads_count++) {
+		if (pthread_create(&pool->threads[pool->threads_count],
+		                   NULL,
+		                   run_content_worker,
+		                   pool) != 0) {
+			fprintf(stderr,
+			        "Error: could not start a contents thread\n");
+			return pool->threads_count > 0 ? SUCCESS : FAILED;
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * Queue the regular file `entity_name` of the directory `directory_fd`, whose
+ * full path is `fullpath`, to search its contents in `pool`, waiting while
+ * `pool` has as many files open as it may. It is opened here, relative to its
+ * directory, so its path may be of any length.
+ */
+void
+submit_content_file(struct content_pool *pool,
+                    int directory_fd,
+                    const char *entity_name,
+                    const char *fullpath)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->open_files == pool->open_files_max) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	pool->open_files++;
+	pthread_mutex_unlock(&pool->lock);
+
+	struct content_job job = {
+		.fd = openat(directory_fd,
+		             entity_name,
+		             O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC),
+		.path = strdup(fullpath),
+	};
+	if (job.fd == GENERIC_ERROR_CODE || job.path == NULL) {
+		fprintf(stderr,
+		        "Error: could not open file '%s': %s\n",
+		        fullpath,
+		        strerror(errno));
+		atomic_fetch_add(&pool->failures, 1);
+		if (job.fd != GENERIC_ERROR_CODE) {
+			close(job.fd);
+		}
+		free(job.path);
+		pthread_mutex_lock(&pool->lock);
+		pool->open_files--;
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs[(pool->head + pool->count) % CONTENT_QUEUE_CAPACITY] = job;
+	pool->count++;
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Wait for the threads of `pool` to search the files still queued, once the
+ * walk is over, and release it.
+ * Returns `SUCCESS` if every file was searched, otherwise returns `FAILED`.
+ */
+int
+finish_content_pool(struct content_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->is_closed = true;
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->threads_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	fflush(stdout);
+
+	pthread_cond_destroy(&pool->not_full);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_mutex_destroy(&pool->output_lock);
+	pthread_mutex_destroy(&pool->lock);
+	return atomic_load(&pool->failures) == 0 ? SUCCESS : FAILED;
+}
+
+/*
+ * Append `name` to the path of `path`, after a '/' unless it is the working
+ * directory, growing it as needed: it has no length limit.
+ * If it cannot grow, the process exits.
+ */
+void
+push_walk_path(struct walk_path *path, const char *name)
+{
+	size_t name_len = strlen(name);
+	size_t len = path->len + (path->len > 0 ? 1 : 0) + name_len;
+	if (len + 1 > path->capacity) {
+		size_t capacity =
+		        path->capacity == 0 ? PATH_MAX : path->capacity;
+		while (capacity < len + 1) {
+			capacity *= 2;
+		}
+		char *data = realloc(path->data, capacity);
+		if (data == NULL) {
+			perror("Error: could not grow the path");
+			exit(EXIT_FAILURE);
+		}
+		path->data = data;
+		path->capacity = capacity;
+	}
+
+	if (path->len > 0) {
+		path->data[path->len++] = '/';
+	}
+	memcpy(path->data + path->len, name, name_len + 1);
+	path->len = len;
+}
+
+/*
+ * Cut the path of `path` back to its first `len` bytes.
+ */
+void
+truncate_walk_path(struct walk_path *path, size_t len)
+{
+	path->len = len;
+	path->data[len] = STRING_NULL_TERMINATOR;
+}
+
+/*
+ * Open the directory at the first `len` bytes of `path`, relative to the
+ * working directory, one component at a time so the path may be longer than
+ * `PATH_MAX`.
+ * Returns the open directory, or `GENERIC_ERROR_CODE` if it cannot be opened.
+ */
+int
+open_walk_path(const char *path, size_t len)
+{
+	int fd = open(WD_PATH_ALIAS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	char name[NAME_MAX + 1];
+	size_t start = 0;
+
+	while (fd != GENERIC_ERROR_CODE && start < len) {
+		size_t end = start;
+		while (end < len && path[end] != '/') {
+			end++;
+		}
+		if (end - start > NAME_MAX) {
+			close(fd);
+			errno = ENAMETOOLONG;
+			return GENERIC_ERROR_CODE;
+		}
+		memcpy(name, path + start, end - start);
+		name[end - start] = STRING_NULL_TERMINATOR;
+
+		int inner_fd =
+		        openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		close(fd);
+		fd = inner_fd;
+		start = end + 1;
+	}
+	return fd;
+}
+
+/*
+ * Push the open directory `directory_fd`, whose path is the current one of
+ * `stack` and whose ignore rules are `ignore`, as the new top of `stack`. When
+ * this goes over the budget of open directories, the shallowest open one is
+ * closed, remembering which directory it was so it can be reopened. If the
+ * stack cannot grow, the process exits.
+ */
+void
+push_walk_frame(struct walk_stack *stack,
+                int directory_fd,
+                struct ignore_state ignore)
+{
+	if (stack->count == stack->capacity) {
+		size_t capacity = stack->capacity == 0
+		                          ? WALK_STACK_INITIAL_CAPACITY
+		                          : stack->capacity * 2;
+		struct walk_frame *frames = realloc(
+		        stack->frames, capacity * sizeof(struct walk_frame));
+		if (frames == NULL) {
+			perror("Error: could not grow the directory stack");
+			exit(EXIT_FAILURE);
+		}
+		stack->frames = frames;
+		stack->capacity = capacity;
+	}
+
+	if (stack->open_count == stack->budget) {
+		struct walk_frame *oldest =
+		        &stack->frames[stack->count - stack->open_count];
+		struct stat info;
+		if (fstat(oldest->reader.fd, &info) == GENERIC_ERROR_CODE) {
+			perror("Error while closing directory");
+			exit(EXIT_FAILURE);
+		}
+		oldest->dev = info.st_dev;
+		oldest->ino = info.st_ino;
+		close_directory(oldest->reader.fd);
+		oldest->is_open = false;
+		stack->open_count--;
+	}
+
+	/* The open frames are the deepest ones, so their buffers never clash */
+	struct walk_frame *frame = &stack->frames[stack->count];
+	frame->reader.fd = directory_fd;
+	frame->reader.buffer = get_dir_buffer(&stack->buffers,
+	                                      stack->count % stack->budget);
+	frame->reader.len = 0;
+	frame->reader.pos = 0;
+	frame->ignore = ignore;
+	frame->path_len = stack->path.len;
+	frame->offset = 0;
+	frame->is_open = true;
+	stack->count++;
+	stack->open_count++;
+}
+
+/*
+ * Check if `fd` is open on the directory `frame` was on before being closed.
+ * Returns `true` if it is, `false` otherwise.
+ */
+bool
+is_frame_directory(const struct walk_frame *frame, int fd)
+{
+	struct stat info;
+	return fd != GENERIC_ERROR_CODE &&
+	       fstat(fd, &info) != GENERIC_ERROR_CODE &&
+	       info.st_dev == frame->dev && info.st_ino == frame->ino;
+}
+
+/*
+ * Reopen the closed directory of `frame`, found at `depth`, through ".." of
+ * its open child `child_fd`, falling back to its path if that is not the same
+ * directory anymore (e.g. the child was moved). Reading resumes after the
+ * last entity taken from it.
+ * Returns `SUCCESS` if it was reopened, otherwise returns `FAILED`.
+ */
+int
+reopen_walk_frame(struct walk_stack *stack,
+                  struct walk_frame *frame,
+                  size_t depth,
+                  int child_fd)
+{
+	int fd = openat(child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (!is_frame_directory(frame, fd)) {
+		if (fd != GENERIC_ERROR_CODE) {
+			close(fd);
+		}
+		fd = open_walk_path(stack->path.data, frame->path_len);
+	}
+
+	if (!is_frame_directory(frame, fd) ||
+	    lseek(fd, frame->offset, SEEK_SET) == GENERIC_ERROR_CODE) {
+		if (fd != GENERIC_ERROR_CODE) {
+			close(fd);
+		}
+		return FAILED;
+	}
+
+	frame->reader.fd = fd;
+	frame->reader.buffer =
+	        get_dir_buffer(&stack->buffers, depth % stack->budget);
+	frame->reader.len = 0;
+	frame->reader.pos = 0;
+	frame->is_open = true;
+	stack->open_count++;
+	return SUCCESS;
+}
+
+/*
+ * Pop the directory at the top of `stack`, which was fully read, reopening
+ * its parent first if it had been closed, and cut the path back to the
+ * parent's. A parent that cannot be reopened is reported and popped as well,
+ * skipping the rest of it.
+ */
+void
+pop_walk_frame(struct walk_stack *stack)
+{
+	int child_fd = stack->frames[stack->count - 1].reader.fd;
+	free_ignore_state(&stack->frames[stack->count - 1].ignore);
+	stack->count--;
+	while (stack->count > 0) {
+		struct walk_frame *parent = &stack->frames[stack->count - 1];
+		truncate_walk_path(&stack->path, parent->path_len);
+		if (parent->is_open ||
+		    reopen_walk_frame(
+		            stack, parent, stack->count - 1, child_fd) ==
+		            SUCCESS) {
+			break;
+		}
+
+		fprintf(stderr,
+		        "Error: could not reopen directory '%s', skipping the "
+		        "rest of it\n",
+		        parent->path_len == 0 ? WD_PATH_ALIAS
+		                              : stack->path.data);
+		free_ignore_state(&parent->ignore);
+		stack->count--;
+	}
+
+	close_directory(child_fd);
+	stack->open_count--;
+}
+
+/*
+ * Read all the entities inside the working directory `directory_fd` and its
+ * subdirectories, depth first, and print the full path of each entity that
+ * contains a phrase of `search` in its name, matched with the `scratch` space.
+ * If `contents` is given, the regular files that match are queued to search
+ * their contents instead of being printed. The entities ignored by the rules
+ * of `search` are skipped before anything else is checked, and the ignored
+ * directories are never opened. The walk keeps its own stack of
+ * directories instead of recursing, and a single path buffer that every entity
+ * name is appended to and cut from, so neither the depth nor the length of the
+ * paths is limited. Only a budget of directories stay open; the shallower ones
+ * are closed and reopened when the walk gets back to them. If a directory
+ * cannot be opened or read, the process exits.
+ */
+void
+walk_tree(int directory_fd,
+          const struct search *search,
+          struct match_scratch *scratch,
+          struct content_pool *contents)
+{
+	struct walk_stack stack = {
+		.frames = NULL,
+		.budget = get_walk_fd_budget(),
+		.path = { NULL, 0, 0 },
+		.buffers = { NULL, 0 },
+	};
+	struct ignore_state ignore;
+	init_ignore_state(search, &ignore);
+	load_ignore_files(search, &ignore, directory_fd, WD_PATH_ALIAS);
+	push_walk_frame(&stack, directory_fd, ignore);
+
+	while (stack.count > 0) {
+		struct walk_frame *frame = &stack.frames[stack.count - 1];
+		struct linux_dirent64 *entity = NULL;
+		read_entity_from_directory(&frame->reader, &entity);
+		if (entity == NULL) {
+			pop_walk_frame(&stack);
+			continue;
+		}
+		frame->offset = entity->d_off;
+
+		const char *parent_path =
+		        stack.path.len == 0 ? WD_PATH_ALIAS : stack.path.data;
+		/* The "." and ".." entries are neither matched nor walked */
+		if (is_directory_blacklisted(entity->d_name)) {
+			continue;
+		}
+
+		bool is_subdirectory =
+		        is_directory_entity(frame->reader.fd, entity);
+		struct ignore_state child_ignore = { NULL, 0, 0, 0 };
+		if (step_ignore_state(&frame->ignore,
+		                      entity->d_name,
+		                      is_subdirectory,
+		                      is_subdirectory ? &child_ignore : NULL)) {
+			continue;
+		}
+
+		bool is_match =
+		        match_entity(search,
+		                     scratch,
+		                     parent_path,
+		                     entity->d_name) &&
+		        match_metadata(
+		                search, frame->reader.fd, entity, parent_path);
+		if (!is_match && !is_subdirectory) {
+			continue;
+		}
+
+		push_walk_path(&stack.path, entity->d_name);
+		if (is_match && contents == NULL) {
+			printf("%s%s\n", stack.path.data, scratch->tags);
+		} else if (is_match && !is_subdirectory &&
+		           is_regular_file_entity(frame->reader.fd, entity)) {
+			submit_content_file(contents,
+			                    frame->reader.fd,
+			                    entity->d_name,
+			                    stack.path.data);
+		}
+		if (!is_subdirectory) {
+			truncate_walk_path(&stack.path, frame->path_len);
+			continue;
+		}
+
+		int inner_directory_fd =
+		        openat(frame->reader.fd,
+		               entity->d_name,
+		               O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (inner_directory_fd == GENERIC_ERROR_CODE) {
+			perror("Failed to open directory");
+			exit(EXIT_FAILURE);
+		}
+		load_ignore_files(search,
+		                  &child_ignore,
+		                  inner_directory_fd,
+		                  stack.path.data);
+		push_walk_frame(&stack, inner_directory_fd, child_ignore);
+	}
+
+	free(stack.frames);
+	free(stack.path.data);
+	free_dir_buffers(&stack.buffers);
+}
+
+/*
+ * Release a reference to `ref`, closing its directory when it was the last.
+ */
+void
+release_dir_ref(struct dir_ref *ref)
+{
+	if (ref == NULL || atomic_fetch_sub(&ref->refs, 1) > 1) {
+		return;
+	}
+
+	close_directory(ref->fd);
+	free(ref);
+}
+
+/*
+ * Open the directory of `job`, relative to its parent directory, and release
+ * the reference the job held on the parent.
+ * Returns the referenced directory, or `NULL` if it could not be opened.
+ */
+struct dir_ref *
+open_job_directory(struct walk_job *job)
+{
+	int parent_fd = job->parent == NULL ? AT_FDCWD : job->parent->fd;
+	int fd = openat(parent_fd,
+	                job->name,
+	                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	release_dir_ref(job->parent);
+	job->parent = NULL;
+
+	if (fd == GENERIC_ERROR_CODE) {
+		fprintf(stderr,
+		        "Failed to open directory '%s': %s\n",
+		        job->path,
+		        strerror(errno));
+		return NULL;
+	}
+
+	struct dir_ref *ref = malloc(sizeof(struct dir_ref));
+	if (ref == NULL) {
+		perror("Error: could not allocate directory reference");
+		close(fd);
+		return NULL;
+	}
+
+	ref->fd = fd;
+	atomic_init(&ref->refs, 1);
+	return ref;
+}
+
+/*
+ * Append `entity_name` to `result`, growing it when it is full.
+ * Returns the new entry, or `NULL` if it could not be allocated.
+ */
+struct result_entry *
+add_result_entry(struct result_dir *result, const char *entity_name)
+{
+	if (result->count == result->capacity) {
+		size_t capacity = result->capacity == 0
+		                          ? RESULT_DIR_INITIAL_CAPACITY
+		                          : result->capacity * 2;
+		struct result_entry *entries =
+		        realloc(result->entries,
+		                capacity * sizeof(struct result_entry));
+		if (entries == NULL) {
+			perror("Error: could not grow the directory entries");
+			return NULL;
+		}
+		result->entries = entries;
+		result->capacity = capacity;
+	}
+
+	struct result_entry *entry = &result->entries[result->count];
+	entry->name = strdup(entity_name);
+	if (entry->name == NULL) {
+		perror("Error: could not allocate entity name");
+		return NULL;
+	}
+	entry->is_match = false;
+	entry->tags = NULL;
+	entry->dir = NULL;
+	result->count++;
+	return entry;
+}
+
+/*
+ * Compare two result entries by name, in byte order, for `qsort`.
+ */
+int
+compare_result_entries(const void *a, const void *b)
+{
+	const struct result_entry *entry_a = a;
+	const struct result_entry *entry_b = b;
+	return strcmp(entry_a->name, entry_b->name);
+}
+
+/*
+ * Print in preorder the matches found inside `result`, whose path is
+ * `parent_path`, and release it.
+ */
+void
+print_result_dir(struct result_dir *result, const char *parent_path)
+{
+	for (size_t i = 0; i < result->count; i++) {
+		struct result_entry *entry = &result->entries[i];
+		char fullpath[PATH_MAX] = { STRING_NULL_TERMINATOR };
+		build_fullpath(fullpath, parent_path, entry->name);
+
+		if (entry->is_match) {
+			printf("%s%s\n",
+			       fullpath,
+			       entry->tags == NULL ? "" : entry->tags);
+		}
+		if (entry->dir != NULL) {
+			print_result_dir(entry->dir, fullpath);
+			free(entry->dir);
+		}
+		free(entry->name);
+		free(entry->tags);
+	}
+	free(result->entries);
+}
+
+/*
+ * Add the line `fullpath`, followed by the phrases in `tags`, to the `output`
+ * buffer of a walker, writing the buffer to stdout first if the line does not
+ * fit. Lines are only written whole, so the output of different walkers is
+ * never interleaved mid line.
+ */
+void
+buffer_output_line(struct output_buffer *output,
+                   const char *fullpath,
+                   const char *tags)
+{
+	size_t path_len = strlen(fullpath);
+	size_t tags_len = strlen(tags);
+	size_t len = path_len + tags_len + 1;
+	if (output->len + len > OUTPUT_BUFFER_SIZE) {
+		fwrite(output->data, 1, output->len, stdout);
+		output->len = 0;
+	}
+	if (len > OUTPUT_BUFFER_SIZE) {
+		printf("%s%s\n", fullpath, tags);
+		return;
+	}
+
+	memcpy(output->data + output->len, fullpath, path_len);
+	memcpy(output->data + output->len + path_len, tags, tags_len);
+	output->len += len;
+	output->data[output->len - 1] = '\n';
+}
+
+/*
+ * Append `job` at the owner end of `deque`, growing it when it is full.
+ * Returns `SUCCESS` if the job was queued, otherwise returns `FAILED`.
+ */
+int
+push_job(struct job_deque *deque, struct walk_job job)
+{
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->tail == deque->capacity && deque->head > 0) {
+		/* Reclaim the slots already stolen from the front */
+		memmove(deque->jobs,
+		        deque->jobs + deque->head,
+		        (deque->tail - deque->head) * sizeof(struct walk_job));
+		deque->tail -= deque->head;
+		deque->head = 0;
+	}
+
+	if (deque->tail == deque->capacity) {
+		size_t capacity = deque->capacity == 0
+		                          ? JOB_DEQUE_INITIAL_CAPACITY
+		                          : deque->capacity * 2;
+		struct walk_job *jobs = realloc(
+		        deque->jobs, capacity * sizeof(struct walk_job));
+		if (jobs == NULL) {
+			pthread_mutex_unlock(&deque->lock);
+			perror("Error: could not grow the jobs queue");
+			return FAILED;
+		}
+		deque->jobs = jobs;
+		deque->capacity = capacity;
+	}
+
+	deque->jobs[deque->tail++] = job;
+	pthread_mutex_unlock(&deque->lock);
+	return SUCCESS;
+}
+
+/*
+ * Take a job from `deque` into `job`, from the owner end (the most recently
+ * pushed, so each walker goes depth first) when `is_owner` is set, or from the
+ * opposite end when stealing, which takes the shallowest directories and so
+ * the largest pieces of work.
+ * Returns `true` if a job was taken, `false` if `deque` is empty.
+ */
+bool
+take_job(struct job_deque *deque, bool is_owner, struct walk_job *job)
+{
+	bool found = false;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->head < deque->tail) {
+		*job = is_owner ? deque->jobs[--deque->tail]
+		                : deque->jobs[deque->head++];
+		found = true;
+	}
+	if (deque->head == deque->tail) {
+		deque->head = 0;
+		deque->tail = 0;
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+/*
+ * Queue `job` into the deque of the walker `walker_id` and wake up an idle
+ * walker to steal it.
+ * Returns `SUCCESS` if the job was queued, otherwise returns `FAILED`.
+ */
+int
+submit_job(struct walk_pool *pool, int walker_id, struct walk_job job)
+{
+	atomic_fetch_add(&pool->pending_jobs, 1);
+	if (push_job(&pool->deques[walker_id], job) == FAILED) {
+		atomic_fetch_sub(&pool->pending_jobs, 1);
+		return FAILED;
+	}
+
+	pthread_mutex_lock(&pool->idle_lock);
+	atomic_fetch_add(&pool->queued_jobs, 1);
+	pthread_cond_signal(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+	return SUCCESS;
+}
+
+/*
+ * Mark a job taken by a walker as done, waking up every idle walker when it
+ * was the last pending one.
+ */
+void
+finish_job(struct walk_pool *pool, struct walk_job *job)
+{
+	free(job->name);
+	free(job->path);
+	free_ignore_state(&job->ignore);
+
+	if (atomic_fetch_sub(&pool->pending_jobs, 1) == 1) {
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_broadcast(&pool->idle_cond);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+/*
+ * Get the next job for the walker `walker_id`, taking it from its own deque
+ * first and stealing from the other walkers' deques otherwise. Sleeps while
+ * there is no job queued but some directory is still being read, as it may
+ * queue more.
+ * Returns `true` if a job was stored in `job`, `false` when the walk is over.
+ */
+bool
+next_job(struct walk_pool *pool, int walker_id, struct walk_job *job)
+{
+	while (true) {
+		for (int i = 0; i < pool->walkers_count; i++) {
+			int victim = (walker_id + i) % pool->walkers_count;
+			if (take_job(&pool->deques[victim], i == 0, job)) {
+				atomic_fetch_sub(&pool->queued_jobs, 1);
+				return true;
+			}
+		}
+
+		pthread_mutex_lock(&pool->idle_lock);
+		while (atomic_load(&pool->queued_jobs) == 0 &&
+		       atomic_load(&pool->pending_jobs) > 0) {
+			pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+		}
+		bool is_done = atomic_load(&pool->pending_jobs) == 0;
+		pthread_mutex_unlock(&pool->idle_lock);
+
+		if (is_done) {
+			return false;
+		}
+	}
+}
+
+/*
+ * Queue the subdirectory `entity_name` of the directory of `job`, referenced
+ * by `directory`, whose full path is `fullpath` and whose ignore rules are
+ * `ignore`, which the job takes over. In sorted mode its entities are stored
+ * in `result`.
+ * Returns `SUCCESS` if the subdirectory was queued, otherwise returns `FAILED`.
+ */
+int
+submit_subdirectory(struct walker *walker,
+                    struct dir_ref *directory,
+                    const char *entity_name,
+                    const char *fullpath,
+                    struct result_dir *result,
+                    struct ignore_state *ignore)
+{
+	struct walk_job child = {
+		.parent = directory,
+		.name = strdup(entity_name),
+		.path = strdup(fullpath),
+		.result = result,
+		.ignore = *ignore,
+	};
+	if (child.name == NULL || child.path == NULL) {
+		perror("Error: could not allocate directory job");
+		free(child.name);
+		free(child.path);
+		free_ignore_state(ignore);
+		return FAILED;
+	}
+
+	atomic_fetch_add(&directory->refs, 1);
+	if (submit_job(walker->pool, walker->id, child) == FAILED) {
+		atomic_fetch_sub(&directory->refs, 1);
+		free(child.name);
+		free(child.path);
+		free_ignore_state(ignore);
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Read all the entities of the directory of `job`: the ones containing the
+ * phrase are printed through the walker output buffer (or stored in the job
+ * result in sorted mode) and the subdirectories that are not blacklisted are
+ * queued for any walker to read.
+ * Returns `SUCCESS` if the directory was read entirely, otherwise returns
+ * `FAILED`.
+ */
+int
+walk_directory(struct walker *walker, struct walk_job *job)
+{
+	struct walk_pool *pool = walker->pool;
+	struct dir_ref *directory = open_job_directory(job);
+	if (directory == NULL) {
+		return FAILED;
+	}
+	load_ignore_files(pool->search, &job->ignore, directory->fd, job->path);
+
+	int res = SUCCESS;
+	struct dir_reader reader = {
+		.fd = directory->fd,
+		.buffer = walker->dir_buffer,
+		.len = 0,
+		.pos = 0,
+	};
+	while (true) {
+		struct linux_dirent64 *entity = NULL;
+		if (next_dir_entity(&reader, &entity) == FAILED) {
+			fprintf(stderr,
+			        "Error while reading from directory '%s': %s\n",
+			        job->path,
+			        strerror(errno));
+			res = FAILED;
+			break;
+		}
+		if (entity == NULL) {
+			break;
+		}
+
+		/* The "." and ".." entries are neither matched nor walked */
+		if (is_directory_blacklisted(entity->d_name)) {
+			continue;
+		}
+
+		bool is_subdirectory =
+		        is_directory_entity(directory->fd, entity);
+		struct ignore_state child_ignore = { NULL, 0, 0, 0 };
+		if (step_ignore_state(&job->ignore,
+		                      entity->d_name,
+		                      is_subdirectory,
+		                      is_subdirectory ? &child_ignore : NULL)) {
+			continue;
+		}
+
+		bool is_match = match_entity(pool->search,
+		                             &walker->scratch,
+		                             job->path,
+		                             entity->d_name) &&
+		                match_metadata(pool->search,
+		                               directory->fd,
+		                               entity,
+		                               job->path);
+		if (!is_subdirectory && !is_match) {
+			continue;
+		}
+
+		char fullpath[PATH_MAX] = { STRING_NULL_TERMINATOR };
+		build_fullpath(fullpath, job->path, entity->d_name);
+
+		struct result_dir *child_result = NULL;
+		if (job->result != NULL) {
+			struct result_entry *entry =
+			        add_result_entry(job->result, entity->d_name);
+			if (entry == NULL) {
+				free_ignore_state(&child_ignore);
+				res = FAILED;
+				continue;
+			}
+			entry->is_match = is_match;
+			if (is_match && walker->scratch.tags[0] !=
+			                        STRING_NULL_TERMINATOR) {
+				entry->tags = strdup(walker->scratch.tags);
+				if (entry->tags == NULL) {
+					perror("Error: could not allocate "
+					       "phrases found");
+					res = FAILED;
+				}
+			}
+			if (is_subdirectory) {
+				entry->dir =
+				        calloc(1, sizeof(struct result_dir));
+				if (entry->dir == NULL) {
+					perror("Error: could not allocate "
+					       "directory entries");
+					free_ignore_state(&child_ignore);
+					res = FAILED;
+					continue;
+				}
+				child_result = entry->dir;
+			}
+		} else if (is_match) {
+			buffer_output_line(&walker->output,
+			                   fullpath,
+			                   walker->scratch.tags);
+		}
+
+		if (is_subdirectory &&
+		    submit_subdirectory(walker,
+		                        directory,
+		                        entity->d_name,
+		                        fullpath,
+		                        child_result,
+		                        &child_ignore) == FAILED) {
+			res = FAILED;
+		}
+	}
+
+	if (job->result != NULL) {
+		qsort(job->result->entries,
+		      job->result->count,
+		      sizeof(struct result_entry),
+		      compare_result_entries);
+	}
+
+	release_dir_ref(directory);
+	return res;
+}
+
+/*
+ * Walker thread: read directories until the walk is over, counting the ones
+ * that could not be read, and write whatever output is left buffered.
+ */
+void *
+run_walker(void *arg)
+{
+	struct walker *walker = arg;
+	struct walk_pool *pool = walker->pool;
+	struct walk_job job;
+
+	while (next_job(pool, walker->id, &job)) {
+		if (walk_directory(walker, &job) == FAILED) {
+			atomic_fetch_add(&pool->failures, 1);
+		}
+		finish_job(pool, &job);
+	}
+
+	fwrite(walker->output.data, 1, walker->output.len, stdout);
+	walker->output.len = 0;
+	return NULL;
+}
+
+/*
+ * Walk the working directory with `options->jobs` walker threads, printing the
+ * full path of each entity that contains a phrase of `search` in its name.
+ * The walkers share the
+ * directories to read with work stealing, so the order of the output is not
+ * deterministic unless `options->sorted` is set: then the entities found are
+ * kept in a tree, every directory sorted by its walker, and printed once the
+ * walk is over.
+ * Returns `SUCCESS` if every directory was read, otherwise returns `FAILED`.
+ */
+int
+walk_in_parallel(const struct find_options *options,
+                 const struct search *search)
+{
+	struct walk_pool pool = {
+		.options = options,
+		.search = search,
+		.walkers_count = options->jobs,
+	};
+	atomic_init(&pool.queued_jobs, 0);
+	atomic_init(&pool.pending_jobs, 0);
+	atomic_init(&pool.failures, 0);
+	pthread_mutex_init(&pool.idle_lock, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+
+	struct result_dir root_result = { NULL, 0, 0 };
+	struct walk_job root = {
+		.parent = NULL,
+		.name = strdup(WD_PATH_ALIAS),
+		.path = strdup(WD_PATH_ALIAS),
+		.result = options->sorted ? &root_result : NULL,
+	};
+	init_ignore_state(search, &root.ignore);
+	pool.deques = calloc(pool.walkers_count, sizeof(struct job_deque));
+	pool.walkers = calloc(pool.walkers_count, sizeof(struct walker));
+	if (pool.deques == NULL || pool.walkers == NULL || root.name == NULL ||
+	    root.path == NULL) {
+		perror("Error: could not allocate the walker pool");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < pool.walkers_count; i++) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+	}
+	if (submit_job(&pool, 0, root) == FAILED) {
+		exit(EXIT_FAILURE);
+	}
+
+	int started = 0;
+	for (; started < pool.walkers_count; started++) {
+		pool.walkers[started].id = started;
+		pool.walkers[started].pool = &pool;
+		pool.walkers[started].dir_buffer = malloc(DIR_BUFFER_SIZE);
+		if (pool.walkers[started].dir_buffer == NULL) {
+			perror("Error: could not allocate a directory buffer");
+			atomic_fetch_add(&pool.failures, 1);
+			break;
+		}
+		if (init_match_scratch(&pool.walkers[started].scratch,
+		                       search) == FAILED) {
+			free_match_scratch(&pool.walkers[started].scratch);
+			free(pool.walkers[started].dir_buffer);
+			atomic_fetch_add(&pool.failures, 1);
+			break;
+		}
+		int res = pthread_create(&pool.walkers[started].thread,
+		                         NULL,
+		                         run_walker,
+		                         &pool.walkers[started]);
+		if (res != 0) {
+			fprintf(stderr,
+			        "Error: could not start walker thread: %s\n",
+			        strerror(res));
+			free_match_scratch(&pool.walkers[started].scratch);
+			free(pool.walkers[started].dir_buffer);
+			atomic_fetch_add(&pool.failures, 1);
+			break;
+		}
+	}
+	if (started == 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(pool.walkers[i].thread, NULL);
+		free(pool.walkers[i].dir_buffer);
+		free_match_scratch(&pool.walkers[i].scratch);
+	}
+
+	if (options->sorted) {
+		print_result_dir(&root_result, WD_PATH_ALIAS);
+	}
+	fflush(stdout);
+
+	for (int i = 0; i < pool.walkers_count; i++) {
+		pthread_mutex_destroy(&pool.deques[i].lock);
+		free(pool.deques[i].jobs);
+	}
+	free(pool.deques);
+	free(pool.walkers);
+	pthread_cond_destroy(&pool.idle_cond);
+	pthread_mutex_destroy(&pool.idle_lock);
+
+	return atomic_load(&pool.failures) == 0 ? SUCCESS : FAILED;
+}
+
+/*
+ * Write `len` bytes of `data` at the end of the index written by `writer`,
+ * unless a previous write failed.
+ */
+void
+write_index_bytes(struct index_writer *writer, const void *data, size_t len)
+{
+	if (writer->has_failed) {
+		return;
+	}
+	if (fwrite(data, 1, len, writer->file) != len) {
+		writer->has_failed = true;
+		return;
+	}
+	writer->offset += len;
+}
+
+/*
+ * Write `value` as a LEB128 varint: 7 bits per byte, the lowest first, with
+ * the high bit set on every byte but the last.
+ */
+void
+write_index_varint(struct index_writer *writer, uint64_t value)
+{
+	uint8_t bytes[10];
+	size_t len = 0;
+	do {
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		bytes[len++] |= value != 0 ? 0x80 : 0;
+	} while (value != 0);
+	write_index_bytes(writer, bytes, len);
+}
+
+/*
+ * Pad the index written by `writer` with zeros up to a multiple of 8 bytes, so
+ * the next section can be read in place once mapped.
+ */
+void
+align_index_writer(struct index_writer *writer)
+{
+	static const uint8_t padding[INDEX_ALIGNMENT] = { 0 };
+	size_t misalignment = writer->offset % INDEX_ALIGNMENT;
+	if (misalignment != 0) {
+		write_index_bytes(
+		        writer, padding, INDEX_ALIGNMENT - misalignment);
+	}
+}
+
+/*
+ * Read a LEB128 varint at `*pos` into `value`, moving `*pos` past it, without
+ * reading at or past `end`.
+ * Returns `true` if it was read, `false` if it is truncated or too long.
+ */
+bool
+read_index_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value)
+{
+	*value = 0;
+	for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+		uint8_t byte = *(*pos)++;
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Compare the index keys of two paths, each given by its directory part
+ * (`dir_len` bytes, empty for the entities of the root) and its name: by
+ * directory first and then by name, so the entities of every directory are
+ * next to each other in the index.
+ */
+int
+compare_index_keys(const char *dir_a,
+                   size_t dir_a_len,
+                   const char *name_a,
+                   const char *dir_b,
+                   size_t dir_b_len,
+                   const char *name_b)
+{
+	size_t len = dir_a_len < dir_b_len ? dir_a_len : dir_b_len;
+	int res = memcmp(dir_a, dir_b, len);
+	if (res != 0) {
+		return res;
+	}
+	if (dir_a_len != dir_b_len) {
+		return dir_a_len < dir_b_len ? -1 : 1;
+	}
+	return strcmp(name_a, name_b);
+}
+
+/*
+ * Compare two entities of an index being built, by their index keys, for
+ * `qsort`.
+ */
+int
+compare_index_entries(const void *a, const void *b)
+{
+	const struct index_entry *entry_a = a;
+	const struct index_entry *entry_b = b;
+	return compare_index_keys(entry_a->path,
+	                          entry_a->dir_len,
+	                          entry_a->path + entry_a->name_offset,
+	                          entry_b->path,
+	                          entry_b->dir_len,
+	                          entry_b->path + entry_b->name_offset);
+}
+
+/*
+ * Open the index at `filepath` and map it into `index`, checking its header
+ * and that its sections are inside the file. If `is_quiet` is set, nothing is
+ * printed when it cannot be opened.
+ * Returns `SUCCESS` if it was opened, otherwise returns `FAILED`.
+ */
+int
+open_index(struct index *index, const char *filepath, bool is_quiet)
+{
+	int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (fd == GENERIC_ERROR_CODE) {
+		if (!is_quiet) {
+			fprintf(stderr,
+			        "Error: could not open index '%s': %s\n",
+			        filepath,
+			        strerror(errno));
+		}
+		return FAILED;
+	}
+
+	struct stat info;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &info) != GENERIC_ERROR_CODE &&
+	    (size_t) info.st_size >= sizeof(struct index_header)) {
+		data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		if (!is_quiet) {
+			fprintf(stderr,
+			        "Error: could not map index '%s'\n",
+			        filepath);
+		}
+		return FAILED;
+	}
+
+	index->data = data;
+	index->size = info.st_size;
+	index->header = data;
+	const struct index_header *header = index->header;
+	uint64_t blocks_size = header->blocks_count * sizeof(uint64_t);
+	uint64_t trigrams_size =
+	        header->trigrams_count * sizeof(struct index_trigram);
+	bool is_valid =
+	        memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+	        header->version == INDEX_VERSION &&
+	        header->block_size == INDEX_BLOCK_SIZE &&
+	        header->size == index->size &&
+	        header->blocks_count <= index->size &&
+	        header->trigrams_count <= index->size &&
+	        header->root_offset >= sizeof(struct index_header) &&
+	        header->root_offset < header->entries_offset &&
+	        header->entries_offset <= header->blocks_offset &&
+	        header->blocks_offset % INDEX_ALIGNMENT == 0 &&
+	        header->blocks_count ==
+	                (header->entries_count + INDEX_BLOCK_SIZE - 1) /
+	                        INDEX_BLOCK_SIZE &&
+	        header->blocks_offset + blocks_size <=
+	                header->postings_offset &&
+	        header->postings_offset <= header->trigrams_offset &&
+	        header->trigrams_offset % INDEX_ALIGNMENT == 0 &&
+	        header->trigrams_offset + trigrams_size <= index->size &&
+	        memchr(index->data + header->root_offset,
+	               STRING_NULL_TERMINATOR,
+	               header->entries_offset - header->root_offset) != NULL;
+	if (!is_valid) {
+		if (!is_quiet) {
+			fprintf(stderr,
+			        "Error: '%s' is not a valid index\n",
+			        filepath);
+		}
+		munmap(data, index->size);
+		return FAILED;
+	}
+
+	index->root = (const char *) index->data + header->root_offset;
+	index->blocks =
+	        (const uint64_t *) (index->data + header->blocks_offset);
+	index->trigrams = (const struct index_trigram *) (
+	        index->data + header->trigrams_offset);
+	return SUCCESS;
+}
+
+/*
+ * Unmap `index`.
+ */
+void
+close_index(struct index *index)
+{
+	munmap((void *) index->data, index->size);
+}
+
+/*
+ * Move `cursor` to the first entity of the front coding block `block` of its
+ * index, which is stored whole.
+ */
+void
+seek_index_block(struct index_cursor *cursor, uint64_t block)
+{
+	const struct index_header *header = cursor->index->header;
+	cursor->id = block * INDEX_BLOCK_SIZE;
+	cursor->next = NULL;
+	cursor->path_len = 0;
+	if (block < header->blocks_count &&
+	    cursor->index->blocks[block] <
+	            header->blocks_offset - header->entries_offset) {
+		cursor->next = cursor->index->data + header->entries_offset +
+		               cursor->index->blocks[block];
+	}
+}
+
+/*
+ * Decode the entity at `cursor`, which shares the first bytes of its path with
+ * the previous entity, and move past it. `cursor->id` is left as the id of
+ * the next entity.
+ * Returns `true` if an entity was decoded, `false` at the end of the index or
+ * if it is corrupt, in which case `cursor->is_corrupt` is set.
+ */
+bool
+read_index_entry(struct index_cursor *cursor)
+{
+	const struct index_header *header = cursor->index->header;
+	const uint8_t *end = cursor->index->data + header->blocks_offset;
+	if (cursor->id >= header->entries_count) {
+		return false;
+	}
+
+	uint64_t shared = 0, suffix_len = 0;
+	if (cursor->next == NULL ||
+	    !read_index_varint(&cursor->next, end, &shared) ||
+	    !read_index_varint(&cursor->next, end, &suffix_len) ||
+	    shared > cursor->path_len || suffix_len >= PATH_MAX - shared ||
+	    suffix_len + 1 > (uint64_t) (end - cursor->next)) {
+		cursor->is_corrupt = true;
+		return false;
+	}
+
+	memcpy(cursor->path + shared, cursor->next, suffix_len);
+	cursor->next += suffix_len;
+	cursor->path_len = shared + suffix_len;
+	cursor->path[cursor->path_len] = STRING_NULL_TERMINATOR;
+
+	uint8_t flags = *cursor->next++;
+	cursor->is_dir = (flags & INDEX_ENTRY_IS_DIR) != 0;
+	uint64_t mtime_sec = 0, mtime_nsec = 0;
+	if (cursor->is_dir &&
+	    (!read_index_varint(&cursor->next, end, &mtime_sec) ||
+	     !read_index_varint(&cursor->next, end, &mtime_nsec))) {
+		cursor->is_corrupt = true;
+		return false;
+	}
+	cursor->mtime.tv_sec = mtime_sec;
+	cursor->mtime.tv_nsec = mtime_nsec;
+
+	char *slash = memrchr(cursor->path, '/', cursor->path_len);
+	cursor->dir_len = slash == NULL ? 0 : slash - cursor->path;
+	cursor->name_offset = slash == NULL ? 0 : cursor->dir_len + 1;
+	cursor->id++;
+	return true;
+}
+
+/*
+ * Move `cursor` to the first entity of its index whose key is not lower than
+ * the directory `dir` (`dir_len` bytes) and the name `name`, leaving it
+ * decoded in `cursor`.
+ * Returns `true` if there is such an entity, `false` otherwise.
+ */
+bool
+seek_index_key(struct index_cursor *cursor,
+               const char *dir,
+               size_t dir_len,
+               const char *name)
+{
+	const struct index_header *header = cursor->index->header;
+
+	/* Find the last block starting below the key */
+	uint64_t low = 0, high = header->blocks_count;
+	while (high - low > 1) {
+		uint64_t middle = low + (high - low) / 2;
+		seek_index_block(cursor, middle);
+		if (!read_index_entry(cursor)) {
+			return false;
+		}
+		if (compare_index_keys(cursor->path,
+		                       cursor->dir_len,
+		                       cursor->path + cursor->name_offset,
+		                       dir,
+		                       dir_len,
+		                       name) < 0) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+
+	seek_index_block(cursor, low);
+	while (read_index_entry(cursor)) {
+		if (compare_index_keys(cursor->path,
+		                       cursor->dir_len,
+		                       cursor->path + cursor->name_offset,
+		                       dir,
+		                       dir_len,
+		                       name) >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Add to `builder` the entity `entity_name` of the directory `dir_path` (empty
+ * for the root).
+ * Returns `SUCCESS` if it was added, otherwise returns `FAILED`.
+ */
+int
+add_index_entry(struct index_builder *builder,
+                const char *dir_path,
+                const char *entity_name,
+                bool is_dir)
+{
+	if (builder->count == builder->capacity) {
+		size_t capacity = builder->capacity == 0
+		                          ? INDEX_ENTRIES_INITIAL_CAPACITY
+		                          : builder->capacity * 2;
+		struct index_entry *entries =
+		        realloc(builder->entries,
+		                capacity * sizeof(struct index_entry));
+		if (entries == NULL) {
+			perror("Error: could not grow the index entries");
+			return FAILED;
+		}
+		builder->entries = entries;
+		builder->capacity = capacity;
+	}
+
+	size_t dir_len = strlen(dir_path);
+	size_t name_offset = dir_len == 0 ? 0 : dir_len + 1;
+	size_t len = name_offset + strlen(entity_name);
+	if (len >= PATH_MAX) {
+		fprintf(stderr,
+		        "Error: path too long to index '%s/%s'\n",
+		        dir_path,
+		        entity_name);
+		return FAILED;
+	}
+
+	struct index_entry *entry = &builder->entries[builder->count];
+	entry->path = malloc(len + 1);
+	if (entry->path == NULL) {
+		perror("Error: could not allocate path");
+		return FAILED;
+	}
+	if (dir_len > 0) {
+		memcpy(entry->path, dir_path, dir_len);
+		entry->path[dir_len] = '/';
+	}
+	strcpy(entry->path + name_offset, entity_name);
+	entry->dir_len = dir_len;
+	entry->name_offset = name_offset;
+	entry->is_dir = is_dir;
+	entry->mtime.tv_sec = 0;
+	entry->mtime.tv_nsec = 0;
+	builder->count++;
+	return SUCCESS;
+}
+
+/*
+ * Drop the entities of `builder` added from `first` on.
+ */
+void
+drop_index_entries(struct index_builder *builder, size_t first)
+{
+	for (size_t i = first; i < builder->count; i++) {
+		free(builder->entries[i].path);
+	}
+	builder->count = first;
+}
+
+/*
+ * Add to `builder` the entities of the directory `dir_path` (empty for the
+ * root) as listed by the previous index, if the directory was not modified
+ * since: its modification time `mtime` is the one the previous index stored.
+ * Returns `true` if the entities were taken from the previous index, `false`
+ * if the directory has to be read.
+ */
+bool
+reuse_index_entries(struct index_builder *builder,
+                    const char *dir_path,
+                    const struct timespec *mtime)
+{
+	if (builder->old == NULL) {
+		return false;
+	}
+
+	struct index_cursor cursor = { .index = builder->old };
+	size_t dir_len = strlen(dir_path);
+	struct timespec old_mtime = {
+		.tv_sec = builder->old->header->root_mtime_sec,
+		.tv_nsec = builder->old->header->root_mtime_nsec,
+	};
+	if (dir_len > 0) {
+		const char *slash = memrchr(dir_path, '/', dir_len);
+		size_t parent_len = slash == NULL ? 0 : slash - dir_path;
+		const char *name = slash == NULL ? dir_path : slash + 1;
+		if (!seek_index_key(&cursor, dir_path, parent_len, name) ||
+		    strcmp(cursor.path, dir_path) != 0 || !cursor.is_dir) {
+			return false;
+		}
+		old_mtime = cursor.mtime;
+	}
+	if (old_mtime.tv_sec != mtime->tv_sec ||
+	    old_mtime.tv_nsec != mtime->tv_nsec) {
+		return false;
+	}
+
+	size_t first = builder->count;
+	bool has_entry = seek_index_key(&cursor, dir_path, dir_len, "");
+	while (has_entry && cursor.dir_len == dir_len &&
+	       memcmp(cursor.path, dir_path, dir_len) == 0) {
+		if (add_index_entry(builder,
+		                    dir_path,
+		                    cursor.path + cursor.name_offset,
+		                    cursor.is_dir) == FAILED) {
+			drop_index_entries(builder, first);
+			return false;
+		}
+		has_entry = read_index_entry(&cursor);
+	}
+
+	if (cursor.is_corrupt) {
+		drop_index_entries(builder, first);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Add to `builder` the entities of the directory `directory_fd`, found at
+ * `dir_path` (empty for the root) and `depth`, reading them with getdents64.
+ * Returns `SUCCESS` if the directory was read, otherwise returns `FAILED`.
+ */
+int
+scan_index_entries(struct index_builder *builder,
+                   int directory_fd,
+                   const char *dir_path,
+                   size_t depth)
+{
+	struct dir_reader reader = {
+		.fd = directory_fd,
+		.buffer = get_dir_buffer(&builder->buffers, depth),
+		.len = 0,
+		.pos = 0,
+	};
+
+	while (true) {
+		struct linux_dirent64 *entity = NULL;
+		if (next_dir_entity(&reader, &entity) == FAILED) {
+			fprintf(stderr,
+			        "Error while reading from directory '%s': %s\n",
+			        dir_path[0] == STRING_NULL_TERMINATOR
+			                ? WD_PATH_ALIAS
+			                : dir_path,
+			        strerror(errno));
+			return FAILED;
+		}
+		if (entity == NULL) {
+			break;
+		}
+		if (is_directory_blacklisted(entity->d_name)) {
+			continue;
+		}
+
+		bool is_dir = is_directory_entity(directory_fd, entity);
+		if (add_index_entry(
+		            builder, dir_path, entity->d_name, is_dir) ==
+		    FAILED) {
+			return FAILED;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/*
+ * Recursively add to `builder` the entities inside the directory
+ * `directory_fd`, found at `dir_path` (empty for the root) and `depth` and
+ * last modified at `mtime`. The entities of a directory not modified since
+ * the previous index are taken from it; only the modified ones are read.
+ * Every subdirectory is still opened to check its own modification time.
+ * The directories that cannot be read are skipped and counted in
+ * `builder->failures`.
+ */
+void
+index_directory(struct index_builder *builder,
+                int directory_fd,
+                const char *dir_path,
+                const struct timespec *mtime,
+                size_t depth)
+{
+	size_t first = builder->count;
+	if (!reuse_index_entries(builder, dir_path, mtime) &&
+	    scan_index_entries(builder, directory_fd, dir_path, depth) ==
+	            FAILED) {
+		builder->failures++;
+	}
+	size_t last = builder->count;
+
+	for (size_t i = first; i < last; i++) {
+		/* `entries` may move while indexing a subdirectory */
+		struct index_entry *entry = &builder->entries[i];
+		if (!entry->is_dir) {
+			continue;
+		}
+
+		int inner_directory_fd =
+		        openat(directory_fd,
+		               entry->path + entry->name_offset,
+		               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		struct stat info;
+		if (inner_directory_fd == GENERIC_ERROR_CODE ||
+		    fstat(inner_directory_fd, &info) == GENERIC_ERROR_CODE) {
+			fprintf(stderr,
+			        "Failed to open directory '%s': %s\n",
+			        entry->path,
+			        strerror(errno));
+			if (inner_directory_fd != GENERIC_ERROR_CODE) {
+				close(inner_directory_fd);
+			}
+			builder->failures++;
+			continue;
+		}
+
+		entry->mtime = info.st_mtim;
+		index_directory(builder,
+		                inner_directory_fd,
+		                entry->path,
+		                &info.st_mtim,
+		                depth + 1);
+		close_directory(inner_directory_fd);
+	}
+}
+
+/*
+ * Write the paths of the sorted entities of `builder` front coded: each one
+ * stores only the bytes that differ from the previous path, except the first
+ * of every block of `INDEX_BLOCK_SIZE`, stored whole so decoding can start
+ * there. `blocks` receives the offset of every block.
+ */
+void
+write_index_entries(struct index_writer *writer,
+                    const struct index_builder *builder,
+                    uint64_t *blocks)
+{
+	uint64_t entries_offset = writer->offset;
+	const char *previous = "";
+
+	for (size_t i = 0; i < builder->count; i++) {
+		const struct index_entry *entry = &builder->entries[i];
+		size_t shared = 0;
+		if (i % INDEX_BLOCK_SIZE == 0) {
+			blocks[i / INDEX_BLOCK_SIZE] =
+			        writer->offset - entries_offset;
+		} else {
+			while (previous[shared] != STRING_NULL_TERMINATOR &&
+			       previous[shared] == entry->path[shared]) {
+				shared++;
+			}
+		}
+
+		size_t len = strlen(entry->path);
+		write_index_varint(writer, shared);
+		write_index_varint(writer, len - shared);
+		write_index_bytes(writer, entry->path + shared, len - shared);
+		uint8_t flags = entry->is_dir ? INDEX_ENTRY_IS_DIR : 0;
+		write_index_bytes(writer, &flags, sizeof(flags));
+		if (entry->is_dir) {
+			write_index_varint(writer, entry->mtime.tv_sec);
+			write_index_varint(writer, entry->mtime.tv_nsec);
+		}
+		previous = entry->path;
+	}
+}
+
+/*
+ * Store in `trigrams` the distinct trigrams of `entity_name`, with the letter
+ * case folded, each packed in the lowest 24 bits of a word.
+ * Returns the number of trigrams stored.
+ */
+size_t
+collect_name_trigrams(const char *entity_name, uint32_t trigrams[PATH_MAX])
+{
+	size_t count = 0;
+	size_t len = strlen(entity_name);
+
+	for (size_t i = 0; i + 2 < len; i++) {
+		uint32_t first = (uint8_t) fold_case(entity_name[i]);
+		uint32_t second = (uint8_t) fold_case(entity_name[i + 1]);
+		uint32_t third = (uint8_t) fold_case(entity_name[i + 2]);
+		uint32_t trigram = first << 16 | second << 8 | third;
+		bool is_repeated = false;
+		for (size_t j = 0; j < count && !is_repeated; j++) {
+			is_repeated = trigrams[j] == trigram;
+		}
+		if (!is_repeated) {
+			trigrams[count++] = trigram;
+		}
+	}
+	return count;
+}
+
+/*
+ * Write the posting list of every trigram found in the names of the entities
+ * of `builder`: the ids of the entities whose name contains it, ascending and
+ * delta encoded as varints. Then write the table of trigrams, sorted, with the
+ * offset of each list.
+ * Returns `SUCCESS` if they were written, otherwise returns `FAILED`.
+ */
+int
+write_index_postings(struct index_writer *writer,
+                     const struct index_builder *builder,
+                     struct index_header *header)
+{
+	/* Count the postings of every trigram, then turn the counts into the
+	 * start of each list in `ids`, filled in id order */
+	uint32_t *starts = calloc(INDEX_TRIGRAMS_SPACE + 1, sizeof(uint32_t));
+	uint32_t trigrams[PATH_MAX];
+	if (starts == NULL) {
+		perror("Error: could not allocate the trigram counts");
+		return FAILED;
+	}
+
+	uint64_t postings_count = 0;
+	for (size_t i = 0; i < builder->count; i++) {
+		const struct index_entry *entry = &builder->entries[i];
+		size_t count = collect_name_trigrams(
+		        entry->path + entry->name_offset, trigrams);
+		for (size_t j = 0; j < count; j++) {
+			starts[trigrams[j] + 1]++;
+		}
+		postings_count += count;
+	}
+	if (postings_count >= UINT32_MAX) {
+		fprintf(stderr, "Error: too many names to index\n");
+		free(starts);
+		return FAILED;
+	}
+
+	uint64_t trigrams_count = 0;
+	for (size_t t = 1; t <= INDEX_TRIGRAMS_SPACE; t++) {
+		trigrams_count += starts[t] != 0;
+		starts[t] += starts[t - 1];
+	}
+
+	uint32_t *ids = malloc((postings_count + 1) * sizeof(uint32_t));
+	struct index_trigram *table =
+	        malloc((trigrams_count + 1) * sizeof(struct index_trigram));
+	if (ids == NULL || table == NULL) {
+		perror("Error: could not allocate the trigram postings");
+		free(starts);
+		free(ids);
+		free(table);
+		return FAILED;
+	}
+
+	for (size_t i = 0; i < builder->count; i++) {
+		const struct index_entry *entry = &builder->entries[i];
+		size_t count = collect_name_trigrams(
+		        entry->path + entry->name_offset, trigrams);
+		for (size_t j = 0; j < count; j++) {
+			ids[starts[trigrams[j]]++] = i;
+		}
+	}
+
+	/* Each start was moved to the end of its list, the next list start */
+	header->postings_offset = writer->offset;
+	size_t table_len = 0;
+	uint32_t start = 0;
+	for (size_t t = 0; t < INDEX_TRIGRAMS_SPACE; t++) {
+		uint32_t end = starts[t];
+		if (end == start) {
+			continue;
+		}
+
+		table[table_len].trigram = t;
+		table[table_len].count = end - start;
+		table[table_len].offset =
+		        writer->offset - header->postings_offset;
+		table_len++;
+		uint32_t previous = 0;
+		for (uint32_t k = start; k < end; k++) {
+			write_index_varint(writer, ids[k] - previous);
+			previous = ids[k];
+		}
+		start = end;
+	}
+
+	align_index_writer(writer);
+	header->trigrams_offset = writer->offset;
+	header->trigrams_count = table_len;
+	write_index_bytes(
+	        writer, table, table_len * sizeof(struct index_trigram));
+
+	free(starts);
+	free(ids);
+	free(table);
+	return SUCCESS;
+}
+
+/*
+ * Write the sorted entities of `builder` as an index at `filepath`, for the
+ * root directory `root` last modified at `root_mtime`. The index is written
+ * to a temporary file first and renamed over `filepath`, so a query never
+ * sees it half written.
+ * Returns `SUCCESS` if it was written, otherwise returns `FAILED`.
+ */
+int
+write_index(const struct index_builder *builder,
+            const char *filepath,
+            const char *root,
+            const struct timespec *root_mtime)
+{
+	char tmp_filepath[PATH_MAX];
+	if (snprintf(tmp_filepath,
+	             sizeof(tmp_filepath),
+	             "%s%s",
+	             filepath,
+	             INDEX_TMP_SUFFIX) >= (int) sizeof(tmp_filepath)) {
+		fprintf(stderr, "Error: index path too long '%s'\n", filepath);
+		return FAILED;
+	}
+
+	struct index_writer writer = { fopen(tmp_filepath, "wb"), 0, false };
+	uint64_t blocks_count =
+	        (builder->count + INDEX_BLOCK_SIZE - 1) / INDEX_BLOCK_SIZE;
+	uint64_t *blocks = malloc((blocks_count + 1) * sizeof(uint64_t));
+	if (writer.file == NULL || blocks == NULL) {
+		perror("Error: could not create the index");
+		if (writer.file != NULL) {
+			fclose(writer.file);
+			unlink(tmp_filepath);
+		}
+		free(blocks);
+		return FAILED;
+	}
+
+	struct index_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.version = INDEX_VERSION;
+	header.block_size = INDEX_BLOCK_SIZE;
+	header.entries_count = builder->count;
+	header.blocks_count = blocks_count;
+	header.root_mtime_sec = root_mtime->tv_sec;
+	header.root_mtime_nsec = root_mtime->tv_nsec;
+	write_index_bytes(&writer, &header, sizeof(header));
+
+	header.root_offset = writer.offset;
+	write_index_bytes(&writer, root, strlen(root) + 1);
+	header.entries_offset = writer.offset;
+	write_index_entries(&writer, builder, blocks);
+	align_index_writer(&writer);
+	header.blocks_offset = writer.offset;
+	write_index_bytes(&writer, blocks, blocks_count * sizeof(uint64_t));
+	free(blocks);
+
+	int res = write_index_postings(&writer, builder, &header);
+	header.size = writer.offset;
+	if (res == SUCCESS && !writer.has_failed &&
+	    fseek(writer.file, 0, SEEK_SET) == 0) {
+		write_index_bytes(&writer, &header, sizeof(header));
+	}
+	if (fclose(writer.file) != 0) {
+		writer.has_failed = true;
+	}
+
+	if (res == SUCCESS &&
+	    (writer.has_failed ||
+	     rename(tmp_filepath, filepath) == GENERIC_ERROR_CODE)) {
+		perror("Error: could not write the index");
+		res = FAILED;
+	}
+	if (res == FAILED) {
+		unlink(tmp_filepath);
+	}
+	return res;
+}
+
+/*
+ * Build the index of the working directory at `filepath`. When there is
+ * already an index of the same directory there, the directories that were not
+ * modified since it was built are not read again.
+ * Returns `SUCCESS` if the index was built and every directory was read,
+ * otherwise returns `FAILED`.
+ */
+int
+build_index(const char *filepath)
+{
+	char root[PATH_MAX];
+	struct stat info;
+	int wd = open(WD_PATH_ALIAS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (wd == GENERIC_ERROR_CODE ||
+	    fstat(wd, &info) == GENERIC_ERROR_CODE ||
+	    getcwd(root, sizeof(root)) == NULL) {
+		perror("Error while opening directory");
+		exit(EXIT_FAILURE);
+	}
+
+	struct index old;
+	struct index_builder builder = { .old = NULL };
+	if (open_index(&old, filepath, true) == SUCCESS) {
+		if (strcmp(old.root, root) == 0) {
+			builder.old = &old;
+		} else {
+			close_index(&old);
+		}
+	}
+
+	index_directory(&builder, wd, "", &info.st_mtim, 0);
+	close_directory(wd);
+	free_dir_buffers(&builder.buffers);
+	if (builder.old != NULL) {
+		close_index(&old);
+	}
+
+	qsort(builder.entries,
+	      builder.count,
+	      sizeof(struct index_entry),
+	      compare_index_entries);
+	int res = write_index(&builder, filepath, root, &info.st_mtim);
+
+	drop_index_entries(&builder, 0);
+	free(builder.entries);
+	return res == SUCCESS && builder.failures == 0 ? SUCCESS : FAILED;
+}
+
+/*
+ * Find the posting list of `trigram` in `index`.
+ * Returns the entry of the trigram table, or `NULL` if no name has it.
+ */
+const struct index_trigram *
+find_index_trigram(const struct index *index, uint32_t trigram)
+{
+	uint64_t low = 0, high = index->header->trigrams_count;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (index->trigrams[middle].trigram < trigram) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	if (low < index->header->trigrams_count &&
+	    index->trigrams[low].trigram == trigram) {
+		return &index->trigrams[low];
+	}
+	return NULL;
+}
+
+/*
+ * Keep in `candidates` (`*count` ascending ids) the ones also found in the
+ * posting list `posting`, or store the whole list when `is_first` is set.
+ * Returns `SUCCESS` if the list could be read, otherwise returns `FAILED`.
+ */
+int
+intersect_postings(const struct index *index,
+                   const struct index_trigram *posting,
+                   uint32_t *candidates,
+                   size_t *count,
+                   bool is_first)
+{
+	const struct index_header *header = index->header;
+	const uint8_t *pos =
+	        index->data + header->postings_offset + posting->offset;
+	const uint8_t *end = index->data + header->trigrams_offset;
+	size_t kept = 0, next = 0;
+	uint64_t id = 0;
+
+	for (uint32_t i = 0; i < posting->count; i++) {
+		uint64_t delta = 0;
+		if (pos >= end || !read_index_varint(&pos, end, &delta)) {
+			return FAILED;
+		}
+		id += delta;
+		if (id >= header->entries_count) {
+			return FAILED;
+		}
+
+		if (is_first) {
+			candidates[kept++] = id;
+			continue;
+		}
+		while (next < *count && candidates[next] < id) {
+			next++;
+		}
+		if (next < *count && candidates[next] == id) {
+			candidates[kept++] = id;
+			next++;
+		}
+	}
+
+	*count = kept;
+	return SUCCESS;
+}
+
+/*
+ * Find in `index` the entities whose name may contain `text` (at least 3
+ * bytes long): the ones in the posting lists of all its trigrams, starting
+ * from the shortest list.
+ * Returns the ascending ids of the candidates in newly allocated memory, with
+ * their number in `count`, or `NULL` if they could not be found.
+ */
+uint32_t *
+find_index_candidates(const struct index *index,
+                      const char *text,
+                      size_t *count)
+{
+	uint32_t trigrams[PATH_MAX];
+	size_t trigrams_count = collect_name_trigrams(text, trigrams);
+	const struct index_trigram *postings[PATH_MAX];
+	size_t shortest = 0;
+
+	*count = 0;
+	for (size_t i = 0; i < trigrams_count; i++) {
+		postings[i] = find_index_trigram(index, trigrams[i]);
+		if (postings[i] == NULL) {
+			/* No name has this trigram, so none can match */
+			return calloc(1, sizeof(uint32_t));
+		}
+		if (postings[i]->count < postings[shortest]->count) {
+			shortest = i;
+		}
+	}
+
+	uint32_t *candidates =
+	        malloc((postings[shortest]->count + 1) * sizeof(uint32_t));
+	if (candidates == NULL) {
+		perror("Error: could not allocate the index candidates");
+		return NULL;
+	}
+	if (intersect_postings(
+	            index, postings[shortest], candidates, count, true) ==
+	    FAILED) {
+		free(candidates);
+		return NULL;
+	}
+	for (size_t i = 0; i < trigrams_count && *count > 0; i++) {
+		if (i != shortest &&
+		    intersect_postings(
+		            index, postings[i], candidates, count, false) ==
+		            FAILED) {
+			free(candidates);
+			return NULL;
+		}
+	}
+	return candidates;
+}
+
+/*
+ * Get some text the name of every entity matching `search` has to contain:
+ * its only phrase or else the literal required by its -name.
+ * Returns the text, or `NULL` if there is none.
+ */
+const char *
+get_search_literal(const struct search *search)
+{
+	if (search->patterns_count == 1) {
+		return search->patterns[0];
+	}
+	if (search->name.source != NULL && search->name.has_literal) {
+		return search->name.literal.needle;
+	}
+	return NULL;
+}
+
+/*
+ * Print the path of the entity decoded at `cursor`, followed by the phrases
+ * found, if it matches `search`.
+ */
+void
+print_index_entry_if_matches(struct index_cursor *cursor,
+                             const struct search *search,
+                             struct match_scratch *scratch)
+{
+	char parent_path[PATH_MAX];
+	if (cursor->name_offset > 0) {
+		memcpy(parent_path, cursor->path, cursor->dir_len);
+		parent_path[cursor->dir_len] = STRING_NULL_TERMINATOR;
+	} else {
+		strcpy(parent_path, WD_PATH_ALIAS);
+	}
+
+	print_if_contains_substring(cursor->path + cursor->name_offset,
+	                            cursor->path,
+	                            parent_path,
+	                            search,
+	                            scratch);
+}
+
+/*
+ * Print the paths in the index at `filepath` whose entity matches `search`.
+ * When a single phrase (or the literal of a -name) of 3 bytes or more has to
+ * be found, only the entities in the posting lists of its trigrams are
+ * decoded; otherwise every entity is. The paths are relative to the indexed
+ * directory, so it has to be the working directory, as for a walk.
+ * Returns `SUCCESS` if the index was read, otherwise returns `FAILED`.
+ */
+int
+query_index(const char *filepath, const struct search *search)
+{
+	struct index index;
+	if (open_index(&index, filepath, false) == FAILED) {
+		return FAILED;
+	}
+	char root[PATH_MAX];
+	if (getcwd(root, sizeof(root)) == NULL) {
+		perror("Error while opening directory");
+		close_index(&index);
+		return FAILED;
+	}
+	if (strcmp(index.root, root) != 0) {
+		fprintf(stderr,
+		        "Error: the index '%s' is of '%s', not of the working "
+		        "directory\n",
+		        filepath,
+		        index.root);
+		close_index(&index);
+		return FAILED;
+	}
+
+	struct match_scratch scratch;
+	if (init_match_scratch(&scratch, search) == FAILED) {
+		close_index(&index);
+		return FAILED;
+	}
+
+	const char *text = get_search_literal(search);
+	struct index_cursor cursor = { .index = &index };
+	seek_index_block(&cursor, 0);
+	int res = SUCCESS;
+	if (text != NULL && strlen(text) >= INDEX_TRIGRAM_LEN) {
+		size_t count = 0;
+		uint32_t *candidates =
+		        find_index_candidates(&index, text, &count);
+		res = candidates == NULL ? FAILED : SUCCESS;
+		for (size_t i = 0; i < count && res == SUCCESS; i++) {
+			/* Decode forward within a block, seek to skip blocks */
+			uint64_t block = candidates[i] / INDEX_BLOCK_SIZE;
+			if (block != cursor.id / INDEX_BLOCK_SIZE) {
+				seek_index_block(&cursor, block);
+			}
+			while (cursor.id <= candidates[i] &&
+			       read_index_entry(&cursor)) {
+			}
+			if (cursor.is_corrupt) {
+				break;
+			}
+			print_index_entry_if_matches(&cursor, search, &scratch);
+		}
+		free(candidates);
+	} else {
+		while (read_index_entry(&cursor)) {
+			print_index_entry_if_matches(&cursor, search, &scratch);
+		}
+	}
+
+	if (cursor.is_corrupt || res == FAILED) {
+		fprintf(stderr, "Error: the index '%s' is corrupt\n", filepath);
+		res = FAILED;
+	}
+	free_match_scratch(&scratch);
+	close_index(&index);
+	return res;
+}
+
+/*
+ * Hash the `len` bytes of `bytes` with FNV-1a, continuing from `hash`.
+ */
+uint64_t
+hash_watch_bytes(const void *bytes, size_t len, uint64_t hash)
+{
+	const uint8_t *data = bytes;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ data[i]) * WATCH_HASH_PRIME;
+	}
+	return hash;
+}
+
+/*
+ * Hash the key of the names table: the parent node and the name.
+ */
+uint64_t
+hash_watch_name(uint32_t parent, const char *name)
+{
+	uint64_t hash =
+	        hash_watch_bytes(&parent, sizeof(parent), WATCH_HASH_BASIS);
+	return hash_watch_bytes(name, strlen(name), hash);
+}
+
+/*
+ * Hash the key of node `id` in the names table.
+ */
+uint64_t
+hash_watch_node_name(const struct watch_index *index, uint32_t id)
+{
+	return hash_watch_name(index->nodes[id].parent, index->nodes[id].name);
+}
+
+/*
+ * Hash the key of the directory node `id` in the directories table: its
+ * fanotify handle, or its inotify watch descriptor.
+ */
+uint64_t
+hash_watch_node_dir(const struct watch_index *index, uint32_t id)
+{
+	const struct watch_node *node = &index->nodes[id];
+	if (index->use_fanotify) {
+		return hash_watch_bytes(
+		        node->handle, node->handle_len, WATCH_HASH_BASIS);
+	}
+	return hash_watch_bytes(&node->wd, sizeof(node->wd), WATCH_HASH_BASIS);
+}
+
+/*
+ * Insert the node `id` in `table`, keyed by `hash`, doubling its size first
+ * when it gets half full.
+ * Returns `SUCCESS` if it was inserted, otherwise returns `FAILED`.
+ */
+int
+insert_watch_table(const struct watch_index *index,
+                   struct watch_table *table,
+                   uint32_t id,
+                   watch_hash_fn hash)
+{
+	if ((table->used + 1) * 2 > table->size) {
+		size_t size = table->size == 0 ? WATCH_TABLE_INITIAL_SIZE
+		                               : table->size * 2;
+		uint32_t *slots = malloc(size * sizeof(uint32_t));
+		if (slots == NULL) {
+			perror("Error: could not grow the watch index");
+			return FAILED;
+		}
+		memset(slots, 0xff, size * sizeof(uint32_t));
+
+		for (size_t i = 0; i < table->size; i++) {
+			uint32_t old_id = table->slots[i];
+			if (old_id == WATCH_EMPTY_SLOT) {
+				continue;
+			}
+			size_t slot = hash(index, old_id) & (size - 1);
+			while (slots[slot] != WATCH_EMPTY_SLOT) {
+				slot = (slot + 1) & (size - 1);
+			}
+			slots[slot] = old_id;
+		}
+		free(table->slots);
+		table->slots = slots;
+		table->size = size;
+	}
+
+	size_t slot = hash(index, id) & (table->size - 1);
+	while (table->slots[slot] != WATCH_EMPTY_SLOT) {
+		slot = (slot + 1) & (table->size - 1);
+	}
+	table->slots[slot] = id;
+	table->used++;
+	return SUCCESS;
+}
+
+/*
+ * Empty `table`, keeping its slots.
+ */
+void
+clear_watch_table(struct watch_table *table)
+{
+	if (table->slots != NULL) {
+		memset(table->slots, 0xff, table->size * sizeof(uint32_t));
+	}
+	table->used = 0;
+}
+
+/*
+ * Check if the node `id` is still in the tree: neither it nor any of its
+ * ancestors was removed.
+ * Returns `true` if it is, `false` otherwise.
+ */
+bool
+is_watch_node_live(const struct watch_index *index, uint32_t id)
+{
+	while (id != WATCH_ROOT_NODE) {
+		if (index->nodes[id].is_removed) {
+			return false;
+		}
+		id = index->nodes[id].parent;
+	}
+	return true;
+}
+
+/*
+ * Find the node named `name` inside the live directory node `parent`.
+ * Returns its id, or `WATCH_EMPTY_SLOT` if there is none.
+ */
+uint32_t
+find_watch_child(const struct watch_index *index,
+                 uint32_t parent,
+                 const char *name)
+{
+	const struct watch_table *table = &index->names;
+	if (table->size == 0) {
+		return WATCH_EMPTY_SLOT;
+	}
+
+	size_t slot = hash_watch_name(parent, name) & (table->size - 1);
+	for (; table->slots[slot] != WATCH_EMPTY_SLOT;
+	     slot = (slot + 1) & (table->size - 1)) {
+		uint32_t id = table->slots[slot];
+		const struct watch_node *node = &index->nodes[id];
+		if (node->parent == parent && !node->is_removed &&
+		    strcmp(node->name, name) == 0) {
+			return id;
+		}
+	}
+	return WATCH_EMPTY_SLOT;
+}
+
+/*
+ * Find the live directory node with the fanotify key `handle` (`len` bytes)
+ * or, if `handle` is `NULL`, with the inotify watch descriptor `wd`.
+ * Returns its id, or `WATCH_EMPTY_SLOT` if there is none.
+ */
+uint32_t
+find_watch_dir(const struct watch_index *index,
+               const unsigned char *handle,
+               size_t len,
+               int wd)
+{
+	const struct watch_table *table = &index->dirs;
+	if (table->size == 0) {
+		return WATCH_EMPTY_SLOT;
+	}
+
+	uint64_t hash =
+	        handle != NULL
+	                ? hash_watch_bytes(handle, len, WATCH_HASH_BASIS)
+	                : hash_watch_bytes(&wd, sizeof(wd), WATCH_HASH_BASIS);
+	size_t slot = hash & (table->size - 1);
+	for (; table->slots[slot] != WATCH_EMPTY_SLOT;
+	     slot = (slot + 1) & (table->size - 1)) {
+		uint32_t id = table->slots[slot];
+		const struct watch_node *node = &index->nodes[id];
+		bool is_same_key =
+		        handle != NULL
+		                ? node->handle_len == len &&
+		                          memcmp(node->handle, handle, len) == 0
+		                : node->wd == wd;
+		if (is_same_key && is_watch_node_live(index, id)) {
+			return id;
+		}
+	}
+	return WATCH_EMPTY_SLOT;
+}
+
+/*
+ * Add the node `id` to the posting list of `trigram`, growing the postings
+ * table when it gets half full. Ids are added in ascending order.
+ * Returns `SUCCESS` if it was added, otherwise returns `FAILED`.
+ */
+int
+add_watch_posting(struct watch_postings *postings,
+                  uint32_t trigram,
+                  uint32_t id)
+{
+	if ((postings->used + 1) * 2 > postings->size) {
+		size_t size = postings->size == 0 ? WATCH_TABLE_INITIAL_SIZE
+		                                  : postings->size * 2;
+		struct watch_posting *slots =
+		        calloc(size, sizeof(struct watch_posting));
+		if (slots == NULL) {
+			perror("Error: could not grow the watch postings");
+			return FAILED;
+		}
+		for (size_t i = 0; i < size; i++) {
+			slots[i].trigram = WATCH_EMPTY_SLOT;
+		}
+
+		for (size_t i = 0; i < postings->size; i++) {
+			if (postings->slots[i].trigram == WATCH_EMPTY_SLOT) {
+				continue;
+			}
+			size_t slot = postings->slots[i].trigram *
+			              WATCH_TRIGRAM_MULTIPLIER & (size - 1);
+			while (slots[slot].trigram != WATCH_EMPTY_SLOT) {
+				slot = (slot + 1) & (size - 1);
+			}
+			slots[slot] = postings->slots[i];
+		}
+		free(postings->slots);
+		postings->slots = slots;
+		postings->size = size;
+	}
+
+	size_t slot = trigram * WATCH_TRIGRAM_MULTIPLIER & (postings->size - 1);
+	while (postings->slots[slot].trigram != WATCH_EMPTY_SLOT &&
+	       postings->slots[slot].trigram != trigram) {
+		slot = (slot + 1) & (postings->size - 1);
+	}
+
+	struct watch_posting *posting = &postings->slots[slot];
+	if (posting->trigram == WATCH_EMPTY_SLOT) {
+		posting->trigram = trigram;
+		postings->used++;
+	}
+	if (posting->count == posting->capacity) {
+		size_t capacity = posting->capacity == 0
+		                          ? WATCH_POSTING_INITIAL_CAPACITY
+		                          : posting->capacity * 2;
+		uint32_t *ids =
+		        realloc(posting->ids, capacity * sizeof(uint32_t));
+		if (ids == NULL) {
+			perror("Error: could not grow a watch posting");
+			return FAILED;
+		}
+		posting->ids = ids;
+		posting->capacity = capacity;
+	}
+	posting->ids[posting->count++] = id;
+	return SUCCESS;
+}
+
+/*
+ * Find the posting list of `trigram`.
+ * Returns it, or `NULL` if no name has the trigram.
+ */
+const struct watch_posting *
+find_watch_posting(const struct watch_postings *postings, uint32_t trigram)
+{
+	if (postings->size == 0) {
+		return NULL;
+	}
+
+	size_t slot = trigram * WATCH_TRIGRAM_MULTIPLIER & (postings->size - 1);
+	for (; postings->slots[slot].trigram != WATCH_EMPTY_SLOT;
+	     slot = (slot + 1) & (postings->size - 1)) {
+		if (postings->slots[slot].trigram == trigram) {
+			return &postings->slots[slot];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Free the posting lists and the table of `postings`.
+ */
+void
+free_watch_postings(struct watch_postings *postings)
+{
+	for (size_t i = 0; i < postings->size; i++) {
+		free(postings->slots[i].ids);
+	}
+	free(postings->slots);
+	postings->slots = NULL;
+	postings->size = 0;
+	postings->used = 0;
+}
+
+/*
+ * Add the node `id` to the names table, to the posting lists of the trigrams
+ * of its name and, for a watched directory, to the directories table.
+ * Returns `SUCCESS` if it was added, otherwise returns `FAILED`.
+ */
+int
+link_watch_node(struct watch_index *index, uint32_t id)
+{
+	uint32_t trigrams[PATH_MAX];
+	const struct watch_node *node = &index->nodes[id];
+	if (insert_watch_table(
+	            index, &index->names, id, hash_watch_node_name) == FAILED) {
+		return FAILED;
+	}
+
+	size_t count = collect_name_trigrams(node->name, trigrams);
+	for (size_t i = 0; i < count; i++) {
+		if (add_watch_posting(&index->postings, trigrams[i], id) ==
+		    FAILED) {
+			return FAILED;
+		}
+	}
+
+	if (node->handle != NULL || node->wd != GENERIC_ERROR_CODE) {
+		return insert_watch_table(
+		        index, &index->dirs, id, hash_watch_node_dir);
+	}
+	return SUCCESS;
+}
+
+/*
+ * Add a node for the entity `name` (inode `ino`) inside the directory node
+ * `parent`.
+ * Returns its id, or `WATCH_EMPTY_SLOT` if it could not be added.
+ */
+uint32_t
+add_watch_node(struct watch_index *index,
+               uint32_t parent,
+               const char *name,
+               ino_t ino,
+               bool is_dir)
+{
+	if (index->count == index->capacity) {
+		size_t capacity = index->capacity == 0
+		                          ? WATCH_NODES_INITIAL_CAPACITY
+		                          : index->capacity * 2;
+		struct watch_node *nodes = realloc(
+		        index->nodes, capacity * sizeof(struct watch_node));
+		if (nodes == NULL) {
+			perror("Error: could not grow the watch index");
+			return WATCH_EMPTY_SLOT;
+		}
+		index->nodes = nodes;
+		index->capacity = capacity;
+	}
+
+	uint32_t id = index->count;
+	struct watch_node *node = &index->nodes[id];
+	node->name = strdup(name);
+	if (node->name == NULL) {
+		perror("Error: could not allocate name");
+		return WATCH_EMPTY_SLOT;
+	}
+	node->parent = parent;
+	node->ino = ino;
+	node->is_dir = is_dir;
+	node->is_removed = false;
+	node->wd = GENERIC_ERROR_CODE;
+	node->handle = NULL;
+	node->handle_len = 0;
+	index->count++;
+
+	if (link_watch_node(index, id) == FAILED) {
+		return WATCH_EMPTY_SLOT;
+	}
+	return id;
+}
+
+/*
+ * Remove the node `id` from the tree, along with everything inside it, which
+ * is left unreachable. Its inotify watch, if any, is dropped.
+ */
+void
+remove_watch_node(struct watch_index *index, uint32_t id)
+{
+	struct watch_node *node = &index->nodes[id];
+	node->is_removed = true;
+	index->removed_count++;
+	if (!index->use_fanotify && node->wd != GENERIC_ERROR_CODE) {
+		inotify_rm_watch(index->events_fd, node->wd);
+		node->wd = GENERIC_ERROR_CODE;
+	}
+}
+
+/*
+ * Write into `path` the path of the node `id` relative to the watched
+ * directory (empty for the root).
+ * Returns `true` if the node is live and its path fits, `false` otherwise.
+ */
+bool
+build_watch_path(const struct watch_index *index,
+                 uint32_t id,
+                 char path[PATH_MAX])
+{
+	uint32_t chain[PATH_MAX / 2];
+	size_t depth = 0;
+	size_t len = 0;
+
+	for (; id != WATCH_ROOT_NODE; id = index->nodes[id].parent) {
+		if (index->nodes[id].is_removed || depth == PATH_MAX / 2) {
+			return false;
+		}
+		chain[depth++] = id;
+		len += strlen(index->nodes[id].name) + 1;
+	}
+	if (len >= PATH_MAX) {
+		return false;
+	}
+
+	len = 0;
+	for (size_t i = depth; i > 0; i--) {
+		const char *name = index->nodes[chain[i - 1]].name;
+		size_t name_len = strlen(name);
+		if (len > 0) {
+			path[len++] = '/';
+		}
+		memcpy(path + len, name, name_len);
+		len += name_len;
+	}
+	path[len] = STRING_NULL_TERMINATOR;
+	return true;
+}
+
+/*
+ * Write into `key` the key of a directory for fanotify: the id of its file
+ * system (`fsid`, 8 bytes), the type of its file handle and its `len` bytes.
+ * Returns the length of the key.
+ */
+size_t
+build_watch_handle_key(unsigned char key[WATCH_HANDLE_KEY_MAX],
+                       const void *fsid,
+                       int handle_type,
+                       const unsigned char *handle,
+                       size_t len)
+{
+	memcpy(key, fsid, sizeof(uint64_t));
+	memcpy(key + sizeof(uint64_t), &handle_type, sizeof(handle_type));
+	memcpy(key + sizeof(uint64_t) + sizeof(handle_type), handle, len);
+	return sizeof(uint64_t) + sizeof(handle_type) + len;
+}
+
+/*
+ * Get the path of a directory of the watched tree to show in a message.
+ */
+const char *
+get_watch_display_path(const char *path)
+{
+	return path[0] == STRING_NULL_TERMINATOR ? WD_PATH_ALIAS : path;
+}
+
+/*
+ * Start watching the directory `directory_fd` of the node `id`: with
+ * fanotify, its file system is marked the first time one of its directories
+ * is seen and the directory is keyed by its file handle; with inotify, a watch
+ * is added to it.
+ * Returns `SUCCESS` if it is watched, otherwise returns `FAILED`.
+ */
+int
+register_watch_directory(struct watch_index *index,
+                         uint32_t id,
+                         int directory_fd)
+{
+	struct watch_node *node = &index->nodes[id];
+	if (!index->use_fanotify) {
+		char fd_path[PATH_MAX];
+		snprintf(fd_path,
+		         sizeof(fd_path),
+		         "/proc/self/fd/%d",
+		         directory_fd);
+		node->wd = inotify_add_watch(
+		        index->events_fd, fd_path, WATCH_INOTIFY_MASK);
+		if (node->wd == GENERIC_ERROR_CODE) {
+			return FAILED;
+		}
+		return insert_watch_table(
+		        index, &index->dirs, id, hash_watch_node_dir);
+	}
+
+	struct statfs fs_info;
+	int mount_id = 0;
+	struct file_handle *handle = index->handle_buffer;
+	handle->handle_bytes = MAX_HANDLE_SZ;
+	if (fstatfs(directory_fd, &fs_info) == GENERIC_ERROR_CODE ||
+	    name_to_handle_at(
+	            directory_fd, "", handle, &mount_id, AT_EMPTY_PATH) ==
+	            GENERIC_ERROR_CODE) {
+		return FAILED;
+	}
 
-static const char WD_PATH_ALIAS[] = ".";
-static const int WD_PATH_ALIAS_LEN = 1;
+	uint64_t fsid = 0;
+	memcpy(&fsid, &fs_info.f_fsid, sizeof(fsid));
+	bool is_marked = false;
+	for (size_t i = 0; i < index->marked_count && !is_marked; i++) {
+		is_marked = index->marked_fsids[i] == fsid;
+	}
+	if (!is_marked) {
+		uint64_t *fsids = realloc(index->marked_fsids,
+		                          (index->marked_count + 1) *
+		                                  sizeof(uint64_t));
+		if (fsids == NULL) {
+			return FAILED;
+		}
+		index->marked_fsids = fsids;
+		if (fanotify_mark(index->events_fd,
+		                  FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+		                  WATCH_FANOTIFY_MASK,
+		                  directory_fd,
+		                  NULL) == GENERIC_ERROR_CODE) {
+			return FAILED;
+		}
+		index->marked_fsids[index->marked_count++] = fsid;
+	}
 
-static const char *DIR_NAMES_BLACKLIST[DIR_NAMES_BLACKLIST_SIZE] = { ".", ".." };
-static const int DIR_NAMES_BLACKLIST_MAX_LEN = 3;
+	node->handle_len = sizeof(fsid) + sizeof(handle->handle_type) +
+	                   handle->handle_bytes;
+	node->handle = malloc(node->handle_len);
+	if (node->handle == NULL) {
+		return FAILED;
+	}
+	build_watch_handle_key(node->handle,
+	                       &fsid,
+	                       handle->handle_type,
+	                       handle->f_handle,
+	                       handle->handle_bytes);
+	return insert_watch_table(index, &index->dirs, id, hash_watch_node_dir);
+}
 
 /*
- * Parse the argv to extract the `phrase` to be used to find inside entity names
- * and establish the `case_sensitivity_code` ased on the presence of the case
- * insensitivity flag. If the arguments don't respect the order or are invalid
- * (e.g. zero size string) the program exits.
+ * Recursively add the entities inside the directory `directory_fd` of the
+ * node `id`, at `depth`, watching it before reading it so no change is
+ * missed. The directories that cannot be read are reported and skipped.
  */
 void
-parse_arguments(char phrase[PATH_MAX],
-                int *case_sensitivity_code,
-                int argc,
-                char *argv[])
+scan_watch_directory(struct watch_index *index,
+                     uint32_t id,
+                     int directory_fd,
+                     size_t depth)
 {
-	size_t flag_str_len = strlen(CASE_SENSITIVITY_NONE_FLAG);
-	int flag_position = NO_FLAG_FOUND;
-
-	for (int i = 1; i < argc; i++) {
-		bool are_args_same_len = strlen(argv[i]) == flag_str_len;
-		bool have_args_equal_content =
-		        strncmp(argv[i],
-		                CASE_SENSITIVITY_NONE_FLAG,
-		                flag_str_len * sizeof(char)) == 0;
+	char path[PATH_MAX];
+	if (register_watch_directory(index, id, directory_fd) == FAILED) {
+		build_watch_path(index, id, path);
+		fprintf(stderr,
+		        "Error: could not watch directory '%s': %s\n",
+		        get_watch_display_path(path),
+		        strerror(errno));
+	}
 
-		if (are_args_same_len && have_args_equal_content) {
-			*case_sensitivity_code = CASE_SENSITIVITY_NONE_CODE;
-			flag_position = i;
+	struct dir_reader reader = {
+		.fd = directory_fd,
+		.buffer = get_dir_buffer(&index->buffers, depth),
+		.len = 0,
+		.pos = 0,
+	};
+	uint32_t first = index->count;
+	while (true) {
+		struct linux_dirent64 *entity = NULL;
+		if (next_dir_entity(&reader, &entity) == FAILED) {
+			build_watch_path(index, id, path);
+			fprintf(stderr,
+			        "Error while reading from directory '%s': %s\n",
+			        get_watch_display_path(path),
+			        strerror(errno));
+			break;
+		}
+		if (entity == NULL) {
 			break;
 		}
+		if (is_directory_blacklisted(entity->d_name)) {
+			continue;
+		}
+
+		bool is_dir = is_directory_entity(directory_fd, entity);
+		if (add_watch_node(index,
+		                   id,
+		                   entity->d_name,
+		                   entity->d_ino,
+		                   is_dir) == WATCH_EMPTY_SLOT) {
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	for (int i = 1; i < argc; i++) {
-		if (flag_position != i) {
-			strncpy(phrase, argv[i], (PATH_MAX - 1) * sizeof(char));
-			break;
+	uint32_t last = index->count;
+	for (uint32_t child = first; child < last; child++) {
+		if (!index->nodes[child].is_dir) {
+			continue;
 		}
+
+		int inner_directory_fd =
+		        openat(directory_fd,
+		               index->nodes[child].name,
+		               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (inner_directory_fd == GENERIC_ERROR_CODE) {
+			build_watch_path(index, child, path);
+			fprintf(stderr,
+			        "Failed to open directory '%s': %s\n",
+			        path,
+			        strerror(errno));
+			continue;
+		}
+		scan_watch_directory(
+		        index, child, inner_directory_fd, depth + 1);
+		close_directory(inner_directory_fd);
 	}
+}
 
-	size_t phrase_len = strlen(phrase);
-	if (phrase_len == 0) {
-		fprintf(stderr,
-		        "Error while calling program, no phrase found. "
-		        "Expected %s [-i] <phrase>\n",
-		        argv[0]);
-		exit(EXIT_FAILURE);
+/*
+ * Check if `node` still stands for the entity found with `info`: the same
+ * inode and type and, for a directory, watched. A directory that could not be
+ * watched (e.g. not readable yet) is this way retried when its permissions
+ * change.
+ * Returns `true` if it does, `false` otherwise.
+ */
+bool
+is_same_watch_entity(const struct watch_node *node, const struct stat *info)
+{
+	if (node->ino != info->st_ino ||
+	    node->is_dir != S_ISDIR(info->st_mode)) {
+		return false;
 	}
+	return !node->is_dir || node->wd != GENERIC_ERROR_CODE ||
+	       node->handle != NULL;
+}
 
-	if (flag_position == NO_FLAG_FOUND && argc != MIN_INPUT_PARAMS + 1) {
-		fprintf(stderr,
-		        "Error while calling program, non recognized parameter "
-		        "found. "
-		        "Expected %s [-i] <phrase>\n",
-		        argv[0]);
+/*
+ * Bring the node of the entity `name` inside the directory node `dir` in line
+ * with the file system after an event about it: it is removed if the entity
+ * is gone or was replaced, and added (with everything inside, for a
+ * directory) if the entity is new. Looking the entity up, instead of trusting
+ * the kind of event, keeps the tree right when events were merged or
+ * reordered.
+ */
+void
+sync_watch_entity(struct watch_index *index, uint32_t dir, const char *name)
+{
+	char path[PATH_MAX];
+	if (dir == WATCH_EMPTY_SLOT || name[0] == STRING_NULL_TERMINATOR ||
+	    is_directory_blacklisted(name) ||
+	    !build_watch_path(index, dir, path)) {
+		return;
+	}
+
+	size_t len = strlen(path);
+	if (len + strlen(name) + 2 > PATH_MAX) {
+		return;
+	}
+	if (len > 0) {
+		path[len++] = '/';
+	}
+	strcpy(path + len, name);
+
+	struct stat info;
+	bool exists =
+	        fstatat(index->root_fd, path, &info, AT_SYMLINK_NOFOLLOW) !=
+	        GENERIC_ERROR_CODE;
+	uint32_t child = find_watch_child(index, dir, name);
+	if (child != WATCH_EMPTY_SLOT &&
+	    (!exists || !is_same_watch_entity(&index->nodes[child], &info))) {
+		remove_watch_node(index, child);
+		child = WATCH_EMPTY_SLOT;
+	}
+	if (!exists || child != WATCH_EMPTY_SLOT) {
+		return;
+	}
+
+	child = add_watch_node(
+	        index, dir, name, info.st_ino, S_ISDIR(info.st_mode));
+	if (child == WATCH_EMPTY_SLOT) {
 		exit(EXIT_FAILURE);
 	}
+	if (!S_ISDIR(info.st_mode)) {
+		return;
+	}
+
+	int directory_fd =
+	        openat(index->root_fd,
+	               path,
+	               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (directory_fd == GENERIC_ERROR_CODE) {
+		/* If it is gone already, the event of its removal follows */
+		if (errno != ENOENT && errno != ENOTDIR) {
+			fprintf(stderr,
+			        "Failed to open directory '%s': %s\n",
+			        path,
+			        strerror(errno));
+		}
+		return;
+	}
+	scan_watch_directory(index, child, directory_fd, 0);
+	close_directory(directory_fd);
 }
 
 /*
- * Close the `directory`. If the closing fails, the current process exits.
+ * Drop every node of `index` and read the whole tree again, as done at start
+ * and when the kernel dropped events.
  */
 void
-close_directory(DIR *directory)
+rescan_watch_index(struct watch_index *index)
 {
-	int res = closedir(directory);
+	for (size_t i = 0; i < index->count; i++) {
+		free(index->nodes[i].name);
+		free(index->nodes[i].handle);
+	}
+	index->count = 0;
+	index->removed_count = 0;
+	clear_watch_table(&index->names);
+	clear_watch_table(&index->dirs);
+	free_watch_postings(&index->postings);
 
-	if (res == GENERIC_ERROR_CODE) {
-		perror("Error while closing directory");
+	struct stat info;
+	if (fstat(index->root_fd, &info) == GENERIC_ERROR_CODE ||
+	    add_watch_node(index, WATCH_ROOT_NODE, "", info.st_ino, true) ==
+	            WATCH_EMPTY_SLOT) {
+		perror("Error while reading the watched directory");
 		exit(EXIT_FAILURE);
 	}
+	scan_watch_directory(index, WATCH_ROOT_NODE, index->root_fd, 0);
 }
 
 /*
- * Read an entity from the directory `wd` into the struct `entity`.
- * If the read fails, `entity` is nulled and the current process exits.
+ * Drop the removed nodes, and everything inside them, once they outnumber the
+ * live ones: the live nodes get new ids, in the same order so every parent
+ * still comes before its children, and the tables and posting lists are
+ * rebuilt.
  */
 void
-read_entity_from_directory(DIR *wd, struct dirent **entity)
+compact_watch_index(struct watch_index *index)
 {
-	errno = 0;
-	*entity = readdir(wd);
-	if (errno != 0 && *entity == NULL) {
-		perror("Error while reading from directory");
-		exit(EXIT_FAILURE);
+	if (index->removed_count < WATCH_COMPACTION_MIN ||
+	    index->removed_count * 2 < index->count) {
+		return;
+	}
+
+	uint32_t *new_ids = malloc(index->count * sizeof(uint32_t));
+	if (new_ids == NULL) {
+		return;
+	}
+
+	size_t count = 0;
+	for (size_t id = 0; id < index->count; id++) {
+		struct watch_node *node = &index->nodes[id];
+		bool is_live = id == WATCH_ROOT_NODE ||
+		               (!node->is_removed &&
+		                new_ids[node->parent] != WATCH_EMPTY_SLOT);
+		if (!is_live) {
+			/* The watch may have been taken over by a live node */
+			if (!index->use_fanotify &&
+			    node->wd != GENERIC_ERROR_CODE &&
+			    find_watch_dir(index, NULL, 0, node->wd) ==
+			            WATCH_EMPTY_SLOT) {
+				inotify_rm_watch(index->events_fd, node->wd);
+			}
+			new_ids[id] = WATCH_EMPTY_SLOT;
+			continue;
+		}
+		new_ids[id] = count++;
+	}
+
+	for (size_t id = 0; id < index->count; id++) {
+		struct watch_node *node = &index->nodes[id];
+		if (new_ids[id] == WATCH_EMPTY_SLOT) {
+			free(node->name);
+			free(node->handle);
+			continue;
+		}
+		node->parent = new_ids[node->parent];
+		index->nodes[new_ids[id]] = *node;
+	}
+	free(new_ids);
+
+	index->count = count;
+	index->removed_count = 0;
+	clear_watch_table(&index->names);
+	clear_watch_table(&index->dirs);
+	free_watch_postings(&index->postings);
+	for (size_t id = 0; id < index->count; id++) {
+		if (link_watch_node(index, id) == FAILED) {
+			exit(EXIT_FAILURE);
+		}
 	}
 }
 
 /*
- * Check if `string` contains `substring` without taking into account the letter
- * case. Returns `true` if `substring` is found in `string`, `false` otherwise.
+ * Apply the events waiting in the fanotify group of `index`. Each one names
+ * an entity inside a directory, given by its file handle.
+ * Returns `SUCCESS` if the events were read, otherwise returns `FAILED`.
  */
-bool
-contains_substring_case_sensitive_none(char *string, char *substring)
+int
+read_fanotify_events(struct watch_index *index, char *buffer)
 {
-	char *first_occurrence = strcasestr(string, substring);
-	if (first_occurrence == NULL) {
-		return false;
+	ssize_t len = read(index->events_fd, buffer, WATCH_EVENTS_SIZE);
+	if (len == GENERIC_ERROR_CODE) {
+		return errno == EINTR ? SUCCESS : FAILED;
 	}
 
-	return true;
+	unsigned char key[WATCH_HANDLE_KEY_MAX];
+	for (ssize_t pos = 0; len - pos >= (ssize_t) FAN_EVENT_METADATA_LEN;) {
+		/* Events are only 4 byte aligned, so the metadata is copied */
+		struct fanotify_event_metadata event;
+		memcpy(&event, buffer + pos, sizeof(event));
+		if (event.vers != FANOTIFY_METADATA_VERSION ||
+		    event.event_len < FAN_EVENT_METADATA_LEN ||
+		    event.event_len > len - pos) {
+			fprintf(stderr, "Error: unexpected fanotify event\n");
+			return FAILED;
+		}
+		char *info_start = buffer + pos + event.metadata_len;
+		char *event_end = buffer + pos + event.event_len;
+		pos += event.event_len;
+		if ((event.mask & FAN_Q_OVERFLOW) != 0) {
+			rescan_watch_index(index);
+			continue;
+		}
+
+		struct fanotify_event_info_fid *info =
+		        (struct fanotify_event_info_fid *) info_start;
+		struct file_handle *handle =
+		        (struct file_handle *) info->handle;
+		if ((char *) (handle + 1) > event_end ||
+		    info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME ||
+		    handle->handle_bytes > MAX_HANDLE_SZ ||
+		    (char *) handle->f_handle + handle->handle_bytes >=
+		            event_end) {
+			continue;
+		}
+
+		const char *name = (const char *) handle->f_handle +
+		                   handle->handle_bytes;
+		size_t key_len = build_watch_handle_key(key,
+		                                        &info->fsid,
+		                                        handle->handle_type,
+		                                        handle->f_handle,
+		                                        handle->handle_bytes);
+		sync_watch_entity(index,
+		                  find_watch_dir(index, key, key_len, 0),
+		                  name);
+	}
+	return SUCCESS;
 }
 
 /*
- * Check if `string` contains `substring` taking into account the letter case.
- * Returns `true` if `substring` is found in `string`, `false` otherwise.
+ * Apply the events waiting in the inotify instance of `index`. Each one names
+ * an entity inside a directory, given by its watch descriptor.
+ * Returns `SUCCESS` if the events were read, otherwise returns `FAILED`.
  */
-bool
-contains_substring_case_sensitive_full(char *string, char *substring)
+int
+read_inotify_events(struct watch_index *index, char *buffer)
 {
-	char *first_occurrence = strstr(string, substring);
-	if (first_occurrence == NULL) {
-		return false;
+	ssize_t len = read(index->events_fd, buffer, WATCH_EVENTS_SIZE);
+	if (len == GENERIC_ERROR_CODE) {
+		return errno == EINTR ? SUCCESS : FAILED;
 	}
 
-	return true;
+	for (ssize_t pos = 0; pos < len;) {
+		struct inotify_event *event =
+		        (struct inotify_event *) (buffer + pos);
+		pos += sizeof(struct inotify_event) + event->len;
+		if ((event->mask & IN_Q_OVERFLOW) != 0) {
+			rescan_watch_index(index);
+			continue;
+		}
+
+		uint32_t dir = find_watch_dir(index, NULL, 0, event->wd);
+		if ((event->mask & IN_IGNORED) != 0) {
+			if (dir != WATCH_EMPTY_SLOT) {
+				index->nodes[dir].wd = GENERIC_ERROR_CODE;
+			}
+			continue;
+		}
+		if (event->len > 0) {
+			sync_watch_entity(index, dir, event->name);
+		}
+	}
+	return SUCCESS;
 }
 
 /*
- * Print the full path of the entity if it contains the `phrase` according to
- * the `contains_substring` parameter function.
+ * Write the `len` bytes of `data` to the socket `fd`.
+ * Returns `SUCCESS` if they were sent, otherwise returns `FAILED`.
  */
-void
-print_if_contains_substring(char *entity_name,
-                            char *fullpath,
-                            bool (*contains_substring)(char *, char *),
-                            char *phrase)
+int
+send_watch_bytes(int fd, const char *data, size_t len)
 {
-	bool _contains_substring = (*contains_substring)(entity_name, phrase);
+	while (len > 0) {
+		ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+		if (sent == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return FAILED;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return SUCCESS;
+}
 
-	if (_contains_substring) {
-		printf("%s\n", fullpath);
+/*
+ * Find the ids of the live nodes whose name may contain `text` (3 bytes or
+ * more): the ones in the posting lists of all its trigrams.
+ * Returns the ascending ids in newly allocated memory, with their number in
+ * `count`, or `NULL` if they could not be allocated.
+ */
+uint32_t *
+find_watch_candidates(const struct watch_index *index,
+                      const char *text,
+                      size_t *count)
+{
+	uint32_t trigrams[PATH_MAX];
+	size_t trigrams_count = collect_name_trigrams(text, trigrams);
+	const struct watch_posting *postings[PATH_MAX];
+	size_t shortest = 0;
+
+	*count = 0;
+	for (size_t i = 0; i < trigrams_count; i++) {
+		postings[i] = find_watch_posting(&index->postings, trigrams[i]);
+		if (postings[i] == NULL) {
+			return calloc(1, sizeof(uint32_t));
+		}
+		if (postings[i]->count < postings[shortest]->count) {
+			shortest = i;
+		}
+	}
+
+	uint32_t *candidates =
+	        malloc((postings[shortest]->count + 1) * sizeof(uint32_t));
+	if (candidates == NULL) {
+		return NULL;
 	}
+	memcpy(candidates,
+	       postings[shortest]->ids,
+	       postings[shortest]->count * sizeof(uint32_t));
+	*count = postings[shortest]->count;
+
+	for (size_t i = 0; i < trigrams_count && *count > 0; i++) {
+		if (i == shortest) {
+			continue;
+		}
+		size_t kept = 0, next = 0;
+		for (size_t j = 0; j < *count; j++) {
+			while (next < postings[i]->count &&
+			       postings[i]->ids[next] < candidates[j]) {
+				next++;
+			}
+			if (next < postings[i]->count &&
+			    postings[i]->ids[next] == candidates[j]) {
+				candidates[kept++] = candidates[j];
+			}
+		}
+		*count = kept;
+	}
+	return candidates;
 }
 
 /*
- * Check if the `entity_name` is in the directory names blacklist `DIR_NAMES_BLACKLIST`.
- * Returns `true` if `entity_name` is blacklisted, `false` otherwise.
+ * Send to the socket `client_fd` the path of the node `id`, followed by the
+ * phrases found, if it is live and matches `search`, gathering the lines in
+ * `output`.
+ * Returns `SUCCESS` if nothing failed to be sent, otherwise returns `FAILED`.
  */
-bool
-is_directory_blacklisted(char *entity_name)
+int
+send_watch_node_if_matches(const struct watch_index *index,
+                           uint32_t id,
+                           const struct search *search,
+                           struct match_scratch *scratch,
+                           struct output_buffer *output,
+                           int client_fd)
 {
-	bool is_blacklisted = false;
+	char path[PATH_MAX];
+	char parent_path[PATH_MAX];
+	if (!build_watch_path(index, id, path)) {
+		return SUCCESS;
+	}
 
-	for (int i = 0; i < DIR_NAMES_BLACKLIST_SIZE; i++) {
-		if (strncmp(entity_name,
-		            DIR_NAMES_BLACKLIST[i],
-		            DIR_NAMES_BLACKLIST_MAX_LEN * sizeof(char)) == 0) {
-			is_blacklisted = true;
-			break;
+	const char *name = index->nodes[id].name;
+	size_t dir_len = strlen(path) - strlen(name);
+	if (dir_len > 0) {
+		memcpy(parent_path, path, dir_len - 1);
+		parent_path[dir_len - 1] = STRING_NULL_TERMINATOR;
+	} else {
+		strcpy(parent_path, WD_PATH_ALIAS);
+	}
+	if (!match_entity(search, scratch, parent_path, name)) {
+		return SUCCESS;
+	}
+
+	size_t path_len = strlen(path);
+	size_t tags_len = strlen(scratch->tags);
+	size_t len = path_len + tags_len + 1;
+	if (output->len + len > OUTPUT_BUFFER_SIZE) {
+		if (send_watch_bytes(client_fd, output->data, output->len) ==
+		    FAILED) {
+			return FAILED;
 		}
+		output->len = 0;
 	}
+	memcpy(output->data + output->len, path, path_len);
+	memcpy(output->data + output->len + path_len, scratch->tags, tags_len);
+	output->len += len;
+	output->data[output->len - 1] = '\n';
+	return SUCCESS;
+}
 
-	return is_blacklisted;
+/*
+ * Send to the socket `client_fd` the paths of the live nodes of `index`
+ * matching `search`, followed by `WATCH_REPLY_END`. When a single phrase (or
+ * the literal of a -name) of 3 bytes or more has to be found, only the nodes
+ * in the posting lists of its trigrams are checked.
+ * Returns `SUCCESS` if the reply was sent, otherwise returns `FAILED`.
+ */
+int
+answer_watch_query(const struct watch_index *index,
+                   const struct search *search,
+                   int client_fd)
+{
+	struct match_scratch scratch;
+	struct output_buffer *output = malloc(sizeof(struct output_buffer));
+	if (output == NULL || init_match_scratch(&scratch, search) == FAILED) {
+		free(output);
+		return FAILED;
+	}
+	output->len = 0;
+
+	int res = SUCCESS;
+	const char *text = get_search_literal(search);
+	if (text != NULL && strlen(text) >= INDEX_TRIGRAM_LEN) {
+		size_t count = 0;
+		uint32_t *candidates =
+		        find_watch_candidates(index, text, &count);
+		res = candidates == NULL ? FAILED : SUCCESS;
+		for (size_t i = 0; i < count && res == SUCCESS; i++) {
+			res = send_watch_node_if_matches(index,
+			                                 candidates[i],
+			                                 search,
+			                                 &scratch,
+			                                 output,
+			                                 client_fd);
+		}
+		free(candidates);
+	} else {
+		for (uint32_t id = WATCH_ROOT_NODE + 1;
+		     id < index->count && res == SUCCESS;
+		     id++) {
+			res = send_watch_node_if_matches(
+			        index, id, search, &scratch, output, client_fd);
+		}
+	}
+
+	if (res == SUCCESS && output->len == OUTPUT_BUFFER_SIZE) {
+		res = send_watch_bytes(client_fd, output->data, output->len);
+		output->len = 0;
+	}
+	if (res == SUCCESS) {
+		output->data[output->len++] = WATCH_REPLY_END;
+		res = send_watch_bytes(client_fd, output->data, output->len);
+	}
+	free_match_scratch(&scratch);
+	free(output);
+	return res;
 }
 
 /*
- * Build the full path of the entity given the `parent_path` and `entity_name`.
- * The result is stored in `fullpath`.
+ * Answer the query of the client connected to `client_fd`: the fields of the
+ * request (see `query_watch_daemon`) are read into a search, which is compiled
+ * and answered from `index`. Only clients of the same user are answered, and
+ * a client taking too long to send its request or sending invalid patterns is
+ * dropped. The reply is sent at the pace the client reads it.
  */
 void
-build_fullpath(char fullpath[PATH_MAX], const char *parent_path, char *entity_name)
+serve_watch_client(const struct watch_index *index, int client_fd)
 {
-	if (strncmp(parent_path, WD_PATH_ALIAS, WD_PATH_ALIAS_LEN * sizeof(char)) ==
-	    0) {
-		snprintf(fullpath, (PATH_MAX - 1) * sizeof(char), "%s", entity_name);
+	struct ucred credentials;
+	socklen_t credentials_len = sizeof(credentials);
+	struct timeval timeout = { .tv_sec = WATCH_CLIENT_TIMEOUT_SEC };
+	if (getsockopt(client_fd,
+	               SOL_SOCKET,
+	               SO_PEERCRED,
+	               &credentials,
+	               &credentials_len) == GENERIC_ERROR_CODE ||
+	    credentials.uid != getuid() ||
+	    setsockopt(client_fd,
+	               SOL_SOCKET,
+	               SO_RCVTIMEO,
+	               &timeout,
+	               sizeof(timeout)) == GENERIC_ERROR_CODE) {
 		return;
 	}
 
-	snprintf(fullpath,
-	         (PATH_MAX - 1) * sizeof(char),
-	         "%s/%s",
-	         parent_path,
-	         entity_name);
+	char *request = malloc(WATCH_REQUEST_MAX);
+	if (request == NULL) {
+		return;
+	}
+
+	/* Every field starts with its type, so only the last one is empty */
+	size_t len = 0;
+	while (len < 2 || request[len - 1] != STRING_NULL_TERMINATOR ||
+	       request[len - 2] != STRING_NULL_TERMINATOR) {
+		ssize_t received = recv(
+		        client_fd, request + len, WATCH_REQUEST_MAX - len, 0);
+		if (received <= 0) {
+			free(request);
+			return;
+		}
+		len += received;
+	}
+
+	struct search search = {
+		.patterns = NULL,
+		.patterns_count = 0,
+		.name = { .source = NULL },
+		.path = { .source = NULL },
+	};
+	bool ignore_case = false;
+	bool is_valid = true;
+	size_t pos = 0;
+	while (request[pos] != STRING_NULL_TERMINATOR && is_valid) {
+		char type = request[pos];
+		const char *value = request + pos + 1;
+		pos += strlen(request + pos) + 1;
+		if (type == WATCH_FIELD_IGNORE_CASE) {
+			ignore_case = true;
+		} else if (type == WATCH_FIELD_PHRASE &&
+		           value[0] != STRING_NULL_TERMINATOR) {
+			add_pattern(&search, value);
+		} else if (type == WATCH_FIELD_NAME) {
+			search.name.source = value;
+			search.name.is_glob = true;
+		} else if (type == WATCH_FIELD_REGEX) {
+			search.path.source = value;
+			search.path.is_glob = false;
+		} else {
+			is_valid = false;
+		}
+	}
+
+	if (is_valid &&
+	    (search.patterns_count > 0 || search.name.source != NULL ||
+	     search.path.source != NULL) &&
+	    build_search(&search, ignore_case) == SUCCESS) {
+		answer_watch_query(index, &search, client_fd);
+	}
+	free_search(&search);
+	free(request);
 }
 
 /*
- * Recursively read the all the entities inside the DIR `directory` and print
- * the full path of each entity that contains the `phrase` in its name according
- * to the `contains_substring` parameter function. If the entity is a directory
- * and not blacklisted, it opens the directory and reads it recursively.
- * If the read of an entity fails, the process exits.
+ * Fill `address` with the address of the socket of the daemon of the current
+ * user watching the working directory: an abstract Unix socket named after the
+ * user and a hash of the absolute path of the directory, so it needs no file
+ * and disappears with the daemon.
+ * Returns `SUCCESS` if the address was built, otherwise returns `FAILED`.
  */
-void
-read_directory(DIR *directory,
-               const char *parent_path,
-               bool (*contains_substring)(char *, char *),
-               char *phrase)
+int
+build_watch_address(struct sockaddr_un *address, socklen_t *len)
 {
-	bool should_stop = false;
-	struct dirent *entity = NULL;
+	char root[PATH_MAX];
+	if (getcwd(root, sizeof(root)) == NULL) {
+		return FAILED;
+	}
 
-	while (!should_stop) {
-		read_entity_from_directory(directory, &entity);
-		if (entity == NULL) {
-			should_stop = true;
-			break;
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	/* The name of an abstract socket starts with a null byte */
+	int name_len = snprintf(address->sun_path + 1,
+	                        sizeof(address->sun_path) - 1,
+	                        "%s%u-%016llx",
+	                        WATCH_SOCKET_PREFIX,
+	                        (unsigned) getuid(),
+	                        (unsigned long long) hash_watch_bytes(
+	                                root, strlen(root), WATCH_HASH_BASIS));
+	*len = offsetof(struct sockaddr_un, sun_path) + 1 + name_len;
+	return SUCCESS;
+}
+
+/*
+ * Watch the working directory: read the whole tree into an in-memory index
+ * (names hashed by parent, and trigram posting lists of the names), keep it up
+ * to date from fanotify events or, when fanotify is not available (it needs
+ * privileges), from inotify watches on every directory, and answer the
+ * queries of the find command on a Unix socket. Every client is served by a
+ * child process working on a copy-on-write snapshot of the index, so a client
+ * reading its reply slowly delays neither the events nor the other clients.
+ * It only returns on error.
+ * Returns `FAILED`.
+ */
+int
+run_watch_daemon(void)
+{
+	struct watch_index index = {
+		.nodes = NULL,
+		.handle_buffer =
+		        malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ),
+		.root_fd = open(WD_PATH_ALIAS,
+		                O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+		.events_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+		                                   FAN_REPORT_DFID_NAME,
+		                           O_RDONLY | O_CLOEXEC),
+		.use_fanotify = true,
+	};
+	if (index.handle_buffer == NULL ||
+	    index.root_fd == GENERIC_ERROR_CODE) {
+		perror("Error while opening directory");
+		return FAILED;
+	}
+
+	if (index.events_fd != GENERIC_ERROR_CODE &&
+	    fanotify_mark(index.events_fd,
+	                  FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+	                  WATCH_FANOTIFY_MASK,
+	                  index.root_fd,
+	                  NULL) == GENERIC_ERROR_CODE) {
+		close(index.events_fd);
+		index.events_fd = GENERIC_ERROR_CODE;
+	}
+	if (index.events_fd == GENERIC_ERROR_CODE) {
+		index.use_fanotify = false;
+		index.events_fd = inotify_init1(IN_CLOEXEC);
+		if (index.events_fd == GENERIC_ERROR_CODE) {
+			perror("Error: could not watch the directory");
+			return FAILED;
 		}
+	}
 
-		char fullpath[PATH_MAX] = { STRING_NULL_TERMINATOR };
-		build_fullpath(fullpath, parent_path, entity->d_name);
+	struct sockaddr_un address;
+	socklen_t address_len = 0;
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == GENERIC_ERROR_CODE ||
+	    build_watch_address(&address, &address_len) == FAILED ||
+	    bind(listen_fd, (struct sockaddr *) &address, address_len) ==
+	            GENERIC_ERROR_CODE ||
+	    listen(listen_fd, SOMAXCONN) == GENERIC_ERROR_CODE) {
+		perror("Error: could not listen for queries (is a daemon "
+		       "already watching this directory?)");
+		return FAILED;
+	}
 
-		print_if_contains_substring(
-		        entity->d_name, fullpath, contains_substring, phrase);
+	rescan_watch_index(&index);
+	fprintf(stderr,
+	        "Watching %zu entities with %s\n",
+	        index.count - 1,
+	        index.use_fanotify ? "fanotify" : "inotify");
 
-		if (entity->d_type == DT_DIR &&
-		    !is_directory_blacklisted(entity->d_name)) {
-			int inner_directory_fd = openat(dirfd(directory),
-			                                entity->d_name,
-			                                O_DIRECTORY);
+	char *buffer = aligned_alloc(
+	        _Alignof(struct fanotify_event_metadata), WATCH_EVENTS_SIZE);
+	if (buffer == NULL) {
+		perror("Error: could not allocate the events buffer");
+		return FAILED;
+	}
 
-			if (inner_directory_fd == GENERIC_ERROR_CODE) {
-				perror("Failed to open directory");
-				exit(EXIT_FAILURE);
+	/* The children serving the clients are reaped by the kernel */
+	signal(SIGCHLD, SIG_IGN);
+	struct pollfd fds[] = {
+		{ .fd = index.events_fd, .events = POLLIN },
+		{ .fd = listen_fd, .events = POLLIN },
+	};
+	while (true) {
+		if (poll(fds, 2, -1) == GENERIC_ERROR_CODE) {
+			if (errno == EINTR) {
+				continue;
 			}
+			perror("Error while waiting for events");
+			return FAILED;
+		}
 
-			DIR *inner_directory = fdopendir(inner_directory_fd);
-			if (inner_directory == NULL) {
-				perror("Failed to get DIR from directory FD");
-				exit(EXIT_FAILURE);
+		if ((fds[0].revents & POLLIN) != 0) {
+			int res = index.use_fanotify
+			                  ? read_fanotify_events(&index, buffer)
+			                  : read_inotify_events(&index, buffer);
+			if (res == FAILED) {
+				perror("Error while reading events");
+				return FAILED;
+			}
+			compact_watch_index(&index);
+		}
+
+		if ((fds[1].revents & POLLIN) != 0) {
+			int client_fd =
+			        accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (client_fd == GENERIC_ERROR_CODE) {
+				continue;
+			}
+			pid_t pid = fork();
+			if (pid == 0) {
+				serve_watch_client(&index, client_fd);
+				_exit(EXIT_SUCCESS);
 			}
+			if (pid == GENERIC_ERROR_CODE) {
+				perror("Error: could not serve a query");
+			}
+			close(client_fd);
+		}
+	}
+}
+
+/*
+ * Connect to the daemon watching the working directory, if there is one,
+ * giving up on it if it does not accept the connection or stops sending its
+ * reply for `WATCH_REPLY_TIMEOUT_SEC`.
+ * Returns the connected socket, or `GENERIC_ERROR_CODE` if there is no
+ * daemon.
+ */
+int
+connect_watch_daemon(void)
+{
+	struct sockaddr_un address;
+	socklen_t address_len = 0;
+	if (build_watch_address(&address, &address_len) == FAILED) {
+		return GENERIC_ERROR_CODE;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == GENERIC_ERROR_CODE) {
+		return GENERIC_ERROR_CODE;
+	}
+	/* On Unix sockets the send timeout also bounds the connection */
+	struct timeval timeout = { .tv_sec = WATCH_REPLY_TIMEOUT_SEC };
+	if (setsockopt(fd,
+	               SOL_SOCKET,
+	               SO_RCVTIMEO,
+	               &timeout,
+	               sizeof(timeout)) == GENERIC_ERROR_CODE ||
+	    setsockopt(fd,
+	               SOL_SOCKET,
+	               SO_SNDTIMEO,
+	               &timeout,
+	               sizeof(timeout)) == GENERIC_ERROR_CODE ||
+	    connect(fd, (struct sockaddr *) &address, address_len) ==
+	            GENERIC_ERROR_CODE) {
+		close(fd);
+		return GENERIC_ERROR_CODE;
+	}
+	return fd;
+}
+
+/*
+ * Append to `request` (`*len` bytes so far) the field of `type` with `value`.
+ * Returns `SUCCESS` if it fits, otherwise returns `FAILED`.
+ */
+int
+add_watch_field(char *request, size_t *len, char type, const char *value)
+{
+	size_t value_len = strlen(value);
+	/* Leave room for the empty field ending the request */
+	if (*len + value_len + 3 > WATCH_REQUEST_MAX) {
+		return FAILED;
+	}
 
-			read_directory(inner_directory,
-			               fullpath,
-			               contains_substring,
-			               phrase);
+	request[(*len)++] = type;
+	memcpy(request + *len, value, value_len + 1);
+	*len += value_len + 1;
+	return SUCCESS;
+}
+
+/*
+ * Send `search` to the daemon connected to `fd` and print its reply. The
+ * request is a list of null terminated fields, each starting with its type
+ * (`WATCH_FIELD_*`), ended by an empty one; the reply holds the lines to print,
+ * ended by `WATCH_REPLY_END`.
+ * Returns `SUCCESS` if the whole reply was printed, otherwise returns
+ * `FAILED`.
+ */
+int
+query_watch_daemon(int fd, const struct search *search, bool ignore_case)
+{
+	char *request = malloc(WATCH_REQUEST_MAX);
+	size_t len = 0;
+	int res = request == NULL ? FAILED : SUCCESS;
+	if (res == SUCCESS && ignore_case) {
+		res = add_watch_field(
+		        request, &len, WATCH_FIELD_IGNORE_CASE, "");
+	}
+	for (size_t i = 0; i < search->patterns_count && res == SUCCESS; i++) {
+		res = add_watch_field(
+		        request, &len, WATCH_FIELD_PHRASE, search->patterns[i]);
+	}
+	if (res == SUCCESS && search->name.source != NULL) {
+		res = add_watch_field(
+		        request, &len, WATCH_FIELD_NAME, search->name.source);
+	}
+	if (res == SUCCESS && search->path.source != NULL) {
+		res = add_watch_field(
+		        request, &len, WATCH_FIELD_REGEX, search->path.source);
+	}
+	if (res == SUCCESS) {
+		request[len++] = STRING_NULL_TERMINATOR;
+		res = send_watch_bytes(fd, request, len);
+	}
+	free(request);
+	if (res == FAILED) {
+		fprintf(stderr,
+		        "Error: could not send the query to the daemon\n");
+		return FAILED;
+	}
 
-			close_directory(inner_directory);
-			close(inner_directory_fd);
+	char buffer[PATH_MAX];
+	bool is_complete = false;
+	while (!is_complete) {
+		ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+		if (received == GENERIC_ERROR_CODE && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			break;
 		}
+
+		char *end = memchr(buffer, WATCH_REPLY_END, received);
+		is_complete = end != NULL;
+		fwrite(buffer,
+		       1,
+		       is_complete ? end - buffer : received,
+		       stdout);
 	}
+
+	if (!is_complete) {
+		fprintf(stderr,
+		        "Error: the daemon did not complete the reply\n");
+		return FAILED;
+	}
+	return SUCCESS;
 }
 
 int
 main(int argc, char *argv[])
 {
-	if (argc > MAX_INPUT_PARAMS + 1 || argc < MIN_INPUT_PARAMS + 1) {
-		fprintf(stderr, "Error while calling program. Expected %s [-i] <phrase>\n", argv[0]);
+	struct search search = {
+		.patterns = NULL,
+		.patterns_count = 0,
+		.name = { .source = NULL },
+		.path = { .source = NULL },
+	};
+	struct find_options options = {
+		.case_sensitivity_code = CASE_SENSITIVITY_FULL_CODE,
+		.jobs = 0,
+		.sorted = false,
+		.build_index_path = NULL,
+		.index_path = NULL,
+		.watch = false,
+		.contains = NULL,
+	};
+
+	parse_arguments(&search, &options, argc, argv);
+
+	if (options.build_index_path != NULL) {
+		int res = build_index(options.build_index_path);
+		exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (options.watch) {
+		run_watch_daemon();
 		exit(EXIT_FAILURE);
 	}
 
-	char phrase[PATH_MAX] = { STRING_NULL_TERMINATOR };
-	int case_sensitivity_code = CASE_SENSITIVITY_FULL_CODE;
-	bool (*contains_substring)(char *, char *) =
-	        &contains_substring_case_sensitive_full;
+	compile_search(&search,
+	               options.case_sensitivity_code ==
+	                       CASE_SENSITIVITY_NONE_CODE);
+
+	if (options.contains == NULL && (options.jobs > 0 || options.sorted)) {
+		if (options.jobs == 0) {
+			options.jobs = 1;
+		}
+		int res = walk_in_parallel(&options, &search);
+		free_search(&search);
+		exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
 
-	parse_arguments(phrase, &case_sensitivity_code, argc, argv);
+	if (options.index_path != NULL) {
+		int res = query_index(options.index_path, &search);
+		free_search(&search);
+		exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
 
-	if (case_sensitivity_code == CASE_SENSITIVITY_NONE_CODE) {
-		contains_substring = &contains_substring_case_sensitive_none;
+	bool is_daemon_query = options.contains == NULL &&
+	                       search.metadata_count == 0 &&
+	                       search.excludes == NULL;
+	int daemon_fd = is_daemon_query ? connect_watch_daemon()
+	                                : GENERIC_ERROR_CODE;
+	if (daemon_fd != GENERIC_ERROR_CODE) {
+		bool ignore_case = options.case_sensitivity_code ==
+		                   CASE_SENSITIVITY_NONE_CODE;
+		int res = query_watch_daemon(daemon_fd, &search, ignore_case);
+		close(daemon_fd);
+		free_search(&search);
+		exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
 	}
 
-	DIR *wd = opendir(WD_PATH_ALIAS);
-	if (wd == NULL) {
+	int wd = open(WD_PATH_ALIAS, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (wd == GENERIC_ERROR_CODE) {
 		perror("Error while opening directory");
 		exit(EXIT_FAILURE);
 	}
 
-	read_directory(wd, WD_PATH_ALIAS, contains_substring, phrase);
-	close_directory(wd);
+	struct match_scratch scratch;
+	if (init_match_scratch(&scratch, &search) == FAILED) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (options.contains == NULL) {
+		walk_tree(wd, &search, &scratch, NULL);
+		free_match_scratch(&scratch);
+		free_search(&search);
+		exit(EXIT_SUCCESS);
+	}
 
-	exit(EXIT_SUCCESS);
+	if (options.jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		options.jobs = cpus > 0 ? cpus : 1;
+	}
+	struct content_pool *contents = malloc(sizeof(struct content_pool));
+	if (contents == NULL) {
+		perror("Error: could not allocate the contents pool");
+		exit(EXIT_FAILURE);
+	}
+	if (start_content_pool(contents,
+	                       options.contains,
+	                       options.case_sensitivity_code ==
+	                               CASE_SENSITIVITY_NONE_CODE,
+	                       options.jobs) == FAILED) {
+		exit(EXIT_FAILURE);
+	}
+	walk_tree(wd, &search, &scratch, contents);
+	int res = finish_content_pool(contents);
+	free(contents);
+	free_match_scratch(&scratch);
+	free_search(&search);
+	exit(res == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE);
 }